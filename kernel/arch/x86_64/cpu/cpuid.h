@@ -63,6 +63,7 @@ struct cpuid_cache_t {
     bool has_smep       :1;
     bool has_erms       :1;
     bool has_invpcid    :1;
+    bool has_avx2       :1;
     bool has_avx512f    :1;
     bool has_smap       :1;
     bool has_inrdtsc    :1;
@@ -226,6 +227,12 @@ CPUID_CONST_INLINE bool cpuid_has_inrdtsc()
     return cpuid_cache.has_inrdtsc;
 }
 
+// Advanced Vector Extensions 2 instructions
+CPUID_CONST_INLINE bool cpuid_has_avx2()
+{
+    return cpuid_cache.has_avx2;
+}
+
 // Avx-512 Foundation
 CPUID_CONST_INLINE bool cpuid_has_avx512f()
 {
@@ -0,0 +1,147 @@
+#include "types.h"
+#include "likely.h"
+#include "control_regs.h"
+#include "inet_csum.h"
+
+// Vector Internet checksum
+//
+// The kernel is built without vector instructions, and only threads
+// with an FPU context may use them. Kernel threads run with CR0.TS
+// set and get the generic version. Otherwise the vector registers
+// hold the user's state, they are saved around the loop and restored,
+// so this is safe in syscalls and in interrupt handlers.
+//
+// 32-bit lanes are widened to 64 bits and added, so the lanes can't
+// overflow. The lanes are added up with carries at the end.
+
+// Below this, saving registers costs more than it gains
+static constexpr size_t inet_csum_simd_min = 256;
+
+static _always_inline bool inet_csum_simd_usable(size_t size)
+{
+    return size >= inet_csum_simd_min &&
+            !(cpu_cr0_get() & CPU_CR0_TS);
+}
+
+extern "C" uint64_t inet_csum_partial_sse2(void const *data, size_t size,
+                                           uint64_t sum)
+{
+    if (!inet_csum_simd_usable(size))
+        return inet_csum_partial_generic(data, size, sum);
+
+    __i64_vec2 save[6];
+    char const *p = (char const *)data;
+    size_t blocks = size >> 5;
+    uint64_t lo, hi;
+
+    __asm__ __volatile__ (
+        "movdqu %%xmm0,0*16(%[save])\n\t"
+        "movdqu %%xmm1,1*16(%[save])\n\t"
+        "movdqu %%xmm2,2*16(%[save])\n\t"
+        "movdqu %%xmm3,3*16(%[save])\n\t"
+        "movdqu %%xmm4,4*16(%[save])\n\t"
+        "movdqu %%xmm5,5*16(%[save])\n\t"
+        "pxor %%xmm0,%%xmm0\n\t"
+        "pxor %%xmm4,%%xmm4\n\t"
+        "pxor %%xmm5,%%xmm5\n\t"
+        "0:\n\t"
+        "movdqu (%[p]),%%xmm1\n\t"
+        "movdqu 16(%[p]),%%xmm2\n\t"
+        "movdqa %%xmm1,%%xmm3\n\t"
+        "punpckldq %%xmm0,%%xmm1\n\t"
+        "punpckhdq %%xmm0,%%xmm3\n\t"
+        "paddq %%xmm1,%%xmm4\n\t"
+        "paddq %%xmm3,%%xmm5\n\t"
+        "movdqa %%xmm2,%%xmm3\n\t"
+        "punpckldq %%xmm0,%%xmm2\n\t"
+        "punpckhdq %%xmm0,%%xmm3\n\t"
+        "paddq %%xmm2,%%xmm4\n\t"
+        "paddq %%xmm3,%%xmm5\n\t"
+        "addq $32,%[p]\n\t"
+        "decq %[blocks]\n\t"
+        "jnz 0b\n\t"
+        "paddq %%xmm5,%%xmm4\n\t"
+        "movq %%xmm4,%[lo]\n\t"
+        "pshufd $0xEE,%%xmm4,%%xmm4\n\t"
+        "movq %%xmm4,%[hi]\n\t"
+        "movdqu 0*16(%[save]),%%xmm0\n\t"
+        "movdqu 1*16(%[save]),%%xmm1\n\t"
+        "movdqu 2*16(%[save]),%%xmm2\n\t"
+        "movdqu 3*16(%[save]),%%xmm3\n\t"
+        "movdqu 4*16(%[save]),%%xmm4\n\t"
+        "movdqu 5*16(%[save]),%%xmm5\n\t"
+        : [p] "+r" (p)
+        , [blocks] "+r" (blocks)
+        , [lo] "=&r" (lo)
+        , [hi] "=&r" (hi)
+        : [save] "r" (save)
+        : "memory", "cc"
+    );
+
+    sum = inet_csum_add(sum, lo);
+    sum = inet_csum_add(sum, hi);
+
+    // The rest starts at a multiple of 32
+    return inet_csum_partial_generic(p, size & 31, sum);
+}
+
+extern "C" uint64_t inet_csum_partial_avx2(void const *data, size_t size,
+                                           uint64_t sum)
+{
+    if (!inet_csum_simd_usable(size))
+        return inet_csum_partial_generic(data, size, sum);
+
+    __i64_vec2 save[12];
+    char const *p = (char const *)data;
+    size_t blocks = size >> 6;
+    uint64_t lo, hi;
+
+    __asm__ __volatile__ (
+        "vmovdqu %%ymm0,0*32(%[save])\n\t"
+        "vmovdqu %%ymm1,1*32(%[save])\n\t"
+        "vmovdqu %%ymm2,2*32(%[save])\n\t"
+        "vmovdqu %%ymm3,3*32(%[save])\n\t"
+        "vmovdqu %%ymm4,4*32(%[save])\n\t"
+        "vmovdqu %%ymm5,5*32(%[save])\n\t"
+        "vpxor %%ymm0,%%ymm0,%%ymm0\n\t"
+        "vpxor %%ymm4,%%ymm4,%%ymm4\n\t"
+        "vpxor %%ymm5,%%ymm5,%%ymm5\n\t"
+        "0:\n\t"
+        "vmovdqu (%[p]),%%ymm1\n\t"
+        "vmovdqu 32(%[p]),%%ymm2\n\t"
+        "vpunpckhdq %%ymm0,%%ymm1,%%ymm3\n\t"
+        "vpunpckldq %%ymm0,%%ymm1,%%ymm1\n\t"
+        "vpaddq %%ymm1,%%ymm4,%%ymm4\n\t"
+        "vpaddq %%ymm3,%%ymm5,%%ymm5\n\t"
+        "vpunpckhdq %%ymm0,%%ymm2,%%ymm3\n\t"
+        "vpunpckldq %%ymm0,%%ymm2,%%ymm2\n\t"
+        "vpaddq %%ymm2,%%ymm4,%%ymm4\n\t"
+        "vpaddq %%ymm3,%%ymm5,%%ymm5\n\t"
+        "addq $64,%[p]\n\t"
+        "decq %[blocks]\n\t"
+        "jnz 0b\n\t"
+        "vpaddq %%ymm5,%%ymm4,%%ymm4\n\t"
+        "vextracti128 $1,%%ymm4,%%xmm5\n\t"
+        "vpaddq %%xmm5,%%xmm4,%%xmm4\n\t"
+        "vmovq %%xmm4,%[lo]\n\t"
+        "vpextrq $1,%%xmm4,%[hi]\n\t"
+        "vmovdqu 0*32(%[save]),%%ymm0\n\t"
+        "vmovdqu 1*32(%[save]),%%ymm1\n\t"
+        "vmovdqu 2*32(%[save]),%%ymm2\n\t"
+        "vmovdqu 3*32(%[save]),%%ymm3\n\t"
+        "vmovdqu 4*32(%[save]),%%ymm4\n\t"
+        "vmovdqu 5*32(%[save]),%%ymm5\n\t"
+        : [p] "+r" (p)
+        , [blocks] "+r" (blocks)
+        , [lo] "=&r" (lo)
+        , [hi] "=&r" (hi)
+        : [save] "r" (save)
+        : "memory", "cc"
+    );
+
+    sum = inet_csum_add(sum, lo);
+    sum = inet_csum_add(sum, hi);
+
+    // The rest starts at a multiple of 64
+    return inet_csum_partial_generic(p, size & 63, sum);
+}
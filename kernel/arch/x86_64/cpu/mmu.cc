@@ -106,12 +106,14 @@
 #define PTE_EX_LOCKED_BIT   (PTE_AVAIL1_BIT+1)
 #define PTE_EX_DEVICE_BIT   (PTE_AVAIL1_BIT+2)
 #define PTE_EX_WAIT_BIT     (PTE_AVAIL2_BIT+0)
+#define PTE_EX_PIN_BIT      (PTE_AVAIL2_BIT+1)
 
 // Size of multi-bit fields
 #define PTE_PK_BITS         4
 #define PTE_ADDR_BITS       40
 #define PTE_AVAIL1_BITS     3
 #define PTE_AVAIL2_BITS     7
+#define PTE_EX_PIN_BITS     6
 
 // Size of physical address including low bits
 #define PTE_FULL_ADDR_BITS  (PTE_ADDR_BITS+PAGE_SIZE_BIT)
@@ -122,6 +124,7 @@
 #define PTE_ADDR_MASK       ((1UL << PTE_ADDR_BITS) - 1U)
 #define PTE_AVAIL1_MASK     ((1UL << PTE_AVAIL1_BITS) - 1U)
 #define PTE_AVAIL2_MASK     ((1UL << PTE_AVAIL2_BITS) - 1U)
+#define PTE_EX_PIN_MASK     ((1UL << PTE_EX_PIN_BITS) - 1U)
 #define PTE_FULL_ADDR_MASK  ((1UL << PTE_FULL_ADDR_BITS) - 1U)
 
 // Values of bits
@@ -151,6 +154,10 @@
 #define PTE_EX_DEVICE       (1UL << PTE_EX_DEVICE_BIT)
 #define PTE_EX_WAIT         (1UL << PTE_EX_WAIT_BIT)
 
+// Count of I/O pins on a page, see mm_pin_user
+#define PTE_EX_PIN          (PTE_EX_PIN_MASK << PTE_EX_PIN_BIT)
+#define PTE_EX_PIN_ONE      (1UL << PTE_EX_PIN_BIT)
+
 // PAT configuration
 #define PAT_IDX_WB  0
 #define PAT_IDX_WT  1
@@ -2250,6 +2257,24 @@ void *mremap(
     return (void*)new_st;
 }
 
+// Replace a PTE once no I/O has its page pinned, returns the old value.
+// The device is still using a pinned page, so it may not be freed yet
+static pte_t pte_replace_unpinned(pte_t *pte, pte_t replace)
+{
+    pte_t expect = *pte;
+
+    for (;;) {
+        if (unlikely(expect & PTE_EX_PIN)) {
+            cpu_wait_value(pte, pte_t(0), PTE_EX_PIN);
+            expect = *pte;
+            continue;
+        }
+
+        if (atomic_cmpxchg_upd(pte, &expect, replace))
+            return expect;
+    }
+}
+
 int munmap(void *addr, size_t size)
 {
     __asan_freeN_noabort(addr, size);
@@ -2275,7 +2300,7 @@ int munmap(void *addr, size_t size)
         if ((present_mask & 0x07) == 0x07) {
             if ((*ptes[2] & PTE_PAGESIZE) == 0) {
                 // PT page level is present, 4KB mapping
-                pte = atomic_xchg(ptes[3], 0);
+                pte = pte_replace_unpinned(ptes[3], 0);
 
                 if ((pte & (PTE_EX_PHYSICAL | PTE_PRESENT)) == PTE_PRESENT) {
                     physaddr_t physaddr = pte & PTE_ADDR;
@@ -2499,6 +2524,12 @@ int madvise(void *addr, size_t len, int advice)
                 // Discarding
                 physaddr_t page = 0;
                 if (expect && (expect & demand_mask) != demand_mask) {
+                    if (unlikely(expect & PTE_EX_PIN)) {
+                        cpu_wait_value(pt[3], pte_t(0), PTE_EX_PIN);
+                        expect = *pt[3];
+                        continue;
+                    }
+
                     page = expect & PTE_ADDR;
                     replace = expect | PTE_ADDR;
 
@@ -3334,6 +3365,99 @@ extern "C" mm_copy_user_fn mm_copy_to_user_resolver()
 _ifunc_resolver(mm_copy_to_user_resolver)
 bool mm_copy_user(void *dst, void const *src, size_t size);
 
+// Fault in the page holding a user byte. A write is a locked add of
+// zero, so it can't lose a store another thread makes to the byte
+static bool mm_touch_user(char *addr, bool write)
+{
+    bool smap = cpuid_has_smap();
+
+    __try {
+        if (smap)
+            cpu_stac();
+
+        if (write)
+            atomic_add(addr, 0);
+        else
+            *(char const volatile *)addr;
+
+        if (smap)
+            cpu_clac();
+    } __catch {
+        return false;
+    }
+
+    return true;
+}
+
+bool mm_pin_user(void *addr, size_t len, bool write)
+{
+    linaddr_t st = linaddr_t(addr);
+    linaddr_t en = st + len;
+
+    pte_t *ptes[4];
+
+    for (linaddr_t page = st & -PAGE_SIZE; page < en; page += PAGE_SIZE) {
+        ptes_from_addr(ptes, page);
+
+        for (;;) {
+            // Stay inside the buffer, the rest of the page may be
+            // another thread's
+            if (unlikely(!mm_touch_user((char*)(page > st ? page : st), write))) {
+                if (page > st)
+                    mm_unpin_user(addr, page - st, 0);
+                return false;
+            }
+
+            // Fault it in again if it went away before it was pinned
+            pte_t expect = *ptes[3];
+
+            if (unlikely(ptes_present(ptes) != 0x0F ||
+                         (write && !(expect & PTE_WRITABLE))))
+                continue;
+
+            // The count saturates, wait for a pin to go
+            if (unlikely((expect & PTE_EX_PIN) == PTE_EX_PIN)) {
+                pause();
+                continue;
+            }
+
+            if (atomic_cmpxchg_upd(ptes[3], &expect, expect + PTE_EX_PIN_ONE))
+                break;
+        }
+    }
+
+    return true;
+}
+
+void mm_unpin_user(void *addr, size_t len, uintptr_t mmu_context)
+{
+    linaddr_t st = linaddr_t(addr) & -PAGE_SIZE;
+    linaddr_t en = linaddr_t(addr) + len;
+
+    // Completions release pins from whatever context they run in, the
+    // page tables are reached through the pinning process' recursive
+    // mapping, switch to it briefly if it isn't the current one
+    cpu_scoped_irq_disable irq_dis;
+
+    uintptr_t cur = cpu_page_directory_get();
+    bool other = mmu_context && (mmu_context & PTE_ADDR) != (cur & PTE_ADDR);
+
+    if (other)
+        cpu_page_directory_set(mmu_context);
+
+    pte_t *ptes[4];
+    ptes_from_addr(ptes, st);
+
+    for (linaddr_t page = st; page < en; page += PAGE_SIZE) {
+        assert((*ptes[3] & PTE_EX_PIN) != 0);
+        atomic_sub(ptes[3], PTE_EX_PIN_ONE);
+        ptes_step(ptes);
+    }
+
+    if (other)
+        cpu_page_directory_set(cur);
+}
+
 bool mm_is_user_range(void *buf, size_t size)
 {
     return linaddr_t(buf) >= 0x400000 &&
@@ -5,9 +5,11 @@
 #include "assert.h"
 
 #include "syscall/sys_fd.h"
+#include "syscall/sys_ioring.h"
 #include "syscall/sys_mem.h"
 #include "syscall/sys_time.h"
 #include "syscall/sys_process.h"
+#include "syscall/sys_socket.h"
 
 long sys_unimplemented()
 {
@@ -34,8 +36,8 @@ syscall_handler_t *syscall_handlers[SYSCALL_COUNT] = {
     (syscall_handler_t*)(void*)sys_ioctl,
     (syscall_handler_t*)(void*)sys_pread64,
     (syscall_handler_t*)(void*)sys_pwrite64,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_readv,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_writev,
+    (syscall_handler_t*)(void*)sys_readv,
+    (syscall_handler_t*)(void*)sys_writev,
     (syscall_handler_t*)(void*)sys_access,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_pipe,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_select,
@@ -55,22 +57,22 @@ syscall_handler_t *syscall_handlers[SYSCALL_COUNT] = {
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_alarm,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_setitimer,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_getpid,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_sendfile,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_socket,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_connect,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_accept,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_sendto,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_recvfrom,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_sendmsg,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_recvmsg,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_shutdown,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_bind,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_listen,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_getsockname,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_getpeername,
+    (syscall_handler_t*)(void*)sys_sendfile,
+    (syscall_handler_t*)(void*)sys_socket,
+    (syscall_handler_t*)(void*)sys_connect,
+    (syscall_handler_t*)(void*)sys_accept,
+    (syscall_handler_t*)(void*)sys_sendto,
+    (syscall_handler_t*)(void*)sys_recvfrom,
+    (syscall_handler_t*)(void*)sys_sendmsg,
+    (syscall_handler_t*)(void*)sys_recvmsg,
+    (syscall_handler_t*)(void*)sys_shutdown,
+    (syscall_handler_t*)(void*)sys_bind,
+    (syscall_handler_t*)(void*)sys_listen,
+    (syscall_handler_t*)(void*)sys_getsockname,
+    (syscall_handler_t*)(void*)sys_getpeername,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_socketpair,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_setsockopt,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_getsockopt,
+    (syscall_handler_t*)(void*)sys_setsockopt,
+    (syscall_handler_t*)(void*)sys_getsockopt,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_clone,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_fork,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_vfork,
@@ -221,10 +223,10 @@ syscall_handler_t *syscall_handlers[SYSCALL_COUNT] = {
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_sched_setaffinity,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_sched_getaffinity,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_set_thread_area,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_io_setup,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_io_destroy,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_io_getevents,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_io_submit,
+    (syscall_handler_t*)(void*)sys_io_ring_setup,
+    (syscall_handler_t*)(void*)sys_io_ring_destroy,
+    (syscall_handler_t*)(void*)sys_io_ring_wait,
+    (syscall_handler_t*)(void*)sys_io_ring_enter,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_io_cancel,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_get_thread_area,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_lookup_dcookie,
@@ -303,18 +305,18 @@ syscall_handler_t *syscall_handlers[SYSCALL_COUNT] = {
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_fallocate,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_timerfd_settime,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_timerfd_gettime,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_accept4,
+    (syscall_handler_t*)(void*)sys_accept4,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_signalfd4,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_eventfd2,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_epoll_create1,
     (syscall_handler_t*)(void*)sys_dup3,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_pipe2,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_inotify_init1,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_preadv,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_pwritev,
+    (syscall_handler_t*)(void*)sys_preadv,
+    (syscall_handler_t*)(void*)sys_pwritev,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_rt_tgsigqueueinfo,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_perf_event_open,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_recvmmsg,
+    (syscall_handler_t*)(void*)sys_recvmmsg,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_fanotify_init,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_fanotify_mark,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_prlimit64,
@@ -322,7 +324,7 @@ syscall_handler_t *syscall_handlers[SYSCALL_COUNT] = {
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_open_by_handle_at,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_clock_adjtime,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_syncfs,
-    (syscall_handler_t*)(void*)sys_unimplemented,//sys_sendmmsg,
+    (syscall_handler_t*)(void*)sys_sendmmsg,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_setns,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_getcpu,
     (syscall_handler_t*)(void*)sys_unimplemented,//sys_process_vm_readv,
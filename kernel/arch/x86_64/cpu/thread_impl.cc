@@ -22,6 +22,7 @@
 #include "vector.h"
 #include "mutex.h"
 #include "except.h"
+#include "ioring.h"
 
 // Implements platform independent thread.h
 
@@ -1195,8 +1196,10 @@ void thread_exit(int exit_code)
     thread_info_t *info = this_thread();
     thread_t tid = info - threads;
     info->exit_code = exit_code;
-    if (info->process->del_thread(tid))
+    if (info->process->del_thread(tid)) {
+        ioring_process_exit(info->process->pid);
         info->state = THREAD_IS_EXITING_BUSY;
+    }
     thread_cleanup();
 }
 
@@ -17,6 +17,8 @@
 #include "cpu/atomic.h"
 #include "cpu/except.h"
 #include "cpu/control_regs.h"
+#include "blk_queue.h"
+#include "algorithm.h"
 
 #define GDBSTUB_FORCE_FULL_CTX 0
 
@@ -489,6 +491,7 @@ private:
     bool get_target_desc(std::unique_ptr<char[]> &result, size_t &result_sz,
                                 char const *annex, size_t annex_sz);
     rx_state_t handle_query_features(char const *input);
+    rx_state_t handle_monitor(char const *input);
 
     _printf_format(2, 3)
     rx_state_t replyf_hex(char const *format, ...);
@@ -1452,6 +1455,34 @@ bool gdbstub_t::get_target_desc(
     return true;
 }
 
+gdbstub_t::rx_state_t gdbstub_t::handle_monitor(char const *input)
+{
+    // The command text is hex encoded
+    char cmd[64];
+    size_t cmd_len = 0;
+    for (; cmd_len + 1 < sizeof(cmd); ++cmd_len, input += 2) {
+        int hi_digit = from_hex(input[0]);
+        int lo_digit = hi_digit >= 0 ? from_hex(input[1]) : -1;
+        if (lo_digit < 0)
+            break;
+        cmd[cmd_len] = char((hi_digit << 4) | lo_digit);
+    }
+    cmd[cmd_len] = 0;
+
+    if (!strcmp(cmd, "blkstat")) {
+        // Other CPUs are halted, possibly holding a queue lock,
+        // so the counters are read without locking.
+        // Formatted into the first half of tx_buf, reply_hex expands
+        // it in place
+        size_t len = blk_stats_format(tx_buf, MAX_BUFFER_SIZE / 2, true);
+        len = std::min(len, MAX_BUFFER_SIZE / 2 - 1);
+        return reply_hex(tx_buf, len);
+    }
+
+    // Empty reply, unsupported
+    return reply("");
+}
+
 gdbstub_t::rx_state_t gdbstub_t::handle_query_features(char const *input)
 {
     char const *annex_st = input;
@@ -1616,6 +1647,9 @@ gdbstub_t::rx_state_t gdbstub_t::handle_packet()
         } else if (match(input, "Xfer:features:read", ":")) {
             // Get machine description
             return handle_query_features(input);
+        } else if (match(input, "Rcmd", ",")) {
+            // monitor command
+            return handle_monitor(input);
         } else if (!strcmp(input, "fThreadInfo") ||
                 !strcmp(input, "sThreadInfo")) {
             // Enumerate threads
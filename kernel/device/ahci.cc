@@ -16,6 +16,8 @@
 #include "unique_ptr.h"
 #include "inttypes.h"
 #include "work_queue.h"
+#include "callout.h"
+#include "fs/devfs.h"
 
 #define AHCI_DEBUG  1
 #if AHCI_DEBUG
@@ -785,13 +787,24 @@ enum struct slot_op_t {
     read,
     write,
 
+    // Queued TRIM when the drive supports it, otherwise the port is
+    // drained and it is issued as trim_dsm
+    trim,
+
     // All non-NCQ operations must go after this value
     non_ncq,
 
     identify,
-    flush
+    flush,
+    trim_dsm
 };
 
+// One 512 byte block of DATA SET MANAGEMENT ranges per command slot,
+// each entry holds a 48 bit LBA and a 16 bit sector count
+#define AHCI_DSM_RANGES         64
+#define AHCI_DSM_RANGE_MAX      0xFFFFU
+#define AHCI_DSM_RANGE_n(lba, count)    ((lba) | (uint64_t(count) << 48))
+
 struct slot_request_t {
     void *data;
     int64_t count;
@@ -801,10 +814,31 @@ struct slot_request_t {
     iocp_t *callback;
 };
 
+struct ahci_port_stats_t {
+    // Commands issued, by the number of commands in flight
+    // on the port after issuing it
+    uint64_t depth_hist[33];
+
+    uint64_t commands;
+
+    // FLUSH CACHE commands issued
+    uint64_t flushes;
+
+    // Flushes completed without a command, nothing was unflushed
+    uint64_t flushes_elided;
+
+    // Reads admitted while a flush waited for the port to drain
+    uint64_t drain_reads;
+
+    // Time spent waiting for the port to drain
+    uint64_t drain_ns;
+};
+
 struct hba_port_info_t {
     hba_fis_t *fis;
     hba_cmd_hdr_t *cmd_hdr;
     hba_cmd_tbl_ent_t *cmd_tbl;
+    uint64_t *dsm_ranges;
     uint32_t is_atapi;
     uint32_t cmd_issued;
     uint32_t slot_mask;
@@ -830,9 +864,24 @@ struct hba_port_info_t {
     // when the command is finished
     bool non_ncq_pending;
 
+    // A non-NCQ command is waiting for the queued commands to finish.
+    // Writes wait behind it, but up to drain_reads_left reads are still
+    // issued, so a flush doesn't stall every reader for the whole drain
+    bool drain_waiting;
+    uint8_t drain_reads_left;
+
+    // Writes issued without an effective FUA since the last flush,
+    // a flush is completed immediately when there are none
+    uint32_t unflushed_writes;
+
+    ahci_port_stats_t stats;
+
     bool use_ncq;
     bool use_fua;
     bool use_48bit;
+    bool use_trim;
+    bool use_queued_trim;
+    bool use_write_cache;
     uint8_t queue_depth;
     uint8_t log2_sector_size;
 };
@@ -861,15 +910,25 @@ public:
     unsigned io(unsigned port_num, slot_request_t &request);
 
     int port_flush(unsigned port_num, iocp_t *iocp);
+    unsigned port_trim(unsigned port_num, int64_t count, uint64_t lba,
+                       iocp_t *iocp);
 
     unsigned get_sector_size(unsigned port);
+    unsigned get_queue_depth(unsigned port);
     void configure_ncq(unsigned port_num, bool enable, uint8_t queue_depth);
     void configure_48bit(unsigned port_num, bool enable);
     void configure_fua(unsigned port_num, bool enable);
+    void configure_trim(unsigned port_num, bool enable, bool queued);
+    void configure_write_cache(unsigned port_num, bool enabled);
+    bool have_trim(unsigned port_num);
 
-    int8_t slot_wait(hba_port_info_t &pi,
+    int8_t slot_wait(hba_port_info_t &pi, slot_op_t op,
                      hba_port_info_t::scoped_lock &hold_port_lock);
 
+    // Append the port counters to buf like snprintf, starting at len,
+    // returns the length the whole text needs
+    size_t format_stats(char *buf, size_t size, size_t len);
+
 private:
     STORAGE_IF_IMPL
 
@@ -893,9 +952,11 @@ private:
 
     void bios_handoff();
 
-    int8_t slot_acquire(hba_port_info_t& pi,
+    int8_t slot_acquire(hba_port_info_t& pi, slot_op_t op,
                         scoped_port_lock &hold_port_lock);
 
+    void port_drain(hba_port_info_t &pi, scoped_port_lock &hold_port_lock);
+
     void cmd_issue(unsigned port_num, unsigned slot,
                    hba_cmd_cfis_t const *cfis, atapi_fis_t const *atapi_fis,
                    size_t fis_size, hba_prdt_ent_t const *prdts,
@@ -957,18 +1018,23 @@ void ahci_if_t::slot_release(unsigned port_num, int slot)
     pi->slotalloc_avail.notify_one();
 
     // Wake non-ncq thread if non-ncq is pending when every slot is free
-    if (pi->non_ncq_pending && ((pi->cmd_issued & pi->slot_mask) == 0))
+    if ((pi->non_ncq_pending || pi->drain_waiting) &&
+            ((pi->cmd_issued & pi->slot_mask) == 0))
         pi->idle_cond.notify_one();
 }
 
 // Acquire slot that is not in use
 // Returns -1 if all slots are in use
 // Must be holding port lock
-int8_t ahci_if_t::slot_acquire(hba_port_info_t& pi,
+int8_t ahci_if_t::slot_acquire(hba_port_info_t& pi, slot_op_t op,
                                scoped_port_lock& hold_port_lock)
 {
-    // Wait for non-NCQ command to finish
-    while (unlikely(pi.use_ncq && pi.non_ncq_pending))
+    // Wait for non-NCQ command to finish, reads may go ahead of one
+    // that is still waiting for the port to drain
+    while (unlikely(pi.use_ncq && (pi.non_ncq_pending ||
+                                   (pi.drain_waiting &&
+                                    (op != slot_op_t::read ||
+                                     !pi.drain_reads_left)))))
         pi.non_ncq_done_cond.wait(hold_port_lock);
 
     // Build bitmask of slots in use
@@ -983,6 +1049,11 @@ int8_t ahci_if_t::slot_acquire(hba_port_info_t& pi,
 
     pi.cmd_issued |= (1U << slot);
 
+    if (unlikely(pi.use_ncq && pi.drain_waiting)) {
+        --pi.drain_reads_left;
+        ++pi.stats.drain_reads;
+    }
+
     return slot;
 }
 
@@ -1003,9 +1074,11 @@ void ahci_if_t::handle_port_irqs(unsigned port_num)
     uint8_t slot;
 
     if (pi->use_ncq) {
-        // Handle all successes first
+        // Handle all successes first. A queued command is done when its
+        // SActive bit clears, a non-queued command issued while the port
+        // was drained only ever sets its command issue bit
         for (uint32_t done_slots = pi->slot_mask & pi->cmd_issued &
-             (pi->cmd_issued ^ port->sata_act);
+             ~(port->sata_act | port->cmd_issue);
              done_slots; done_slots &= ~(1U << slot)) {
             slot = bit_lsb_set(done_slots);
 
@@ -1023,6 +1096,11 @@ void ahci_if_t::handle_port_irqs(unsigned port_num)
             request.callback = nullptr;
 
             slot_release(port_num, slot);
+
+            if (int(request.op) > int(slot_op_t::non_ncq)) {
+                pi->non_ncq_pending = false;
+                pi->non_ncq_done_cond.notify_all();
+            }
         }
 
         if (unlikely(port_intr_status & AHCI_HP_IS_TFES)) {
@@ -1221,11 +1299,16 @@ void ahci_if_t::cmd_issue(unsigned port_num, unsigned slot,
         cmd_tbl_ent->atapi_fis = *atapi_fis;
 
     cmd_hdr->hdr = AHCI_CH_LEN_n(fis_size >> 2) |
-            (request.op == slot_op_t::write ? AHCI_CH_WR : 0) |
+            (request.op == slot_op_t::write ||
+             request.op == slot_op_t::trim ||
+             request.op == slot_op_t::trim_dsm ? AHCI_CH_WR : 0) |
             (atapi_fis ? AHCI_CH_ATAPI : 0);
     cmd_hdr->prdbc = 0;
     cmd_hdr->prdtl = ranges_count;
 
+    ++pi->stats.commands;
+    ++pi->stats.depth_hist[bit_popcnt(pi->cmd_issued & pi->slot_mask)];
+
     atomic_barrier();
 
     if (pi->use_ncq)
@@ -1240,6 +1323,12 @@ unsigned ahci_if_t::get_sector_size(unsigned port)
     return 1U << port_info[port].log2_sector_size;
 }
 
+unsigned ahci_if_t::get_queue_depth(unsigned port)
+{
+    (void)port;
+    return num_cmd_slots;
+}
+
 void ahci_if_t::configure_48bit(unsigned port_num, bool enable)
 {
     port_info[port_num].use_48bit = enable;
@@ -1250,6 +1339,87 @@ void ahci_if_t::configure_fua(unsigned port_num, bool enable)
     port_info[port_num].use_fua = enable;
 }
 
+size_t ahci_if_t::format_stats(char *buf, size_t size, size_t len)
+{
+    unsigned port_num;
+    for (uint32_t ports_impl = ports_impl_mask; ports_impl;
+         ports_impl &= ~(1U << port_num)) {
+        port_num = bit_lsb_set(ports_impl);
+
+        hba_port_info_t &pi = port_info[port_num];
+
+        scoped_port_lock hold_port_lock(pi.lock);
+        ahci_port_stats_t st = pi.stats;
+        unsigned queue_depth = pi.use_ncq ? pi.queue_depth : 1;
+        hold_port_lock.unlock();
+
+        if (!st.commands)
+            continue;
+
+        uint64_t depth_sum = 0;
+        unsigned peak = 0;
+        for (unsigned i = 0; i < countof(st.depth_hist); ++i) {
+            depth_sum += st.depth_hist[i] * i;
+            if (st.depth_hist[i])
+                peak = i;
+        }
+
+        // Average depth in hundredths, utilization in percent
+        uint64_t avg = depth_sum * 100 / st.commands;
+
+        size_t avail = len < size ? size - len : 0;
+        len += snprintf(avail ? buf + len : nullptr, avail,
+                        "ahci: port %u: %" PRIu64 " commands,"
+                        " depth avg %" PRIu64 ".%02" PRIu64 " peak %u"
+                        " (%" PRIu64 "%% of %u),"
+                        " %" PRIu64 " flushes, %" PRIu64 " elided,"
+                        " %" PRIu64 " reads during drain,"
+                        " %" PRIu64 "us draining\n",
+                        port_num, st.commands,
+                        avg / 100, avg % 100, peak,
+                        avg / queue_depth, queue_depth,
+                        st.flushes, st.flushes_elided,
+                        st.drain_reads,
+                        st.drain_ns / 1000);
+    }
+
+    return len;
+}
+
+static size_t ahci_stats_snapshot(char *buf, size_t size)
+{
+    size_t len = 0;
+
+    for (ahci_if_t *dev : ahci_devices)
+        len = dev->format_stats(buf, size, len);
+
+    return len;
+}
+
+static void ahci_stats_register(void *)
+{
+    devfs_add_snapshot("ahcistat", ahci_stats_snapshot);
+}
+
+REGISTER_CALLOUT(ahci_stats_register, nullptr,
+                 callout_type_t::storage_dev, "001");
+
+void ahci_if_t::configure_write_cache(unsigned port_num, bool enabled)
+{
+    port_info[port_num].use_write_cache = enabled;
+}
+
+void ahci_if_t::configure_trim(unsigned port_num, bool enable, bool queued)
+{
+    port_info[port_num].use_trim = enable;
+    port_info[port_num].use_queued_trim = enable && queued;
+}
+
+bool ahci_if_t::have_trim(unsigned port_num)
+{
+    return port_info[port_num].use_trim;
+}
+
 void ahci_if_t::configure_ncq(unsigned port_num, bool enable,
                               uint8_t queue_depth)
 {
@@ -1345,48 +1515,124 @@ unsigned ahci_if_t::io(unsigned port_num, slot_request_t &request)
     return expect_count;
 }
 
+// Flush the drive's write cache. SATA has no queued flush, so the
+// queued commands must finish first, but a flush with nothing to make
+// durable, because the cache is off or every write since the last flush
+// was FUA, completes without touching the port. That only covers writes
+// that have reached the port, blk_queue_t holds a flush until every
+// write submitted before it has completed, so none can still be queued
+// above the driver
 int ahci_if_t::port_flush(unsigned port_num, iocp_t *iocp)
 {
     hba_port_info_t &pi = port_info[port_num];
 
     scoped_port_lock hold_port_lock(pi.lock);
 
-    bool save_ncq = false;
+    if (!pi.use_write_cache || !pi.unflushed_writes) {
+        ++pi.stats.flushes_elided;
+        hold_port_lock.unlock();
 
-    if (pi.use_ncq) {
-        if (!pi.non_ncq_pending)
-            pi.non_ncq_pending = true;
+        iocp->set_result(errno_t::OK);
+        iocp->invoke();
+        return 1;
+    }
 
-        // Wait for all slots to become available
-        while (pi.cmd_issued & pi.slot_mask)
-            pi.idle_cond.wait(hold_port_lock);
+    slot_request_t request{};
+    request.count = 1;
+    request.op = slot_op_t::flush;
+    request.callback = iocp;
+
+    unsigned expect;
+
+    if (pi.use_ncq) {
+        port_drain(pi, hold_port_lock);
 
-        // Disable NCQ for duration of flush
-        save_ncq = pi.use_ncq;
         pi.use_ncq = false;
+        expect = io_locked(port_num, request, hold_port_lock);
+        pi.use_ncq = true;
+    } else {
+        expect = io_locked(port_num, request, hold_port_lock);
     }
 
-    slot_request_t request = pi.slot_requests[0];
+    // Writes issued from here on are after the flush
+    pi.unflushed_writes = 0;
+    ++pi.stats.flushes;
 
-    memset(&request, 0, sizeof(request));
-    request.op = slot_op_t::flush;
+    return expect;
+}
+
+// Wait until the port is idle so a non-NCQ command can be issued. Returns
+// with non_ncq_pending set, which holds off every other command until the
+// non-NCQ command completes
+void ahci_if_t::port_drain(hba_port_info_t &pi,
+                           scoped_port_lock &hold_port_lock)
+{
+    while (pi.non_ncq_pending || pi.drain_waiting)
+        pi.non_ncq_done_cond.wait(hold_port_lock);
+
+    pi.drain_waiting = true;
+    pi.drain_reads_left = pi.queue_depth;
+
+    uint64_t drain_st = time_ns();
+
+    while (pi.cmd_issued & pi.slot_mask)
+        pi.idle_cond.wait(hold_port_lock);
+
+    pi.stats.drain_ns += time_ns() - drain_st;
+
+    pi.drain_waiting = false;
+    pi.non_ncq_pending = true;
+}
+
+unsigned ahci_if_t::port_trim(unsigned port_num, int64_t count, uint64_t lba,
+                              iocp_t *iocp)
+{
+    hba_port_info_t &pi = port_info[port_num];
+
+    slot_request_t request{};
+    request.count = count;
+    request.lba = lba;
+    request.op = slot_op_t::trim;
     request.callback = iocp;
 
-    io(port_num, request);
+    scoped_port_lock hold_port_lock(pi.lock);
+
+    if (likely(!pi.use_ncq || pi.use_queued_trim))
+        return io_locked(port_num, request, hold_port_lock);
+
+    // The drive can't queue a TRIM, so drain the port like a flush
+    // and issue the commands one at a time
+    request.op = slot_op_t::trim_dsm;
 
-    if (save_ncq)
-        pi.use_ncq = save_ncq;
+    unsigned chunks = 0;
+
+    while (request.count > 0) {
+        int64_t chunk = std::min(request.count, int64_t(
+                                     AHCI_DSM_RANGES * AHCI_DSM_RANGE_MAX));
+
+        port_drain(pi, hold_port_lock);
+
+        slot_request_t chunk_request = request;
+        chunk_request.count = chunk;
+
+        pi.use_ncq = false;
+        chunks += io_locked(port_num, chunk_request, hold_port_lock);
+        pi.use_ncq = true;
+
+        request.lba += chunk;
+        request.count -= chunk;
+    }
 
-    return 0;
+    return chunks;
 }
 
 // Acquire a slot, waiting if necessary
-int8_t ahci_if_t::slot_wait(hba_port_info_t &pi,
+int8_t ahci_if_t::slot_wait(hba_port_info_t &pi, slot_op_t op,
                             scoped_port_lock& hold_port_lock)
 {
     int8_t slot;
     for (;;) {
-        slot = slot_acquire(pi, hold_port_lock);
+        slot = slot_acquire(pi, op, hold_port_lock);
         if (slot >= 0)
             break;
 
@@ -1418,15 +1664,18 @@ unsigned ahci_if_t::io_locked(unsigned port_num, slot_request_t &request,
     }
 
     void *data = request.data;
-    uint32_t lba = request.lba;
-    uint32_t count = request.count;
+    uint64_t lba = request.lba;
+    int64_t count = request.count;
+
+    bool is_trim = request.op == slot_op_t::trim ||
+            request.op == slot_op_t::trim_dsm;
 
     unsigned chunks;
     for (chunks = 0; count > 0; ++chunks) {
-        if (likely(request.data != nullptr)) {
+        if (likely(data != nullptr)) {
             ranges_count = mphysranges(ranges, countof(ranges),
-                                       request.data,
-                                       request.count << pi.log2_sector_size,
+                                       data,
+                                       count << pi.log2_sector_size,
                                        4<<20);
         } else {
             ranges_count = 0;
@@ -1445,7 +1694,27 @@ unsigned ahci_if_t::io_locked(unsigned port_num, slot_request_t &request,
         size_t transferred_blocks = transferred >> pi.log2_sector_size;
 
         // Wait for a slot
-        uint8_t slot = slot_wait(pi, hold_port_lock);
+        uint8_t slot = slot_wait(pi, request.op, hold_port_lock);
+
+        if (unlikely(is_trim)) {
+            // Fill the slot's range block, the rest of it must be zero
+            uint64_t *dsm = pi.dsm_ranges + slot * AHCI_DSM_RANGES;
+            memset(dsm, 0, sizeof(*dsm) * AHCI_DSM_RANGES);
+
+            transferred_blocks = 0;
+            for (size_t i = 0; i < AHCI_DSM_RANGES &&
+                 int64_t(transferred_blocks) < count; ++i) {
+                uint32_t n = std::min(count - int64_t(transferred_blocks),
+                                      int64_t(AHCI_DSM_RANGE_MAX));
+                dsm[i] = AHCI_DSM_RANGE_n(lba + transferred_blocks, n);
+                transferred_blocks += n;
+            }
+
+            prdts[0].dba = mphysaddr(dsm);
+            prdts[0].dbc_intr = AHCI_PE_DBC_n(
+                        sizeof(*dsm) * AHCI_DSM_RANGES);
+            ranges_count = 1;
+        }
 
         hba_cmd_cfis_t cfis;
         size_t fis_size;
@@ -1477,6 +1746,33 @@ unsigned ahci_if_t::io_locked(unsigned port_num, slot_request_t &request,
             cfis.h2d.command = pi.use_48bit
                     ? ata_cmd_t::CACHE_FLUSH_EXT
                     : ata_cmd_t::CACHE_FLUSH;
+
+            // No data, the whole request is one command
+            transferred_blocks = count;
+        } else if (unlikely(is_trim) && pi.use_ncq) {
+            fis_size = sizeof(cfis.ncq);
+
+            // SEND FPDMA QUEUED, DATA SET MANAGEMENT subcommand (0),
+            // one block of ranges, TRIM bit in auxiliary
+            cfis.ncq.fis_type = FIS_TYPE_REG_H2D;
+            cfis.ncq.ctl = AHCI_FIS_CTL_CMD;
+            cfis.ncq.command = ata_cmd_t::SEND_FPDMA_NCQ;
+            cfis.ncq.set_count(1);
+            cfis.ncq.tag = AHCI_FIS_TAG_TAG_n(slot);
+            cfis.ncq.fua = AHCI_FIS_FUA_LBA;
+            cfis.ncq.prio = 0;
+            cfis.ncq.aux = 1;
+        } else if (unlikely(is_trim)) {
+            fis_size = sizeof(cfis.h2d);
+
+            cfis.h2d.fis_type = FIS_TYPE_REG_H2D;
+            cfis.h2d.ctl = AHCI_FIS_CTL_CMD;
+            cfis.h2d.command = ata_cmd_t::DATA_SET_MGMT;
+
+            // TRIM bit, one block of ranges
+            cfis.h2d.feature_lo = 1;
+            cfis.h2d.set_count(1);
+            cfis.h2d.device = AHCI_FIS_FUA_LBA;
         } else if (pi.use_ncq) {
             fis_size = sizeof(cfis.ncq);
 
@@ -1486,10 +1782,10 @@ unsigned ahci_if_t::io_locked(unsigned port_num, slot_request_t &request,
             cfis.ncq.command = request.op == slot_op_t::read
                     ? ata_cmd_t::READ_DMA_NCQ
                     : ata_cmd_t::WRITE_DMA_NCQ;
-            cfis.ncq.set_lba(request.lba);
+            cfis.ncq.set_lba(lba);
             cfis.ncq.set_count(transferred_blocks);
             cfis.ncq.tag = AHCI_FIS_TAG_TAG_n(slot);
-            cfis.ncq.fua = AHCI_FIS_FUA_LBA | (request.fua
+            cfis.ncq.fua = AHCI_FIS_FUA_LBA | (request.fua && pi.use_fua
                                                ? AHCI_FIS_FUA_FUA : 0);
             cfis.ncq.prio = 0;
             cfis.ncq.aux = 0;
@@ -1500,7 +1796,7 @@ unsigned ahci_if_t::io_locked(unsigned port_num, slot_request_t &request,
             cfis.h2d.ctl = AHCI_FIS_CTL_CMD;
             cfis.h2d.command = ata_cmd_t::PACKET;
 
-            atapifis.set(ATAPI_CMD_READ, request.lba, transferred_blocks, 1);
+            atapifis.set(ATAPI_CMD_READ, lba, transferred_blocks, 1);
             // DMA and DMADIR
             cfis.h2d.feature_lo = 1 | ((request.op == slot_op_t::read) << 2);
             cfis.h2d.set_count(0);
@@ -1514,26 +1810,38 @@ unsigned ahci_if_t::io_locked(unsigned port_num, slot_request_t &request,
 
             cfis.h2d.command = request.op == slot_op_t::read
                     ? ata_cmd_t::READ_DMA_EXT
+                    : request.fua && pi.use_fua
+                    ? ata_cmd_t::WRITE_DMA_FUA_EXT
                     : ata_cmd_t::WRITE_DMA_EXT;
-            assert(request.lba < (1UL << 48));
-            cfis.h2d.set_lba(request.lba);
+            assert(lba < (1UL << 48));
+            cfis.h2d.set_lba(lba);
             cfis.h2d.set_count(transferred_blocks);
             cfis.h2d.feature_lo = 1;
 
             // LBA
-            cfis.h2d.device = request.fua ? AHCI_FIS_FUA_LBA : 0;
+            cfis.h2d.device = AHCI_FIS_FUA_LBA;
         }
 
+        // A FUA write that the drive can't honor is covered by the next
+        // flush instead
+        if (request.op == slot_op_t::write && !(request.fua && pi.use_fua))
+            ++pi.unflushed_writes;
+
         atomic_barrier();
 
-        pi.slot_requests[slot] = request;
+        slot_request_t &slot_request = pi.slot_requests[slot];
+        slot_request = request;
+        slot_request.data = data;
+        slot_request.lba = lba;
+        slot_request.count = transferred_blocks;
 
         cmd_issue(port_num, slot, &cfis,
                   (request.op == slot_op_t::read &&
                    pi.is_atapi) ? &atapifis : nullptr,
                   fis_size, prdts, ranges_count);
 
-        data = (char*)data + transferred;
+        if (data)
+            data = (char*)data + transferred;
         lba += transferred_blocks;
         count -= transferred_blocks;
     }
@@ -1632,6 +1940,8 @@ void ahci_if_t::rebase()
         port_buffer_size += sizeof(hba_cmd_hdr_t) * 32;
         // One cmd tbl per slot
         port_buffer_size += sizeof(hba_cmd_tbl_ent_t) * 32;
+        // One block of DSM ranges per slot
+        port_buffer_size += sizeof(uint64_t) * AHCI_DSM_RANGES * 32;
 
         buffers = mmap(nullptr, port_buffer_size,
                              PROT_READ | PROT_WRITE,
@@ -1640,12 +1950,14 @@ void ahci_if_t::rebase()
 
         hba_cmd_hdr_t *cmd_hdr = (hba_cmd_hdr_t *)buffers;
         hba_cmd_tbl_ent_t *cmd_tbl = (hba_cmd_tbl_ent_t*)(cmd_hdr + 32);
-        hba_fis_t *fis = (hba_fis_t*)(cmd_tbl + 32);
+        uint64_t *dsm_ranges = (uint64_t*)(cmd_tbl + 32);
+        hba_fis_t *fis = (hba_fis_t*)(dsm_ranges + AHCI_DSM_RANGES * 32);
 
         // Store linear addresses for writing to buffers
         pi->fis = fis;
         pi->cmd_hdr = cmd_hdr;
         pi->cmd_tbl = cmd_tbl;
+        pi->dsm_ranges = dsm_ranges;
 
         assert(port->sata_act == 0);
 
@@ -1844,6 +2156,13 @@ bool ahci_dev_t::init(ahci_if_t *parent, unsigned dev_port, bool dev_is_atapi)
                              identify->max_queue_minus1 + 1);
 
         iface->configure_fua(port, identify->support_fua_ext);
+
+        // Flushes are only needed with a volatile write cache
+        iface->configure_write_cache(port, identify->write_cache_enabled);
+
+        // Queued TRIM needs SEND FPDMA QUEUED
+        iface->configure_trim(port, identify->support_trim,
+                              identify->support_ncq_send_recv);
     }
 
     return true;
@@ -1890,11 +2209,16 @@ errno_t ahci_dev_t::write_async(
 
 errno_t ahci_dev_t::trim_async(
         int64_t count, uint64_t lba,
-        iocp_t *)
+        iocp_t *iocp)
 {
-    (void)count;
-    (void)lba;
-    return errno_t::ENOSYS;
+    if (unlikely(is_atapi || !iface->have_trim(port)))
+        return errno_t::ENOSYS;
+
+    int expect = iface->port_trim(port, count, lba, iocp);
+
+    iocp->set_expect(expect);
+
+    return errno_t::OK;
 }
 
 errno_t ahci_dev_t::flush_async(iocp_t *iocp)
@@ -1912,11 +2236,17 @@ long ahci_dev_t::info(storage_dev_info_t key)
         return iface->get_sector_size(port);
 
     case STORAGE_INFO_HAVE_TRIM:
-        return 0;
+        return !is_atapi && iface->have_trim(port);
 
     case STORAGE_INFO_NAME:
         return long("AHCI");
 
+    case STORAGE_INFO_QUEUE_COUNT:
+        return 1;
+
+    case STORAGE_INFO_QUEUE_DEPTH:
+        return iface->get_queue_depth(port);
+
     default:
         return 0;
     }
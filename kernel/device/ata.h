@@ -93,6 +93,7 @@ enum struct ata_cmd_t : uint8_t {
 
     // Trim
     DATA_SET_MGMT       = 0x06,
+    SEND_FPDMA_NCQ      = 0x64,
 
     // Security
     SEC_SET_PASSWORD    = 0xF1,
@@ -248,8 +249,10 @@ struct ata_identify_t {
     uint16_t support_ncq_priority:1;
     uint16_t :3;
 
-    // Word 77
-    uint16_t unused_77;
+    // Word 77 (SATA additional capabilities)
+    uint16_t :6;
+    uint16_t support_ncq_send_recv:1;
+    uint16_t :9;
 
     // Word 78 (SATA features supported)
     uint16_t :1;
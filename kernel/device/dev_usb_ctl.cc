@@ -1,4 +1,5 @@
 #include "dev_usb_ctl.h"
+#include "algorithm.h"
 
 usb_class_drv_t *usb_class_drv_t::first_driver;
 
@@ -117,6 +118,19 @@ int usb_pipe_t::send_async(void const *data, uint32_t length,
                            0, iocp);
 }
 
+int usb_pipe_t::stream_recv_async(uint16_t stream_id, void *data,
+                                  uint32_t length, usb_iocp_t *iocp) const
+{
+    return bus->xfer_async(slotid, epid, stream_id, length, data, 1, iocp);
+}
+
+int usb_pipe_t::stream_send_async(uint16_t stream_id, void const *data,
+                                  uint32_t length, usb_iocp_t *iocp) const
+{
+    return bus->xfer_async(slotid, epid, stream_id, length,
+                           const_cast<void*>(data), 0, iocp);
+}
+
 int usb_pipe_t::clear_ep_halt(usb_pipe_t const& target)
 {
     // Must be sent to control pipe
@@ -158,3 +172,20 @@ bool usb_bus_t::alloc_pipe(int slotid, usb_desc_iface const *iface,
                       iface->iface_num, iface->alt_setting,
                       ep->max_packet_sz, ep->interval, ep->ep_attr);
 }
+
+int usb_bus_t::alloc_stream_pipe(int slotid, usb_desc_iface const *iface,
+                                 usb_desc_ep const *ep,
+                                 usb_desc_ep_companion const *epc,
+                                 int max_streams, usb_pipe_t &pipe)
+{
+    // Streams require a SuperSpeed endpoint companion that advertises them
+    int ep_streams = epc ? 1 << (epc->attr & 0x1F) : 0;
+
+    if (ep_streams <= 1)
+        ep_streams = 0;
+
+    return alloc_stream_pipe(slotid, pipe, ep->ep_addr, iface->iface_index,
+                             iface->iface_num, iface->alt_setting,
+                             ep->max_packet_sz, epc ? epc->max_burst : 0,
+                             std::min(max_streams, ep_streams));
+}
@@ -1261,6 +1261,10 @@ long ide_dev_t::info(storage_dev_info_t key)
     case STORAGE_INFO_NAME:
         return long("IDE");
 
+    case STORAGE_INFO_QUEUE_COUNT:
+    case STORAGE_INFO_QUEUE_DEPTH:
+        return 1;
+
     default:
         return -1;
     }
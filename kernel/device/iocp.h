@@ -60,6 +60,9 @@ public:
 
     T wait();
 
+    // True once the callback has run, wait will not block
+    bool is_done() const;
+
 private:
     using lock_type = std::mcslock;
     using scoped_lock = std::unique_lock<lock_type>;
@@ -113,6 +116,9 @@ void basic_iocp_t<T, S>::set_expect(unsigned expect)
 template<typename T, typename S>
 void basic_iocp_t<T, S>::set_result(T const& sub_result)
 {
+    // Split requests may complete concurrently
+    scoped_lock hold(lock);
+
     // Only write not-ok to err to avoid losing split command errors
     if (result_count++ == 0 || !S::succeeded(sub_result))
         result = sub_result;
@@ -206,6 +212,12 @@ T basic_blocking_iocp_t<T, S>::wait()
     return status;
 }
 
+template<typename T, typename S>
+bool basic_blocking_iocp_t<T, S>::is_done() const
+{
+    return done;
+}
+
 template<typename T>
 struct __basic_iocp_error_success_t {
     static constexpr bool succeeded(errno_t const& status)
@@ -0,0 +1,255 @@
+#include "dev_eth.h"
+#include "eth_rx.h"
+#include "ipv4.h"
+#include "thread.h"
+#include "mutex.h"
+#include "string.h"
+#include "printk.h"
+#include "unique_ptr.h"
+#include "cpu/control_regs.h"
+
+// Loopback interface, a NIC that needs no hardware. Transmitted frames
+// are handed to the receive path through a per-CPU receive queue that
+// is polled like a hardware ring. Checksums are left to the "NIC",
+// which has nothing to compute, since nothing leaves memory
+
+// CPU that receives looped back frames, -1 receives them on the
+// sending CPU
+#define LOOPBACK_RX_CPU         -1
+
+// Frames allowed to wait in one receive queue, more are dropped
+#define LOOPBACK_QUEUE_MAX      1024
+
+#define DEBUG_LOOPBACK  0
+#if DEBUG_LOOPBACK
+#define LOOPBACK_TRACE(...) printdbg("loopback: " __VA_ARGS__)
+#else
+#define LOOPBACK_TRACE(...) ((void)0)
+#endif
+
+struct loopback_factory_t : public eth_dev_factory_t {
+    loopback_factory_t() : eth_dev_factory_t("loopback") {}
+    virtual int detect(eth_dev_base_t ***result) override;
+};
+
+static loopback_factory_t loopback_factory;
+
+class loopback_dev_t;
+
+struct loopback_rxq_t final : public eth_rx_queue_t {
+    int rx_poll(int budget) override final;
+    void rx_irq_unmask() override final;
+
+    using lock_type = std::spinlock;
+    using scoped_lock = std::unique_lock<lock_type>;
+    lock_type lock;
+
+    ethq_pkt_t *head = nullptr;
+    ethq_pkt_t *tail = nullptr;
+    size_t count = 0;
+
+    uint64_t drops = 0;
+
+    loopback_dev_t *owner = nullptr;
+    int cpu = 0;
+};
+
+class loopback_dev_t final : public eth_dev_base_t {
+public:
+    ETH_DEV_IMPL
+
+    unsigned get_offloads() override final;
+    size_t rx_queue_count() override final;
+
+    bool init();
+
+private:
+    friend struct loopback_rxq_t;
+
+    static ethq_pkt_t *clone(ethq_pkt_t const *pkt);
+
+    loopback_rxq_t rx_queues[MAX_CPUS];
+};
+
+static loopback_dev_t *loopback_dev;
+
+int loopback_factory_t::detect(eth_dev_base_t ***result)
+{
+    if (!ethq_init())
+        panic_oom();
+
+    std::unique_ptr<loopback_dev_t> dev(new loopback_dev_t());
+
+    if (!dev->init())
+        return 0;
+
+    if (!ipv4_addr_add(dev, IPV4_ADDR32(127U, 0U, 0U, 1U), 8))
+        return 0;
+
+    loopback_dev = dev.release();
+
+    *result = (eth_dev_base_t**)&loopback_dev;
+
+    return 1;
+}
+
+bool loopback_dev_t::init()
+{
+    for (size_t i = 0; i < countof(rx_queues); ++i) {
+        rx_queues[i].owner = this;
+        rx_queues[i].cpu = int(i);
+    }
+
+    return true;
+}
+
+// A frame that is also held elsewhere, like a TCP segment kept for
+// retransmission, can't be linked into receive queues, receive a copy
+ethq_pkt_t *loopback_dev_t::clone(ethq_pkt_t const *pkt)
+{
+    ethq_pkt_t *first = nullptr;
+    ethq_pkt_t **link = &first;
+
+    for (; pkt; pkt = pkt->frag) {
+        ethq_pkt_t *copy = ethq_pkt_acquire();
+
+        if (unlikely(!copy)) {
+            ethq_pkt_release(first);
+            return nullptr;
+        }
+
+        memcpy(&copy->pkt, &pkt->pkt, pkt->size);
+        copy->size = pkt->size;
+
+        *link = copy;
+        link = &copy->frag;
+    }
+
+    return first;
+}
+
+int loopback_dev_t::send(ethq_pkt_t *pkt)
+{
+    // Transmit completes immediately
+    if (pkt->callback) {
+        pkt->callback(pkt, 0, pkt->callback_arg);
+        pkt->callback = nullptr;
+        pkt->callback_arg = 0;
+    }
+
+    if (ethq_pkt_shared(pkt)) {
+        ethq_pkt_t *copy = clone(pkt);
+        ethq_pkt_release(pkt);
+        pkt = copy;
+
+        if (unlikely(!pkt))
+            return 0;
+    }
+
+    // No checksum was computed and none needs to be verified
+    pkt->offload = ETHQ_OFFLOAD_CSUM_OK;
+    pkt->gso_size = 0;
+    pkt->proto_flags = 0;
+    pkt->seq = 0;
+    pkt->stamp = 0;
+    pkt->data_ofs = 0;
+    pkt->data_len = 0;
+    pkt->nic = this;
+    pkt->next = nullptr;
+
+    int cpu = LOOPBACK_RX_CPU >= 0
+            ? LOOPBACK_RX_CPU
+            : thread_cpu_number();
+
+    loopback_rxq_t& rxq = rx_queues[size_t(cpu) % countof(rx_queues)];
+
+    loopback_rxq_t::scoped_lock hold(rxq.lock);
+
+    if (unlikely(rxq.count >= LOOPBACK_QUEUE_MAX)) {
+        ++rxq.drops;
+        hold.unlock();
+        LOOPBACK_TRACE("queue %d full, dropped\n", rxq.cpu);
+        ethq_pkt_release(pkt);
+        return 0;
+    }
+
+    if (rxq.tail)
+        rxq.tail->next = pkt;
+    else
+        rxq.head = pkt;
+    rxq.tail = pkt;
+    ++rxq.count;
+
+    hold.unlock();
+
+    eth_rx_schedule(&rxq, rxq.cpu);
+
+    return 1;
+}
+
+int loopback_rxq_t::rx_poll(int budget)
+{
+    scoped_lock hold(lock);
+
+    ethq_pkt_t *first = head;
+    ethq_pkt_t *last = nullptr;
+    int taken = 0;
+
+    for (ethq_pkt_t *pkt = head; pkt && taken < budget; pkt = pkt->next) {
+        last = pkt;
+        ++taken;
+    }
+
+    if (last) {
+        head = last->next;
+        if (!head)
+            tail = nullptr;
+        last->next = nullptr;
+        count -= taken;
+    }
+
+    hold.unlock();
+
+    if (first && taken)
+        eth_rx_deliver(first);
+
+    return taken;
+}
+
+// There is no interrupt, pick up frames queued since the last poll
+void loopback_rxq_t::rx_irq_unmask()
+{
+    if (atomic_ld_acq(&head))
+        eth_rx_schedule(this, cpu);
+}
+
+void loopback_dev_t::get_mac(void *mac_addr)
+{
+    memset(mac_addr, 0, 6);
+}
+
+void loopback_dev_t::set_mac(void const *mac_addr)
+{
+    (void)mac_addr;
+}
+
+int loopback_dev_t::get_promiscuous()
+{
+    return 1;
+}
+
+void loopback_dev_t::set_promiscuous(int promiscuous)
+{
+    (void)promiscuous;
+}
+
+unsigned loopback_dev_t::get_offloads()
+{
+    return ETH_DEV_OFFLOAD_TX_CSUM | ETH_DEV_OFFLOAD_RX_CSUM;
+}
+
+// Receiving on the sending CPU already spreads the flows
+size_t loopback_dev_t::rx_queue_count()
+{
+    return LOOPBACK_RX_CPU >= 0 ? 1 : thread_get_cpu_count();
+}
@@ -1605,3 +1605,75 @@
 #define NVME_CMP_SETFEAT_NQ_DW0_NSQA_SET(r,n)  ((r) = ((r) \
     & ~NVME_CMP_SETFEAT_NQ_DW0_NSQA) | NVME_CMP_SETFEAT_NQ_DW0_NSQA_n((n)))
 
+//
+// NVME_CMD_SETFEAT_IC_CDW11: Set features interrupt coalescing
+
+#define NVME_CMD_SETFEAT_IC_CDW11_TIME_BIT       8
+#define NVME_CMD_SETFEAT_IC_CDW11_THR_BIT        0
+
+#define NVME_CMD_SETFEAT_IC_CDW11_TIME_BITS      8
+#define NVME_CMD_SETFEAT_IC_CDW11_THR_BITS       8
+#define NVME_CMD_SETFEAT_IC_CDW11_TIME_MASK \
+    ((1U << NVME_CMD_SETFEAT_IC_CDW11_TIME_BITS)-1)
+#define NVME_CMD_SETFEAT_IC_CDW11_THR_MASK \
+    ((1U << NVME_CMD_SETFEAT_IC_CDW11_THR_BITS)-1)
+
+// Aggregation time in 100 microsecond increments
+#define NVME_CMD_SETFEAT_IC_CDW11_TIME \
+    (NVME_CMD_SETFEAT_IC_CDW11_TIME_MASK << NVME_CMD_SETFEAT_IC_CDW11_TIME_BIT)
+
+// Aggregation threshold, zero based completion count
+#define NVME_CMD_SETFEAT_IC_CDW11_THR \
+    (NVME_CMD_SETFEAT_IC_CDW11_THR_MASK << NVME_CMD_SETFEAT_IC_CDW11_THR_BIT)
+
+#define NVME_CMD_SETFEAT_IC_CDW11_TIME_n(n) \
+    ((n) << NVME_CMD_SETFEAT_IC_CDW11_TIME_BIT)
+#define NVME_CMD_SETFEAT_IC_CDW11_THR_n(n) \
+    ((n) << NVME_CMD_SETFEAT_IC_CDW11_THR_BIT)
+
+#define NVME_CMD_SETFEAT_IC_CDW11_TIME_GET(n)    (((n) >> \
+    NVME_CMD_SETFEAT_IC_CDW11_TIME_BIT) & NVME_CMD_SETFEAT_IC_CDW11_TIME_MASK)
+#define NVME_CMD_SETFEAT_IC_CDW11_THR_GET(n)     (((n) \
+    >> NVME_CMD_SETFEAT_IC_CDW11_THR_BIT) & NVME_CMD_SETFEAT_IC_CDW11_THR_MASK)
+
+#define NVME_CMD_SETFEAT_IC_CDW11_TIME_SET(r,n)  ((r) = ((r) \
+    & ~NVME_CMD_SETFEAT_IC_CDW11_TIME) | NVME_CMD_SETFEAT_IC_CDW11_TIME_n((n)))
+#define NVME_CMD_SETFEAT_IC_CDW11_THR_SET(r,n)   ((r) = ((r) \
+    & ~NVME_CMD_SETFEAT_IC_CDW11_THR) | NVME_CMD_SETFEAT_IC_CDW11_THR_n((n)))
+
+//
+// NVME_CMD_SETFEAT_IVC_CDW11: Set features interrupt vector config
+
+#define NVME_CMD_SETFEAT_IVC_CDW11_CD_BIT       16
+#define NVME_CMD_SETFEAT_IVC_CDW11_IV_BIT       0
+
+#define NVME_CMD_SETFEAT_IVC_CDW11_CD_BITS      1
+#define NVME_CMD_SETFEAT_IVC_CDW11_IV_BITS      16
+#define NVME_CMD_SETFEAT_IVC_CDW11_CD_MASK \
+    ((1U << NVME_CMD_SETFEAT_IVC_CDW11_CD_BITS)-1)
+#define NVME_CMD_SETFEAT_IVC_CDW11_IV_MASK \
+    ((1U << NVME_CMD_SETFEAT_IVC_CDW11_IV_BITS)-1)
+
+// Coalescing disable
+#define NVME_CMD_SETFEAT_IVC_CDW11_CD \
+    (NVME_CMD_SETFEAT_IVC_CDW11_CD_MASK << NVME_CMD_SETFEAT_IVC_CDW11_CD_BIT)
+
+// Interrupt vector
+#define NVME_CMD_SETFEAT_IVC_CDW11_IV \
+    (NVME_CMD_SETFEAT_IVC_CDW11_IV_MASK << NVME_CMD_SETFEAT_IVC_CDW11_IV_BIT)
+
+#define NVME_CMD_SETFEAT_IVC_CDW11_CD_n(n) \
+    ((n) << NVME_CMD_SETFEAT_IVC_CDW11_CD_BIT)
+#define NVME_CMD_SETFEAT_IVC_CDW11_IV_n(n) \
+    ((n) << NVME_CMD_SETFEAT_IVC_CDW11_IV_BIT)
+
+#define NVME_CMD_SETFEAT_IVC_CDW11_CD_GET(n)    (((n) \
+    >> NVME_CMD_SETFEAT_IVC_CDW11_CD_BIT) & NVME_CMD_SETFEAT_IVC_CDW11_CD_MASK)
+#define NVME_CMD_SETFEAT_IVC_CDW11_IV_GET(n)    (((n) \
+    >> NVME_CMD_SETFEAT_IVC_CDW11_IV_BIT) & NVME_CMD_SETFEAT_IVC_CDW11_IV_MASK)
+
+#define NVME_CMD_SETFEAT_IVC_CDW11_CD_SET(r,n)  ((r) = ((r) \
+    & ~NVME_CMD_SETFEAT_IVC_CDW11_CD) | NVME_CMD_SETFEAT_IVC_CDW11_CD_n((n)))
+#define NVME_CMD_SETFEAT_IVC_CDW11_IV_SET(r,n)  ((r) = ((r) \
+    & ~NVME_CMD_SETFEAT_IVC_CDW11_IV) | NVME_CMD_SETFEAT_IVC_CDW11_IV_n((n)))
+
@@ -1,4 +1,5 @@
 #include "dev_storage.h"
+#include "nvme.h"
 #include "nvmedecl.h"
 #include "device/pci.h"
 #include "mm.h"
@@ -13,6 +14,9 @@
 #include "mutex.h"
 #include "inttypes.h"
 #include "work_queue.h"
+#include "callout.h"
+#include "fs/devfs.h"
+#include "../libc/include/sys/nvme_ioctl.h"
 
 #define NVME_DEBUG	1
 #if NVME_DEBUG
@@ -21,6 +25,20 @@
 #define NVME_TRACE(...) ((void)0)
 #endif
 
+// Interrupt coalescing applied to the I/O queues at startup.
+// The threshold is a zero based completion count, the time is
+// in 100us units, both zero leaves coalescing off. It can be changed
+// at runtime with NVME_IOC_COALESCE on /dev/nvmestat
+#define NVME_COALESCE_THRESHOLD 0
+#define NVME_COALESCE_TIME      0
+
+// Largest transfer issued as a single command, further limited by
+// the controller's MDTS. Transfers that don't fit the inline PRP list
+// of their slot take pages from a per-queue pool, which must hold
+// enough pages for at least one maximum size transfer
+#define NVME_MAX_TRANSFER       (size_t(2) << 20)
+#define NVME_PRP_POOL_PAGES     64
+
 // 5.11 Identify command
 nvme_cmd_t nvme_cmd_t::create_identify(
         void *addr, uint8_t cns, uint8_t nsid)
@@ -105,21 +123,19 @@ nvme_cmd_t nvme_cmd_t::create_write(uint64_t lba, uint32_t count,
 }
 
 nvme_cmd_t nvme_cmd_t::create_trim(uint64_t lba, uint32_t count,
-                                   uint8_t ns)
+                                   uint8_t ns, nvme_dataset_range_t *range)
 {
     nvme_cmd_t cmd{};
     cmd.hdr.cdw0 = NVME_CMD_SDW0_OPC_n(
                 uint8_t(nvme_cmd_opcode_t::dataset_mgmt));
     cmd.hdr.nsid = ns;
 
-    nvme_dataset_range_t range;
-    range.attr = 0;
-    range.lba_count = count;
-    range.starting_lba = lba;
-
-    cmd.hdr.dptr.prpp[0].addr = mphysaddr(&range);
+    range->attr = 0;
+    range->lba_count = count;
+    range->starting_lba = lba;
 
-    cmd.cmd_dword_10[0] = NVME_CMD_DSMGMT_CDW10_NR_n(1);
+    // Number of ranges, zero based
+    cmd.cmd_dword_10[0] = NVME_CMD_DSMGMT_CDW10_NR_n(0);
     cmd.cmd_dword_10[1] = NVME_CMD_DSMGMT_CDW11_AD_n(1);
 
     return cmd;
@@ -148,6 +164,36 @@ nvme_cmd_t nvme_cmd_t::create_setfeatures(uint16_t ncqr, uint16_t nsqr)
     return cmd;
 }
 
+nvme_cmd_t nvme_cmd_t::create_setfeat_coalescing(
+        uint8_t threshold, uint8_t time)
+{
+    nvme_cmd_t cmd{};
+    cmd.hdr.cdw0 = NVME_CMD_SDW0_OPC_n(
+                uint8_t(nvme_admin_cmd_opcode_t::set_features));
+    cmd.cmd_dword_10[0] =
+            NVME_CMD_SETFEAT_CDW10_FID_n(
+                uint8_t(nvme_feat_id_t::irq_coalescing));
+    cmd.cmd_dword_10[1] =
+            NVME_CMD_SETFEAT_IC_CDW11_TIME_n(time) |
+            NVME_CMD_SETFEAT_IC_CDW11_THR_n(threshold);
+    return cmd;
+}
+
+nvme_cmd_t nvme_cmd_t::create_setfeat_vector_config(
+        uint16_t vector, bool coalesce)
+{
+    nvme_cmd_t cmd{};
+    cmd.hdr.cdw0 = NVME_CMD_SDW0_OPC_n(
+                uint8_t(nvme_admin_cmd_opcode_t::set_features));
+    cmd.cmd_dword_10[0] =
+            NVME_CMD_SETFEAT_CDW10_FID_n(
+                uint8_t(nvme_feat_id_t::irq_vector_config));
+    cmd.cmd_dword_10[1] =
+            NVME_CMD_SETFEAT_IVC_CDW11_CD_n(uint32_t(!coalesce)) |
+            NVME_CMD_SETFEAT_IVC_CDW11_IV_n(vector);
+    return cmd;
+}
+
 // ---------------------------------------------------------------------------
 // VFS interface forward declarations
 class nvme_if_t;
@@ -216,15 +262,23 @@ public:
         return next(tail) == head;
     }
 
+    // When ring is false, the doorbell is not written,
+    // and ring_tail must be called later
     template<typename... Args>
-    uint32_t enqueue(T&& item)
+    uint32_t enqueue(T&& item, bool ring = true)
     {
         size_t index = tail;
         entries[tail] = std::move(item);
-        phase ^= set_tail(next(tail));
+        phase ^= set_tail(next(tail), ring);
         return index;
     }
 
+    void ring_tail()
+    {
+        assert(tail_doorbell);
+        *tail_doorbell = tail;
+    }
+
     T& at_tail(size_t tail_offset, bool& ret_phase)
     {
         uint32_t index = (tail + tail_offset) & mask;
@@ -306,13 +360,13 @@ private:
     }
 
     // Returns 1 if the queue wrapped
-    bool set_tail(uint32_t new_tail)
+    bool set_tail(uint32_t new_tail, bool ring = true)
     {
         bool wrapped = new_tail < tail;
 
         tail = new_tail;
 
-        if (tail_doorbell)
+        if (tail_doorbell && ring)
             *tail_doorbell = tail;
 
         return wrapped;
@@ -438,10 +492,24 @@ struct nvme_request_t {
 typedef nvme_queue_t<nvme_cmd_t> sub_queue_t;
 typedef nvme_queue_t<nvme_cmp_t> cmp_queue_t;
 
+struct nvme_queue_stats_t {
+    uint64_t commands;
+    uint64_t doorbells;
+    uint64_t interrupts;
+    uint64_t completions;
+
+    // Completions reaped by polling, included in completions
+    uint64_t polled;
+};
+
 class nvme_queue_state_t {
 public:
     nvme_queue_state_t()
         : prp_lists(nullptr)
+        , prp_pool(nullptr)
+        , stats{}
+        , vector(0)
+        , doorbell_pending(false)
         , ready(false)
     {
     }
@@ -457,23 +525,53 @@ public:
 
     void init(size_t count,
               nvme_cmd_t *sub_queue_ptr, uint32_t volatile *sub_doorbell,
-              nvme_cmp_t *cmp_queue_ptr, uint32_t volatile *cmp_doorbell);
+              nvme_cmp_t *cmp_queue_ptr, uint32_t volatile *cmp_doorbell,
+              size_t max_transfer = 0);
 
     template<typename T>
     void submit_multiple();
 
+    // buffer is translated to a PRP list in the submitting context,
+    // it must fit in the max_transfer the queue was initialized with.
+    // A deferred command is placed in the queue without writing the
+    // doorbell, ring_doorbell makes all deferred commands visible to
+    // the controller with a single doorbell write
     void submit_cmd(nvme_cmd_t&& cmd,
                     nvme_callback_t::member_t callback = nullptr,
                     void *data = nullptr,
-                    mmphysrange_t *ranges = nullptr,
-                    size_t range_count = 0);
+                    void const *buffer = nullptr,
+                    size_t bytes = 0,
+                    bool defer = false);
+
+    // Submit a command with a small parameter payload, like dataset
+    // management ranges. The payload is copied into the command slot's
+    // inline PRP list, so the caller's copy may go away immediately
+    void submit_inline(nvme_cmd_t&& cmd,
+                       nvme_callback_t::member_t callback,
+                       void *data,
+                       void const *payload,
+                       size_t size,
+                       bool defer = false);
+
+    void ring_doorbell();
+
+    void get_stats(nvme_queue_stats_t *result);
+
+    void set_vector(uint16_t vector);
+    uint16_t get_vector() const;
 
     void advance_head(uint16_t new_head, bool need_lock);
 
+    void release_prp(uint16_t cmd_id, bool need_lock);
+
     void invoke_completion(nvme_if_t* owner, nvme_cmp_t& packet,
                            uint16_t cmd_id, int status_type, int status);
 
-    void process_completions(nvme_if_t *nvme_if, nvme_queue_state_t *queues);
+    // Reap the completion queue. Called from the interrupt worker, or
+    // by a polling submitter, which gives up if the queue is busy.
+    // Returns true if anything completed
+    bool process_completions(nvme_if_t *nvme_if, nvme_queue_state_t *queues,
+                             bool polled = false);
 
     nvme_cmd_t *sub_queue_ptr();
 
@@ -487,15 +585,44 @@ private:
     cmp_queue_t cmp_queue;
 
     void wait_sub_queue_not_full(scoped_lock& lock_);
+    void ring_doorbell_locked();
+    void enqueue_locked(nvme_cmd_t&& cmd, uint32_t index,
+                        nvme_callback_t::member_t callback,
+                        void *data, bool defer);
+
+    static size_t prp_pages_needed(size_t entries);
+    uint16_t build_prp_chain(mmphysrange_t const *ranges, size_t count);
 
+    // Held while reaping, cmp_buf is used after lock is released
+    std::spinlock reap_lock;
     std::vector<nvme_cmp_t> cmp_buf;
 
     std::vector<nvme_callback_t> cmp_handlers;
+
+    // PRP list entries kept with each slot, enough for 64KB
+    static constexpr size_t prp_inline = 16;
     uint64_t *prp_lists;
 
+    // Pool of PRP list pages, chained when a list needs more than one
+    // page. prp_chain holds the first pool page of each slot and
+    // prp_next links the pages of a chain
+    static constexpr size_t prp_per_page = PAGE_SIZE / sizeof(uint64_t);
+    static constexpr uint16_t prp_none = 0xFFFF;
+    uint64_t *prp_pool;
+    std::vector<uint16_t> prp_free;
+    std::vector<uint16_t> prp_next;
+    std::vector<uint16_t> prp_chain;
+
+    // Scratch for translating the buffer of the command being submitted
+    std::vector<mmphysrange_t> phys_ranges;
+
     lock_type lock;
     std::condition_variable not_full;
     std::condition_variable not_empty;
+    std::condition_variable prp_available;
+    nvme_queue_stats_t stats;
+    uint16_t vector;
+    bool doorbell_pending;
     bool ready;
 };
 
@@ -517,6 +644,27 @@ class nvme_if_t : public storage_if_base_t {
 public:
     bool init(const pci_dev_iterator_t &pci_dev);
     size_t get_queue_count() const;
+    size_t get_queue_slots() const;
+    size_t get_max_transfer() const;
+
+    bool have_trim() const;
+
+    // Hold back I/O queue doorbell writes until the last unplug
+    void plug();
+    void unplug();
+
+    // Controller wide coalescing parameters, then enable or disable
+    // coalescing for the interrupt vector of one I/O queue.
+    // Queues that share a vector share the setting
+    errno_t set_coalescing(uint8_t threshold, uint8_t time);
+    errno_t set_queue_coalescing(size_t queue, bool enable);
+
+    // Append the queue counters to buf like snprintf, starting at len,
+    // returns the length the whole text needs
+    size_t format_stats(char *buf, size_t size, size_t len);
+
+    // Reap completions on the calling CPU's I/O queue
+    bool poll();
 
 private:
     STORAGE_IF_IMPL
@@ -528,15 +676,17 @@ private:
 
     uint32_t volatile* doorbell_ptr(bool completion, size_t queue);
 
+    size_t queue_for_cpu() const;
+
     unsigned io(uint8_t ns, nvme_request_t &request, uint8_t log2_sectorsize);
 
     // Handle setting the queue count
     void setfeat_queues_handler(void *data, nvme_cmp_t &packet,
                                 uint16_t cmd_id, int status_type, int status);
 
-    // Handle controller identify
-    void identify_handler(void *data, nvme_cmp_t &packet,
-                          uint16_t cmd_id, int status_type, int status);
+    // Handle admin commands that only report status
+    void status_handler(void *data, nvme_cmp_t &packet,
+                        uint16_t cmd_id, int status_type, int status);
 
     // Handle namespace list identify
     void identify_ns_id_handler(void *data, nvme_cmp_t &packet,
@@ -562,6 +712,15 @@ private:
     size_t queue_count;
     size_t max_queues;
 
+    // Entries in each submission and completion queue
+    size_t queue_slots;
+
+    // Largest data transfer of one command, in bytes
+    size_t max_transfer;
+
+    // Controller supports the dataset management command
+    bool have_dsm;
+
     uintptr_t queue_memory_physaddr;
     void* queue_memory;
 
@@ -572,6 +731,9 @@ private:
 
     std::unique_ptr<nvme_queue_state_t[]> queues;
     bool use_msi;
+
+    // Nonzero while doorbell writes are being held back
+    unsigned plugged;
 };
 
 class nvme_dev_t : public storage_dev_base_t {
@@ -581,6 +743,10 @@ public:
 private:
     STORAGE_DEV_IMPL
 
+    void plug() override final;
+    void unplug() override final;
+    bool poll() override final;
+
     errno_t io(void *data, int64_t count,
                uint64_t lba, bool fua, nvme_op_t op, iocp_t *iocp);
 
@@ -693,7 +859,7 @@ bool nvme_if_t::init(pci_dev_iterator_t const &pci_dev)
         pause();
 
     // Attempt to use 64KB/16KB submission/completion queue sizes
-    size_t queue_slots = 1024;
+    queue_slots = 1024;
     assert(queue_slots <= 4096);
     size_t max_queue_slots = NVME_CAP_MQES_GET(mmio_base->cap) + 1;
 
@@ -803,24 +969,61 @@ bool nvme_if_t::init(pci_dev_iterator_t const &pci_dev)
 
     NVME_TRACE("Allocated queue count %zu\n", queue_count - 1);
 
+    uintptr_t identify_physaddr = mm_alloc_contiguous(4096);
+
+    nvme_identify_t *identify = (nvme_identify_t*)mmap(
+                (void*)identify_physaddr, 4096,
+                PROT_READ | PROT_WRITE, MAP_PHYSICAL, -1, 0);
+
+    // 5.11 Execute identify controller command, the I/O queues are
+    // sized from the maximum data transfer size it reports
+    blocking_iocp_t blocking_identify;
+
+    admin_queue.submit_cmd(nvme_cmd_t::create_identify(identify, 1, 0),
+                           &nvme_if_t::status_handler,
+                           (iocp_t*)&blocking_identify);
+
+    blocking_identify.set_expect(1);
+    status = blocking_identify.wait();
+
+    max_transfer = NVME_MAX_TRANSFER;
+
+    if (status == errno_t::OK) {
+        // ONCS bit 2, dataset management
+        have_dsm = identify->oncs & (1U << 2);
+
+        host_buffer_size = identify->hmpre;
+        if (host_buffer_size > 0)
+            host_buffer_physaddr = mm_alloc_contiguous(host_buffer_size);
+
+        // MDTS is a power of two in units of the minimum page size,
+        // zero means no limit
+        if (identify->mdts) {
+            size_t min_page_size = size_t(1) <<
+                    (12 + NVME_CAP_MPSMIN_GET(mmio_base->cap));
+
+            if (identify->mdts < 32)
+                max_transfer = std::min(max_transfer,
+                                        min_page_size << identify->mdts);
+        }
+    }
+
+    munmap(identify, 4096);
+    mm_free_contiguous(identify_physaddr, 4096);
+
+    if (status != errno_t::OK)
+        return false;
+
+    NVME_TRACE("Maximum transfer %zuKB\n", max_transfer >> 10);
+
     for (size_t i = 1; i < queue_count; ++i) {
         nvme_queue_state_t& queue = queues[i];
         queue.init(queue_slots, sub_queue_ptr, doorbell_ptr(false, i),
-                   cmp_queue_ptr, doorbell_ptr(true, i));
+                   cmp_queue_ptr, doorbell_ptr(true, i), max_transfer);
         sub_queue_ptr += queue_slots;
         cmp_queue_ptr += queue_slots;
     }
 
-    uintptr_t identify_physaddr = mm_alloc_contiguous(4096);
-
-    void* identify = mmap((void*)identify_physaddr, 4096,
-                          PROT_READ | PROT_WRITE,
-                          MAP_PHYSICAL, -1, 0);
-
-    // 5.11 Execute identify controller command
-    admin_queue.submit_cmd(nvme_cmd_t::create_identify(identify, 1, 0),
-                           &nvme_if_t::identify_handler, identify);
-
     // Create completion queues
     for (size_t i = 1; i < queue_count; ++i) {
         int vector;
@@ -832,6 +1035,8 @@ bool nvme_if_t::init(pci_dev_iterator_t const &pci_dev)
             vector = i ? (i - 1) % irq_range.count : 0;
         }
 
+        queues[i].set_vector(vector);
+
         admin_queue.submit_cmd(nvme_cmd_t::create_cmp_queue(
                                    queues[i].cmp_queue_ptr(),
                                    queue_slots, i, vector));
@@ -844,6 +1049,14 @@ bool nvme_if_t::init(pci_dev_iterator_t const &pci_dev)
                                    queue_slots, i, i, 2));
     }
 
+    if (NVME_COALESCE_THRESHOLD || NVME_COALESCE_TIME) {
+        if (set_coalescing(NVME_COALESCE_THRESHOLD,
+                           NVME_COALESCE_TIME) == errno_t::OK) {
+            for (size_t i = 1; i < queue_count; ++i)
+                set_queue_coalescing(i, true);
+        }
+    }
+
     NVME_TRACE("interface initialization success\n");
 
     return true;
@@ -854,6 +1067,99 @@ size_t nvme_if_t::get_queue_count() const
     return queue_count;
 }
 
+size_t nvme_if_t::get_queue_slots() const
+{
+    return queue_slots;
+}
+
+size_t nvme_if_t::get_max_transfer() const
+{
+    return max_transfer;
+}
+
+bool nvme_if_t::have_trim() const
+{
+    return have_dsm;
+}
+
+void nvme_if_t::plug()
+{
+    atomic_inc(&plugged);
+}
+
+void nvme_if_t::unplug()
+{
+    if (atomic_dec(&plugged) != 0)
+        return;
+
+    for (size_t i = 1; i < queue_count; ++i)
+        queues[i].ring_doorbell();
+}
+
+errno_t nvme_if_t::set_coalescing(uint8_t threshold, uint8_t time)
+{
+    blocking_iocp_t iocp;
+
+    queues[0].submit_cmd(nvme_cmd_t::create_setfeat_coalescing(
+                             threshold, time),
+                         &nvme_if_t::status_handler, (iocp_t*)&iocp);
+
+    iocp.set_expect(1);
+    errno_t status = iocp.wait();
+
+    NVME_TRACE("interrupt coalescing threshold=%u time=%uus status=%d\n",
+               threshold + 1, time * 100, int(status));
+
+    return status;
+}
+
+errno_t nvme_if_t::set_queue_coalescing(size_t queue, bool enable)
+{
+    // Coalescing never applies to the admin queue
+    if (unlikely(queue == 0 || queue >= queue_count))
+        return errno_t::EINVAL;
+
+    blocking_iocp_t iocp;
+
+    queues[0].submit_cmd(nvme_cmd_t::create_setfeat_vector_config(
+                             queues[queue].get_vector(), enable),
+                         &nvme_if_t::status_handler, (iocp_t*)&iocp);
+
+    iocp.set_expect(1);
+    return iocp.wait();
+}
+
+size_t nvme_if_t::format_stats(char *buf, size_t size, size_t len)
+{
+    for (size_t i = 1; i < queue_count; ++i) {
+        nvme_queue_stats_t st;
+        queues[i].get_stats(&st);
+
+        if (!st.commands)
+            continue;
+
+        uint64_t irq_completions = st.completions - st.polled;
+
+        // Ratios in hundredths
+        size_t avail = len < size ? size - len : 0;
+        len += snprintf(avail ? buf + len : nullptr, avail,
+                        "nvme: queue %zu: %" PRIu64 " commands,"
+                        " %" PRIu64 ".%02" PRIu64 " per doorbell,"
+                        " %" PRIu64 ".%02" PRIu64 " completions per interrupt,"
+                        " %" PRIu64 " polled\n",
+                        i, st.commands,
+                        st.commands / std::max(st.doorbells, UINT64_C(1)),
+                        st.commands * 100 /
+                        std::max(st.doorbells, UINT64_C(1)) % 100,
+                        irq_completions / std::max(st.interrupts, UINT64_C(1)),
+                        irq_completions * 100 /
+                        std::max(st.interrupts, UINT64_C(1)) % 100,
+                        st.polled);
+    }
+
+    return len;
+}
+
 void nvme_if_t::identify_ns_id_handler(
         void *data, nvme_cmp_t&, uint16_t, int, int)
 {
@@ -913,19 +1219,6 @@ void nvme_if_t::identify_ns_handler(
     }
 }
 
-void nvme_if_t::identify_handler(
-        void *data, nvme_cmp_t&, uint16_t, int, int)
-{
-    nvme_identify_t* identify = (nvme_identify_t*)data;
-
-    host_buffer_size = identify->hmpre;
-    if (host_buffer_size > 0)
-        host_buffer_physaddr = mm_alloc_contiguous(host_buffer_size);
-
-    mm_free_contiguous(mphysaddr(data), 4096);
-    munmap(data, 4096);
-}
-
 void nvme_if_t::cleanup_if()
 {
 }
@@ -965,6 +1258,73 @@ void nvme_dev_t::cleanup_dev()
 
 }
 
+void nvme_dev_t::plug()
+{
+    parent->plug();
+}
+
+void nvme_dev_t::unplug()
+{
+    parent->unplug();
+}
+
+bool nvme_dev_t::poll()
+{
+    return parent->poll();
+}
+
+static size_t nvme_stats_snapshot(char *buf, size_t size)
+{
+    size_t len = 0;
+
+    for (nvme_if_t *dev : nvme_devices)
+        len = dev->format_stats(buf, size, len);
+
+    return len;
+}
+
+static int nvme_stats_ioctl(int cmd, void *data)
+{
+    switch (unsigned(cmd)) {
+    case NVME_IOC_COALESCE:
+    {
+        nvme_coalesce const *req = (nvme_coalesce const *)data;
+
+        if (unlikely(req->controller >= nvme_devices.size()))
+            return -int(errno_t::ENODEV);
+
+        nvme_if_t *dev = nvme_devices[req->controller];
+
+        size_t queue_count = dev->get_queue_count();
+
+        if (unlikely(req->queue >= queue_count))
+            return -int(errno_t::EINVAL);
+
+        errno_t status = dev->set_coalescing(req->threshold, req->time);
+
+        // Queue zero selects every I/O queue
+        size_t st = req->queue ? req->queue : 1;
+        size_t en = req->queue ? req->queue + 1 : queue_count;
+
+        for (size_t i = st; status == errno_t::OK && i < en; ++i)
+            status = dev->set_queue_coalescing(i, req->enable);
+
+        return status == errno_t::OK ? 0 : -int(status);
+    }
+
+    default:
+        return -int(errno_t::ENOTTY);
+    }
+}
+
+static void nvme_stats_register(void *)
+{
+    devfs_add_snapshot("nvmestat", nvme_stats_snapshot, nvme_stats_ioctl);
+}
+
+REGISTER_CALLOUT(nvme_stats_register, nullptr,
+                 callout_type_t::storage_dev, "001");
+
 isr_context_t *nvme_if_t::irq_handler(int irq, isr_context_t *ctx)
 {
     for (unsigned i = 0; i < nvme_devices.size(); ++i) {
@@ -1008,17 +1368,25 @@ uint32_t volatile* nvme_if_t::doorbell_ptr(bool completion, size_t queue)
     return doorbells + ((queue << doorbell_shift) + completion);
 }
 
-unsigned nvme_if_t::io(uint8_t ns, nvme_request_t &request,
-                       uint8_t log2_sectorsize)
+size_t nvme_if_t::queue_for_cpu() const
 {
     size_t cur_cpu = thread_cpu_number();
 
-    int queue_index;
-
     if (cur_cpu < queue_count - 1)
-        queue_index = cur_cpu + 1;
-    else
-        queue_index = cur_cpu % (queue_count - 1) + 1;
+        return cur_cpu + 1;
+
+    return cur_cpu % (queue_count - 1) + 1;
+}
+
+bool nvme_if_t::poll()
+{
+    return queues[queue_for_cpu()].process_completions(this, queues, true);
+}
+
+unsigned nvme_if_t::io(uint8_t ns, nvme_request_t &request,
+                       uint8_t log2_sectorsize)
+{
+    int queue_index = queue_for_cpu();
 
     size_t bytes = request.count << log2_sectorsize;
 
@@ -1027,26 +1395,31 @@ unsigned nvme_if_t::io(uint8_t ns, nvme_request_t &request,
     while (request.count > 0) {
         ++expect;
 
-        size_t chunk;
+        size_t chunk = 0;
         size_t lba_count;
-        size_t range_count;
-        mmphysrange_t ranges[16];
+        void const *buffer = request.data;
         nvme_cmd_t cmd;
+        nvme_dataset_range_t range;
 
         switch (request.op) {
         case nvme_op_t::read:
         case nvme_op_t::write:
-            chunk = std::min(bytes, size_t(0x10000));
-            range_count = mphysranges(ranges, countof(ranges),
-                                      request.data, chunk, PAGE_SIZE);
+            chunk = std::min(bytes, max_transfer);
 
             lba_count = chunk >> log2_sectorsize;
             request.count -= lba_count;
-            request.data = (char*)request.data + (lba_count << log2_sectorsize);
+            request.data = (char*)request.data + chunk;
+            bytes -= chunk;
+            break;
+
+        case nvme_op_t::trim:
+            lba_count = std::min(uint64_t(request.count),
+                                 uint64_t(0xFFFFFFFFU));
+            request.count -= lba_count;
             break;
 
         case nvme_op_t::flush:
-            range_count = 0;
+            lba_count = 0;
             request.count = 0;
             break;
 
@@ -1067,7 +1440,7 @@ unsigned nvme_if_t::io(uint8_t ns, nvme_request_t &request,
 
         case nvme_op_t::trim:
             cmd = nvme_cmd_t::create_trim(
-                    request.lba, lba_count, ns);
+                    request.lba, lba_count, ns, &range);
             break;
 
         case nvme_op_t::flush:
@@ -1076,11 +1449,23 @@ unsigned nvme_if_t::io(uint8_t ns, nvme_request_t &request,
 
         }
 
+        request.lba += lba_count;
+
         nvme_queue_state_t& queue = queues[queue_index];
-        queue.submit_cmd(std::move(cmd), &nvme_if_t::io_handler, request.iocp,
-                         ranges, range_count);
+
+        if (request.op == nvme_op_t::trim)
+            queue.submit_inline(std::move(cmd), &nvme_if_t::io_handler,
+                                request.iocp, &range, sizeof(range), true);
+        else
+            queue.submit_cmd(std::move(cmd), &nvme_if_t::io_handler,
+                             request.iocp, buffer, chunk, true);
     }
 
+    // One doorbell write for all of the chunks, or for the whole
+    // batch if plugged, the last unplug rings it then
+    if (!atomic_ld_acq(&plugged))
+        queues[queue_index].ring_doorbell();
+
     return expect;
 }
 
@@ -1102,6 +1487,17 @@ errno_t nvme_if_t::status_to_errno(int status_type, int status)
             : errno_t::EIO;
 }
 
+void nvme_if_t::status_handler(
+        void *data, nvme_cmp_t&, uint16_t, int status_type, int status)
+{
+    iocp_t* iocp = (iocp_t*)data;
+
+    errno_t err = status_to_errno(status_type, status);
+
+    iocp->set_result(err);
+    iocp->invoke();
+}
+
 void nvme_if_t::setfeat_queues_handler(
         void *data, nvme_cmp_t& packet,
         uint16_t, int status_type, int status)
@@ -1159,6 +1555,9 @@ errno_t nvme_dev_t::flush_async(iocp_t *iocp)
 errno_t nvme_dev_t::trim_async(int64_t count,
         uint64_t lba, iocp_t *iocp)
 {
+    if (unlikely(!parent->have_trim()))
+        return errno_t::ENOSYS;
+
     return io(nullptr, count, lba, false, nvme_op_t::trim, iocp);
 }
 
@@ -1169,11 +1568,21 @@ long nvme_dev_t::info(storage_dev_info_t key)
         return 1L << log2_sectorsize;
 
     case STORAGE_INFO_HAVE_TRIM:
-        return 1;
+        return parent->have_trim();
 
     case STORAGE_INFO_NAME:
         return long("NVME");
 
+    case STORAGE_INFO_QUEUE_COUNT:
+        return parent->get_queue_count() - 1;
+
+    case STORAGE_INFO_QUEUE_DEPTH:
+        // One slot is always empty to tell a full queue from an empty one
+        return parent->get_queue_slots() - 1;
+
+    case STORAGE_INFO_MAX_TRANSFER:
+        return parent->get_max_transfer();
+
     default:
         return 0;
     }
@@ -1182,7 +1591,7 @@ long nvme_dev_t::info(storage_dev_info_t key)
 void nvme_queue_state_t::init(
         size_t count, nvme_cmd_t *sub_queue_ptr,
         uint32_t volatile *sub_doorbell, nvme_cmp_t *cmp_queue_ptr,
-        volatile uint32_t *cmp_doorbell)
+        volatile uint32_t *cmp_doorbell, size_t max_transfer)
 {
     sub_queue.init(sub_queue_ptr, count, nullptr, sub_doorbell, 1);
     cmp_queue.init(cmp_queue_ptr, count, cmp_doorbell, nullptr, 1);
@@ -1190,28 +1599,170 @@ void nvme_queue_state_t::init(
     cmp_handlers.resize(count);
     cmp_buf.reserve(count);
 
-    // Allocate enough memory for 16 PRP list entries per slot
+    // Allocate enough memory for the inline PRP list entries of each slot
     prp_lists = (uint64_t*)mmap(
-                nullptr, count * sizeof(*prp_lists) * 16,
+                nullptr, count * sizeof(*prp_lists) * prp_inline,
+                PROT_READ | PROT_WRITE, MAP_POPULATE, -1, 0);
+
+    if (!prp_chain.resize(count, prp_none))
+        panic_oom();
+
+    // An unaligned buffer touches one more page than its size
+    size_t max_ranges = (max_transfer >> PAGE_SCALE) + 1;
+
+    // One spare entry to detect a buffer that doesn't fit
+    if (!phys_ranges.resize(std::max(max_ranges, prp_inline + 1) + 1))
+        panic_oom();
+
+    if (max_ranges - 1 <= prp_inline)
+        return;
+
+    size_t pool_pages = NVME_PRP_POOL_PAGES;
+    assert(prp_pages_needed(max_ranges - 1) <= pool_pages);
+
+    prp_pool = (uint64_t*)mmap(
+                nullptr, pool_pages << PAGE_SCALE,
                 PROT_READ | PROT_WRITE, MAP_POPULATE, -1, 0);
+
+    if (unlikely(prp_pool == MAP_FAILED))
+        panic_oom();
+
+    if (!prp_next.resize(pool_pages, prp_none) ||
+            !prp_free.reserve(pool_pages))
+        panic_oom();
+
+    for (size_t i = pool_pages; i > 0; --i)
+        prp_free.push_back(i - 1);
+}
+
+// A list page holds prp_per_page entries when it is the last one of
+// the chain, otherwise its last entry points to the next list page
+size_t nvme_queue_state_t::prp_pages_needed(size_t entries)
+{
+    return (entries + prp_per_page - 3) / (prp_per_page - 1);
+}
+
+// Called with the lock held, after enough pool pages are free
+uint16_t nvme_queue_state_t::build_prp_chain(
+        mmphysrange_t const *ranges, size_t count)
+{
+    uint16_t first = prp_none;
+    uint16_t prev = prp_none;
+
+    for (size_t i = 0; i < count; ) {
+        uint16_t page = prp_free.back();
+        prp_free.pop_back();
+
+        uint64_t *list = prp_pool + page * prp_per_page;
+
+        if (prev == prp_none) {
+            first = page;
+        } else {
+            prp_pool[prev * prp_per_page + prp_per_page - 1] =
+                    mphysaddr(list);
+            prp_next[prev] = page;
+        }
+
+        size_t remain = count - i;
+        size_t fill = remain <= prp_per_page ? remain : prp_per_page - 1;
+
+        for (size_t k = 0; k < fill; ++k)
+            list[k] = ranges[i + k].physaddr;
+
+        i += fill;
+        prev = page;
+    }
+
+    prp_next[prev] = prp_none;
+
+    return first;
+}
+
+void nvme_queue_state_t::release_prp(uint16_t cmd_id, bool need_lock)
+{
+    scoped_lock hold(lock, std::defer_lock_t());
+
+    if (need_lock)
+        hold.lock();
+
+    uint16_t page = prp_chain[cmd_id];
+
+    if (page == prp_none)
+        return;
+
+    prp_chain[cmd_id] = prp_none;
+
+    while (page != prp_none) {
+        prp_free.push_back(page);
+        page = prp_next[page];
+    }
+
+    prp_available.notify_all();
 }
 
 void nvme_queue_state_t::submit_cmd(
         nvme_cmd_t &&cmd, nvme_callback_t::member_t callback,
-        void *data, mmphysrange_t *ranges, size_t range_count)
+        void *data, void const *buffer, size_t bytes, bool defer)
 {
     scoped_lock hold(lock);
 
-    wait_sub_queue_not_full(hold);
+    // Once split at page boundaries there is one range per page touched
+    size_t page_count = 0;
+
+    if (bytes) {
+        uintptr_t misalignment = uintptr_t(buffer) & (PAGE_SIZE - 1);
+        page_count = (misalignment + bytes + PAGE_SIZE - 1) >> PAGE_SCALE;
+    }
+
+    // PRP list pages needed, if the list doesn't fit inline
+    size_t list_pages = page_count > prp_inline + 1
+            ? prp_pages_needed(page_count - 1)
+            : 0;
+
+    for (;;) {
+        wait_sub_queue_not_full(hold);
+
+        if (likely(prp_free.size() >= list_pages))
+            break;
+
+        // Deferred commands may hold the pages we are waiting for
+        ring_doorbell_locked();
+        prp_available.wait(hold);
+    }
+
+    // Translate only now, the waits drop the lock and phys_ranges
+    // is shared by every submitter on the queue
+    size_t range_count = 0;
+    mmphysrange_t *ranges = phys_ranges.data();
+
+    if (bytes) {
+        range_count = mphysranges(ranges, phys_ranges.size(),
+                                  buffer, bytes, PAGE_SIZE);
+
+        // Every entry after the first must start on a page boundary
+        bool split_ok = mphysranges_split(ranges, range_count,
+                                          phys_ranges.size(), PAGE_SCALE);
+
+        assert(split_ok && range_count <= page_count);
+        (void)split_ok;
+    }
 
     uint32_t index = sub_queue.get_tail();
 
     NVME_CMD_SDW0_CID_SET(cmd.hdr.cdw0, index);
 
-    if (range_count > 2) {
+    if (list_pages) {
+        cmd.hdr.dptr.prpp[0].addr = ranges[0].physaddr;
+
+        uint16_t first = build_prp_chain(ranges + 1, range_count - 1);
+        prp_chain[index] = first;
+
+        cmd.hdr.dptr.prpp[1].addr = mphysaddr(
+                    prp_pool + first * prp_per_page);
+    } else if (range_count > 2) {
         cmd.hdr.dptr.prpp[0].addr = ranges[0].physaddr;
 
-        uint64_t volatile *prp_list = prp_lists + index * 16;
+        uint64_t volatile *prp_list = prp_lists + index * prp_inline;
 
         for (size_t i = 1; i < range_count; ++i)
             prp_list[i-1] = ranges[i].physaddr;
@@ -1224,14 +1775,84 @@ void nvme_queue_state_t::submit_cmd(
         cmd.hdr.dptr.prpp[0].addr = ranges[0].physaddr;
     }
 
+    enqueue_locked(std::move(cmd), index, callback, data, defer);
+}
+
+void nvme_queue_state_t::submit_inline(
+        nvme_cmd_t &&cmd, nvme_callback_t::member_t callback,
+        void *data, void const *payload, size_t size, bool defer)
+{
+    assert(size <= prp_inline * sizeof(*prp_lists));
+
+    scoped_lock hold(lock);
+
+    wait_sub_queue_not_full(hold);
+
+    uint32_t index = sub_queue.get_tail();
+
+    NVME_CMD_SDW0_CID_SET(cmd.hdr.cdw0, index);
+
+    // The slot's inline list is 128 byte aligned, never crosses a page
+    uint64_t *slot_payload = prp_lists + index * prp_inline;
+    memcpy(slot_payload, payload, size);
+
+    cmd.hdr.dptr.prpp[0].addr = mphysaddr(slot_payload);
+
+    enqueue_locked(std::move(cmd), index, callback, data, defer);
+}
+
+void nvme_queue_state_t::enqueue_locked(
+        nvme_cmd_t &&cmd, uint32_t index,
+        nvme_callback_t::member_t callback, void *data, bool defer)
+{
     assert(index < cmp_handlers.size());
     cmp_handlers[index] = nvme_callback_t(callback, data);
 
-    sub_queue.enqueue(std::move(cmd));
+    sub_queue.enqueue(std::move(cmd), false);
+    ++stats.commands;
+    doorbell_pending = true;
+
+    if (!defer)
+        ring_doorbell_locked();
+}
+
+void nvme_queue_state_t::ring_doorbell()
+{
+    scoped_lock hold(lock);
+    ring_doorbell_locked();
+}
+
+void nvme_queue_state_t::ring_doorbell_locked()
+{
+    if (doorbell_pending) {
+        doorbell_pending = false;
+        ++stats.doorbells;
+        sub_queue.ring_tail();
+    }
+}
+
+void nvme_queue_state_t::get_stats(nvme_queue_stats_t *result)
+{
+    scoped_lock hold(lock);
+    *result = stats;
+}
+
+void nvme_queue_state_t::set_vector(uint16_t vector)
+{
+    this->vector = vector;
+}
+
+uint16_t nvme_queue_state_t::get_vector() const
+{
+    return vector;
 }
 
 void nvme_queue_state_t::wait_sub_queue_not_full(scoped_lock& lock_)
 {
+    // The controller can't make room for commands it hasn't seen
+    if (sub_queue.is_full())
+        ring_doorbell_locked();
+
     while (sub_queue.is_full())
         not_full.wait(lock_);
 }
@@ -1255,9 +1876,19 @@ void nvme_queue_state_t::invoke_completion(
     cmp_handlers[cmd_id](owner, packet, cmd_id, status_type, status);
 }
 
-void nvme_queue_state_t::process_completions(
-        nvme_if_t *nvme_if, nvme_queue_state_t *queues)
+bool nvme_queue_state_t::process_completions(
+        nvme_if_t *nvme_if, nvme_queue_state_t *queues, bool polled)
 {
+    // The interrupt path must not skip completions that arrive
+    // while a poller is reaping, so only the poller gives up
+    std::unique_lock<std::spinlock> reap_hold(reap_lock,
+                                             std::defer_lock_t());
+
+    if (!polled)
+        reap_hold.lock();
+    else if (!reap_hold.try_lock())
+        return false;
+
     scoped_lock hold(lock);
 
     uint32_t i = 0;
@@ -1283,12 +1914,22 @@ void nvme_queue_state_t::process_completions(
         sub_queue_state.advance_head(sub_queue_head,
                                      &sub_queue_state != this);
 
+        // The command's PRP list pages can be reused now
+        sub_queue_state.release_prp(NVME_CMP_DW3_CID_GET(packet.cmp_dword[3]),
+                                    &sub_queue_state != this);
+
         cmp_buf.push_back(packet);
     }
 
     if (i > 0)
         cmp_queue.take(i);
 
+    if (!polled)
+        ++stats.interrupts;
+    else
+        stats.polled += i;
+    stats.completions += i;
+
     hold.unlock();
 
     for (nvme_cmp_t& packet : cmp_buf) {
@@ -1301,6 +1942,8 @@ void nvme_queue_state_t::process_completions(
     }
 
     cmp_buf.clear();
+
+    return i > 0;
 }
 
 nvme_cmd_t *nvme_queue_state_t::sub_queue_ptr()
@@ -126,10 +126,14 @@ enum struct nvme_cmd_opcode_t : uint8_t {
 };
 
 enum struct nvme_feat_id_t : uint8_t {
-    num_queues = 0x07
+    num_queues = 0x07,
+    irq_coalescing = 0x08,
+    irq_vector_config = 0x09
 };
 
 // NVM command structure with command factories
+struct nvme_dataset_range_t;
+
 struct nvme_cmd_t {
     nvme_cmd_hdr_t hdr;
 
@@ -154,11 +158,21 @@ struct nvme_cmd_t {
     static nvme_cmd_t create_write(
             uint64_t lba, uint32_t count, uint8_t ns, bool fua);
 
-    static nvme_cmd_t create_trim(uint64_t lba, uint32_t count, uint8_t ns);
+    // Fills in range, which must be passed to submit_inline
+    static nvme_cmd_t create_trim(uint64_t lba, uint32_t count, uint8_t ns,
+                                  nvme_dataset_range_t *range);
 
     static nvme_cmd_t create_flush(uint8_t ns);
 
     static nvme_cmd_t create_setfeatures(uint16_t ncqr, uint16_t nsqr);
+
+    // Set features interrupt coalescing, time is in 100us units
+    static nvme_cmd_t create_setfeat_coalescing(uint8_t threshold,
+                                                uint8_t time);
+
+    // Set features interrupt vector configuration
+    static nvme_cmd_t create_setfeat_vector_config(uint16_t vector,
+                                                   bool coalesce);
 };
 
 C_ASSERT(sizeof(nvme_cmd_t) == 64);
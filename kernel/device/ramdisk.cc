@@ -0,0 +1,262 @@
+#include "dev_storage.h"
+#include "blk_delay.h"
+#include "mm.h"
+#include "string.h"
+#include "printk.h"
+#include "unique_ptr.h"
+#include "inttypes.h"
+
+// RAM disk, a deterministic target for benchmarking the block layer
+// and filesystems. Requests complete synchronously in the submitting
+// thread, unless a latency is configured, then they complete through
+// a synthetic latency device
+
+// Size of the RAM disk, 0 disables it
+#define RAMDISK_SIZE_MB         0
+#define RAMDISK_LOG2_BLOCKSIZE  9
+
+// Added completion latency, and queue depth reported to the block layer
+#define RAMDISK_LATENCY_NS      0
+#define RAMDISK_QUEUE_DEPTH     32
+
+#define DEBUG_RAMDISK   0
+#if DEBUG_RAMDISK
+#define RAMDISK_TRACE(...) printdbg("ramdisk: " __VA_ARGS__)
+#else
+#define RAMDISK_TRACE(...) ((void)0)
+#endif
+
+struct ramdisk_if_factory_t : public storage_if_factory_t {
+    ramdisk_if_factory_t() : storage_if_factory_t("ramdisk") {}
+    virtual std::vector<storage_if_base_t *> detect(void) override final;
+};
+
+static ramdisk_if_factory_t ramdisk_if_factory;
+STORAGE_REGISTER_FACTORY(ramdisk_if);
+
+class ramdisk_dev_t final : public storage_dev_base_t {
+public:
+    ramdisk_dev_t();
+    ~ramdisk_dev_t();
+
+    bool init(uint64_t size, uint8_t log2_blocksize);
+
+    STORAGE_DEV_IMPL
+
+private:
+    errno_t check(int64_t count, uint64_t lba) const;
+    static void complete(iocp_t *iocp, errno_t err);
+
+    char *mem;
+    uint64_t block_count;
+    uint8_t log2_blocksize;
+};
+
+class ramdisk_if_t final : public storage_if_base_t {
+public:
+    STORAGE_IF_IMPL
+
+    bool init(uint64_t size, uint8_t log2_blocksize);
+
+private:
+    std::unique_ptr<ramdisk_dev_t> drive;
+};
+
+std::vector<storage_if_base_t *> ramdisk_if_factory_t::detect(void)
+{
+    std::vector<storage_if_base_t *> list;
+
+    if (RAMDISK_SIZE_MB == 0)
+        return list;
+
+    std::unique_ptr<ramdisk_if_t> if_(new ramdisk_if_t());
+
+    if (!if_ || !if_->init(uint64_t(RAMDISK_SIZE_MB) << 20,
+                           RAMDISK_LOG2_BLOCKSIZE))
+        return list;
+
+    if (list.push_back(if_.get()))
+        if_.release();
+
+    return list;
+}
+
+bool ramdisk_if_t::init(uint64_t size, uint8_t log2_blocksize)
+{
+    drive.reset(new ramdisk_dev_t());
+
+    return drive && drive->init(size, log2_blocksize);
+}
+
+void ramdisk_if_t::cleanup_if()
+{
+    drive.reset();
+}
+
+std::vector<storage_dev_base_t *> ramdisk_if_t::detect_devices()
+{
+    std::vector<storage_dev_base_t *> list;
+
+    storage_dev_base_t *dev = drive.get();
+
+    if (RAMDISK_LATENCY_NS) {
+        dev = blk_delay_create(dev, RAMDISK_LATENCY_NS, RAMDISK_QUEUE_DEPTH);
+        if (!dev)
+            return list;
+    }
+
+    if (!list.push_back(dev))
+        panic_oom();
+
+    return list;
+}
+
+ramdisk_dev_t::ramdisk_dev_t()
+    : mem(nullptr)
+    , block_count(0)
+    , log2_blocksize(9)
+{
+}
+
+ramdisk_dev_t::~ramdisk_dev_t()
+{
+    cleanup_dev();
+}
+
+bool ramdisk_dev_t::init(uint64_t size, uint8_t log2_blocksize)
+{
+    this->log2_blocksize = log2_blocksize;
+    block_count = size >> log2_blocksize;
+
+    // Populated up front so page faults never show up in measurements
+    mem = (char*)mmap(nullptr, block_count << log2_blocksize,
+                      PROT_READ | PROT_WRITE, MAP_POPULATE, -1, 0);
+
+    if (mem == MAP_FAILED) {
+        mem = nullptr;
+        return false;
+    }
+
+    RAMDISK_TRACE("%" PRIu64 " blocks of %u bytes at %p\n",
+                  block_count, 1U << log2_blocksize, (void*)mem);
+
+    return true;
+}
+
+void ramdisk_dev_t::cleanup_dev()
+{
+    if (mem) {
+        munmap(mem, block_count << log2_blocksize);
+        mem = nullptr;
+    }
+}
+
+errno_t ramdisk_dev_t::check(int64_t count, uint64_t lba) const
+{
+    if (unlikely(count < 0 || lba > block_count ||
+                 uint64_t(count) > block_count - lba))
+        return errno_t::EINVAL;
+
+    return errno_t::OK;
+}
+
+void ramdisk_dev_t::complete(iocp_t *iocp, errno_t err)
+{
+    iocp->set_result(err);
+    iocp->set_expect(1);
+    iocp->invoke();
+}
+
+errno_t ramdisk_dev_t::read_async(void *data, int64_t count,
+                                  uint64_t lba, iocp_t *iocp)
+{
+    errno_t err = check(count, lba);
+
+    if (unlikely(err != errno_t::OK))
+        return err;
+
+    size_t size = size_t(count) << log2_blocksize;
+    char const *src = mem + (lba << log2_blocksize);
+
+    if (mm_is_user_range(data, size)) {
+        if (unlikely(!mm_copy_user(data, src, size)))
+            err = errno_t::EFAULT;
+    } else {
+        memcpy(data, src, size);
+    }
+
+    complete(iocp, err);
+
+    return errno_t::OK;
+}
+
+errno_t ramdisk_dev_t::write_async(void const *data, int64_t count,
+                                   uint64_t lba, bool fua, iocp_t *iocp)
+{
+    (void)fua;
+
+    errno_t err = check(count, lba);
+
+    if (unlikely(err != errno_t::OK))
+        return err;
+
+    size_t size = size_t(count) << log2_blocksize;
+    char *dst = mem + (lba << log2_blocksize);
+
+    if (mm_is_user_range((void*)data, size)) {
+        if (unlikely(!mm_copy_user(dst, data, size)))
+            err = errno_t::EFAULT;
+    } else {
+        memcpy(dst, data, size);
+    }
+
+    complete(iocp, err);
+
+    return errno_t::OK;
+}
+
+errno_t ramdisk_dev_t::trim_async(int64_t count, uint64_t lba, iocp_t *iocp)
+{
+    errno_t err = check(count, lba);
+
+    if (unlikely(err != errno_t::OK))
+        return err;
+
+    // Trimmed blocks read back as zeros
+    memset(mem + (lba << log2_blocksize), 0,
+           size_t(count) << log2_blocksize);
+
+    complete(iocp, errno_t::OK);
+
+    return errno_t::OK;
+}
+
+errno_t ramdisk_dev_t::flush_async(iocp_t *iocp)
+{
+    complete(iocp, errno_t::OK);
+
+    return errno_t::OK;
+}
+
+long ramdisk_dev_t::info(storage_dev_info_t key)
+{
+    switch (key) {
+    case STORAGE_INFO_BLOCKSIZE:
+        return long(1) << log2_blocksize;
+
+    case STORAGE_INFO_HAVE_TRIM:
+        return 1;
+
+    case STORAGE_INFO_NAME:
+        return long("ramdisk");
+
+    case STORAGE_INFO_QUEUE_COUNT:
+        return 1;
+
+    case STORAGE_INFO_QUEUE_DEPTH:
+        return RAMDISK_QUEUE_DEPTH;
+
+    default:
+        return 0;
+    }
+}
@@ -10,6 +10,8 @@
 #include "bswap.h"
 #include "eth_q.h"
 #include "eth_frame.h"
+#include "eth_rx.h"
+#include "eth_tx.h"
 #include "time.h"
 #include "udp_frame.h"
 #include "dev_eth.h"
@@ -58,9 +60,25 @@ struct rtl8139_factory_t : public eth_dev_factory_t {
 
 static rtl8139_factory_t rtl8139_factory;
 
-struct rtl8139_dev_t : public eth_dev_base_t {
+// The four transmit slots are one ring driven by the transmit layer,
+// see eth_tx.h. Transmit OK only interrupts while frames wait for a
+// slot, otherwise slots are reclaimed when the layer runs out of them.
+// eth_dev_base_t stays the first base, detect hands out the device
+// pointers as eth_dev_base_t pointers
+struct rtl8139_dev_t
+        : public eth_dev_base_t
+        , public eth_tx_queue_t {
     ETH_DEV_IMPL
 
+    size_t send_batch(ethq_pkt_t **pkts, size_t count) override;
+
+    size_t tx_post(ethq_pkt_t **pkts, size_t count) override;
+    size_t tx_reclaim() override;
+    bool tx_wait() override;
+
+    int rx_poll(int budget) override;
+    void rx_irq_unmask() override;
+
     _used
     _always_inline void rtl8139_mm_out_8(uint32_t reg, uint8_t val)
     {
@@ -106,8 +124,8 @@ struct rtl8139_dev_t : public eth_dev_base_t {
     void detect(const pci_dev_iterator_t &pci_dev);
 
     void tx_packet(int slot, ethq_pkt_t *pkt);
-    void rx_irq_handler(uint16_t isr);
-    void tx_irq_handler();
+    ethq_pkt_t *tx_prepare(ethq_pkt_t *pkt);
+    int rx_drain(int budget);
     void irq_handler();
     static isr_context_t *irq_dispatcher(int irq, isr_context_t *ctx);
 
@@ -118,8 +136,9 @@ struct rtl8139_dev_t : public eth_dev_base_t {
     void *rx_buffer;
     size_t rx_offset;
 
+    // Only touched by the transmit layer
     ethq_pkt_t *tx_pkts[4];
-    ethq_pkt_t *tx_next[4];
+    size_t tx_bytes[4];
 
     unsigned tx_head;
     unsigned tx_tail;
@@ -128,9 +147,11 @@ struct rtl8139_dev_t : public eth_dev_base_t {
     using scoped_lock = std::unique_lock<lock_type>;
     lock_type lock;
 
-    ethq_queue_t tx_queue;
     ethq_queue_t rx_queue;
 
+    // Current interrupt mask register value
+    uint16_t irq_mask;
+
     // Actually 6 bytes
     uint8_t mac_addr[8];
 
@@ -402,6 +423,10 @@ static size_t rtl8139_device_count;
 // Rx OK
 #define RTL8139_IxR_ROK             (1U<<RTL8139_IxR_ROK_BIT)
 
+// Receive interrupts, masked while the receive ring is polled
+#define RTL8139_IxR_RX_MASK \
+    (RTL8139_IxR_ROK | RTL8139_IxR_RXOVW | RTL8139_IxR_FOVW)
+
 //
 // RTL8139_IO_RCR: Rx Configuration Register (32-bit)
 
@@ -633,22 +658,17 @@ void rtl8139_dev_t::tx_packet(int slot, ethq_pkt_t *pkt)
 //
 // IRQ handler
 
-void rtl8139_dev_t::rx_irq_handler(uint16_t isr)
+// Move up to budget frames from the receive ring to rx_queue,
+// returns how many were taken from the ring, called with lock held
+int rtl8139_dev_t::rx_drain(int budget)
 {
-    RTL8139_TRACE("IRQ: Rx OK\n");
-
-    if (isr & RTL8139_IxR_RXOVW) {
-        RTL8139_TRACE("IRQ Rx: RXOVW\n");
-        //rx_offset = 0;
-        //RTL8139_MM_WR_16(RTL8139_IO_CAPR,
-        //                 (uint16_t)rx_offset);
-    }
-
     rtl8139_rx_hdr_t hdr;
     rtl8139_rx_hdr_t *hdr_ptr = (rtl8139_rx_hdr_t*)
             ((char*)rx_buffer + rx_offset);
 
-    while (!(RTL8139_MM_RD_8(RTL8139_IO_CR) & RTL8139_CR_RXEMPTY)) {
+    int done;
+    for (done = 0; done < budget &&
+         !(RTL8139_MM_RD_8(RTL8139_IO_CR) & RTL8139_CR_RXEMPTY); ++done) {
         memcpy(&hdr, hdr_ptr, sizeof(hdr));
 
         RTL8139_TRACE("Header flags: %x len=%d\n",
@@ -711,93 +731,128 @@ void rtl8139_dev_t::rx_irq_handler(uint16_t isr)
 
         RTL8139_MM_WR_16(RTL8139_IO_CAPR, rx_offset - 16);
     }
+
+    return done;
 }
 
-void rtl8139_dev_t::tx_irq_handler()
+int rtl8139_dev_t::rx_poll(int budget)
 {
-    RTL8139_TRACE("IRQ: Tx OK\n");
+    scoped_lock lock_(lock);
 
-    // Transmit status of all descriptors
-    uint16_t tsad = RTL8139_MM_RD_16(RTL8139_IO_TSAD);
+    // Acknowledge before draining, frames that
+    // arrive after this set the status again
+    RTL8139_MM_WR_16(RTL8139_IO_ISR, RTL8139_IxR_RX_MASK);
 
-    RTL8139_TRACE("RX IRQ TSAD=%x\n", tsad);
+    int done = rx_drain(budget);
 
-    for (int i = 0; i < 4; ++i,
-         (tx_tail = ((tx_tail + 1) & 3))) {
-        ethq_pkt_t *pkt = tx_pkts[tx_tail];
+    ethq_pkt_t *rx_first = ethq_dequeue_all(&rx_queue);
 
-        if (!pkt)
-            break;
+    lock_.unlock();
 
-        if (tsad & RTL8139_TSAD_TOK_n(tx_tail)) {
-            tx_pkts[tx_tail] = nullptr;
+    // Run the protocol stack outside the lock
+    eth_rx_deliver(rx_first);
 
-            RTL8139_TRACE("IRQ: TOK slot=%d\n", tx_tail);
+    return done;
+}
 
-            // Ignore slots that are not transmitting a packet
-            if (!pkt) {
-                RTL8139_TRACE("*** Spurious Tx OK IRQ"
-                         " for slot=%d\n", tx_tail);
-                continue;
-            }
+void rtl8139_dev_t::rx_irq_unmask()
+{
+    scoped_lock lock_(lock);
 
-            // Packet successfully transmitted
-            if (pkt->callback)
-                pkt->callback(pkt, 0, pkt->callback_arg);
+    irq_mask |= RTL8139_IxR_RX_MASK;
+    RTL8139_MM_WR_16(RTL8139_IO_IMR, irq_mask);
 
-            // Return packet to pool
-            ethq_pkt_release(pkt);
+    // A frame that arrived after the ring was drained
+    // may not raise another interrupt
+    bool pending = !(RTL8139_MM_RD_8(RTL8139_IO_CR) & RTL8139_CR_RXEMPTY);
+
+    if (pending) {
+        irq_mask &= ~RTL8139_IxR_RX_MASK;
+        RTL8139_MM_WR_16(RTL8139_IO_IMR, irq_mask);
+    }
 
-            // Get another outgoing packet
-            pkt = ethq_dequeue(&tx_queue);
+    lock_.unlock();
 
-            //RTL8139_MM_WR_32(RTL8139_IO_TSD_n(tx_tail),
-            //                 0);
+    if (pending)
+        eth_rx_schedule(this);
+}
 
-            // Transmit new packet
-            if (pkt) {
-                assert(!tx_next[i]);
-                tx_next[i] = pkt;
-            }
-        }
+//
+// Transmit
 
-        if (tsad & RTL8139_TSAD_TABT_n(tx_tail)) {
-            // Transmit aborted?
+size_t rtl8139_dev_t::tx_post(ethq_pkt_t **pkts, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count && !tx_pkts[tx_head]; ++i) {
+        tx_bytes[tx_head] = ethq_pkt_total_size(pkts[i]);
+        tx_packet(tx_head, pkts[i]);
+        tx_head = (tx_head + 1) & 3;
+    }
 
-            // Ignore slots that are not transmitting a packet
-            if (!pkt) {
-                RTL8139_TRACE("*** Spurious transmit aborted IRQ"
-                         " for slot=%d\n", tx_tail);
-                continue;
-            }
+    return i;
+}
 
-            RTL8139_TRACE("*** Transmit aborted?!\n");
+size_t rtl8139_dev_t::tx_reclaim()
+{
+    // Transmit status of all descriptors
+    uint16_t tsad = RTL8139_MM_RD_16(RTL8139_IO_TSAD);
+
+    RTL8139_TRACE("Tx reclaim TSAD=%x\n", tsad);
+
+    size_t bytes = 0;
+
+    for (ethq_pkt_t *pkt; (pkt = tx_pkts[tx_tail]) != nullptr;
+         tx_tail = (tx_tail + 1) & 3) {
+        int error;
+
+        if (tsad & RTL8139_TSAD_TOK_n(tx_tail)) {
+            RTL8139_TRACE("Tx OK slot=%d\n", tx_tail);
+            error = 0;
+        } else if (tsad & RTL8139_TSAD_TABT_n(tx_tail)) {
+            RTL8139_TRACE("*** Transmit aborted slot=%d\n", tx_tail);
 
             // Clear transmit abort
             RTL8139_MM_WR_32(RTL8139_IO_TCR,
                              RTL8139_MM_RD_32(RTL8139_IO_TCR) |
                              RTL8139_TCR_CLRABT);
 
-            if (pkt->callback)
-                pkt->callback(pkt, 1, pkt->callback_arg);
+            error = 1;
+        } else if (tsad & RTL8139_TSAD_TUN_n(tx_tail)) {
+            RTL8139_TRACE("*** Transmit underrun slot=%d\n", tx_tail);
+            error = 1;
+        } else {
+            // Still transmitting, later slots are too
+            break;
         }
 
-        if (tsad & RTL8139_TSAD_TUN_n(tx_tail)) {
-            // Transmit underrun?
-
-            // Ignore slots that are not transmitting a packet
-            if (!pkt) {
-                RTL8139_TRACE("*** Spurious transmit aborted IRQ"
-                         " for slot=%d\n", tx_tail);
-                continue;
-            }
+        tx_pkts[tx_tail] = nullptr;
+        bytes += tx_bytes[tx_tail];
 
-            RTL8139_TRACE("*** transmit underrun?!\n");
+        if (pkt->callback)
+            pkt->callback(pkt, error, pkt->callback_arg);
 
-            if (pkt->callback)
-                pkt->callback(pkt, 1, pkt->callback_arg);
-        }
+        // Return packet to pool
+        ethq_pkt_release(pkt);
     }
+
+    return bytes;
+}
+
+bool rtl8139_dev_t::tx_wait()
+{
+    scoped_lock lock_(lock);
+
+    irq_mask |= RTL8139_IxR_TOK | RTL8139_IxR_TER;
+    RTL8139_MM_WR_16(RTL8139_IO_IMR, irq_mask);
+
+    lock_.unlock();
+
+    // A slot that finished before the unmask may not interrupt
+    uint16_t tsad = RTL8139_MM_RD_16(RTL8139_IO_TSAD);
+
+    return tx_pkts[tx_tail] && (tsad & (RTL8139_TSAD_TOK_n(tx_tail) |
+                                        RTL8139_TSAD_TABT_n(tx_tail) |
+                                        RTL8139_TSAD_TUN_n(tx_tail)));
 }
 
 isr_context_t *rtl8139_dev_t::irq_dispatcher(int irq, isr_context_t *ctx)
@@ -824,7 +879,8 @@ void rtl8139_dev_t::irq_handler()
     // Acknowledge everything
     RTL8139_MM_WR_16(RTL8139_IO_ISR, isr);
 
-    ethq_pkt_t *rx_first = nullptr;
+    bool rx_pending = false;
+    bool tx_pending = false;
 
     if (isr != 0) {
         RTL8139_TRACE("IRQ status = %x\n", isr);
@@ -833,12 +889,18 @@ void rtl8139_dev_t::irq_handler()
             RTL8139_TRACE("*** IRQ: System Error\n");
         }
 
-        if (isr & RTL8139_IxR_TOK) {
-            tx_irq_handler();
+        if (isr & (RTL8139_IxR_TOK | RTL8139_IxR_TER)) {
+            // Masked again until frames wait for a slot, see tx_wait
+            irq_mask &= ~(RTL8139_IxR_TOK | RTL8139_IxR_TER);
+            RTL8139_MM_WR_16(RTL8139_IO_IMR, irq_mask);
+            tx_pending = true;
         }
 
-        if (isr & RTL8139_IxR_ROK) {
-            rx_irq_handler(isr);
+        if (isr & RTL8139_IxR_RX_MASK) {
+            // Mask receive interrupts until the poll drains the ring
+            irq_mask &= ~RTL8139_IxR_RX_MASK;
+            RTL8139_MM_WR_16(RTL8139_IO_IMR, irq_mask);
+            rx_pending = true;
         }
 
         if (isr & RTL8139_IxR_FOVW) {
@@ -856,50 +918,70 @@ void rtl8139_dev_t::irq_handler()
         if (isr & RTL8139_IxR_RXOVW) {
             RTL8139_TRACE("*** IRQ: Rx Overflow Error\n");
         }
+    }
 
-        // Dequeue all received packets inside the lock
-        rx_first = ethq_dequeue_all(&rx_queue);
+    lock_.unlock();
 
-        for (int n = 0; n < 4; ++n) {
-            if (!tx_next[n])
-                continue;
+    if (tx_pending)
+        eth_tx_complete(this);
 
-            tx_pkts[tx_head] = tx_next[n];
-            tx_packet(tx_head, tx_next[n]);
-            tx_next[n] = nullptr;
-            tx_head = ((tx_head + 1) & 3);
+    if (rx_pending)
+        eth_rx_schedule(this);
+}
+
+// Returns the frame to transmit, or nullptr if it was dropped
+ethq_pkt_t *rtl8139_dev_t::tx_prepare(ethq_pkt_t *pkt)
+{
+    // The transmit address registers are 32 bits, and
+    // the frame must be contiguous, otherwise copy it
+    if (unlikely(pkt->frag || pkt->physaddr + pkt->size >
+                 UINT64_C(0x100000000))) {
+        ethq_pkt_t *bounce = ethq_pkt_acquire_dma32();
+
+        if (unlikely(!bounce)) {
+            RTL8139_TRACE("No 32-bit buffer, outgoing packet dropped\n");
+            if (pkt->callback)
+                pkt->callback(pkt, 1, pkt->callback_arg);
+            ethq_pkt_release(pkt);
+            return nullptr;
         }
-    }
 
-    lock_.unlock();
+        bounce->size = ethq_pkt_copy(&bounce->pkt, pkt, ethq_pkt_capacity);
+        bounce->callback = pkt->callback;
+        bounce->callback_arg = pkt->callback_arg;
+        bounce->nic = pkt->nic;
 
-    // Service the receive queue outside the lock
-    if (rx_first) {
-        ethq_pkt_t *rx_next;
-        for (ethq_pkt_t *rx_packet = rx_first; rx_packet;
-             rx_packet = rx_next) {
-            rx_next = rx_packet->next;
-            eth_frame_received(rx_packet);
-            ethq_pkt_release(rx_packet);
-        }
+        ethq_pkt_release(pkt);
+        pkt = bounce;
     }
+
+    // Write the source MAC address into the ethernet header
+    memcpy(pkt->pkt.hdr.s_mac, mac_addr, 6);
+
+    return pkt;
 }
 
 int rtl8139_dev_t::send(ethq_pkt_t *pkt)
 {
-    scoped_lock lock_(lock);
+    pkt = tx_prepare(pkt);
 
-    // Write the source MAC address into the ethernet header
-    memcpy(pkt->pkt.hdr.s_mac, mac_addr, 6);
+    if (unlikely(!pkt))
+        return 0;
 
-    if (!tx_pkts[tx_head]) {
-        tx_packet(tx_head, pkt);
-        tx_head = (tx_head + 1) & 3;
-    } else {
-        ethq_enqueue(&tx_queue, pkt);
+    return eth_tx_send(this, pkt);
+}
+
+size_t rtl8139_dev_t::send_batch(ethq_pkt_t **pkts, size_t count)
+{
+    // Compact the frames that survive preparation
+    size_t ready = 0;
+    for (size_t i = 0; i < count; ++i) {
+        ethq_pkt_t *pkt = tx_prepare(pkts[i]);
+        if (likely(pkt))
+            pkts[ready++] = pkt;
     }
 
-    return 1;
+    return eth_tx_send_batch(this, pkts, ready);
 }
 
 //
@@ -937,7 +1019,12 @@ int rtl8139_factory_t::detect(eth_dev_base_t ***devices)
                  pci_iter.config.get_bar(5),
                  pci_iter.config.irq_line);
 
-        void *mem = calloc(1, sizeof(rtl8139_dev_t));
+        // Page allocated, the transmit state is cache line aligned
+        void *mem = mmap(nullptr, sizeof(rtl8139_dev_t),
+                         PROT_READ | PROT_WRITE, MAP_POPULATE, -1, 0);
+        if (unlikely(mem == MAP_FAILED))
+            panic_oom();
+
         rtl8139_dev_t *self = new (mem) rtl8139_dev_t;
 
         rtl8139_devices = (rtl8139_dev_t**)realloc(rtl8139_devices,
@@ -1048,8 +1135,6 @@ void rtl8139_dev_t::detect(pci_dev_iterator_t const &pci_dev)
             RTL8139_IxR_FOVW |
             RTL8139_IxR_PUNLC |
             RTL8139_IxR_RXOVW |
-            RTL8139_IxR_TER |
-            RTL8139_IxR_TOK |
             RTL8139_IxR_RER |
             RTL8139_IxR_ROK;
 
@@ -1057,6 +1142,7 @@ void rtl8139_dev_t::detect(pci_dev_iterator_t const &pci_dev)
     //RTL8139_MM_WR_16(RTL8139_IO_ISR, unmask);
 
     // Unmask IRQs
+    irq_mask = unmask;
     RTL8139_MM_WR_16(RTL8139_IO_IMR, unmask);
 
     pci_set_irq_unmask(pci_dev, true);
@@ -1101,15 +1187,6 @@ static void rtl8139_startup_hack(void *p)
     if (rtl8139_device_count == 0)
         return;
 
-    ipv4_addr_pair_t bind = {
-        { IPV4_ADDR32(255U,255U,255U,255U), 67, 0 },
-        { IPV4_ADDR32(255U,255U,255U,255U), 68, 0 }
-    };
-
-    int handle = udp_bind(&bind);
-
-    (void)handle;
-
     rtl8139_dev_t *self = rtl8139_devices[0];
 
     // Send a DHCP discover
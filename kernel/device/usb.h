@@ -263,8 +263,16 @@ struct usb_desc_ep_companion {
     usb_desc_hdr_t hdr;
 
     uint8_t max_burst;
+
+    // Bulk: 4:0 log2 of maximum number of streams
+    // Isoch: 1:0 Mult
+    uint8_t attr;
+
+    uint16_t bytes_per_interval;
 } _packed;
 
+C_ASSERT(sizeof(usb_desc_ep_companion) == 6);
+
 // Binary device object store (BOS)
 struct usb_desc_bos {
     usb_desc_hdr_t hdr;
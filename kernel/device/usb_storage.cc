@@ -24,13 +24,6 @@ enum usb_msc_request_t : uint8_t {
     RESET = 0xFF
 };
 
-enum struct usb_msc_op_t {
-    write,
-    read,
-    flush,
-    trim
-};
-
 // A factory that enumerates all of the available storage devices
 class usb_msc_if_factory_t : public storage_if_factory_t {
 public:
@@ -52,7 +45,8 @@ public:
         cmd_read_16 = 0x88,
         cmd_write_10 = 0x2A,
         cmd_write_12 = 0xAA,
-        cmd_write_16 = 0x8A
+        cmd_write_16 = 0x8A,
+        cmd_sync_cache_10 = 0x35
     };
 
     // read capacity 16
@@ -196,11 +190,12 @@ public:
         usb_iocp_t io_iocp;
         void *data;
         uint32_t tag;
-        uint32_t lba;
+        uint64_t lba;
         uint32_t count;
         uint8_t lun;
         uint8_t log2_sector_sz;
         usb_msc_op_t op;
+        bool fua;
     };
 
     // Commands are enqueued at head from I/O requests
@@ -242,7 +237,7 @@ private:
 
     usb_pipe_t control, bulk_in, bulk_out;
     int iface_idx;
-    int next_tag;
+    uint32_t next_tag;
 };
 
 // A LUN on a storage interface
@@ -328,20 +323,14 @@ errno_t usb_msc_dev_t::read_async(
 {
     //USB_MSC_TRACE("Reading %" PRId64 " blocks at LBA %#" PRIx64, count, lba);
 
-    errno_t status = io(data, count, lba, false,
-                        usb_msc_op_t::read, iocp);
-    iocp->set_expect(1);
-    return status;
+    return io(data, count, lba, false, usb_msc_op_t::read, iocp);
 }
 
 errno_t usb_msc_dev_t::write_async(
         void const *data, int64_t count,
         uint64_t lba, bool fua, iocp_t *iocp)
 {
-    errno_t status = io((void*)data, count, lba, fua,
-                        usb_msc_op_t::write, iocp);
-    iocp->set_expect(1);
-    return status;
+    return io((void*)data, count, lba, fua, usb_msc_op_t::write, iocp);
 }
 
 errno_t usb_msc_dev_t::flush_async(iocp_t *iocp)
@@ -352,7 +341,7 @@ errno_t usb_msc_dev_t::flush_async(iocp_t *iocp)
 errno_t usb_msc_dev_t::trim_async(int64_t count,
         uint64_t lba, iocp_t *iocp)
 {
-    return io(nullptr, count, lba, false, usb_msc_op_t::trim, iocp);
+    return errno_t::ENOSYS;
 }
 
 long usb_msc_dev_t::info(storage_dev_info_t key)
@@ -367,6 +356,10 @@ long usb_msc_dev_t::info(storage_dev_info_t key)
     case STORAGE_INFO_NAME:
         return long("USB-MSC");
 
+    case STORAGE_INFO_QUEUE_COUNT:
+    case STORAGE_INFO_QUEUE_DEPTH:
+        return 1;
+
     default:
         return 0;
     }
@@ -381,8 +374,8 @@ bool usb_msc_classdrv_t::probe(usb_config_helper *cfg_hlp, usb_bus_t *bus)
     // 6 = SCSI command set
     // 0x50 = bulk only
     match_result match = match_config(
-                cfg_hlp, 0, int(usb_class_t::mass_storage), 6, 0x50,
-                -1, -1, -1);
+                cfg_hlp, 0, int(usb_class_t::mass_storage), 6, -1,
+                0x50, -1, -1);
 
     if (!match.dev)
         return false;
@@ -472,6 +465,51 @@ int usb_msc_dev_t::trim()
 
 static usb_msc_classdrv_t usb_mass_storage;
 
+size_t usb_msc_make_cdb(uint8_t *cdb, usb_msc_op_t op,
+                        uint64_t lba, uint32_t count, bool fua)
+{
+    usb_msc_if_t::cmdblk_t *blk = (usb_msc_if_t::cmdblk_t*)cdb;
+
+    *blk = {};
+
+    if (op == usb_msc_op_t::flush) {
+        blk->raw[0] = usb_msc_if_t::cmd_sync_cache_10;
+        return sizeof(blk->rw10);
+    }
+
+    bool write = (op == usb_msc_op_t::write);
+
+    // bit 3 is FUA
+    uint8_t flags = (write && fua) ? (1U << 3) : 0;
+
+    if (lba + count <= UINT64_C(0x100000000) && count <= 0xFFFF) {
+        blk->rw10.op = write
+                ? usb_msc_if_t::cmd_write_10
+                : usb_msc_if_t::cmd_read_10;
+        blk->rw10.flags = flags;
+        blk->rw10.lba = bswap_32(uint32_t(lba));
+        blk->rw10.len = bswap_16(uint16_t(count));
+        return sizeof(blk->rw10);
+    }
+
+    blk->rw16.op = write
+            ? usb_msc_if_t::cmd_write_16
+            : usb_msc_if_t::cmd_read_16;
+    blk->rw16.flags = flags;
+    blk->rw16.lba = bswap_64(lba);
+    blk->rw16.len = bswap_32(count);
+    return sizeof(blk->rw16);
+}
+
+uint32_t usb_msc_chunk_blocks(void const *data, uint64_t count,
+                              uint8_t log2_sector_sz)
+{
+    // Keep the chunk within 64KB worth of pages when it starts mid-page
+    size_t bytes = usb_msc_max_xfer - (uintptr_t(data) & (PAGE_SIZE - 1));
+
+    return std::min<uint64_t>(count, bytes >> log2_sector_sz);
+}
+
 uint32_t usb_msc_if_t::cmd_wrap(uint32_t n)
 {
     return n < cmd_capacity ? n : 0;
@@ -573,37 +611,48 @@ errno_t usb_msc_if_t::io(void *data, uint64_t count, uint64_t lba,
                          bool fua, usb_msc_op_t op, iocp_t *iocp,
                          int lun, uint8_t log2_sectorsize)
 {
+    unsigned chunks = 0;
+
     scoped_lock hold_cmd_lock(cmd_lock);
 
-    wait_cmd_not_full(hold_cmd_lock);
+    // Each command transfers at most usb_msc_max_xfer bytes, so large
+    // requests are split into one command per chunk. The device executes
+    // bulk-only commands in order, so the chunks are queued back to back
+    do {
+        uint32_t blocks = usb_msc_chunk_blocks(data, count, log2_sectorsize);
 
-    // Get a pointer to the next available entry in the command queue
-    pending_cmd_t *cmd = cmd_queue + cmd_head;
+        wait_cmd_not_full(hold_cmd_lock);
 
-    USB_MSC_TRACE("Enqueueing command at slot %u\n", cmd_head);
+        // Get a pointer to the next available entry in the command queue
+        pending_cmd_t *cmd = cmd_queue + cmd_head;
 
-    // Compute number of transfers in chunks of up to 64KB
-    uint64_t sz = count << log2_sectorsize;
-    int tx_count = (sz + (1 << 16) - 1) >> 16;
+        USB_MSC_TRACE("Enqueueing command at slot %u\n", cmd_head);
 
-    // FIXME: handle multiple chunks
-    assert(tx_count == 1);
+        cmd->if_ = this;
+        cmd->caller_iocp = iocp;
+        cmd->data = data;
+        cmd->tag = ++next_tag;
+        cmd->lba = lba;
+        cmd->count = blocks;
+        cmd->lun = lun;
+        cmd->log2_sector_sz = log2_sectorsize;
+        cmd->op = op;
+        cmd->fua = fua;
 
-    cmd->if_ = this;
-    cmd->io_iocp.reset(&usb_msc_if_t::usb_completion);
-    cmd->caller_iocp = iocp;
-    cmd->data = data;
-    cmd->tag = atomic_xadd(&next_tag, tx_count);
-    cmd->lba = lba;
-    cmd->count = count;
-    cmd->lun = lun;
-    cmd->log2_sector_sz = log2_sectorsize;
-    cmd->op = op;
+        // Advance command queue head
+        cmd_head = cmd_wrap(cmd_head + 1);
 
-    // Advance command queue head
-    cmd_head = cmd_wrap(cmd_head + 1);
+        issue_cmd(cmd, hold_cmd_lock);
+
+        data = (char*)data + (uint64_t(blocks) << log2_sectorsize);
+        lba += blocks;
+        count -= blocks;
+        ++chunks;
+    } while (count);
+
+    hold_cmd_lock.unlock();
 
-    issue_cmd(cmd, hold_cmd_lock);
+    iocp->set_expect(chunks);
 
     return errno_t::OK;
 }
@@ -641,13 +690,8 @@ void usb_msc_if_t::issue_cmd(pending_cmd_t *cmd, scoped_lock& hold_cmd_lock)
 
     cmd->cbw.lun = cmd->lun;
 
-    cmd->cbw.wcb_len = sizeof(cmd->cbw.cmd.rw10);
-    cmd->cbw.cmd.rw10.op = cmd_read_10;
-    cmd->cbw.cmd.rw10.flags = 0;
-    cmd->cbw.cmd.rw10.lba = bswap_32(cmd->lba);
-    cmd->cbw.cmd.rw10.len = bswap_16(cmd->count);
-    cmd->cbw.cmd.rw10.group = 0;
-    cmd->cbw.cmd.rw10.control = 0;
+    cmd->cbw.wcb_len = usb_msc_make_cdb(cmd->cbw.cmd.raw, cmd->op,
+                                        cmd->lba, cmd->count, cmd->fua);
 
     bulk_out.send_async(&cmd->cbw, sizeof(cmd->cbw), &cmd->io_iocp);
 
@@ -666,12 +710,13 @@ void usb_msc_if_t::issue_cmd(pending_cmd_t *cmd, scoped_lock& hold_cmd_lock)
     // status block wrapper
     bulk_in.recv_async(&cmd->csw, sizeof(cmd->csw), &cmd->io_iocp);
 
-    cmd->io_iocp.set_expect(3);
+    cmd->io_iocp.set_expect(cmd->count ? 3 : 2);
 }
 
 void usb_msc_if_t::usb_completion(pending_cmd_t *cmd)
 {
-    if (cmd->csw.status == cmd_status_t::success) {
+    if (cmd->csw.sig == csw_sig && cmd->csw.tag == cmd->tag &&
+            cmd->csw.status == cmd_status_t::success) {
         USB_MSC_TRACE("Command completed successfully\n");
         cmd->caller_iocp->set_result(errno_t::OK);
     } else {
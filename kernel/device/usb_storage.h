@@ -0,0 +1,25 @@
+#pragma once
+#include "types.h"
+
+// Shared by the bulk-only transport and USB attached SCSI drivers
+
+enum struct usb_msc_op_t {
+    write,
+    read,
+    flush,
+    trim
+};
+
+// Largest data transfer issued in one command. A transfer is described
+// with at most 16 TRBs, so the buffer must not span more than 64KB of pages
+static constexpr uint32_t usb_msc_max_xfer = 64 << 10;
+
+// Fill in the SCSI command descriptor block for a read, write or flush,
+// using the 10 byte form when the LBA and count fit.
+// Returns the command block length
+size_t usb_msc_make_cdb(uint8_t *cdb, usb_msc_op_t op,
+                        uint64_t lba, uint32_t count, bool fua);
+
+// Number of blocks of a transfer at data to issue in the next command
+uint32_t usb_msc_chunk_blocks(void const *data, uint64_t count,
+                              uint8_t log2_sector_sz);
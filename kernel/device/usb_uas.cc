@@ -0,0 +1,661 @@
+#include "usb_storage.h"
+#include "dev_storage.h"
+#include "dev_usb_ctl.h"
+#include "bswap.h"
+#include "bitsearch.h"
+#include "algorithm.h"
+#include "string.h"
+
+// USB attached SCSI class driver
+//
+// Every command gets a tag, and the tag is also the stream id used for
+// its status and data transfers, so the device can work on as many
+// commands as there are streams and complete them in any order.
+// Streams require a SuperSpeed device on an xHCI controller, the
+// USB 2 variant of the protocol (read/write ready IUs) is not supported
+
+#define DEBUG_USB_UAS 0
+#if DEBUG_USB_UAS
+#define USB_UAS_TRACE(...) printdbg("usbuas: " __VA_ARGS__)
+#else
+#define USB_UAS_TRACE(...) ((void)0)
+#endif
+
+class usb_uas_if_factory_t;
+class usb_uas_if_t;
+class usb_uas_dev_t;
+class usb_uas_classdrv_t;
+
+// Information unit identifiers
+enum usb_uas_iu_id_t : uint8_t {
+    UAS_IU_COMMAND = 0x01,
+    UAS_IU_SENSE = 0x03,
+    UAS_IU_RESPONSE = 0x04,
+    UAS_IU_TASK_MGMT = 0x05,
+    UAS_IU_READ_READY = 0x06,
+    UAS_IU_WRITE_READY = 0x07
+};
+
+// Pipe usage descriptor pipe identifiers
+enum usb_uas_pipe_id_t : uint8_t {
+    UAS_PIPE_COMMAND = 1,
+    UAS_PIPE_STATUS = 2,
+    UAS_PIPE_DATA_IN = 3,
+    UAS_PIPE_DATA_OUT = 4
+};
+
+// Class specific descriptor that follows each endpoint descriptor
+// (and its SuperSpeed companion)
+struct usb_uas_pipe_usage_t {
+    usb_desc_hdr_t hdr;
+
+    usb_uas_pipe_id_t pipe_id;
+    uint8_t rsvd;
+} _packed;
+
+C_ASSERT(sizeof(usb_uas_pipe_usage_t) == 4);
+
+static constexpr uint8_t usb_uas_pipe_usage_type = 0x24;
+
+struct usb_uas_cmd_iu_t {
+    usb_uas_iu_id_t id;
+    uint8_t rsvd;
+
+    // Big endian, also the stream id
+    uint16_t tag;
+
+    // 6:3 priority, 2:0 task attribute (0=simple)
+    uint8_t prio_attr;
+    uint8_t rsvd2;
+
+    // 7:2 additional CDB length in dwords
+    uint8_t add_cdb_len;
+    uint8_t rsvd3;
+
+    // Big endian SAM LUN
+    uint64_t lun;
+
+    uint8_t cdb[16];
+} _packed;
+
+C_ASSERT(sizeof(usb_uas_cmd_iu_t) == 32);
+
+struct usb_uas_sense_iu_t {
+    usb_uas_iu_id_t id;
+    uint8_t rsvd;
+    uint16_t tag;
+    uint16_t status_qual;
+    uint8_t status;
+    uint8_t rsvd2[7];
+    uint16_t len;
+    uint8_t sense[80];
+} _packed;
+
+C_ASSERT(sizeof(usb_uas_sense_iu_t) == 96);
+
+struct usb_uas_response_iu_t {
+    usb_uas_iu_id_t id;
+    uint8_t rsvd;
+    uint16_t tag;
+    uint8_t add_info[3];
+    uint8_t code;
+} _packed;
+
+union usb_uas_status_iu_t {
+    usb_uas_iu_id_t id;
+    usb_uas_sense_iu_t sense;
+    usb_uas_response_iu_t response;
+};
+
+// Information units read and written by the device. These are packed
+// into a page so neither of them crosses a page boundary
+struct usb_uas_iu_buf_t {
+    usb_uas_cmd_iu_t cmd;
+    usb_uas_status_iu_t status;
+};
+
+C_ASSERT(sizeof(usb_uas_iu_buf_t) == 128);
+
+// A factory that enumerates all of the available storage devices
+class usb_uas_if_factory_t : public storage_if_factory_t {
+public:
+    usb_uas_if_factory_t() : storage_if_factory_t("usb_uas") {}
+protected:
+    // storage_if_factory_t interface
+    std::vector<storage_if_base_t *> detect() override;
+};
+
+// A USB attached SCSI interface
+class usb_uas_if_t : public storage_if_base_t {
+public:
+    // One command per tag, each page of information units holds 32
+    static constexpr int max_streams = PAGE_SIZE / sizeof(usb_uas_iu_buf_t);
+
+    bool init(usb_pipe_t const& cmd_pipe,
+              usb_pipe_t const& status_pipe,
+              usb_pipe_t const& data_in,
+              usb_pipe_t const& data_out,
+              int streams);
+
+    errno_t io(void *data, uint64_t count, uint64_t lba,
+               bool fua, usb_msc_op_t op, iocp_t *iocp,
+               uint8_t log2_sectorsize);
+
+    int queue_depth() const;
+
+private:
+    STORAGE_IF_IMPL
+
+    struct pending_cmd_t {
+        pending_cmd_t()
+            : io_iocp(&usb_uas_if_t::usb_completion, uintptr_t(this))
+        {
+        }
+
+        usb_uas_if_t *if_;
+        usb_uas_iu_buf_t *iu;
+        iocp_t *caller_iocp;
+        usb_iocp_t io_iocp;
+        uint16_t tag;
+    };
+
+    using lock_type = std::mcslock;
+    using scoped_lock = std::unique_lock<lock_type>;
+
+    pending_cmd_t *cmd_alloc();
+    void cmd_free(pending_cmd_t *cmd);
+
+    void issue(pending_cmd_t *cmd, void *data, uint32_t length, bool in);
+
+    errno_t command_sync(void const *cdb, size_t cdb_len,
+                         void *data, uint32_t length);
+
+    static void usb_completion(usb_iocp_result_t const& result,
+                               uintptr_t arg);
+    void usb_completion(pending_cmd_t *cmd, usb_iocp_result_t const& result);
+
+    usb_pipe_t cmd_pipe, status_pipe, data_in, data_out;
+
+    usb_uas_dev_t *drive;
+
+    pending_cmd_t *cmds;
+    usb_uas_iu_buf_t *iu_bufs;
+    int streams;
+
+    // Bit n set when tag n+1 is free
+    uint64_t free_tags;
+
+    lock_type lock;
+    std::condition_variable free_cond;
+};
+
+// Logical unit 0 of a UAS interface
+class usb_uas_dev_t : public storage_dev_base_t {
+public:
+    bool init(usb_uas_if_t *if_, uint64_t max_lba, uint8_t log2_blk_sz);
+
+protected:
+    // storage_dev_base_t interface
+    STORAGE_DEV_IMPL
+
+    usb_uas_if_t *if_;
+    uint64_t max_lba;
+    uint8_t log2_blk_size;
+};
+
+// USB attached SCSI class driver
+class usb_uas_classdrv_t : public usb_class_drv_t {
+protected:
+    // usb_class_drv_t interface
+    bool probe(usb_config_helper *cfg_hlp, usb_bus_t *bus) override final;
+
+    char const *name() const override final;
+};
+
+static std::vector<usb_uas_if_t*> usb_uas_devices;
+
+//
+// Storage interface factory
+
+std::vector<storage_if_base_t *> usb_uas_if_factory_t::detect()
+{
+    USB_UAS_TRACE("Reporting %zu UAS interfaces\n", usb_uas_devices.size());
+
+    std::vector<storage_if_base_t*> list(usb_uas_devices.begin(),
+                                         usb_uas_devices.end());
+    return list;
+}
+
+//
+// Storage interface
+
+void usb_uas_if_t::cleanup_if()
+{
+}
+
+std::vector<storage_dev_base_t*> usb_uas_if_t::detect_devices()
+{
+    std::vector<storage_dev_base_t*> list;
+
+    if (drive && !list.push_back(drive))
+        panic_oom();
+
+    return list;
+}
+
+bool usb_uas_if_t::init(usb_pipe_t const& cmd_pipe,
+                        usb_pipe_t const& status_pipe,
+                        usb_pipe_t const& data_in,
+                        usb_pipe_t const& data_out,
+                        int streams)
+{
+    this->cmd_pipe = cmd_pipe;
+    this->status_pipe = status_pipe;
+    this->data_in = data_in;
+    this->data_out = data_out;
+    this->streams = std::min(streams, max_streams);
+
+    iu_bufs = (usb_uas_iu_buf_t*)mmap(
+                nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_POPULATE, -1, 0);
+
+    if (unlikely(iu_bufs == MAP_FAILED))
+        return false;
+
+    cmds = (pending_cmd_t*)mmap(
+                nullptr, sizeof(*cmds) * this->streams,
+                PROT_READ | PROT_WRITE, MAP_POPULATE, -1, 0);
+
+    if (unlikely(cmds == MAP_FAILED))
+        return false;
+
+    for (int i = 0; i < this->streams; ++i) {
+        pending_cmd_t *cmd = new (cmds + i) pending_cmd_t();
+        cmd->if_ = this;
+        cmd->iu = iu_bufs + i;
+        cmd->tag = i + 1;
+    }
+
+    free_tags = this->streams < 64
+            ? (UINT64_C(1) << this->streams) - 1
+            : ~UINT64_C(0);
+
+    // READ CAPACITY (10)
+    uint8_t cdb[16] = { 0x25 };
+    uint32_t rdcap10[2] = {};
+
+    errno_t err = command_sync(cdb, 10, rdcap10, sizeof(rdcap10));
+
+    if (unlikely(err != errno_t::OK))
+        return false;
+
+    uint64_t max_lba = bswap_32(rdcap10[0]);
+    uint32_t blk_sz = bswap_32(rdcap10[1]);
+
+    if (max_lba == 0xFFFFFFFF) {
+        // SERVICE ACTION IN (16), READ CAPACITY (16)
+        struct rdcap16_t {
+            uint64_t max_lba;
+            uint32_t blk_size;
+        } _packed rdcap16 = {};
+
+        memset(cdb, 0, sizeof(cdb));
+        cdb[0] = 0x9E;
+        cdb[1] = 0x10;
+        cdb[13] = sizeof(rdcap16);
+
+        err = command_sync(cdb, 16, &rdcap16, sizeof(rdcap16));
+
+        if (unlikely(err != errno_t::OK))
+            return false;
+
+        max_lba = bswap_64(rdcap16.max_lba);
+        blk_sz = bswap_32(rdcap16.blk_size);
+    }
+
+    USB_UAS_TRACE("max_lba=%#" PRIx64 ", block size=%u, streams=%d\n",
+                  max_lba, blk_sz, this->streams);
+
+    std::unique_ptr<usb_uas_dev_t> drv(new usb_uas_dev_t{});
+
+    if (!drv->init(this, max_lba, bit_msb_set(blk_sz)))
+        return false;
+
+    drive = drv.release();
+
+    return true;
+}
+
+int usb_uas_if_t::queue_depth() const
+{
+    return streams;
+}
+
+usb_uas_if_t::pending_cmd_t *usb_uas_if_t::cmd_alloc()
+{
+    scoped_lock hold_lock(lock);
+
+    while (!free_tags)
+        free_cond.wait(hold_lock);
+
+    uint8_t index = bit_lsb_set(free_tags);
+
+    free_tags &= ~(UINT64_C(1) << index);
+
+    return cmds + index;
+}
+
+void usb_uas_if_t::cmd_free(pending_cmd_t *cmd)
+{
+    scoped_lock hold_lock(lock);
+
+    free_tags |= UINT64_C(1) << (cmd->tag - 1);
+
+    free_cond.notify_one();
+}
+
+errno_t usb_uas_if_t::io(void *data, uint64_t count, uint64_t lba,
+                         bool fua, usb_msc_op_t op, iocp_t *iocp,
+                         uint8_t log2_sectorsize)
+{
+    unsigned chunks = 0;
+
+    // Large requests are split into one command per chunk, each on its
+    // own stream, so the device works on all of them at once
+    do {
+        uint32_t blocks = usb_msc_chunk_blocks(data, count, log2_sectorsize);
+
+        pending_cmd_t *cmd = cmd_alloc();
+
+        cmd->caller_iocp = iocp;
+
+        cmd->iu->cmd = usb_uas_cmd_iu_t{};
+        usb_msc_make_cdb(cmd->iu->cmd.cdb, op, lba, blocks, fua);
+
+        issue(cmd, data, blocks << log2_sectorsize,
+              op == usb_msc_op_t::read);
+
+        data = (char*)data + (uint64_t(blocks) << log2_sectorsize);
+        lba += blocks;
+        count -= blocks;
+        ++chunks;
+    } while (count);
+
+    iocp->set_expect(chunks);
+
+    return errno_t::OK;
+}
+
+errno_t usb_uas_if_t::command_sync(void const *cdb, size_t cdb_len,
+                                   void *data, uint32_t length)
+{
+    blocking_iocp_t block;
+
+    pending_cmd_t *cmd = cmd_alloc();
+
+    cmd->caller_iocp = &block;
+
+    cmd->iu->cmd = usb_uas_cmd_iu_t{};
+    memcpy(cmd->iu->cmd.cdb, cdb, cdb_len);
+
+    issue(cmd, data, length, true);
+
+    block.set_expect(1);
+
+    return block.wait();
+}
+
+void usb_uas_if_t::issue(pending_cmd_t *cmd, void *data,
+                         uint32_t length, bool in)
+{
+    cmd->io_iocp.reset(&usb_uas_if_t::usb_completion);
+
+    cmd->iu->cmd.id = UAS_IU_COMMAND;
+    cmd->iu->cmd.tag = bswap_16(cmd->tag);
+
+    cmd->iu->status.sense = usb_uas_sense_iu_t{};
+
+    // Queue the status and data transfers on the command's stream before
+    // sending the command, so the device can move them as soon as it
+    // selects the stream
+    status_pipe.stream_recv_async(cmd->tag, &cmd->iu->status,
+                                  sizeof(cmd->iu->status), &cmd->io_iocp);
+
+    if (length) {
+        if (in)
+            data_in.stream_recv_async(cmd->tag, data, length, &cmd->io_iocp);
+        else
+            data_out.stream_send_async(cmd->tag, data, length, &cmd->io_iocp);
+    }
+
+    cmd_pipe.send_async(&cmd->iu->cmd, sizeof(cmd->iu->cmd), &cmd->io_iocp);
+
+    cmd->io_iocp.set_expect(length ? 3 : 2);
+}
+
+void usb_uas_if_t::usb_completion(
+        usb_iocp_result_t const& result, uintptr_t arg)
+{
+    pending_cmd_t *cmd = reinterpret_cast<pending_cmd_t*>(arg);
+    cmd->if_->usb_completion(cmd, result);
+}
+
+void usb_uas_if_t::usb_completion(pending_cmd_t *cmd,
+                                  usb_iocp_result_t const& result)
+{
+    usb_uas_status_iu_t const& status = cmd->iu->status;
+
+    // The status IU is shorter than the buffer, short packets are expected
+    bool ok = (result.cc == usb_cc_t::success ||
+               result.cc == usb_cc_t::short_pkt) &&
+            status.id == UAS_IU_SENSE &&
+            bswap_16(status.sense.tag) == cmd->tag &&
+            status.sense.status == 0;
+
+    if (unlikely(!ok)) {
+        USB_UAS_TRACE("Command %u failed, cc=%d, iu=%#x, status=%#x\n",
+                      cmd->tag, int(result.cc), status.id,
+                      status.sense.status);
+    }
+
+    iocp_t *caller_iocp = cmd->caller_iocp;
+
+    caller_iocp->set_result(ok ? errno_t::OK : errno_t::EIO);
+
+    cmd_free(cmd);
+
+    caller_iocp->invoke();
+}
+
+//
+// UAS device (LUN 0)
+
+bool usb_uas_dev_t::init(usb_uas_if_t *if_, uint64_t max_lba,
+                         uint8_t log2_blk_sz)
+{
+    this->if_ = if_;
+    this->max_lba = max_lba;
+    this->log2_blk_size = log2_blk_sz;
+
+    return true;
+}
+
+void usb_uas_dev_t::cleanup_dev()
+{
+}
+
+errno_t usb_uas_dev_t::read_async(
+        void *data, int64_t count,
+        uint64_t lba, iocp_t *iocp)
+{
+    return if_->io(data, count, lba, false,
+                   usb_msc_op_t::read, iocp, log2_blk_size);
+}
+
+errno_t usb_uas_dev_t::write_async(
+        void const *data, int64_t count,
+        uint64_t lba, bool fua, iocp_t *iocp)
+{
+    return if_->io((void*)data, count, lba, fua,
+                   usb_msc_op_t::write, iocp, log2_blk_size);
+}
+
+errno_t usb_uas_dev_t::flush_async(iocp_t *iocp)
+{
+    return if_->io(nullptr, 0, 0, false,
+                   usb_msc_op_t::flush, iocp, log2_blk_size);
+}
+
+errno_t usb_uas_dev_t::trim_async(int64_t count,
+        uint64_t lba, iocp_t *iocp)
+{
+    return errno_t::ENOSYS;
+}
+
+long usb_uas_dev_t::info(storage_dev_info_t key)
+{
+    switch (key) {
+    case STORAGE_INFO_BLOCKSIZE:
+        return 1L << log2_blk_size;
+
+    case STORAGE_INFO_HAVE_TRIM:
+        return 0;
+
+    case STORAGE_INFO_NAME:
+        return long("USB-UAS");
+
+    case STORAGE_INFO_QUEUE_COUNT:
+        return 1;
+
+    case STORAGE_INFO_QUEUE_DEPTH:
+        return if_->queue_depth();
+
+    case STORAGE_INFO_MAX_TRANSFER:
+        return usb_msc_max_xfer;
+
+    default:
+        return 0;
+    }
+}
+
+//
+// USB attached SCSI class driver
+
+// Find the pipe usage descriptor following an endpoint descriptor
+static usb_uas_pipe_usage_t const *usb_uas_pipe_usage(
+        usb_desc_config const *cfg, usb_desc_ep const *ep)
+{
+    char const *end = (char const *)cfg + cfg->total_len;
+
+    for (usb_desc_hdr_t const *hdr = (usb_desc_hdr_t const *)
+         ((char const *)ep + ep->hdr.len);
+         (char const *)hdr < end && hdr->len; hdr = (usb_desc_hdr_t const *)
+         ((char const *)hdr + hdr->len)) {
+        if (uint8_t(hdr->desc_type) == usb_uas_pipe_usage_type)
+            return (usb_uas_pipe_usage_t const *)hdr;
+
+        if (hdr->desc_type == usb_desctype_t::ENDPOINT ||
+                hdr->desc_type == usb_desctype_t::INTERFACE)
+            break;
+    }
+
+    return nullptr;
+}
+
+bool usb_uas_classdrv_t::probe(usb_config_helper *cfg_hlp, usb_bus_t *bus)
+{
+    // Match SCSI mass storage devices
+    // 6 = SCSI command set
+    // 0x62 = USB attached SCSI
+    match_result match = match_config(
+                cfg_hlp, 0, int(usb_class_t::mass_storage), 6, -1,
+                0x62, -1, -1);
+
+    if (!match.dev)
+        return false;
+
+    USB_UAS_TRACE("found UAS interface, slot=%d\n", cfg_hlp->slot());
+
+    usb_pipe_t control;
+
+    if (!bus->get_pipe(cfg_hlp->slot(), 0, control))
+        return false;
+
+    usb_desc_ep const *eps[5] = {};
+    usb_desc_ep const *ep = nullptr;
+
+    for (int i = 0; (ep = cfg_hlp->find_ep(match.iface, i)) != nullptr; ++i) {
+        usb_uas_pipe_usage_t const *usage = usb_uas_pipe_usage(match.cfg, ep);
+
+        if (usage && usage->pipe_id >= UAS_PIPE_COMMAND &&
+                usage->pipe_id <= UAS_PIPE_DATA_OUT)
+            eps[usage->pipe_id] = ep;
+    }
+
+    if (!eps[UAS_PIPE_COMMAND] || !eps[UAS_PIPE_STATUS] ||
+            !eps[UAS_PIPE_DATA_IN] || !eps[UAS_PIPE_DATA_OUT]) {
+        USB_UAS_TRACE("missing pipe usage descriptors\n");
+        return false;
+    }
+
+    // The UAS interface is usually an alternate setting of a
+    // bulk-only interface
+    if (match.iface->alt_setting &&
+            control.send_default_control(
+                uint8_t(usb_dir_t::OUT) |
+                (uint8_t(usb_req_type::STD) << 5) |
+                uint8_t(usb_req_recip_t::INTERFACE),
+                uint8_t(usb_rqcode_t::SET_INTERFACE),
+                match.iface->alt_setting, match.iface->iface_num,
+                0, nullptr) < 0)
+        return false;
+
+    usb_pipe_t pipes[5];
+
+    if (!bus->alloc_pipe(cfg_hlp->slot(), match.iface,
+                         eps[UAS_PIPE_COMMAND], pipes[UAS_PIPE_COMMAND]))
+        return false;
+
+    int streams = usb_uas_if_t::max_streams;
+
+    for (int id = UAS_PIPE_STATUS; id <= UAS_PIPE_DATA_OUT; ++id) {
+        int pipe_streams = bus->alloc_stream_pipe(
+                    cfg_hlp->slot(), match.iface, eps[id],
+                    cfg_hlp->get_ep_companion(eps[id]),
+                    usb_uas_if_t::max_streams, pipes[id]);
+
+        if (pipe_streams < 0)
+            return false;
+
+        streams = std::min(streams, pipe_streams);
+    }
+
+    if (streams < 1) {
+        USB_UAS_TRACE("streams not available, not supported\n");
+        return false;
+    }
+
+    std::unique_ptr<usb_uas_if_t> if_(new usb_uas_if_t{});
+
+    if (!if_->init(pipes[UAS_PIPE_COMMAND], pipes[UAS_PIPE_STATUS],
+                   pipes[UAS_PIPE_DATA_IN], pipes[UAS_PIPE_DATA_OUT],
+                   streams))
+        return false;
+
+    if (!usb_uas_devices.push_back(if_.get()))
+        return false;
+
+    if_.release();
+
+    return true;
+}
+
+char const *usb_uas_classdrv_t::name() const
+{
+    return "USB attached SCSI";
+}
+
+static usb_uas_classdrv_t usb_uas;
+
+static usb_uas_if_factory_t usb_uas_if_factory;
+STORAGE_REGISTER_FACTORY(usb_uas_if);
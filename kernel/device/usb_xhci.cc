@@ -237,9 +237,9 @@ struct usbxhci_ep_ctx_t {
     // LSA:MaxPStreams:Mult
     // Mult: Maximum supported number of bursts in an interval
     //   If LEC == 1, this must be 0
-    // MaxPStreams: Maximum number of primary stream IDs
+    // MaxPStreams: Primary stream array holds 2^(MaxPStreams+1) entries
     //   Must be zero for non-SS, control, isoch, and interrupt endpoints
-    // LSA: 1=enable secondary stream arrays
+    // LSA: 1=linear primary stream array, 0=enable secondary stream arrays
     //   if MaxPStreams is 0, this must be zero
     uint8_t mml;
 
@@ -290,6 +290,28 @@ C_ASSERT(sizeof(usbxhci_ep_ctx_t) == 0x20);
 #define USBXHCI_EPTYPE_BULKIN     6
 #define USBXHCI_EPTYPE_INTRIN     7
 
+// 6.2.4.1 Stream Context
+
+struct usbxhci_stream_ctx_t {
+    // Transfer ring dequeue pointer
+    //  Bits 3:1 are the stream context type, bit 0 is dequeue cycle state
+    uint64_t tr_dq_ptr;
+
+    // Stopped endpoint data transfer length accumulator
+    uint32_t stopped_edtla;
+
+    uint32_t rsvd;
+} _packed;
+
+C_ASSERT(sizeof(usbxhci_stream_ctx_t) == 0x10);
+
+#define USBXHCI_STREAMCTX_SCT_PRIMARY_TR    (1U << 1)
+
+// The stream context array must be physically contiguous, so it is
+// kept within a single page
+#define USBXHCI_MAX_LOG2_STREAM_ARRAY \
+    (PAGE_SCALE - 4)
+
 // 6.2.1 Device Context
 
 struct usbxhci_devctx_small_t {
@@ -702,6 +724,13 @@ struct usbxhci_endpoint_data_t {
     usbxhci_endpoint_target_t target;
 
     usbxhci_trb_ring_data_t ring;
+
+    // When streams are enabled, the endpoint context points to the
+    // stream context array and each stream has its own transfer ring,
+    // indexed by stream id. Entry 0 is reserved
+    usbxhci_stream_ctx_t *stream_ctx;
+    usbxhci_trb_ring_data_t *stream_rings;
+    uint32_t stream_array_size;
 };
 
 struct usbxhci_pending_cmd_t {
@@ -785,6 +814,12 @@ protected:
                     int max_packet_sz, int interval,
                     usb_ep_attr ep_type) override final;
 
+    int alloc_stream_pipe(int slotid, usb_pipe_t &pipe,
+                          int epid, int cfg_value,
+                          int iface_num, int alt_iface,
+                          int max_packet_sz, int max_burst,
+                          int max_streams) override final;
+
     int send_control(int slotid, uint8_t request_type, uint8_t request,
                      uint16_t value, uint16_t index, uint16_t length,
                      void *data) override final;
@@ -874,6 +909,15 @@ private:
 
     usbxhci_endpoint_data_t *add_endpoint(uint8_t slotid, uint8_t epid);
 
+    int add_streams(usbxhci_endpoint_data_t *epd, int max_streams);
+
+    int configure_ep(int slotid, usb_pipe_t &pipe,
+                     int epid, int cfg_value,
+                     int iface_num, int alt_iface,
+                     int max_packet_sz, int interval,
+                     usb_ep_attr ep_type, int max_burst,
+                     int max_streams);
+
     usbxhci_endpoint_data_t *lookup_endpoint(uint8_t slotid, uint8_t epid);
 
     void evt_handler(usbxhci_interrupter_info_t *ir_info,
@@ -997,11 +1041,18 @@ void usbxhci::add_xfer_trbs(uint8_t slotid, uint8_t epid, uint16_t stream_id,
 
     usbxhci_endpoint_data_t *epd = lookup_endpoint(slotid, epid);
 
+    usbxhci_trb_ring_data_t *ring = &epd->ring;
+
+    if (stream_id) {
+        assert(stream_id < epd->stream_array_size);
+        ring = epd->stream_rings + stream_id;
+    }
+
     for (size_t i = 0; i < count; ++i) {
         // Get pointer to source TRB
         auto src = (usbxhci_cmd_trb_t *)trbs + i;
 
-        epd->ring.insert(this, src, iocp, iocp && (i + 1) == count);
+        ring->insert(this, src, iocp, iocp && (i + 1) == count);
     }
 
     ring_doorbell(slotid, (dir || !epid)
@@ -1081,6 +1132,9 @@ usbxhci_endpoint_data_t *usbxhci::add_endpoint(uint8_t slotid, uint8_t epid)
 
     newepd->target.slotid = slotid;
     newepd->target.epid = epid;
+    newepd->stream_ctx = nullptr;
+    newepd->stream_rings = nullptr;
+    newepd->stream_array_size = 0;
 
     scoped_lock hold_endpoints_lock(endpoints_lock);
 
@@ -1098,6 +1152,60 @@ usbxhci_endpoint_data_t *usbxhci::add_endpoint(uint8_t slotid, uint8_t epid)
     return newepd;
 }
 
+// Returns the number of usable streams, 0 if streams are not supported,
+// or -1 on allocation failure
+int usbxhci::add_streams(usbxhci_endpoint_data_t *epd, int max_streams)
+{
+    unsigned max_psa = USBXHCI_CAPREG_HCCPARAMS1_MAXPSASZ_GET(
+                mmio_cap->hccparams1);
+
+    if (max_streams < 1 || !max_psa)
+        return 0;
+
+    // The array holds 2^(MaxPStreams+1) entries, at most
+    // 2^(MaxPSASize+1), entry 0 is reserved, and MaxPStreams
+    // must be at least 1
+    unsigned log2_size = std::max(bit_log2(uint32_t(max_streams + 1)),
+                                  uint8_t(2));
+    log2_size = std::min(log2_size, max_psa + 1);
+    log2_size = std::min(log2_size, unsigned(USBXHCI_MAX_LOG2_STREAM_ARRAY));
+
+    uint32_t array_size = 1U << log2_size;
+    int streams = std::min(max_streams, int(array_size - 1));
+
+    epd->stream_ctx = (usbxhci_stream_ctx_t*)mmap(
+                nullptr, sizeof(*epd->stream_ctx) * array_size,
+                PROT_READ | PROT_WRITE, MAP_POPULATE, -1, 0);
+
+    if (unlikely(epd->stream_ctx == MAP_FAILED)) {
+        epd->stream_ctx = nullptr;
+        return -1;
+    }
+
+    epd->stream_rings = (usbxhci_trb_ring_data_t*)
+            calloc(array_size, sizeof(*epd->stream_rings));
+
+    if (unlikely(!epd->stream_rings))
+        return -1;
+
+    for (int i = 1; i <= streams; ++i) {
+        usbxhci_trb_ring_data_t &ring = epd->stream_rings[i];
+
+        if (unlikely(!ring.alloc(PAGESIZE / sizeof(*ring.ptr))))
+            return -1;
+
+        ring.reserve_link();
+
+        epd->stream_ctx[i].tr_dq_ptr = (USBXHCI_EPCTX_TR_DQ_PTR_PTR_MASK &
+                ring.physaddr) | USBXHCI_STREAMCTX_SCT_PRIMARY_TR |
+                USBXHCI_EPCTX_TR_DQ_PTR_DCS_n(ring.cycle);
+    }
+
+    epd->stream_array_size = array_size;
+
+    return streams;
+}
+
 usbxhci_endpoint_data_t *usbxhci::lookup_endpoint(uint8_t slotid, uint8_t epid)
 {
     scoped_lock hold_endpoints_lock(endpoints_lock);
@@ -1692,21 +1800,53 @@ bool usbxhci::alloc_pipe(int slotid, usb_pipe_t &pipe,
                          int iface_num, int alt_iface,
                          int max_packet_sz, int interval,
                          usb_ep_attr ep_type)
+{
+    return configure_ep(slotid, pipe, epid, cfg_value, iface_num,
+                        alt_iface, max_packet_sz, interval,
+                        ep_type, 0, 0) >= 0;
+}
+
+int usbxhci::alloc_stream_pipe(int slotid, usb_pipe_t &pipe,
+                               int epid, int cfg_value,
+                               int iface_num, int alt_iface,
+                               int max_packet_sz, int max_burst,
+                               int max_streams)
+{
+    return configure_ep(slotid, pipe, epid, cfg_value, iface_num,
+                        alt_iface, max_packet_sz, 0, usb_ep_attr::bulk,
+                        max_burst, max_streams);
+}
+
+// Returns the number of streams enabled, or a negated completion code
+int usbxhci::configure_ep(int slotid, usb_pipe_t &pipe,
+                          int epid, int cfg_value,
+                          int iface_num, int alt_iface,
+                          int max_packet_sz, int interval,
+                          usb_ep_attr ep_type, int max_burst,
+                          int max_streams)
 {
     if (slotid < 0)
-        return false;
+        return -int(usb_cc_t::parameter_err);
 
-    if (likely(lookup_endpoint(slotid, epid))) {
+    usbxhci_endpoint_data_t *epd = lookup_endpoint(slotid, epid);
+
+    if (likely(epd)) {
         pipe = usb_pipe_t(this, slotid, epid);
-        return true;
+        return epd->stream_array_size
+                ? std::min(max_streams, int(epd->stream_array_size - 1))
+                : 0;
     }
 
     if (!assert(epid != 0))
-        return false;
+        return -int(usb_cc_t::parameter_err);
 
-    usbxhci_endpoint_data_t *epd = add_endpoint(slotid, epid);
+    epd = add_endpoint(slotid, epid);
     if (!epd)
-        return false;
+        return -int(usb_cc_t::resource_err);
+
+    int streams = add_streams(epd, max_streams);
+    if (unlikely(streams < 0))
+        return -int(usb_cc_t::resource_err);
 
     usbxhci_inpctx_t inp;
     usbxhci_inpctlctx_t *ctlctx;
@@ -1733,11 +1873,22 @@ bool usbxhci::alloc_pipe(int slotid, usb_pipe_t &pipe,
     usbxhci_ep_ctx_t *ep = inpepctx + (bit_index - 1);
 
     ep->max_packet = max_packet_sz;
+    ep->max_burst = max_burst;
     ep->interval = interval;
 
-    ep->tr_dq_ptr = (USBXHCI_EPCTX_TR_DQ_PTR_PTR_MASK &
-            epd->ring.physaddr) |
-            USBXHCI_EPCTX_TR_DQ_PTR_DCS_n(epd->ring.cycle);
+    if (streams) {
+        // Linear primary stream array, one ring per stream
+        ep->mml = USBXHCI_EPCTX_MML_MAXPSTREAMS_n(
+                    bit_log2(epd->stream_array_size) - 1) |
+                USBXHCI_EPCTX_MML_LSA_n(1);
+
+        ep->tr_dq_ptr = USBXHCI_EPCTX_TR_DQ_PTR_PTR_MASK &
+                mphysaddr(epd->stream_ctx);
+    } else {
+        ep->tr_dq_ptr = (USBXHCI_EPCTX_TR_DQ_PTR_PTR_MASK &
+                epd->ring.physaddr) |
+                USBXHCI_EPCTX_TR_DQ_PTR_DCS_n(epd->ring.cycle);
+    }
 
     uint8_t ep_type_value = uint8_t(ep_type);
     if (in)
@@ -1749,11 +1900,11 @@ bool usbxhci::alloc_pipe(int slotid, usb_pipe_t &pipe,
                                  USBXHCI_TRB_TYPE_CONFIGUREEPCMD);
     if (unlikely(cc != usb_cc_t::success)) {
         pipe = usb_pipe_t(nullptr, -1, -1);
-        return false;
+        return -int(cc);
     }
 
     pipe = usb_pipe_t(this, slotid, epid);
-    return true;
+    return streams;
 }
 
 int usbxhci::send_control(int slotid, uint8_t request_type,
@@ -1806,8 +1957,8 @@ int usbxhci::xfer(int slotid, uint8_t epid, uint16_t stream_id,
 int usbxhci::xfer_async(int slotid, uint8_t epid, uint16_t stream_id,
                         uint32_t length, void *data, int dir, usb_iocp_t *iocp)
 {
-    // Worst case is 64KB
-    usbxhci_ctl_trb_data_t trbs[64/4] = {};
+    // Worst case is 64KB, make_data_trbs wants room for two more
+    usbxhci_ctl_trb_data_t trbs[64/4+2] = {};
 
     int data_trb_count = make_data_trbs(trbs, countof(trbs),
                                         data, length, dir, true);
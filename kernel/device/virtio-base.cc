@@ -96,8 +96,6 @@ bool virtio_base_t::virtio_init(pci_dev_iterator_t const& pci_iter,
 
             // Negotiate features
             do {
-                feature_set_t features;
-
                 features.fetch_device_features(common_cfg);
 
                 // Offer the feature bitmap to the subclass
@@ -129,7 +127,12 @@ bool virtio_base_t::virtio_init(pci_dev_iterator_t const& pci_iter,
                 return false;
             }
 
-            queue_count = common_cfg->num_queues;
+            queue_count = std::min(size_t(common_cfg->num_queues),
+                                   max_queue_count);
+
+            // One queue per CPU is enough
+            if (per_cpu_queues)
+                queue_count = std::min(queue_count, thread_get_cpu_count());
 
             // Allocate number of queues supported by device
             queues.reset(new virtio_virtqueue_t[queue_count]);
@@ -159,10 +162,21 @@ bool virtio_base_t::virtio_init(pci_dev_iterator_t const& pci_iter,
                                           isr_name, target_cpus.data(),
                                           vector_offsets.data());
             } else {
+                // One vector per queue, optionally routed
+                // to the CPU the subclass picks for it
+                std::vector<int> target_cpus(queue_count + 1, 0);
+                bool targeted = false;
+                for (size_t i = 1; i <= queue_count; ++i) {
+                    int cpu = queue_cpu(i - 1);
+                    targeted |= (cpu >= 0);
+                    target_cpus[i] = cpu >= 0 ? cpu : 0;
+                }
                 use_msi = pci_try_msi_irq(pci_iter, &irq_range, 0, false,
                                           queue_count + 1,
                                           &virtio_base_t::irq_handler,
-                                          isr_name);
+                                          isr_name, targeted
+                                          ? target_cpus.data()
+                                          : nullptr);
             }
 
             pci_set_irq_unmask(pci_iter, true);
@@ -177,7 +191,8 @@ bool virtio_base_t::virtio_init(pci_dev_iterator_t const& pci_iter,
                         ? i : 0;
 
                 if (!vq.init(i - 1, common_cfg, (char*)notify_cap,
-                             notify_off_multiplier, queue_msix_vector)) {
+                             notify_off_multiplier, queue_msix_vector,
+                             features[VIRTIO_F_RING_EVENT_IDX_BIT])) {
                     // Tell the device we gave up
                     common_cfg->device_status |= VIRTIO_STATUS_FAILED;
                     return false;
@@ -242,9 +257,10 @@ isr_context_t *virtio_base_t::irq_handler(int irq, isr_context_t *ctx)
 bool virtio_virtqueue_t::init(
         int queue_idx, virtio_pci_common_cfg_t volatile *common_cfg,
         char volatile *notify_base, uint32_t notify_off_multiplier,
-        uint16_t msix_vector)
+        uint16_t msix_vector, bool use_event_idx)
 {
     this->queue_idx = queue_idx;
+    event_idx = use_event_idx;
 
     atomic_fence();
     common_cfg->queue_select = queue_idx;
@@ -365,6 +381,24 @@ bool virtio_virtqueue_t::init(
     return true;
 }
 
+bool virtio_virtqueue_t::init_indirect(size_t max_entries)
+{
+    assert(max_entries && !(max_entries & (max_entries - 1)));
+    assert(sizeof(desc_t) * max_entries <= PAGE_SIZE);
+
+    indirect_tabs = (desc_t*)mmap(
+                nullptr, (sizeof(desc_t) * max_entries) << log2_queue_size,
+                PROT_READ | PROT_WRITE, MAP_POPULATE, -1, 0);
+    if (unlikely(indirect_tabs == MAP_FAILED)) {
+        indirect_tabs = nullptr;
+        return false;
+    }
+
+    indirect_max = max_entries;
+
+    return true;
+}
+
 virtio_virtqueue_t::desc_t *virtio_virtqueue_t::alloc_desc(bool dev_writable)
 {
     scoped_lock lock(queue_lock);
@@ -402,6 +436,10 @@ void virtio_virtqueue_t::alloc_multiple(
     while (desc_free_count < count) {
         VIRTIO_TRACE("Waiting for %zu free descriptors"
                      ", desc_free_count=%u\n", count, desc_free_count);
+
+        // Deferred descriptors only complete once the device is told
+        kick_locked();
+
         queue_not_full.wait(lock);
     }
     desc_free_count -= count;
@@ -417,8 +455,31 @@ void virtio_virtqueue_t::alloc_multiple(
     }
 }
 
+bool virtio_virtqueue_t::try_alloc_multiple(
+        virtio_virtqueue_t::desc_t **descs, size_t count)
+{
+    scoped_lock lock(queue_lock);
+
+    if (desc_free_count < count)
+        return false;
+
+    desc_free_count -= count;
+
+    for (size_t i = 0; i < count; ++i) {
+        desc_t *desc = desc_tab + desc_first_free;
+        desc_first_free = desc->next;
+        descs[i] = desc;
+        desc->addr = 0;
+        desc->len = 0;
+        desc->flags.raw = 0;
+        desc->next = -1;
+    }
+
+    return true;
+}
+
 void virtio_virtqueue_t::enqueue_avail(desc_t **desc, size_t count,
-                                       virtio_iocp_t *iocp)
+                                       virtio_iocp_t *iocp, bool defer)
 {
     size_t mask = ~-(1U << log2_queue_size);
 
@@ -439,13 +500,43 @@ void virtio_virtqueue_t::enqueue_avail(desc_t **desc, size_t count,
         skip = desc[i]->flags.bits.next;
     }
 
-    // Update used idx
-    atomic_st_rel(&avail_ftr->used_event, avail_head - 1);
-
     // Update idx
     atomic_st_rel(&avail_hdr->idx, avail_head);
 
-    if ((int16_t)avail_head - (int16_t)avail_ftr->used_event > 0)
+    if (!defer)
+        kick_locked();
+}
+
+void virtio_virtqueue_t::kick()
+{
+    scoped_lock lock(queue_lock);
+    kick_locked();
+}
+
+void virtio_virtqueue_t::kick_locked()
+{
+    uint16_t new_idx = avail_hdr->idx;
+    uint16_t old_idx = kick_idx;
+
+    if (new_idx == old_idx)
+        return;
+
+    kick_idx = new_idx;
+
+    // The new index must be visible before reading what the device wants
+    atomic_fence();
+
+    bool notify;
+    if (event_idx) {
+        // Notify if the device's avail_event is in the range just added
+        uint16_t avail_event = atomic_ld_acq(&used_ftr->event);
+        notify = uint16_t(new_idx - avail_event - 1) <
+                uint16_t(new_idx - old_idx);
+    } else {
+        notify = !(atomic_ld_acq(&used_hdr->flags) & VIRTQ_USED_F_NO_NOTIFY);
+    }
+
+    if (notify)
         atomic_st_rel(notify_ptr, queue_idx);
 }
 
@@ -496,51 +587,70 @@ void virtio_virtqueue_t::sendrecv(const void *sent_data, size_t sent_size,
     enqueue_avail(desc, out, iocp);
 }
 
-void virtio_virtqueue_t::recycle_used()
+bool virtio_virtqueue_t::recycle_used(bool polled)
 {
+    std::unique_lock<std::spinlock> reap_hold(reap_lock,
+                                             std::defer_lock_t());
+
+    if (!polled)
+        reap_hold.lock();
+    else if (!reap_hold.try_lock())
+        return false;
+
     scoped_lock lock(queue_lock);
 
     VIRTIO_TRACE("Recycling used descriptors\n");
 
     size_t tail = used_tail;
     size_t const mask = ~-(1 << log2_queue_size);
-    size_t const done_idx = atomic_ld_acq(&used_hdr->idx);
+    size_t done_idx = atomic_ld_acq(&used_hdr->idx);
     VIRTIO_TRACE("done_idx = %zu\n", done_idx);
     while (unlikely(done_idx == tail)) {
         VIRTIO_TRACE("dropped spurious virtio IRQ\n");
-        return;
+        return false;
     }
-    do {
-        used_t const& used = used_ring[tail & mask];
-        avail_t const id = used.id;
-        uint64_t const used_len = used.len;
 
-        VIRTIO_TRACE("Recycling id=%u (head)\n", id);
+    for (;;) {
+        do {
+            used_t const& used = used_ring[tail & mask];
+            avail_t const id = used.id;
+            uint64_t const used_len = used.len;
 
-        unsigned freed_count = 1;
+            VIRTIO_TRACE("Recycling id=%u (head)\n", id);
 
-        avail_t end = id;
-        while (desc_tab[end].flags.bits.next) {
-            end = desc_tab[end].next;
-            ++freed_count;
-            VIRTIO_TRACE("Recycling id=%u (chained)\n", end);
-        }
+            unsigned freed_count = 1;
 
-        desc_tab[end].next = desc_first_free;
-        desc_first_free = id;
-        desc_free_count += freed_count;
+            avail_t end = id;
+            while (desc_tab[end].flags.bits.next) {
+                end = desc_tab[end].next;
+                ++freed_count;
+                VIRTIO_TRACE("Recycling id=%u (chained)\n", end);
+            }
 
-        virtio_iocp_t* const completion = completions[id];
-        completions[id] = nullptr;
-        completion->set_result(used_len);
-        if (!pending_completions.push_back(completion))
-            panic_oom();
-    } while ((++tail & 0xFFFF) != done_idx);
+            desc_tab[end].next = desc_first_free;
+            desc_first_free = id;
+            desc_free_count += freed_count;
 
-    used_tail = tail;
+            virtio_iocp_t* const completion = completions[id];
+            completions[id] = nullptr;
+            completion->set_result(used_len);
+            if (!pending_completions.push_back(completion))
+                panic_oom();
+        } while ((++tail & 0xFFFF) != done_idx);
+
+        // Ask for an interrupt on the next completion, then pick up
+        // anything completed before the device could see that
+        if (event_idx && !irq_disabled)
+            atomic_st_rel(&avail_ftr->event, uint16_t(tail));
+
+        atomic_fence();
+
+        done_idx = atomic_ld_acq(&used_hdr->idx);
+        if (done_idx == (tail & 0xFFFF))
+            break;
+    }
 
-    // Notify device how far used ring has been processed
-    atomic_st_rel(&used_ftr->used_event, tail);
+    used_tail = tail;
 
     pending_completions.swap(finished_completions);
 
@@ -552,6 +662,43 @@ void virtio_virtqueue_t::recycle_used()
     finished_completions.clear();
 
     VIRTIO_TRACE("Free descriptors: %u\n", desc_free_count);
+
+    return true;
+}
+
+void virtio_virtqueue_t::disable_irq()
+{
+    scoped_lock lock(queue_lock);
+
+    irq_disabled = true;
+
+    if (event_idx) {
+        // The event index just passed is never reached
+        // again until the index wraps around
+        atomic_st_rel(&avail_ftr->event, uint16_t(used_tail - 1));
+    } else {
+        atomic_st_rel(&avail_hdr->flags, uint16_t(
+                          avail_hdr->flags | VIRTQ_AVAIL_F_NO_INTERRUPT));
+    }
+}
+
+bool virtio_virtqueue_t::enable_irq()
+{
+    scoped_lock lock(queue_lock);
+
+    irq_disabled = false;
+
+    if (event_idx) {
+        atomic_st_rel(&avail_ftr->event, used_tail);
+    } else {
+        atomic_st_rel(&avail_hdr->flags, uint16_t(
+                          avail_hdr->flags & ~VIRTQ_AVAIL_F_NO_INTERRUPT));
+    }
+
+    // The device must see that before we look at the used index
+    atomic_fence();
+
+    return atomic_ld_acq(&used_hdr->idx) != used_tail;
 }
 
 int virtio_factory_base_t::detect_virtio(int dev_class, int device,
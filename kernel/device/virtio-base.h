@@ -68,8 +68,9 @@ public:
         uint16_t idx;
     };
 
+    // used_event in the available ring, avail_event in the used ring
     struct ring_ftr_t {
-        uint16_t used_event;
+        uint16_t event;
         uint16_t padding;
     };
 
@@ -85,9 +86,14 @@ public:
         , avail_ring(nullptr)
         , used_ring(nullptr)
         , used_tail(0)
+        , kick_idx(0)
         , desc_first_free(-1)
+        , indirect_tabs(nullptr)
+        , indirect_max(0)
         , log2_queue_size(0)
         , single_page(false)
+        , event_idx(false)
+        , irq_disabled(false)
     {
     }
 
@@ -105,28 +111,73 @@ public:
             single_page = false;
         }
 
+        if (indirect_tabs) {
+            munmap(indirect_tabs,
+                   (sizeof(*indirect_tabs) * indirect_max) <<
+                   log2_queue_size);
+            indirect_tabs = nullptr;
+        }
     }
 
     bool init(int queue_idx, virtio_pci_common_cfg_t volatile *common_cfg,
               char volatile *notify_base, uint32_t notify_off_multiplier,
-              uint16_t msix_vector);
+              uint16_t msix_vector, bool use_event_idx = false);
+
+    // Allocate an indirect descriptor table of max_entries for every
+    // ring descriptor. max_entries must be a power of two, at most 256,
+    // so each table stays within one page
+    bool init_indirect(size_t max_entries);
+
+    // The indirect table belonging to a ring descriptor
+    desc_t *indirect_table(desc_t const *desc) const
+    {
+        return indirect_tabs + index_of(desc) * indirect_max;
+    }
+
+    size_t get_indirect_max() const
+    {
+        return indirect_max;
+    }
 
     desc_t *alloc_desc(bool dev_writable);
 
     void alloc_multiple(desc_t **descs, size_t count);
 
-    uint16_t index_of(desc_t *desc) const
+    // Like alloc_multiple, but returns false instead of waiting
+    // when there aren't enough free descriptors
+    bool try_alloc_multiple(desc_t **descs, size_t count);
+
+    size_t get_free_count() const
+    {
+        return atomic_ld_acq(&desc_free_count);
+    }
+
+    uint16_t index_of(desc_t const *desc) const
     {
         return desc - desc_tab;
     }
 
-    void enqueue_avail(desc_t **desc, size_t count, virtio_iocp_t *iocp);
+    // A deferred enqueue makes the descriptors available without
+    // notifying the device, kick notifies once for all of them
+    void enqueue_avail(desc_t **desc, size_t count, virtio_iocp_t *iocp,
+                       bool defer = false);
+
+    void kick();
 
     void sendrecv(void const *sent_data, size_t sent_size,
                   void *rcvd_data, size_t rcvd_size,
                   virtio_iocp_t *iocp);
 
-    void recycle_used();
+    // Reap the used ring and invoke the completions. A polling caller
+    // gives up if another CPU is already reaping. Returns true if
+    // anything completed
+    bool recycle_used(bool polled = false);
+
+    // Ask the device not to interrupt on completions, it is a hint,
+    // the device may interrupt anyway. enable_irq returns true if
+    // completions arrived while disabled, they may not interrupt
+    void disable_irq();
+    bool enable_irq();
 
     uint8_t get_log2_queue_size() const
     {
@@ -140,6 +191,10 @@ private:
     lock_type queue_lock;
     std::condition_variable queue_not_full;
 
+    // Held while reaping, finished_completions is
+    // used after queue_lock is released
+    std::spinlock reap_lock;
+
     std::unique_ptr<virtio_iocp_t*[]> completions;
     std::vector<virtio_iocp_t*> pending_completions;
     std::vector<virtio_iocp_t*> finished_completions;
@@ -157,13 +212,26 @@ private:
     uint16_t used_tail;
     uint16_t queue_idx;
 
+    // Available index at the last notify decision
+    uint16_t kick_idx;
+
     int desc_first_free;
     unsigned desc_free_count;
 
     uint16_t volatile *notify_ptr;
 
+    desc_t *indirect_tabs;
+    uint16_t indirect_max;
+
     uint8_t log2_queue_size;
     bool single_page;
+
+    // VIRTIO_F_RING_EVENT_IDX negotiated
+    bool event_idx;
+
+    bool irq_disabled;
+
+    void kick_locked();
 };
 
 struct virtio_pci_cap_hdr_t {
@@ -214,6 +282,10 @@ C_ASSERT(sizeof(virtio_pci_cap_hdr_t) == 16);
 #define VIRTIO_F_RING_EVENT_IDX_BIT 29
 #define VIRTIO_F_INDIRECT_DESC_BIT  28
 
+// Ring flags, used when VIRTIO_F_RING_EVENT_IDX is not negotiated
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  1
+#define VIRTQ_USED_F_NO_NOTIFY      1
+
 // virtqueue
 
 struct virtio_pci_common_cfg_t {
@@ -283,6 +355,7 @@ class virtio_base_t {
 public:
     virtio_base_t()
         : use_msi(false)
+        , max_queue_count(SIZE_MAX)
         , common_cfg(nullptr)
         , common_cfg_size(0)
         , notify_off_multiplier(0)
@@ -404,6 +477,13 @@ protected:
         return true;
     }
 
+    // Without per_cpu_queues, the CPU that should take the interrupts
+    // of a queue, or -1 to leave the choice to the interrupt allocator
+    virtual int queue_cpu(size_t queue_idx)
+    {
+        return -1;
+    }
+
     using blocking_iocp_t = virtio_virtqueue_t::virtio_blocking_iocp_t;
     using async_iocp_t = virtio_virtqueue_t::virtio_iocp_t;
     using lock_type = std::mcslock;
@@ -420,6 +500,13 @@ protected:
     std::unique_ptr<virtio_virtqueue_t[]> queues;
     size_t queue_count;
 
+    // Set by the subclass during feature negotiation to use
+    // fewer queues than the device has
+    size_t max_queue_count;
+
+    // Features accepted by the device
+    feature_set_t features;
+
     lock_type cfg_lock;
 
     // MMIO
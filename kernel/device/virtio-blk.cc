@@ -31,9 +31,17 @@
 // Device exports information on optimal I/O alignment.
 #define VIRTIO_BLK_F_TOPOLOGY_BIT (10)
 
-#define VIRTIO_BLK_T_IN     0
-#define VIRTIO_BLK_T_OUT    1
-#define VIRTIO_BLK_T_FLUSH  4
+// Device supports multiqueue.
+#define VIRTIO_BLK_F_MQ_BIT (12)
+
+// Device can support discard command, maximum discard sectors size in
+// max_discard_sectors and maximum discard segment number in max_discard_seg.
+#define VIRTIO_BLK_F_DISCARD_BIT (13)
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_T_DISCARD    11
 
 #define VIRTIO_BLK_S_OK     0
 #define VIRTIO_BLK_S_IOERR  1
@@ -90,6 +98,13 @@ public:
             uint64_t lba;
         } header;
 
+        // Discard segment, sector is always in 512 byte units
+        struct discard_t {
+            uint64_t sector;
+            uint32_t num_sectors;
+            uint32_t flags;
+        } discard;
+
         per_queue_t *owner;
         void *data;
         int64_t count;
@@ -104,7 +119,10 @@ public:
     virtio_blk_if_t()
         : per_queue(nullptr)
         , blk_config(nullptr)
+        , plugged(0)
         , log2_sectorsize(0)
+        , has_discard(false)
+        , has_indirect(false)
     {
     }
 
@@ -118,6 +136,11 @@ private:
     STORAGE_IF_IMPL
     STORAGE_DEV_IMPL
 
+    bool poll() override final;
+
+    void plug() override final;
+    void unplug() override final;
+
     errno_t io(void *data, int64_t count, uint64_t lba, bool fua,
                virtio_blk_op_t op, iocp_t *iocp);
 
@@ -152,9 +175,22 @@ private:
             uint32_t opt_io_size;
         } topology;
 
+        // Writeback
         uint8_t reserved;
+
+        uint8_t unused0;
+
+        uint16_t num_queues;
+
+        uint32_t max_discard_sectors;
+        uint32_t max_discard_seg;
+        uint32_t discard_sector_alignment;
     };
 
+    // Entries in each indirect descriptor table. A request with more
+    // segments than fit, with the header and status, uses a direct chain
+    static constexpr size_t indirect_max = 64;
+
     struct per_queue_t {
         bool init(virtio_blk_if_t *owner, virtio_virtqueue_t *queue);
 
@@ -179,7 +215,14 @@ private:
 
     per_queue_t *per_queue;
     blk_config_t *blk_config;
+
+    // Nonzero while plugged, requests are made available to the device
+    // without notifying it, the last unplug notifies every queue
+    unsigned plugged;
+
     uint8_t log2_sectorsize;
+    bool has_discard;
+    bool has_indirect;
 };
 
 int virtio_blk_factory_t::detect()
@@ -230,6 +273,9 @@ bool virtio_blk_if_t::per_queue_t::init(
     if (!phys_ranges.resize(16))
         return false;
 
+    if (owner->has_indirect && !queue->init_indirect(indirect_max))
+        return false;
+
     return true;
 }
 
@@ -237,6 +283,9 @@ int virtio_blk_if_t::per_queue_t::io(request_t *request)
 {
     request->owner = this;
 
+    char *data = (char*)request->data;
+    size_t remain = request->count << owner->log2_sectorsize;
+
     switch (request->op) {
     case virtio_blk_op_t::read:
         request->header.type = VIRTIO_BLK_T_IN;
@@ -251,12 +300,20 @@ int virtio_blk_if_t::per_queue_t::io(request_t *request)
         break;
 
     case virtio_blk_op_t::trim:
-        return -1;
+        // The data is the discard segment, the header sector is unused
+        request->header.type = VIRTIO_BLK_T_DISCARD;
+        request->discard.sector = request->header.lba <<
+                (owner->log2_sectorsize - 9);
+        request->discard.num_sectors = request->count <<
+                (owner->log2_sectorsize - 9);
+        request->discard.flags = 0;
+        request->header.lba = 0;
+        data = (char*)&request->discard;
+        remain = sizeof(request->discard);
+        break;
     }
 
     size_t range_count;
-    char *data = (char*)request->data;
-    size_t remain = request->count << owner->log2_sectorsize;
 
     scoped_lock lock(per_queue_lock);
 
@@ -271,6 +328,49 @@ int virtio_blk_if_t::per_queue_t::io(request_t *request)
         phys_ranges.resize(phys_ranges.size() * 2);
     }
 
+    request->io_iocp.reset(&virtio_blk_if_t::io_completion,
+                           uintptr_t(request));
+
+    bool defer = atomic_ld_acq(&owner->plugged) != 0;
+
+    if (range_count + 2 <= req_queue->get_indirect_max()) {
+        // The whole request takes one ring descriptor
+        virtio_virtqueue_t::desc_t *head;
+        req_queue->alloc_multiple(&head, 1);
+
+        virtio_virtqueue_t::desc_t *tab = req_queue->indirect_table(head);
+
+        tab[0].addr = mphysaddr(&request->header);
+        tab[0].len = sizeof(request->header);
+        tab[0].flags.raw = 0;
+
+        size_t i;
+        for (i = 0; i < range_count; ++i) {
+            tab[i + 1].addr = phys_ranges[i].physaddr;
+            tab[i + 1].len = phys_ranges[i].size;
+            tab[i + 1].flags.raw = 0;
+            tab[i + 1].flags.bits.write =
+                    (request->op == virtio_blk_op_t::read);
+            tab[i].next = i + 1;
+            tab[i].flags.bits.next = true;
+        }
+
+        tab[i + 1].addr = mphysaddr(&request->status);
+        tab[i + 1].len = sizeof(request->status);
+        tab[i + 1].flags.raw = 0;
+        tab[i + 1].flags.bits.write = true;
+        tab[i].next = i + 1;
+        tab[i].flags.bits.next = true;
+
+        head->addr = mphysaddr(tab);
+        head->len = sizeof(*tab) * (range_count + 2);
+        head->flags.bits.indirect = true;
+
+        req_queue->enqueue_avail(&head, 1, &request->io_iocp, defer);
+
+        return 1;
+    }
+
     if (unlikely(desc_chain.size() < range_count + 2))
         desc_chain.resize(range_count + 2);
 
@@ -295,10 +395,8 @@ int virtio_blk_if_t::per_queue_t::io(request_t *request)
     desc_chain[i]->next = req_queue->index_of(desc_chain[i + 1]);
     desc_chain[i]->flags.bits.next = true;
 
-    request->io_iocp.reset(&virtio_blk_if_t::io_completion,
-                           uintptr_t(request));
     req_queue->enqueue_avail(desc_chain.data(), range_count + 2,
-                             &request->io_iocp);
+                             &request->io_iocp, defer);
 
     return 1;
 }
@@ -307,6 +405,12 @@ void virtio_blk_if_t::io_completion(
         uint64_t const& total_len, uintptr_t arg)
 {
     request_t *request = reinterpret_cast<request_t*>(arg);
+    request->caller_iocp->set_result(
+                request->status == VIRTIO_BLK_S_OK
+                ? errno_t::OK
+                : request->status == VIRTIO_BLK_S_UNSUPP
+                ? errno_t::ENOSYS
+                : errno_t::EIO);
     request->caller_iocp->invoke();
     delete request;
 }
@@ -319,6 +423,11 @@ bool virtio_blk_if_t::init(pci_dev_iterator_t const &pci_iter)
     blk_config = (blk_config_t*)device_cfg;
     log2_sectorsize = bit_log2(blk_config->blk_size);
 
+    // A discard limit below one block can't discard anything
+    if (has_discard && blk_config->max_discard_sectors &&
+            (blk_config->max_discard_sectors >> (log2_sectorsize - 9)) == 0)
+        has_discard = false;
+
     per_queue = new per_queue_t[queue_count];
 
     for (size_t i = 0; i < queue_count; ++i) {
@@ -332,12 +441,17 @@ bool virtio_blk_if_t::init(pci_dev_iterator_t const &pci_iter)
 bool virtio_blk_if_t::offer_features(virtio_base_t::feature_set_t &features)
 {
     virtio_base_t::feature_set_t support{
+        VIRTIO_F_VERSION_1_BIT,
+        VIRTIO_F_INDIRECT_DESC_BIT,
+        VIRTIO_F_RING_EVENT_IDX_BIT,
+        VIRTIO_BLK_F_MQ_BIT,
         VIRTIO_BLK_F_SIZE_MAX_BIT,
         VIRTIO_BLK_F_SEG_MAX_BIT,
         VIRTIO_BLK_F_GEOMETRY_BIT,
         VIRTIO_BLK_F_RO_BIT,
         VIRTIO_BLK_F_BLK_SIZE_BIT,
-        VIRTIO_BLK_F_TOPOLOGY_BIT
+        VIRTIO_BLK_F_TOPOLOGY_BIT,
+        VIRTIO_BLK_F_DISCARD_BIT
     };
 
     features &= support;
@@ -359,6 +473,21 @@ bool virtio_blk_if_t::verify_features(virtio_base_t::feature_set_t &features)
         printk("virtio-blk: supports %s\n", "BLK_SIZE");
     if (features[VIRTIO_BLK_F_TOPOLOGY_BIT])
         printk("virtio-blk: supports %s\n", "TOPOLOGY");
+    if (features[VIRTIO_BLK_F_DISCARD_BIT])
+        printk("virtio-blk: supports %s\n", "DISCARD");
+    if (features[VIRTIO_BLK_F_MQ_BIT])
+        printk("virtio-blk: supports %s\n", "MQ");
+    if (features[VIRTIO_F_INDIRECT_DESC_BIT])
+        printk("virtio-blk: supports %s\n", "INDIRECT_DESC");
+    if (features[VIRTIO_F_RING_EVENT_IDX_BIT])
+        printk("virtio-blk: supports %s\n", "RING_EVENT_IDX");
+
+    has_discard = features[VIRTIO_BLK_F_DISCARD_BIT];
+    has_indirect = features[VIRTIO_F_INDIRECT_DESC_BIT];
+
+    // Only the first queue works without multiqueue
+    if (!features[VIRTIO_BLK_F_MQ_BIT])
+        max_queue_count = 1;
 
     return true;
 }
@@ -374,7 +503,12 @@ void virtio_blk_if_t::irq_handler(int offset)
     if (offset == 0 || irq_range.count == 1)
         config_irq();
 
-    if (offset == 1 || irq_range.count == 1) {
+    if (irq_range.count == 1) {
+        // One vector for everything
+        for (size_t i = 0; i < queue_count; ++i)
+            per_queue[i].req_queue->recycle_used();
+    } else if (offset == 1) {
+        // Each queue's vector is routed to the CPU that submits on it
         int cpu_nr = thread_cpu_number();
         int queue_nr = cpu_nr % queue_count;
 
@@ -385,6 +519,27 @@ void virtio_blk_if_t::irq_handler(int offset)
     }
 }
 
+bool virtio_blk_if_t::poll()
+{
+    int cpu_nr = thread_cpu_number();
+    unsigned queue_nr = cpu_nr % queue_count;
+
+    return per_queue[queue_nr].req_queue->recycle_used(true);
+}
+
+void virtio_blk_if_t::plug()
+{
+    atomic_inc(&plugged);
+}
+
+void virtio_blk_if_t::unplug()
+{
+    if (atomic_dec(&plugged) == 0) {
+        for (size_t i = 0; i < queue_count; ++i)
+            per_queue[i].req_queue->kick();
+    }
+}
+
 errno_t virtio_blk_if_t::io(
         void *data, int64_t count, uint64_t lba,
         bool fua, virtio_blk_op_t op, iocp_t *iocp)
@@ -431,6 +586,36 @@ errno_t virtio_blk_if_t::flush_async(iocp_t *iocp)
 
 errno_t virtio_blk_if_t::trim_async(int64_t count, uint64_t lba, iocp_t *iocp)
 {
+    if (unlikely(!has_discard))
+        return errno_t::ENOSYS;
+
+    // Each request carries one segment, split at the device limit
+    uint8_t sector_shift = log2_sectorsize - 9;
+    int64_t max_count = blk_config->max_discard_sectors
+            ? blk_config->max_discard_sectors >> sector_shift
+            : std::numeric_limits<uint32_t>::max() >> sector_shift;
+
+    int expect = 0;
+
+    while (count > 0) {
+        int64_t chunk = std::min(count, max_count);
+
+        request_t *request = new request_t;
+        request->data = nullptr;
+        request->count = chunk;
+        request->header.lba = lba;
+        request->op = virtio_blk_op_t::trim;
+        request->fua = false;
+        request->caller_iocp = iocp;
+
+        expect += io(request);
+
+        lba += chunk;
+        count -= chunk;
+    }
+
+    iocp->set_expect(expect);
+
     return errno_t::OK;
 }
 
@@ -441,11 +626,20 @@ long virtio_blk_if_t::info(storage_dev_info_t key)
         return blk_config->blk_size;
 
     case STORAGE_INFO_HAVE_TRIM:
-        return 0;
+        return has_discard;
 
     case STORAGE_INFO_NAME:
         return long("virtio-blk");
 
+    case STORAGE_INFO_QUEUE_COUNT:
+        return queue_count;
+
+    case STORAGE_INFO_QUEUE_DEPTH:
+        // Each request takes one descriptor with an indirect table,
+        // otherwise at least a header, data and status descriptor
+        return (size_t(1) << queues[0].get_log2_queue_size()) /
+                (has_indirect ? 1 : 3);
+
     default:
         return 0;
     }
@@ -0,0 +1,1048 @@
+#include "virtio-net.h"
+#include "virtio-base.h"
+#include "dev_eth.h"
+#include "eth_rx.h"
+#include "eth_tx.h"
+#include "rss.h"
+#include "thread.h"
+#include "string.h"
+#include "printk.h"
+#include "cpu/atomic.h"
+
+#define DEBUG_VIRTIO_NET 0
+#if DEBUG_VIRTIO_NET
+#define VIRTIO_NET_TRACE(...) printdbg("virtio-net: " __VA_ARGS__)
+#else
+#define VIRTIO_NET_TRACE(...) ((void)0)
+#endif
+
+// Accept coalesced TCP segments from the host. They arrive as frag
+// chains of up to 64KB, only enable it when the protocols above
+// handle frag chains
+#define VIRTIO_NET_RX_GSO   0
+
+#define VIRTIO_DEVICE_NET           (0x1041)
+
+// Transitional device, network subsystem
+#define VIRTIO_DEVICE_NET_LEGACY    (0x1000)
+
+// Device handles packets with partial checksum.
+#define VIRTIO_NET_F_CSUM_BIT               (0)
+
+// Driver handles packets with partial checksum.
+#define VIRTIO_NET_F_GUEST_CSUM_BIT         (1)
+
+// Device maximum MTU reporting is supported.
+#define VIRTIO_NET_F_MTU_BIT                (3)
+
+// Device has given MAC address.
+#define VIRTIO_NET_F_MAC_BIT                (5)
+
+// Driver can receive TSOv4.
+#define VIRTIO_NET_F_GUEST_TSO4_BIT         (7)
+
+// Device can receive TSOv4.
+#define VIRTIO_NET_F_HOST_TSO4_BIT          (11)
+
+// Driver can merge receive buffers.
+#define VIRTIO_NET_F_MRG_RXBUF_BIT          (15)
+
+// Configuration status field is available.
+#define VIRTIO_NET_F_STATUS_BIT             (16)
+
+// Control channel is available.
+#define VIRTIO_NET_F_CTRL_VQ_BIT            (17)
+
+// Control channel RX mode support.
+#define VIRTIO_NET_F_CTRL_RX_BIT            (18)
+
+// Device supports multiqueue with automatic receive steering.
+#define VIRTIO_NET_F_MQ_BIT                 (22)
+
+// Set MAC address through control channel.
+#define VIRTIO_NET_F_CTRL_MAC_ADDR_BIT      (23)
+
+// Device supports RSS with a driver provided key and indirection table.
+#define VIRTIO_NET_F_RSS_BIT                (60)
+
+#define VIRTIO_NET_S_LINK_UP        1
+
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_F_DATA_VALID 2
+
+#define VIRTIO_NET_HDR_GSO_NONE     0
+#define VIRTIO_NET_HDR_GSO_TCPV4    1
+
+#define VIRTIO_NET_CTRL_RX                  0
+#define VIRTIO_NET_CTRL_RX_PROMISC          0
+
+#define VIRTIO_NET_CTRL_MAC                 1
+#define VIRTIO_NET_CTRL_MAC_ADDR_SET        1
+
+#define VIRTIO_NET_CTRL_MQ                  4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET     0
+#define VIRTIO_NET_CTRL_MQ_RSS_CONFIG       1
+
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv4       (1U<<0)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv4      (1U<<1)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv4      (1U<<2)
+
+#define VIRTIO_NET_OK   0
+#define VIRTIO_NET_ERR  1
+
+// Precedes every packet in both directions
+struct virtio_net_hdr_t {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t num_buffers;
+};
+
+C_ASSERT(sizeof(virtio_net_hdr_t) == 12);
+C_ASSERT(sizeof(virtio_net_hdr_t) <= ETHQ_HEADROOM);
+
+struct virtio_net_config_t {
+    uint8_t mac[6];
+    uint16_t status;
+    uint16_t max_virtqueue_pairs;
+    uint16_t mtu;
+    uint32_t speed;
+    uint8_t duplex;
+    uint8_t rss_max_key_size;
+    uint16_t rss_max_indirection_table_length;
+    uint32_t supported_hash_types;
+};
+
+C_ASSERT(offsetof(virtio_net_config_t, supported_hash_types) == 20);
+
+// Indirection table entries used at most
+#define VIRTIO_NET_RSS_TABLE_MAX    128
+
+class virtio_net_dev_t;
+
+class virtio_net_factory_t : public virtio_factory_base_t {
+public:
+    ~virtio_net_factory_t() {}
+    int detect();
+
+protected:
+    // virtio_factory_base_t interface
+    virtio_base_t *create() override final;
+    void found_device(virtio_base_t *device) override final;
+};
+
+static virtio_net_factory_t virtio_net_factory;
+
+static std::vector<eth_dev_base_t *> virtio_net_devs;
+
+struct virtio_net_eth_factory_t : public eth_dev_factory_t {
+    virtio_net_eth_factory_t() : eth_dev_factory_t("virtio-net") {}
+    virtual int detect(eth_dev_base_t ***result) override;
+};
+
+static virtio_net_eth_factory_t virtio_net_eth_factory;
+
+// Queue 2n receives and queue 2n+1 transmits for queue pair n. Each
+// pair has its interrupts routed to its own CPU, and the device
+// steers flows across the receive queues, by RSS hash if it can. Receive interrupts only
+// schedule a poll, see eth_rx.h, and stay disabled until the poll
+// drains the ring. Transmit queues are driven by the transmit layer,
+// see eth_tx.h. Their completions only interrupt while frames wait for
+// descriptors, otherwise descriptors are reclaimed when the transmit
+// layer runs short of them and on receive polls of the pair
+class virtio_net_dev_t final
+        : public virtio_base_t
+        , public eth_dev_base_t
+{
+public:
+    virtio_net_dev_t()
+        : net_config(nullptr)
+        , tx_queues(nullptr)
+        , ctrl_queue(nullptr)
+        , pair_count(0)
+        , rx_buf_size(0)
+        , offloads(0)
+        , promiscuous(0)
+        , ready(false)
+    {
+    }
+
+    ~virtio_net_dev_t()
+    {
+        if (tx_queues) {
+            for (size_t i = 0; i < pair_count; ++i)
+                tx_queues[i].~tx_queue_t();
+
+            munmap(tx_queues, sizeof(tx_queue_t) * pair_count);
+        }
+    }
+
+    ETH_DEV_IMPL
+
+    size_t send_batch(ethq_pkt_t **pkts, size_t count) override final;
+
+    unsigned get_offloads() override final;
+    size_t rx_queue_count() override final;
+
+private:
+    using virtio_iocp_t = virtio_virtqueue_t::virtio_iocp_t;
+    using desc_t = virtio_virtqueue_t::desc_t;
+
+    struct rx_queue_t;
+
+    struct rx_slot_t {
+        virtio_iocp_t iocp;
+        rx_queue_t *owner;
+        ethq_pkt_t *pkt;
+    };
+
+    struct tx_queue_t;
+
+    struct tx_slot_t {
+        virtio_iocp_t iocp;
+        tx_queue_t *owner;
+        ethq_pkt_t *pkt;
+        size_t bytes;
+    };
+
+    struct tx_queue_t : public eth_tx_queue_t {
+        bool init(virtio_net_dev_t *owner, virtio_virtqueue_t *queue);
+
+        size_t tx_post(ethq_pkt_t **pkts, size_t count) override final;
+        void tx_kick() override final;
+        size_t tx_reclaim() override final;
+        bool tx_wait() override final;
+
+        bool post(ethq_pkt_t *pkt);
+
+        void irq();
+
+        static void completion(uint64_t const& len, uintptr_t arg);
+
+        virtio_net_dev_t *owner;
+        virtio_virtqueue_t *queue;
+
+        // Indexed by the chain's first descriptor
+        std::unique_ptr<tx_slot_t[]> slots;
+
+        // Reclaim completed sends when fewer descriptors are free
+        size_t reclaim_threshold;
+
+        // Bytes completed since the last tx_reclaim
+        size_t completed_bytes;
+
+        // The completion interrupt was enabled by tx_wait
+        bool volatile irq_wanted;
+    };
+
+    struct rx_queue_t : public eth_rx_queue_t {
+        bool init(virtio_net_dev_t *owner, virtio_virtqueue_t *queue,
+                  tx_queue_t *tx);
+
+        int rx_poll(int budget) override final;
+        void rx_irq_unmask() override final;
+
+        void irq();
+        void refill();
+
+        ethq_pkt_t *assemble(ethq_pkt_t *pkt);
+
+        static void completion(uint64_t const& len, uintptr_t arg);
+
+        virtio_net_dev_t *owner;
+        virtio_virtqueue_t *queue;
+        tx_queue_t *tx;
+
+        // Indexed by descriptor
+        std::unique_ptr<rx_slot_t[]> slots;
+
+        // Filled buffers in used ring order, only
+        // touched by the poll, which never runs twice
+        ethq_queue_t filled;
+    };
+
+    // virtio_base_t interface
+    bool init(pci_dev_iterator_t const &pci_iter) override final;
+    bool offer_features(feature_set_t &features) override final;
+    bool verify_features(feature_set_t &features) override final;
+    int queue_cpu(size_t queue_idx) override final;
+    void irq_handler(int offset) override final;
+
+    void config_irq();
+
+    bool ctrl_cmd(uint8_t cls, uint8_t cmd, void const *data, size_t size);
+
+    bool rss_config();
+
+    virtio_net_config_t volatile *net_config;
+
+    std::unique_ptr<rx_queue_t[]> rx_queues;
+    // Page allocated, new doesn't honor its cache line alignment
+    tx_queue_t *tx_queues;
+
+    virtio_virtqueue_t *ctrl_queue;
+    std::mutex ctrl_lock;
+
+    size_t pair_count;
+    size_t rx_buf_size;
+
+    unsigned offloads;
+    int promiscuous;
+
+    bool volatile ready;
+
+    uint8_t mac_addr[6];
+};
+
+//
+// Detection
+
+int virtio_net_factory_t::detect()
+{
+    detect_virtio(PCI_DEV_CLASS_NETWORK, VIRTIO_DEVICE_NET, "virtio-net");
+    detect_virtio(PCI_DEV_CLASS_NETWORK, VIRTIO_DEVICE_NET_LEGACY,
+                  "virtio-net");
+    return 0;
+}
+
+virtio_base_t *virtio_net_factory_t::create()
+{
+    return new virtio_net_dev_t;
+}
+
+void virtio_net_factory_t::found_device(virtio_base_t *device)
+{
+    if (!virtio_net_devs.push_back(static_cast<virtio_net_dev_t*>(device)))
+        panic_oom();
+}
+
+int virtio_net_eth_factory_t::detect(eth_dev_base_t ***result)
+{
+    // Make sure we have an ethernet packet pool
+    if (!ethq_init())
+        panic_oom();
+
+    virtio_net_factory.detect();
+
+    *result = virtio_net_devs.data();
+
+    return virtio_net_devs.size();
+}
+
+//
+// Initialization
+
+bool virtio_net_dev_t::offer_features(feature_set_t &features)
+{
+    feature_set_t support{
+        VIRTIO_F_VERSION_1_BIT,
+        VIRTIO_F_RING_EVENT_IDX_BIT,
+        VIRTIO_NET_F_CSUM_BIT,
+        VIRTIO_NET_F_GUEST_CSUM_BIT,
+        VIRTIO_NET_F_MTU_BIT,
+        VIRTIO_NET_F_MAC_BIT,
+        VIRTIO_NET_F_HOST_TSO4_BIT,
+        VIRTIO_NET_F_STATUS_BIT,
+        VIRTIO_NET_F_CTRL_VQ_BIT,
+        VIRTIO_NET_F_CTRL_RX_BIT,
+        VIRTIO_NET_F_MQ_BIT,
+        VIRTIO_NET_F_CTRL_MAC_ADDR_BIT,
+        VIRTIO_NET_F_RSS_BIT
+    };
+
+    // Coalesced segments don't fit in one buffer,
+    // they are only accepted into merged buffers
+    if (VIRTIO_NET_RX_GSO && features[VIRTIO_NET_F_MRG_RXBUF_BIT]) {
+        support[VIRTIO_NET_F_MRG_RXBUF_BIT] = true;
+        support[VIRTIO_NET_F_GUEST_TSO4_BIT] = true;
+    }
+
+    features &= support;
+
+    // Segmentation offloads depend on checksum offload
+    if (!features[VIRTIO_NET_F_CSUM_BIT])
+        features[VIRTIO_NET_F_HOST_TSO4_BIT] = false;
+    if (!features[VIRTIO_NET_F_GUEST_CSUM_BIT])
+        features[VIRTIO_NET_F_GUEST_TSO4_BIT] = false;
+
+    // Everything on the control queue depends on it
+    if (!features[VIRTIO_NET_F_CTRL_VQ_BIT]) {
+        features[VIRTIO_NET_F_CTRL_RX_BIT] = false;
+        features[VIRTIO_NET_F_MQ_BIT] = false;
+        features[VIRTIO_NET_F_CTRL_MAC_ADDR_BIT] = false;
+        features[VIRTIO_NET_F_RSS_BIT] = false;
+    }
+
+    return true;
+}
+
+bool virtio_net_dev_t::verify_features(feature_set_t &features)
+{
+    if (!features[VIRTIO_F_VERSION_1_BIT])
+        return false;
+
+    if (features[VIRTIO_NET_F_CSUM_BIT])
+        printk("virtio-net: supports %s\n", "CSUM");
+    if (features[VIRTIO_NET_F_GUEST_CSUM_BIT])
+        printk("virtio-net: supports %s\n", "GUEST_CSUM");
+    if (features[VIRTIO_NET_F_HOST_TSO4_BIT])
+        printk("virtio-net: supports %s\n", "HOST_TSO4");
+    if (features[VIRTIO_NET_F_GUEST_TSO4_BIT])
+        printk("virtio-net: supports %s\n", "GUEST_TSO4");
+    if (features[VIRTIO_NET_F_MRG_RXBUF_BIT])
+        printk("virtio-net: supports %s\n", "MRG_RXBUF");
+    if (features[VIRTIO_NET_F_CTRL_VQ_BIT])
+        printk("virtio-net: supports %s\n", "CTRL_VQ");
+    if (features[VIRTIO_NET_F_MQ_BIT])
+        printk("virtio-net: supports %s\n", "MQ");
+    if (features[VIRTIO_NET_F_RSS_BIT])
+        printk("virtio-net: supports %s\n", "RSS");
+    if (features[VIRTIO_F_RING_EVENT_IDX_BIT])
+        printk("virtio-net: supports %s\n", "RING_EVENT_IDX");
+
+    if (features[VIRTIO_NET_F_CSUM_BIT])
+        offloads |= ETH_DEV_OFFLOAD_TX_CSUM;
+    if (features[VIRTIO_NET_F_HOST_TSO4_BIT])
+        offloads |= ETH_DEV_OFFLOAD_TSO4;
+    if (features[VIRTIO_NET_F_GUEST_CSUM_BIT])
+        offloads |= ETH_DEV_OFFLOAD_RX_CSUM;
+
+    // The header is always there, the frame may continue
+    // into more buffers when they are merged
+    rx_buf_size = features[VIRTIO_NET_F_MRG_RXBUF_BIT]
+            ? ethq_pkt_capacity
+            : sizeof(virtio_net_hdr_t) + ethq_pkt_capacity;
+
+    return true;
+}
+
+int virtio_net_dev_t::queue_cpu(size_t queue_idx)
+{
+    // Each queue pair interrupts its own CPU
+    return int((queue_idx >> 1) % thread_get_cpu_count());
+}
+
+bool virtio_net_dev_t::init(pci_dev_iterator_t const &pci_iter)
+{
+    if (!virtio_init(pci_iter, "virtio-net"))
+        return false;
+
+    net_config = (virtio_net_config_t*)device_cfg;
+
+    // The control queue is the last one
+    size_t data_queues = queue_count;
+    if (features[VIRTIO_NET_F_CTRL_VQ_BIT] && queue_count > 2) {
+        ctrl_queue = &queues[queue_count - 1];
+        --data_queues;
+    }
+
+    pair_count = std::min(data_queues >> 1, thread_get_cpu_count());
+
+    if (unlikely(!pair_count))
+        return false;
+
+    rx_queues.reset(new rx_queue_t[pair_count]);
+
+    if (unlikely(!rx_queues))
+        return false;
+
+    void *tx_mem = mmap(nullptr, sizeof(tx_queue_t) * pair_count,
+                        PROT_READ | PROT_WRITE, MAP_POPULATE, -1, 0);
+
+    if (unlikely(tx_mem == MAP_FAILED))
+        return false;
+
+    tx_queues = (tx_queue_t*)tx_mem;
+
+    for (size_t i = 0; i < pair_count; ++i)
+        new (tx_queues + i) tx_queue_t();
+
+    for (size_t i = 0; i < pair_count; ++i) {
+        if (!tx_queues[i].init(this, &queues[i * 2 + 1]))
+            return false;
+
+        if (!rx_queues[i].init(this, &queues[i * 2], &tx_queues[i]))
+            return false;
+    }
+
+    if (features[VIRTIO_NET_F_MAC_BIT]) {
+        for (size_t i = 0; i < sizeof(mac_addr); ++i)
+            mac_addr[i] = net_config->mac[i];
+    } else {
+        // Locally administered, unique per device
+        static uint8_t serial;
+        uint8_t const local_mac[] = { 0x02, 0, 0, 0, 0, ++serial };
+        memcpy(mac_addr, local_mac, sizeof(mac_addr));
+    }
+
+    atomic_st_rel(&ready, true);
+
+    // The first poll fills the ring, only
+    // the poll ever touches it after that
+    for (size_t i = 0; i < pair_count; ++i)
+        rx_queues[i].irq();
+
+    // Steering across more than the first pair has to be enabled,
+    // by hash when the device takes our key and table
+    if (features[VIRTIO_NET_F_RSS_BIT] && pair_count > 1 && rss_config()) {
+        printk("virtio-net: RSS across %zu queues\n", pair_count);
+    } else if (features[VIRTIO_NET_F_MQ_BIT] && pair_count > 1) {
+        uint16_t pairs = pair_count;
+        if (!ctrl_cmd(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                      &pairs, sizeof(pairs))) {
+            printk("virtio-net: multiqueue setup failed\n");
+            pair_count = 1;
+        }
+    }
+
+    printk("virtio-net: %02x:%02x:%02x:%02x:%02x:%02x"
+           ", %zu queue pairs, offloads=%#x\n",
+           mac_addr[0], mac_addr[1], mac_addr[2],
+           mac_addr[3], mac_addr[4], mac_addr[5],
+           pair_count, offloads);
+
+    return true;
+}
+
+bool virtio_net_dev_t::tx_queue_t::init(
+        virtio_net_dev_t *owner, virtio_virtqueue_t *queue)
+{
+    this->owner = owner;
+    this->queue = queue;
+    completed_bytes = 0;
+    irq_wanted = false;
+
+    size_t queue_size = size_t(1) << queue->get_log2_queue_size();
+
+    reclaim_threshold = queue_size >> 2;
+
+    slots.reset(new tx_slot_t[queue_size]);
+    if (unlikely(!slots))
+        return false;
+
+    for (size_t i = 0; i < queue_size; ++i) {
+        slots[i].owner = this;
+        slots[i].pkt = nullptr;
+    }
+
+    queue->disable_irq();
+
+    return true;
+}
+
+bool virtio_net_dev_t::rx_queue_t::init(
+        virtio_net_dev_t *owner, virtio_virtqueue_t *queue, tx_queue_t *tx)
+{
+    this->owner = owner;
+    this->queue = queue;
+    this->tx = tx;
+    filled.head = nullptr;
+    filled.tail = nullptr;
+    filled.count = 0;
+
+    size_t queue_size = size_t(1) << queue->get_log2_queue_size();
+
+    slots.reset(new rx_slot_t[queue_size]);
+    if (unlikely(!slots))
+        return false;
+
+    for (size_t i = 0; i < queue_size; ++i) {
+        slots[i].owner = this;
+        slots[i].pkt = nullptr;
+    }
+
+    return true;
+}
+
+//
+// Control queue
+
+bool virtio_net_dev_t::ctrl_cmd(uint8_t cls, uint8_t cmd,
+                                void const *data, size_t size)
+{
+    if (unlikely(!ctrl_queue))
+        return false;
+
+    // Class and command, followed by the data
+    std::unique_ptr<uint8_t[]> req(new uint8_t[2 + size]);
+
+    if (unlikely(!req))
+        return false;
+
+    req[0] = cls;
+    req[1] = cmd;
+    memcpy(req.get() + 2, data, size);
+
+    uint8_t ack = VIRTIO_NET_ERR;
+
+    std::unique_lock<std::mutex> hold(ctrl_lock);
+
+    blocking_iocp_t iocp;
+    ctrl_queue->sendrecv(req.get(), 2 + size, &ack, sizeof(ack), &iocp);
+    iocp.wait();
+
+    return ack == VIRTIO_NET_OK;
+}
+
+// Spread flows across the receive queues by the Toeplitz hash with
+// rss_key. Indirection table entry n picks receive queue n % pairs,
+// whose MSI-X vector was routed to its CPU, see queue_cpu
+bool virtio_net_dev_t::rss_config()
+{
+    uint32_t hash_types = net_config->supported_hash_types &
+            (VIRTIO_NET_RSS_HASH_TYPE_IPv4 |
+             VIRTIO_NET_RSS_HASH_TYPE_TCPv4 |
+             VIRTIO_NET_RSS_HASH_TYPE_UDPv4);
+
+    size_t key_size = std::min(size_t(net_config->rss_max_key_size),
+                               rss_key_size);
+
+    // A power of two, the mask selects the entry
+    size_t table_size = std::min(
+                size_t(net_config->rss_max_indirection_table_length),
+                size_t(VIRTIO_NET_RSS_TABLE_MAX));
+    while (table_size & (table_size - 1))
+        table_size &= table_size - 1;
+
+    if (unlikely(!hash_types || !key_size || table_size < pair_count))
+        return false;
+
+    uint16_t table[VIRTIO_NET_RSS_TABLE_MAX];
+    rss_indir_fill(table, table_size, pair_count);
+
+    // hash_types, indirection_table_mask, unclassified_queue,
+    // indirection_table, max_tx_vq, hash_key_length, hash_key_data
+    size_t size = sizeof(uint32_t) + sizeof(uint16_t) * 2 +
+            sizeof(uint16_t) * table_size +
+            sizeof(uint16_t) + sizeof(uint8_t) + key_size;
+
+    std::unique_ptr<uint8_t[]> config(new uint8_t[size]);
+
+    if (unlikely(!config))
+        return false;
+
+    uint8_t *out = config.get();
+
+    uint16_t table_mask = uint16_t(table_size - 1);
+    uint16_t unclassified_queue = 0;
+    uint16_t max_tx_vq = uint16_t(pair_count);
+    uint8_t key_length = uint8_t(key_size);
+
+    memcpy(out, &hash_types, sizeof(hash_types));
+    out += sizeof(hash_types);
+    memcpy(out, &table_mask, sizeof(table_mask));
+    out += sizeof(table_mask);
+    memcpy(out, &unclassified_queue, sizeof(unclassified_queue));
+    out += sizeof(unclassified_queue);
+    memcpy(out, table, sizeof(*table) * table_size);
+    out += sizeof(*table) * table_size;
+    memcpy(out, &max_tx_vq, sizeof(max_tx_vq));
+    out += sizeof(max_tx_vq);
+    *out++ = key_length;
+    memcpy(out, rss_key, key_size);
+
+    return ctrl_cmd(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG,
+                    config.get(), size);
+}
+
+//
+// Interrupts
+
+void virtio_net_dev_t::config_irq()
+{
+    if (features[VIRTIO_NET_F_STATUS_BIT]) {
+        printk("virtio-net: link %s\n",
+               (net_config->status & VIRTIO_NET_S_LINK_UP) ? "up" : "down");
+    }
+}
+
+void virtio_net_dev_t::irq_handler(int offset)
+{
+    if (unlikely(!atomic_ld_acq(&ready)))
+        return;
+
+    if (irq_range.count == 1) {
+        // One vector for everything
+        config_irq();
+
+        for (size_t i = 0; i < pair_count; ++i) {
+            rx_queues[i].irq();
+            tx_queues[i].irq();
+        }
+
+        if (ctrl_queue)
+            ctrl_queue->recycle_used();
+
+        return;
+    }
+
+    if (offset == 0) {
+        config_irq();
+        return;
+    }
+
+    size_t queue_idx = offset - 1;
+
+    VIRTIO_NET_TRACE("IRQ offset=%d, cpu=%d\n",
+                     offset, thread_cpu_number());
+
+    if (ctrl_queue && &queues[queue_idx] == ctrl_queue)
+        ctrl_queue->recycle_used();
+    else if ((queue_idx & 1) && (queue_idx >> 1) < pair_count)
+        tx_queues[queue_idx >> 1].irq();
+    else if ((queue_idx >> 1) < pair_count)
+        rx_queues[queue_idx >> 1].irq();
+}
+
+//
+// Receive
+
+void virtio_net_dev_t::rx_queue_t::irq()
+{
+    // Stays disabled until the poll drains the ring
+    queue->disable_irq();
+    eth_rx_schedule(this);
+}
+
+void virtio_net_dev_t::rx_queue_t::completion(
+        uint64_t const& len, uintptr_t arg)
+{
+    rx_slot_t *slot = (rx_slot_t*)arg;
+    ethq_pkt_t *pkt = slot->pkt;
+    slot->pkt = nullptr;
+
+    // Bytes written, including the header
+    pkt->size = len;
+
+    ethq_enqueue(&slot->owner->filled, pkt);
+}
+
+void virtio_net_dev_t::rx_queue_t::refill()
+{
+    size_t posted = 0;
+
+    while (queue->get_free_count()) {
+        ethq_pkt_t *pkt = ethq_pkt_acquire();
+
+        if (unlikely(!pkt))
+            break;
+
+        desc_t *desc;
+        if (unlikely(!queue->try_alloc_multiple(&desc, 1))) {
+            ethq_pkt_release(pkt);
+            break;
+        }
+
+        // The header goes into the headroom
+        desc->addr = ethq_pkt_prepend_physaddr(
+                    pkt, sizeof(virtio_net_hdr_t));
+        desc->len = owner->rx_buf_size;
+        desc->flags.bits.write = true;
+
+        rx_slot_t& slot = slots[queue->index_of(desc)];
+        slot.pkt = pkt;
+        slot.iocp.reset(&rx_queue_t::completion, uintptr_t(&slot));
+
+        queue->enqueue_avail(&desc, 1, &slot.iocp, true);
+
+        ++posted;
+    }
+
+    if (posted)
+        queue->kick();
+}
+
+// Turn the first buffer of a received frame into a packet,
+// taking any merged buffers that follow it from filled
+ethq_pkt_t *virtio_net_dev_t::rx_queue_t::assemble(ethq_pkt_t *pkt)
+{
+    virtio_net_hdr_t const *hdr = (virtio_net_hdr_t const *)
+            ethq_pkt_prepend(pkt, sizeof(*hdr));
+
+    if (unlikely(pkt->size < sizeof(*hdr))) {
+        ethq_pkt_release(pkt);
+        return nullptr;
+    }
+
+    size_t num_buffers = owner->features[VIRTIO_NET_F_MRG_RXBUF_BIT]
+            ? hdr->num_buffers
+            : 1;
+
+    pkt->size -= sizeof(*hdr);
+    pkt->nic = owner;
+
+    if (hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID)
+        pkt->offload |= ETHQ_OFFLOAD_CSUM_OK;
+
+    if (hdr->gso_type == VIRTIO_NET_HDR_GSO_TCPV4) {
+        pkt->offload |= ETHQ_OFFLOAD_TSO4;
+        pkt->gso_size = hdr->gso_size;
+    }
+
+    ethq_pkt_t **link = &pkt->frag;
+    ethq_pkt_t *last = pkt;
+
+    while (num_buffers-- > 1) {
+        ethq_pkt_t *frag = ethq_dequeue(&filled);
+
+        if (unlikely(!frag))
+            break;
+
+        // Continuation buffers were posted at the header
+        // position too, the data starts there
+        char const *data = (char const *)
+                ethq_pkt_prepend(frag, sizeof(*hdr));
+
+        if (last->size + frag->size <= ethq_pkt_capacity) {
+            // Short tail, the last few bytes of a full size frame
+            memcpy((char*)&last->pkt + last->size, data, frag->size);
+            last->size += frag->size;
+            ethq_pkt_release(frag);
+            continue;
+        }
+
+        memmove(&frag->pkt, data, frag->size);
+        *link = frag;
+        link = &frag->frag;
+        last = frag;
+    }
+
+    return pkt;
+}
+
+int virtio_net_dev_t::rx_queue_t::rx_poll(int budget)
+{
+    // Transmit completions don't interrupt
+    if (tx->queue->get_free_count() < tx->reclaim_threshold)
+        eth_tx_complete(tx);
+
+    queue->recycle_used();
+
+    ethq_pkt_t *first = nullptr;
+    ethq_pkt_t **link = &first;
+
+    int done;
+    for (done = 0; done < budget && filled.count; ++done) {
+        ethq_pkt_t *pkt = assemble(ethq_dequeue(&filled));
+
+        if (unlikely(!pkt))
+            continue;
+
+        *link = pkt;
+        link = &pkt->next;
+    }
+
+    VIRTIO_NET_TRACE("rx poll %d frames, cpu=%d\n",
+                     done, thread_cpu_number());
+
+    // Replace the buffers before the protocols get to run
+    refill();
+
+    eth_rx_deliver(first);
+
+    return done;
+}
+
+void virtio_net_dev_t::rx_queue_t::rx_irq_unmask()
+{
+    if (filled.count || queue->enable_irq()) {
+        // Arrived while disabled, they won't interrupt
+        queue->disable_irq();
+        eth_rx_schedule(this);
+    }
+}
+
+//
+// Transmit
+
+void virtio_net_dev_t::tx_queue_t::completion(
+        uint64_t const& len, uintptr_t arg)
+{
+    tx_slot_t *slot = (tx_slot_t*)arg;
+    ethq_pkt_t *pkt = slot->pkt;
+    slot->pkt = nullptr;
+
+    // Only the transmit layer reaps, from tx_reclaim
+    slot->owner->completed_bytes += slot->bytes;
+
+    if (pkt->callback)
+        pkt->callback(pkt, 0, pkt->callback_arg);
+
+    ethq_pkt_release(pkt);
+}
+
+size_t virtio_net_dev_t::tx_queue_t::tx_post(ethq_pkt_t **pkts, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count && post(pkts[i]); ++i);
+    return i;
+}
+
+void virtio_net_dev_t::tx_queue_t::tx_kick()
+{
+    queue->kick();
+}
+
+size_t virtio_net_dev_t::tx_queue_t::tx_reclaim()
+{
+    queue->recycle_used(true);
+
+    size_t bytes = completed_bytes;
+    completed_bytes = 0;
+    return bytes;
+}
+
+bool virtio_net_dev_t::tx_queue_t::tx_wait()
+{
+    atomic_st_rel(&irq_wanted, true);
+
+    if (!queue->enable_irq())
+        return false;
+
+    // Completed while disabled, they won't interrupt
+    atomic_st_rel(&irq_wanted, false);
+    queue->disable_irq();
+    return true;
+}
+
+void virtio_net_dev_t::tx_queue_t::irq()
+{
+    if (!atomic_xchg(&irq_wanted, false))
+        return;
+
+    queue->disable_irq();
+
+    eth_tx_complete(this);
+}
+
+// Returns false if the ring is out of descriptors
+bool virtio_net_dev_t::tx_queue_t::post(ethq_pkt_t *pkt)
+{
+    // Enough for a 64KB segmentation offload chain
+    desc_t *descs[64];
+
+    size_t bytes = ethq_pkt_total_size(pkt);
+
+    size_t count = 0;
+    for (ethq_pkt_t *frag = pkt; frag; frag = frag->frag)
+        ++count;
+
+    if (unlikely(count > countof(descs))) {
+        // Can never fit, drop it, it counts as completed
+        VIRTIO_NET_TRACE("dropped %zu fragment frame\n", count);
+        completed_bytes += bytes;
+        if (pkt->callback)
+            pkt->callback(pkt, 1, pkt->callback_arg);
+        ethq_pkt_release(pkt);
+        return true;
+    }
+
+    if (!queue->try_alloc_multiple(descs, count))
+        return false;
+
+    virtio_net_hdr_t *hdr = (virtio_net_hdr_t*)
+            ethq_pkt_prepend(pkt, sizeof(*hdr));
+
+    memset(hdr, 0, sizeof(*hdr));
+
+    if ((pkt->offload & ETHQ_OFFLOAD_CSUM) &&
+            (owner->offloads & ETH_DEV_OFFLOAD_TX_CSUM)) {
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = pkt->csum_start;
+        hdr->csum_offset = pkt->csum_offset;
+    }
+
+    if ((pkt->offload & ETHQ_OFFLOAD_TSO4) &&
+            (owner->offloads & ETH_DEV_OFFLOAD_TSO4)) {
+        // Headers end after the TCP header, which starts at csum_start
+        uint8_t tcp_hdr_len = (((uint8_t const *)&pkt->pkt)
+                               [pkt->csum_start + 12] >> 4) << 2;
+
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr->gso_size = pkt->gso_size;
+        hdr->hdr_len = pkt->csum_start + tcp_hdr_len;
+    }
+
+    descs[0]->addr = ethq_pkt_prepend_physaddr(pkt, sizeof(*hdr));
+    descs[0]->len = sizeof(*hdr) + pkt->size;
+
+    size_t i = 1;
+    for (ethq_pkt_t *frag = pkt->frag; frag; frag = frag->frag, ++i) {
+        descs[i]->addr = frag->physaddr;
+        descs[i]->len = frag->size;
+        descs[i - 1]->next = queue->index_of(descs[i]);
+        descs[i - 1]->flags.bits.next = true;
+    }
+
+    tx_slot_t& slot = slots[queue->index_of(descs[0])];
+    slot.pkt = pkt;
+    slot.bytes = bytes;
+    slot.iocp.reset(&tx_queue_t::completion, uintptr_t(&slot));
+
+    // tx_kick notifies once for the whole batch
+    queue->enqueue_avail(descs, count, &slot.iocp, true);
+
+    return true;
+}
+
+//
+// eth_dev_base_t interface
+
+int virtio_net_dev_t::send(ethq_pkt_t *pkt)
+{
+    size_t pair = thread_cpu_number() % pair_count;
+
+    return eth_tx_send(&tx_queues[pair], pkt);
+}
+
+size_t virtio_net_dev_t::send_batch(ethq_pkt_t **pkts, size_t count)
+{
+    size_t pair = thread_cpu_number() % pair_count;
+
+    return eth_tx_send_batch(&tx_queues[pair], pkts, count);
+}
+
+void virtio_net_dev_t::get_mac(void *mac)
+{
+    memcpy(mac, mac_addr, sizeof(mac_addr));
+}
+
+void virtio_net_dev_t::set_mac(void const *mac)
+{
+    if (features[VIRTIO_NET_F_CTRL_MAC_ADDR_BIT] &&
+            !ctrl_cmd(VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_ADDR_SET,
+                      mac, sizeof(mac_addr)))
+        return;
+
+    memcpy(mac_addr, mac, sizeof(mac_addr));
+}
+
+int virtio_net_dev_t::get_promiscuous()
+{
+    return promiscuous;
+}
+
+void virtio_net_dev_t::set_promiscuous(int promiscuous)
+{
+    uint8_t on = promiscuous != 0;
+
+    if (!features[VIRTIO_NET_F_CTRL_RX_BIT] ||
+            !ctrl_cmd(VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC,
+                      &on, sizeof(on)))
+        return;
+
+    this->promiscuous = on;
+}
+
+unsigned virtio_net_dev_t::get_offloads()
+{
+    return offloads;
+}
+
+size_t virtio_net_dev_t::rx_queue_count()
+{
+    return pair_count;
+}
@@ -1,4 +1,9 @@
+#include "devfs.h"
 #include "dev_storage.h"
+#include "dirent.h"
+#include "mutex.h"
+#include "string.h"
+#include "stdlib.h"
 
 struct dev_fs_t final : public fs_base_t {
     FS_BASE_RW_IMPL
@@ -9,31 +14,109 @@ struct dev_fs_t final : public fs_base_t {
             DIR
         };
 
-        file_handle_t(type_t type)
+        file_handle_t(type_t type, ino_t ino)
             : type(type)
+            , ino(ino)
         {
         }
 
+        ino_t get_inode() const override final
+        {
+            return ino;
+        }
+
         type_t type;
+        ino_t ino;
     };
 
+    // Holds the snapshot taken when the file was opened
     struct node_handle_t : public file_handle_t {
-        node_handle_t()
-            : file_handle_t(NODE)
+        node_handle_t(ino_t ino, devfs_ioctl_fn_t ioctl)
+            : file_handle_t(NODE, ino)
+            , data(nullptr)
+            , size(0)
+            , ioctl(ioctl)
+        {
+        }
+
+        ~node_handle_t()
         {
+            free(data);
         }
+
+        char *data;
+        size_t size;
+        devfs_ioctl_fn_t ioctl;
     };
 
     struct dir_handle_t : public file_handle_t {
         dir_handle_t()
-            : file_handle_t(DIR)
+            : file_handle_t(DIR, 1)
         {
         }
     };
+
+    struct node_t {
+        char const *name;
+        devfs_snapshot_fn_t snapshot;
+        devfs_ioctl_fn_t ioctl;
+    };
+
+    using lock_type = std::mcslock;
+    using scoped_lock = std::unique_lock<lock_type>;
+
+    // Returns the name of the node under /dev, an empty string for /dev
+    // itself, or null if the path is not under /dev
+    static char const *node_name(fs_cpath_t path);
+
+    // Inode numbers are the node index plus 2, 1 is the directory
+    int lookup(char const *name, node_t *node);
+
+    lock_type nodes_lock;
+    std::vector<node_t> nodes;
 };
 
 static dev_fs_t dev_fs;
 
+bool devfs_add_snapshot(char const *name, devfs_snapshot_fn_t fn,
+                        devfs_ioctl_fn_t ioctl)
+{
+    dev_fs_t::scoped_lock hold(dev_fs.nodes_lock);
+    return dev_fs.nodes.push_back(dev_fs_t::node_t{ name, fn, ioctl });
+}
+
+fs_base_t *devfs_get()
+{
+    return &dev_fs;
+}
+
+char const *dev_fs_t::node_name(fs_cpath_t path)
+{
+    if (strncmp(path, "/dev", 4) || (path[4] && path[4] != '/'))
+        return nullptr;
+
+    path += 4;
+
+    while (*path == '/')
+        ++path;
+
+    return path;
+}
+
+int dev_fs_t::lookup(char const *name, node_t *node)
+{
+    scoped_lock hold(nodes_lock);
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (!strcmp(nodes[i].name, name)) {
+            *node = nodes[i];
+            return int(i + 2);
+        }
+    }
+
+    return -int(errno_t::ENOENT);
+}
+
 void dev_fs_t::unmount()
 {
 
@@ -46,22 +129,83 @@ bool dev_fs_t::is_boot() const
 
 int dev_fs_t::opendir(fs_file_info_t **fi, fs_cpath_t path)
 {
-    return -int(errno_t::ENOENT);
+    char const *name = node_name(path);
+
+    if (!name)
+        return -int(errno_t::ENOENT);
+
+    if (*name) {
+        node_t node;
+        int ino = lookup(name, &node);
+        return ino < 0 ? ino : -int(errno_t::ENOTDIR);
+    }
+
+    dir_handle_t *dir = new dir_handle_t();
+
+    if (unlikely(!dir))
+        return -int(errno_t::ENOMEM);
+
+    *fi = dir;
+
+    return 0;
 }
 
+// Each entry advances the position by one
 ssize_t dev_fs_t::readdir(fs_file_info_t *fi, dirent_t* buf, off_t offset)
 {
-    return -int(errno_t::ENOSYS);
+    file_handle_t *file = (file_handle_t*)fi;
+
+    if (unlikely(file->type != file_handle_t::DIR))
+        return -int(errno_t::ENOTDIR);
+
+    scoped_lock hold(nodes_lock);
+
+    if (offset < 0 || size_t(offset) >= nodes.size()) {
+        memset(buf, 0, sizeof(*buf));
+        return 0;
+    }
+
+    buf->d_ino = offset + 2;
+    strncpy(buf->d_name, nodes[offset].name, sizeof(buf->d_name) - 1);
+    buf->d_name[sizeof(buf->d_name) - 1] = 0;
+
+    return 1;
 }
 
 int dev_fs_t::releasedir(fs_file_info_t *fi)
 {
-    return -int(errno_t::ENOSYS);
+    delete (dir_handle_t*)fi;
+    return 0;
 }
 
 int dev_fs_t::getattr(fs_cpath_t path, fs_stat_t* stbuf)
 {
-    return -int(errno_t::ENOSYS);
+    char const *name = node_name(path);
+
+    if (!name)
+        return -int(errno_t::ENOENT);
+
+    memset(stbuf, 0, sizeof(*stbuf));
+
+    if (!*name) {
+        stbuf->st_ino = 1;
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+        return 0;
+    }
+
+    node_t node;
+    int ino = lookup(name, &node);
+
+    if (ino < 0)
+        return ino;
+
+    stbuf->st_ino = ino;
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = node.snapshot(nullptr, 0);
+
+    return 0;
 }
 
 int dev_fs_t::access(fs_cpath_t path, int mask)
@@ -133,12 +277,49 @@ int dev_fs_t::utimens(fs_cpath_t path, fs_timespec_t const *ts)
 int dev_fs_t::open(fs_file_info_t **fi, fs_cpath_t path,
                    int flags, mode_t mode)
 {
-    return -int(errno_t::ENOSYS);
+    char const *name = node_name(path);
+
+    if (!name || !*name)
+        return -int(errno_t::ENOENT);
+
+    node_t node;
+    int ino = lookup(name, &node);
+
+    if (ino < 0)
+        return ino;
+
+    if ((flags & O_WRONLY) || (flags & (O_CREAT | O_TRUNC)))
+        return -int(errno_t::EROFS);
+
+    std::unique_ptr<node_handle_t> file(new node_handle_t(ino, node.ioctl));
+
+    if (unlikely(!file))
+        return -int(errno_t::ENOMEM);
+
+    // The text may grow between sizing it and generating it
+    for (size_t size = node.snapshot(nullptr, 0) + 1; ; ) {
+        file->data = (char*)realloc(file->data, size);
+
+        if (unlikely(!file->data))
+            return -int(errno_t::ENOMEM);
+
+        file->size = node.snapshot(file->data, size);
+
+        if (file->size < size)
+            break;
+
+        size = file->size + 1;
+    }
+
+    *fi = file.release();
+
+    return 0;
 }
 
 int dev_fs_t::release(fs_file_info_t *fi)
 {
-    return -int(errno_t::ENOSYS);
+    delete (node_handle_t*)fi;
+    return 0;
 }
 
 ssize_t dev_fs_t::read(fs_file_info_t *fi,
@@ -146,13 +327,30 @@ ssize_t dev_fs_t::read(fs_file_info_t *fi,
         size_t size,
         off_t offset)
 {
-    return -int(errno_t::ENOSYS);
+    file_handle_t *file = (file_handle_t*)fi;
+
+    if (unlikely(file->type != file_handle_t::NODE))
+        return -int(errno_t::EISDIR);
+
+    node_handle_t *node = (node_handle_t*)file;
+
+    if (offset < 0)
+        return -int(errno_t::EINVAL);
+
+    if (size_t(offset) >= node->size)
+        return 0;
+
+    size = std::min(size, node->size - size_t(offset));
+
+    memcpy(buf, node->data + offset, size);
+
+    return size;
 }
 
 ssize_t dev_fs_t::write(fs_file_info_t *fi, char const *buf,
                         size_t size, off_t offset)
 {
-    return -int(errno_t::ENOSYS);
+    return -int(errno_t::EROFS);
 }
 
 int dev_fs_t::ftruncate(fs_file_info_t *fi, off_t offset)
@@ -162,7 +360,22 @@ int dev_fs_t::ftruncate(fs_file_info_t *fi, off_t offset)
 
 int dev_fs_t::fstat(fs_file_info_t *fi, fs_stat_t *st)
 {
-    return -int(errno_t::ENOSYS);
+    file_handle_t *file = (file_handle_t*)fi;
+
+    memset(st, 0, sizeof(*st));
+
+    st->st_ino = file->ino;
+
+    if (file->type == file_handle_t::DIR) {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+    } else {
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
+        st->st_size = ((node_handle_t*)file)->size;
+    }
+
+    return 0;
 }
 
 int dev_fs_t::fsync(fs_file_info_t *fi, int isdatasync)
@@ -215,7 +428,17 @@ int dev_fs_t::listxattr(fs_cpath_t path, char const* list, size_t size)
 int dev_fs_t::ioctl(fs_file_info_t *fi, int cmd, void* arg,
                     unsigned int flags, void* data)
 {
-    return -int(errno_t::ENOSYS);
+    file_handle_t *file = (file_handle_t*)fi;
+
+    if (unlikely(file->type != file_handle_t::NODE))
+        return -int(errno_t::ENOTTY);
+
+    node_handle_t *node = (node_handle_t*)file;
+
+    if (!node->ioctl)
+        return -int(errno_t::ENOTTY);
+
+    return node->ioctl(cmd, data);
 }
 
 int dev_fs_t::poll(fs_file_info_t *fi, fs_pollhandle_t* ph, unsigned* reventsp)
@@ -0,0 +1,22 @@
+#pragma once
+#include "types.h"
+
+struct fs_base_t;
+
+// Generates the contents of a devfs file into buf, returns the length
+// of the whole text like snprintf, so the caller can retry with a
+// larger buffer
+typedef size_t (*devfs_snapshot_fn_t)(char *buf, size_t size);
+
+// Handles an ioctl on a devfs file, data is the kernel copy of the
+// argument. Returns zero or a negated errno
+typedef int (*devfs_ioctl_fn_t)(int cmd, void *data);
+
+// Add a read only text file to /dev. Its contents are generated when it
+// is opened, so a reader sees one consistent snapshot. If ioctl is not
+// null, it handles ioctls on the open file
+bool devfs_add_snapshot(char const *name, devfs_snapshot_fn_t fn,
+                        devfs_ioctl_fn_t ioctl = nullptr);
+
+// The filesystem serving paths under /dev
+fs_base_t *devfs_get();
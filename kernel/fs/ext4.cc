@@ -1,13 +1,40 @@
 #include "dev_storage.h"
 
 #include "bitop.h"
+#include "bitsearch.h"
 #include "mm.h"
+#include "pool.h"
 #include "printk.h"
+#include "string.h"
+#include "unique_ptr.h"
 #include "vector.h"
 #include "inttypes.h"
 
-class ext4_fs_t final : public fs_base_t {
-    FS_BASE_RW_IMPL
+#define DEBUG_EXT4 1
+#if DEBUG_EXT4
+#define EXT4_TRACE(...) printdbg("ext4: " __VA_ARGS__)
+#else
+#define EXT4_TRACE(...) ((void)0)
+#endif
+
+// Read-only ext4 implementation
+//
+// File data is located by walking the extent tree (or the legacy
+// indirect block map for ext2/ext3 style inodes). Directory lookups
+// use the hashed (htree/dx) index when the directory has one, and fall
+// back to a linear scan otherwise. All metadata and data is accessed
+// through the demand paged device mapping, which acts as the block cache
+// for inode table blocks. The group descriptor table is decoded once at
+// mount time.
+
+class ext4_fs_t final : public fs_base_ro_t {
+    FS_BASE_IMPL
+
+    ssize_t read_async(fs_file_info_t *fi, char *buf, size_t size,
+                       off_t offset, fs_aio_t *aio) override final;
+
+    ssize_t readv(fs_file_info_t *fi, fs_iovec_t const *iov,
+                  size_t iovcnt, off_t offset) override final;
 
     friend class ext4_factory_t;
 
@@ -86,6 +113,7 @@ class ext4_fs_t final : public fs_base_t {
             HALF_MD4,
             TEA,
             LEGACY_UNSIGNED,
+            HALF_MD4_UNSIGNED,
             TEA_UNSIGNED
         };
 
@@ -225,6 +253,8 @@ class ext4_fs_t final : public fs_base_t {
     C_ASSERT(offsetof(superblock_t, s_mount_opts) == 0x200);
     C_ASSERT(sizeof(superblock_t) == 0x400);
 
+    using hash_version_t = superblock_t::hash_version_t;
+
     friend constexpr bool enable_bitwise(superblock_t::state_t);
     friend constexpr bool enable_bitwise(superblock_t::feature_compat_t);
     friend constexpr bool enable_bitwise(superblock_t::feature_incompat_t);
@@ -232,8 +262,202 @@ class ext4_fs_t final : public fs_base_t {
     friend constexpr bool enable_bitwise(superblock_t::mount_opts_t);
     friend constexpr bool enable_bitwise(superblock_t::misc_flags_t);
 
+    // Block group descriptor, the hi fields are only present
+    // when the filesystem has the 64 bit feature
+    struct group_desc_t {
+        le32 bg_block_bitmap_lo;
+        le32 bg_inode_bitmap_lo;
+        le32 bg_inode_table_lo;
+        le16 bg_free_blocks_count_lo;
+        le16 bg_free_inodes_count_lo;
+        le16 bg_used_dirs_count_lo;
+        le16 bg_flags;
+        le32 bg_exclude_bitmap_lo;
+        le16 bg_block_bitmap_csum_lo;
+        le16 bg_inode_bitmap_csum_lo;
+        le16 bg_itable_unused_lo;
+        le16 bg_checksum;
+
+        le32 bg_block_bitmap_hi;
+        le32 bg_inode_bitmap_hi;
+        le32 bg_inode_table_hi;
+        le16 bg_free_blocks_count_hi;
+        le16 bg_free_inodes_count_hi;
+        le16 bg_used_dirs_count_hi;
+        le16 bg_itable_unused_hi;
+        le32 bg_exclude_bitmap_hi;
+        le16 bg_block_bitmap_csum_hi;
+        le16 bg_inode_bitmap_csum_hi;
+        le32 bg_reserved;
+    } _packed;
+
+    C_ASSERT(offsetof(group_desc_t, bg_block_bitmap_hi) == 0x20);
+    C_ASSERT(sizeof(group_desc_t) == 0x40);
+
+    // The part of the on-disk inode that we use
+    struct inode_t {
+        le16 i_mode;
+        le16 i_uid;
+        le32 i_size_lo;
+        le32 i_atime;
+        le32 i_ctime;
+        le32 i_mtime;
+        le32 i_dtime;
+        le16 i_gid;
+        le16 i_links_count;
+        le32 i_blocks_lo;
+        le32 i_flags;
+        le32 i_version_lo;
+        le32 i_block[15];
+        le32 i_generation;
+        le32 i_file_acl_lo;
+        le32 i_size_high;
+        le32 i_obso_faddr;
+        le16 i_blocks_high;
+        le16 i_file_acl_high;
+        le16 i_uid_high;
+        le16 i_gid_high;
+        le16 i_checksum_lo;
+        le16 i_reserved;
+    } _packed;
+
+    C_ASSERT(offsetof(inode_t, i_block) == 0x28);
+    C_ASSERT(sizeof(inode_t) == 0x80);
+
+    // i_mode file type
+    static constexpr le16 mode_type_mask = 0xF000;
+    static constexpr le16 mode_type_lnk = 0xA000;
+    static constexpr le16 mode_type_reg = 0x8000;
+    static constexpr le16 mode_type_dir = 0x4000;
+
+    // i_flags
+    static constexpr le32 inode_flag_index = 0x1000;
+    static constexpr le32 inode_flag_huge_file = 0x40000;
+    static constexpr le32 inode_flag_extents = 0x80000;
+
+    struct extent_header_t {
+        le16 eh_magic;
+        le16 eh_entries;
+        le16 eh_max;
+        le16 eh_depth;
+        le32 eh_generation;
+    } _packed;
+
+    // Interior node of the extent tree
+    struct extent_idx_t {
+        le32 ei_block;
+        le32 ei_leaf_lo;
+        le16 ei_leaf_hi;
+        le16 ei_unused;
+    } _packed;
+
+    // Leaf node of the extent tree
+    struct extent_t {
+        le32 ee_block;
+        le16 ee_len;
+        le16 ee_start_hi;
+        le32 ee_start_lo;
+    } _packed;
+
+    C_ASSERT(sizeof(extent_idx_t) == sizeof(extent_t));
+
+    static constexpr le16 extent_magic = 0xF30A;
+
+    // Deepest extent tree the kernel creates
+    static constexpr le16 extent_max_depth = 5;
+
+    // Extents longer than this are uninitialized (read as zero)
+    static constexpr le16 extent_init_max = 32768;
+
+    struct dir_entry_t {
+        le32 inode;
+        le16 rec_len;
+        u8 name_len;
+        u8 file_type;
+
+        // The name follows the fixed fields
+        char const *name() const
+        {
+            return (char const *)(this + 1);
+        }
+    } _packed;
+
+    struct dx_root_info_t {
+        le32 reserved_zero;
+        hash_version_t hash_version;
+        u8 info_length;
+        u8 indirect_levels;
+        u8 unused_flags;
+    } _packed;
+
+    struct dx_entry_t {
+        le32 hash;
+        le32 block;
+    } _packed;
+
+    // Overlays the hash field of the first dx_entry_t in each index block
+    struct dx_countlimit_t {
+        le16 limit;
+        le16 count;
+    } _packed;
+
+    // dx_root_info_t is after the "." and ".." entries in the root block
+    static constexpr size_t dx_root_info_offset = 24;
+
+    // Interior index blocks start with an empty directory entry
+    static constexpr size_t dx_node_entries_offset = 8;
+
+    static constexpr uint32_t root_ino = 2;
+
+    // A contiguous range of file blocks, mapped to a contiguous
+    // range of device blocks, or a hole if pblk is zero
+    struct block_run_t {
+        uint64_t pblk;
+        uint32_t lblk;
+        uint32_t len;
+    };
+
+    struct group_info_t {
+        uint64_t inode_table;
+    };
+
+    struct file_handle_t : public fs_file_info_t {
+        file_handle_t()
+            : fs(nullptr)
+            , ino(0)
+            , inode{}
+            , cached_run{}
+            , direct(false)
+        {
+        }
+
+        // fs_file_info_t interface
+        ino_t get_inode() const override
+        {
+            return ino;
+        }
+
+        ext4_fs_t *fs;
+        uint32_t ino;
+        inode_t inode;
+
+        // Most recently used extent, sequential reads hit this
+        using lock_type = std::mcslock;
+        using scoped_lock = std::unique_lock<lock_type>;
+        lock_type run_lock;
+        block_run_t cached_run;
+
+        // Opened with O_DIRECT, reads bypass mm_dev
+        bool direct;
+    };
+
+    static pool_t<file_handle_t> handles;
+
     bool mount(fs_init_info_t *conn);
 
+    // Read the superblock and group descriptors through mm_dev
+    bool load_metadata();
+
     //
     // Internals
 
@@ -243,22 +467,120 @@ class ext4_fs_t final : public fs_base_t {
     int mm_fault_handler(void *addr, uint64_t offset, uint64_t length,
                          bool read, bool flush);
 
+    template<typename T>
+    bool has_feature(T feature) const;
+
+    _pure
+    void *lookup_block(uint64_t block);
+
+    _pure
+    static uint64_t inode_size(inode_t const *inode);
+
+    uint64_t inode_blocks(inode_t const *inode) const;
+
+    static bool is_dir(inode_t const *inode);
+
+    int read_inode(uint32_t ino, inode_t *inode);
+
+    int map_block(inode_t const *inode, uint32_t lblk, block_run_t *run);
+
+    int map_extent(inode_t const *inode, uint32_t lblk, block_run_t *run);
+
+    int map_indirect(inode_t const *inode, uint32_t lblk, block_run_t *run);
+
+    void *dir_block(inode_t const *inode, uint32_t lblk);
+
+    uint32_t rec_len(dir_entry_t const *de) const;
+
+    uint32_t search_dir_block(void const *block,
+                              char const *name, size_t name_len);
+
+    int lookup_linear(inode_t const *dir, char const *name,
+                      size_t name_len, uint32_t *ino);
+
+    int lookup_htree(inode_t const *dir, char const *name,
+                     size_t name_len, uint32_t *ino);
+
+    int lookup_dir(inode_t const *dir, char const *name,
+                   size_t name_len, uint32_t *ino);
+
+    int lookup_path(char const *path, uint32_t *ino, inode_t *inode);
+
+    file_handle_t *create_handle(char const *path, errno_t& err);
+
+    void fill_stat(fs_stat_t *st, uint32_t ino, inode_t const *inode) const;
+
+    ssize_t direct_read(file_handle_t *file, char *buf,
+                        size_t size, off_t offset, fs_aio_t *aio = nullptr);
+    ssize_t direct_read_issue(file_handle_t *file, char *buf,
+                              size_t size, off_t offset, fs_aio_t *aio);
+    ssize_t direct_readv(file_handle_t *file, fs_iovec_t const *iov,
+                         size_t iovcnt, off_t offset);
+
+    static uint32_t dirhash(hash_version_t version, uint32_t const *seed,
+                            char const *name, size_t len);
+
     storage_dev_base_t *drive;
     uint64_t part_st;
     uint64_t part_len;
 
-    static constexpr uint8_t sector_shift = 9;
-    static constexpr uint8_t block_shift = 3;
-    static constexpr uint32_t sector_size = 1U << (sector_shift);
-    static constexpr uint32_t block_size = sector_size << block_shift;
+    superblock_t sb;
+
+    std::vector<group_info_t> groups;
+
+    uint64_t blocks_count;
+    uint32_t group_count;
+    uint32_t inode_size_bytes;
+    uint32_t block_size;
+
+    uint32_t sector_size;
+    uint8_t sector_shift;
+    uint8_t block_shift;
 
     char *mm_dev;
 };
 
+pool_t<ext4_fs_t::file_handle_t> ext4_fs_t::handles;
+
+constexpr bool enable_bitwise(ext4_fs_t::superblock_t::state_t)
+{
+    return true;
+}
+
+constexpr bool enable_bitwise(ext4_fs_t::superblock_t::feature_compat_t)
+{
+    return true;
+}
+
+constexpr bool enable_bitwise(ext4_fs_t::superblock_t::feature_incompat_t)
+{
+    return true;
+}
+
+constexpr bool enable_bitwise(ext4_fs_t::superblock_t::feature_ro_compat_t)
+{
+    return true;
+}
+
+constexpr bool enable_bitwise(ext4_fs_t::superblock_t::mount_opts_t)
+{
+    return true;
+}
+
+constexpr bool enable_bitwise(ext4_fs_t::superblock_t::misc_flags_t)
+{
+    return true;
+}
+
 class ext4_factory_t : public fs_factory_t {
+public:
+    ext4_factory_t() : fs_factory_t("ext4") {}
     fs_base_t *mount(fs_init_info_t *conn) override;
 };
 
+static ext4_factory_t ext4_factory;
+STORAGE_REGISTER_FACTORY(ext4);
+
 static std::vector<ext4_fs_t*> ext4_mounts;
 
 // ---------------------------------------------------------------------------
@@ -274,286 +596,1383 @@ int ext4_fs_t::mm_fault_handler(
 }
 
 int ext4_fs_t::mm_fault_handler(
-        void *addr, uint64_t offset, uint64_t length, bool read, bool flush)
+        void *addr, uint64_t offset, uint64_t length, bool read, bool)
 {
+    if (unlikely(!read))
+        return -int(errno_t::EROFS);
+
     uint64_t sector_offset = (offset >> sector_shift);
     uint64_t lba = part_st + sector_offset;
+    uint64_t count = length >> sector_shift;
 
-    if (likely(read)) {
-        printdbg("Demand paging LBA %" PRId64 " at addr %p\n", lba, addr);
-
-        return drive->read_blocks(addr, length >> sector_shift, lba);
-    }
+    // Don't read past the end of the partition
+    if (unlikely(sector_offset + count > part_len))
+        count = part_len - sector_offset;
 
-    printdbg("Writing back LBA %" PRId64 " at addr %p\n", lba, addr);
-    int result = drive->write_blocks(addr, length >> sector_shift, lba, flush);
+    printdbg("Demand paging LBA %" PRId64 " at addr %p\n", lba, addr);
 
-    return result;
+    return drive->read_blocks(addr, count, lba);
 }
 
-// ---------------------------------------------------------------------------
-// Public interface
-// ---------------------------------------------------------------------------
+template<typename T>
+bool ext4_fs_t::has_feature(T feature) const
+{
+    using underlying = typename std::underlying_type<T>::type;
 
-//
-// Startup and shutdown
+    T features;
 
-fs_base_t *ext4_factory_t::mount(fs_init_info_t *conn)
-{
-    std::unique_ptr<ext4_fs_t> self(new ext4_fs_t);
-    if (self->mount(conn)) {
-        if (!ext4_mounts.push_back(self)) {
-            panic_oom();
-            return nullptr;
-        }
-        return self.release();
-    }
+    if (std::is_same<T, superblock_t::feature_compat_t>::value)
+        features = T(sb.s_feature_compat);
+    else if (std::is_same<T, superblock_t::feature_incompat_t>::value)
+        features = T(sb.s_feature_incompat);
+    else
+        features = T(sb.s_feature_ro_compat);
 
-    return nullptr;
+    return underlying(features & feature) != 0;
 }
 
-bool ext4_fs_t::mount(fs_init_info_t *conn)
+void *ext4_fs_t::lookup_block(uint64_t block)
 {
-    drive = conn->drive;
-    part_st = conn->part_st;
-    part_len = conn->part_len;
-
-    mm_dev = (char*)mmap_register_device(
-                this, block_size, conn->part_len,
-                PROT_READ | PROT_WRITE, &ext4_fs_t::mm_fault_handler);
-
-    if (!mm_dev)
-        return false;
-
-    return false;
+    return mm_dev + (block << block_shift);
 }
 
-void ext4_fs_t::unmount()
+uint64_t ext4_fs_t::inode_size(inode_t const *inode)
 {
+    return inode->i_size_lo | (uint64_t(inode->i_size_high) << 32);
 }
 
-bool ext4_fs_t::is_boot() const
+uint64_t ext4_fs_t::inode_blocks(inode_t const *inode) const
 {
-    return false;
-}
+    uint64_t blocks = inode->i_blocks_lo;
 
-//
-// Read directory entry information
+    if (has_feature(superblock_t::feature_ro_compat_t::HUGE_FILE)) {
+        blocks |= uint64_t(inode->i_blocks_high) << 32;
 
-int ext4_fs_t::getattr(fs_cpath_t path, fs_stat_t* stbuf)
-{
-    (void)path;
-    (void)stbuf;
-    return -int(errno_t::ENOSYS);
+        // Counted in filesystem blocks instead of 512 byte sectors
+        if (inode->i_flags & inode_flag_huge_file)
+            blocks <<= block_shift - 9;
+    }
+
+    return blocks;
 }
 
-int ext4_fs_t::access(fs_cpath_t path, int mask)
+bool ext4_fs_t::is_dir(inode_t const *inode)
 {
-    (void)path;
-    (void)mask;
-    return -int(errno_t::ENOSYS);
+    return (inode->i_mode & mode_type_mask) == mode_type_dir;
 }
 
-int ext4_fs_t::readlink(fs_cpath_t path, char* buf, size_t size)
+int ext4_fs_t::read_inode(uint32_t ino, inode_t *inode)
 {
-    (void)path;
-    (void)buf;
-    (void)size;
-    return -int(errno_t::ENOSYS);
-}
+    if (unlikely(ino == 0 || ino > sb.s_inodes_count))
+        return -int(errno_t::EINVAL);
 
-//
-// Scan directories
+    uint32_t group = (ino - 1) / sb.s_inodes_per_group;
+    uint32_t index = (ino - 1) % sb.s_inodes_per_group;
 
-int ext4_fs_t::opendir(fs_file_info_t **fi, fs_cpath_t path)
-{
-    (void)path;
-    (void)fi;
-    return -int(errno_t::ENOSYS);
+    if (unlikely(group >= group_count))
+        return -int(errno_t::EIO);
+
+    char const *itable = (char const *)
+            lookup_block(groups[group].inode_table);
+
+    size_t copy_size = inode_size_bytes < sizeof(*inode)
+            ? inode_size_bytes
+            : sizeof(*inode);
+
+    memcpy(inode, itable + size_t(index) * inode_size_bytes, copy_size);
+    memset((char*)inode + copy_size, 0, sizeof(*inode) - copy_size);
+
+    return 0;
 }
 
-ssize_t ext4_fs_t::readdir(fs_file_info_t *fi,
-                                   dirent_t *buf, off_t offset)
+int ext4_fs_t::map_block(inode_t const *inode, uint32_t lblk,
+                         block_run_t *run)
 {
-    (void)buf;
-    (void)offset;
-    (void)fi;
-    return -int(errno_t::ENOSYS);
+    if (inode->i_flags & inode_flag_extents)
+        return map_extent(inode, lblk, run);
+
+    return map_indirect(inode, lblk, run);
 }
 
-int ext4_fs_t::releasedir(fs_file_info_t *fi)
+// Walk the extent tree from the root in the inode down to the leaf
+// that covers lblk, and return the whole extent, so the caller can
+// transfer all of it at once
+int ext4_fs_t::map_extent(inode_t const *inode, uint32_t lblk,
+                          block_run_t *run)
 {
-    (void)fi;
-    return -int(errno_t::ENOSYS);
-}
+    extent_header_t const *hdr = (extent_header_t const *)inode->i_block;
+
+    // The first logical block past the node we are in, for sizing holes
+    uint64_t node_end = uint64_t(1) << 32;
+
+    // The root lives in i_block, the other nodes fill a whole block
+    size_t node_size = sizeof(inode->i_block);
+
+    if (unlikely(hdr->eh_depth > extent_max_depth))
+        return -int(errno_t::EIO);
+
+    for (int level = hdr->eh_depth; ; --level) {
+        // Both entry types are the same size, so one limit covers both
+        size_t node_capacity = (node_size - sizeof(*hdr)) /
+                sizeof(extent_t);
+
+        if (unlikely(hdr->eh_magic != extent_magic ||
+                     hdr->eh_depth != level ||
+                     hdr->eh_entries > hdr->eh_max ||
+                     hdr->eh_max > node_capacity))
+            return -int(errno_t::EIO);
+
+        if (level == 0)
+            break;
+
+        extent_idx_t const *idx = (extent_idx_t const *)(hdr + 1);
+
+        // Find the last index entry that starts at or before lblk
+        size_t st = 0;
+        size_t en = hdr->eh_entries;
+        while (st < en) {
+            size_t md = st + ((en - st) >> 1);
+            if (idx[md].ei_block <= lblk)
+                st = md + 1;
+            else
+                en = md;
+        }
 
+        if (st == 0) {
+            // Hole before the first index entry
+            run->pblk = 0;
+            run->lblk = lblk;
+            run->len = hdr->eh_entries
+                    ? idx[0].ei_block - lblk
+                    : uint32_t(node_end - lblk);
+            return 0;
+        }
 
-//
-// Modify directories
+        if (st < hdr->eh_entries)
+            node_end = idx[st].ei_block;
 
-int ext4_fs_t::mknod(fs_cpath_t path, fs_mode_t mode, fs_dev_t rdev)
-{
-    (void)path;
-    (void)mode;
-    (void)rdev;
-    return -int(errno_t::ENOSYS);
-}
+        extent_idx_t const *found = idx + (st - 1);
 
-int ext4_fs_t::mkdir(fs_cpath_t path, fs_mode_t mode)
-{
-    (void)path;
-    (void)mode;
-    return -int(errno_t::ENOSYS);
-}
+        uint64_t leaf = found->ei_leaf_lo |
+                (uint64_t(found->ei_leaf_hi) << 32);
 
-int ext4_fs_t::rmdir(fs_cpath_t path)
-{
-    (void)path;
-    return -int(errno_t::ENOSYS);
-}
+        if (unlikely(leaf == 0 || leaf >= blocks_count))
+            return -int(errno_t::EIO);
 
-int ext4_fs_t::symlink(fs_cpath_t to, fs_cpath_t from)
-{
-    (void)to;
-    (void)from;
-    return -int(errno_t::ENOSYS);
-}
+        hdr = (extent_header_t const *)lookup_block(leaf);
+        node_size = block_size;
+    }
 
-int ext4_fs_t::rename(fs_cpath_t from, fs_cpath_t to)
-{
-    (void)from;
-    (void)to;
-    return -int(errno_t::ENOSYS);
-}
+    extent_t const *ext = (extent_t const *)(hdr + 1);
+
+    // Find the last extent that starts at or before lblk
+    size_t st = 0;
+    size_t en = hdr->eh_entries;
+    while (st < en) {
+        size_t md = st + ((en - st) >> 1);
+        if (ext[md].ee_block <= lblk)
+            st = md + 1;
+        else
+            en = md;
+    }
 
-int ext4_fs_t::link(fs_cpath_t from, fs_cpath_t to)
-{
-    (void)from;
-    (void)to;
-    return -int(errno_t::ENOSYS);
-}
+    if (st > 0) {
+        extent_t const *found = ext + (st - 1);
 
-int ext4_fs_t::unlink(fs_cpath_t path)
-{
-    (void)path;
-    return -int(errno_t::ENOSYS);
-}
+        uint32_t len = found->ee_len;
+        bool uninit = len > extent_init_max;
+        if (uninit)
+            len -= extent_init_max;
 
-//
-// Modify directory entries
+        if (lblk - found->ee_block < len) {
+            run->lblk = found->ee_block;
+            run->len = len;
 
-int ext4_fs_t::chmod(fs_cpath_t path, fs_mode_t mode)
-{
-    (void)path;
-    (void)mode;
-    return -int(errno_t::ENOSYS);
-}
+            // Uninitialized extents read as zeros, like a hole
+            run->pblk = !uninit
+                    ? found->ee_start_lo |
+                      (uint64_t(found->ee_start_hi) << 32)
+                    : 0;
+            return 0;
+        }
+    }
 
-int ext4_fs_t::chown(fs_cpath_t path, fs_uid_t uid, fs_gid_t gid)
-{
-    (void)path;
-    (void)uid;
-    (void)gid;
-    return -int(errno_t::ENOSYS);
-}
+    // Hole, extends until the next extent
+    run->pblk = 0;
+    run->lblk = lblk;
+    run->len = st < hdr->eh_entries
+            ? ext[st].ee_block - lblk
+            : uint32_t(node_end - lblk);
 
-int ext4_fs_t::truncate(fs_cpath_t path, off_t size)
-{
-    (void)path;
-    (void)size;
-    return -int(errno_t::ENOSYS);
+    return 0;
 }
 
-int ext4_fs_t::utimens(fs_cpath_t path, const fs_timespec_t *ts)
+// Legacy ext2/ext3 block map, 12 direct blocks, then single,
+// double and triple indirect blocks
+int ext4_fs_t::map_indirect(inode_t const *inode, uint32_t lblk,
+                            block_run_t *run)
 {
-    (void)path;
-    (void)ts;
-    return -int(errno_t::ENOSYS);
-}
+    uint32_t per_block_shift = block_shift - 2;
+    uint32_t per_block = 1U << per_block_shift;
+
+    // The inode is packed, copy the block map out of it
+    le32 direct[12];
+    memcpy(direct, inode->i_block, sizeof(direct));
+
+    le32 const *table = direct;
+    size_t table_size = 12;
+    uint32_t index = lblk;
+    int levels = 0;
+
+    if (index >= 12) {
+        index -= 12;
+        for (levels = 1; levels <= 3; ++levels) {
+            uint64_t span = uint64_t(1) << (per_block_shift * levels);
+            if (index < span)
+                break;
+            index -= span;
+        }
 
+        if (unlikely(levels > 3))
+            return -int(errno_t::EFBIG);
 
-//
-// Open/close files
+        // Descend from the inode's indirect block pointer
+        uint32_t block = inode->i_block[11 + levels];
 
-int ext4_fs_t::open(fs_file_info_t **fi,
-                     fs_cpath_t path, int flags, mode_t mode)
-{
-    (void)fi;
-    (void)path;
-    (void)flags;
-    (void)mode;
-    return -int(errno_t::ENOSYS);
+        for (int level = levels; level > 0; --level) {
+            if (block == 0) {
+                // Hole covering the rest of this subtree
+                uint64_t span = uint64_t(1) << (per_block_shift * level);
+                run->pblk = 0;
+                run->lblk = lblk;
+                run->len = uint32_t(std::min(span - (index & (span - 1)),
+                                             uint64_t(UINT32_MAX)));
+                return 0;
+            }
+
+            if (unlikely(block >= blocks_count))
+                return -int(errno_t::EIO);
+
+            table = (le32 const *)lookup_block(block);
+            table_size = per_block;
+
+            uint32_t shift = per_block_shift * (level - 1);
+            uint32_t slot = (index >> shift) & (per_block - 1);
+
+            if (level > 1)
+                block = table[slot];
+            else
+                index = slot;
+        }
+    }
+
+    run->lblk = lblk;
+    run->pblk = table[index];
+
+    // Coalesce physically contiguous (or all-hole) neighbours
+    // within the same table, so callers can do large transfers
+    size_t end = index + 1;
+    if (run->pblk) {
+        while (end < table_size && table[end] == run->pblk + (end - index))
+            ++end;
+    } else {
+        while (end < table_size && table[end] == 0)
+            ++end;
+    }
+
+    run->len = end - index;
+
+    return 0;
 }
 
-int ext4_fs_t::release(fs_file_info_t *fi)
+void *ext4_fs_t::dir_block(inode_t const *inode, uint32_t lblk)
 {
-    (void)fi;
-    return -int(errno_t::ENOSYS);
-}
+    block_run_t run;
 
+    if (unlikely(map_block(inode, lblk, &run) < 0))
+        return nullptr;
 
-//
-// Read/write files
+    if (unlikely(run.pblk == 0))
+        return nullptr;
 
-ssize_t ext4_fs_t::read(fs_file_info_t *fi, char *buf,
-                                size_t size, off_t offset)
-{
-    (void)buf;
-    (void)size;
-    (void)offset;
-    (void)fi;
-    return -int(errno_t::ENOSYS);
+    uint64_t pblk = run.pblk + (lblk - run.lblk);
+
+    if (unlikely(pblk >= blocks_count))
+        return nullptr;
+
+    return lookup_block(pblk);
 }
 
-ssize_t ext4_fs_t::write(fs_file_info_t *fi, char const *buf,
-                                 size_t size, off_t offset)
+uint32_t ext4_fs_t::rec_len(dir_entry_t const *de) const
 {
-    (void)buf;
-    (void)size;
-    (void)offset;
-    (void)fi;
-    return -int(errno_t::ENOSYS);
+    uint32_t len = de->rec_len;
+
+    // 64KB blocks encode a full block record specially
+    if (unlikely(block_size >= 65536 && (len == 65535 || len == 0)))
+        return block_size;
+
+    return len;
 }
 
-int ext4_fs_t::ftruncate(fs_file_info_t *fi, off_t offset)
+uint32_t ext4_fs_t::search_dir_block(void const *block,
+                                     char const *name, size_t name_len)
 {
-    (void)offset;
-    (void)fi;
-    // Fail, read only
-    return -1;
-}
+    char const *base = (char const *)block;
 
-//
-// Query open files
+    for (uint32_t ofs = 0; ofs + sizeof(dir_entry_t) <= block_size; ) {
+        dir_entry_t const *de = (dir_entry_t const *)(base + ofs);
 
-int ext4_fs_t::fstat(fs_file_info_t *fi, fs_stat_t *st)
+        uint32_t len = rec_len(de);
+
+        if (unlikely(len < sizeof(dir_entry_t) || ofs + len > block_size))
+            break;
+
+        if (de->inode && de->name_len == name_len &&
+                !memcmp(de->name(), name, name_len))
+            return de->inode;
+
+        ofs += len;
+    }
+
+    return 0;
+}
+
+int ext4_fs_t::lookup_linear(inode_t const *dir, char const *name,
+                             size_t name_len, uint32_t *ino)
 {
-    (void)fi;
-    (void)st;
-    return -int(errno_t::ENOSYS);
+    uint32_t dir_blocks = (inode_size(dir) + block_size - 1) >> block_shift;
+
+    for (uint32_t lblk = 0; lblk < dir_blocks; ++lblk) {
+        void const *block = dir_block(dir, lblk);
+
+        if (!block)
+            continue;
+
+        *ino = search_dir_block(block, name, name_len);
+
+        if (*ino)
+            return 0;
+    }
+
+    return -int(errno_t::ENOENT);
+}
+
+// Hashed directory lookup. Returns -EAGAIN if the index looks unusable,
+// so the caller can fall back to a linear scan
+int ext4_fs_t::lookup_htree(inode_t const *dir, char const *name,
+                            size_t name_len, uint32_t *ino)
+{
+    char const *root = (char const *)dir_block(dir, 0);
+
+    if (unlikely(!root))
+        return -int(errno_t::EAGAIN);
+
+    dx_root_info_t const *info = (dx_root_info_t const *)
+            (root + dx_root_info_offset);
+
+    uint32_t max_levels = has_feature(
+                superblock_t::feature_incompat_t::LARGEDIR) ? 3 : 2;
+
+    if (unlikely(info->reserved_zero != 0 ||
+                 info->indirect_levels >= max_levels ||
+                 dx_root_info_offset + info->info_length +
+                 sizeof(dx_entry_t) > block_size))
+        return -int(errno_t::EAGAIN);
+
+    hash_version_t version = info->hash_version;
+
+    if (version <= hash_version_t::TEA &&
+            (uint32_t(sb.s_flags) &
+             uint32_t(superblock_t::misc_flags_t::UNSIGNED_DIR_HASH)))
+        version = hash_version_t(uint8_t(version) + 3);
+
+    // The superblock is packed, copy the seed out of it
+    uint32_t seed[4];
+    memcpy(seed, sb.s_hash_seed, sizeof(seed));
+
+    uint32_t hash = dirhash(version, seed, name, name_len);
+
+    size_t entries_ofs = dx_root_info_offset + info->info_length;
+
+    dx_entry_t const *entries = (dx_entry_t const *)(root + entries_ofs);
+
+    dx_entry_t const *at = nullptr;
+    uint32_t count = 0;
+
+    for (uint32_t level = 0; ; ++level) {
+        dx_countlimit_t const *cl = (dx_countlimit_t const *)entries;
+        count = cl->count;
+
+        // The limit comes from the disk, it must fit the block
+        size_t limit_max = (block_size - entries_ofs) / sizeof(dx_entry_t);
+
+        if (unlikely(count == 0 || count > cl->limit ||
+                     cl->limit > limit_max))
+            return -int(errno_t::EAGAIN);
+
+        // Find the last entry with a hash less than or equal to ours,
+        // entry 0 has an implied hash of zero
+        size_t st = 1;
+        size_t en = count;
+        while (st < en) {
+            size_t md = st + ((en - st) >> 1);
+            if (entries[md].hash <= hash)
+                st = md + 1;
+            else
+                en = md;
+        }
+
+        at = entries + (st - 1);
+
+        if (level == info->indirect_levels)
+            break;
+
+        char const *node = (char const *)
+                dir_block(dir, at->block & 0x0FFFFFFF);
+
+        if (unlikely(!node))
+            return -int(errno_t::EAGAIN);
+
+        entries_ofs = dx_node_entries_offset;
+        entries = (dx_entry_t const *)(node + entries_ofs);
+    }
+
+    for (;;) {
+        void const *leaf = dir_block(dir, at->block & 0x0FFFFFFF);
+
+        if (unlikely(!leaf))
+            return -int(errno_t::EAGAIN);
+
+        *ino = search_dir_block(leaf, name, name_len);
+
+        if (*ino)
+            return 0;
+
+        // The low bit of the hash marks a leaf that continues
+        // a run of colliding hashes from the previous leaf
+        if (++at >= entries + count ||
+                !(at->hash & 1) || (at->hash & ~1U) != hash)
+            break;
+    }
+
+    return -int(errno_t::ENOENT);
+}
+
+int ext4_fs_t::lookup_dir(inode_t const *dir, char const *name,
+                          size_t name_len, uint32_t *ino)
+{
+    if (unlikely(!is_dir(dir)))
+        return -int(errno_t::ENOTDIR);
+
+    if ((dir->i_flags & inode_flag_index) &&
+            has_feature(superblock_t::feature_compat_t::DIR_INDEX)) {
+        int status = lookup_htree(dir, name, name_len, ino);
+
+        if (likely(status != -int(errno_t::EAGAIN)))
+            return status;
+
+        EXT4_TRACE("unusable directory index, using linear lookup\n");
+    }
+
+    return lookup_linear(dir, name, name_len, ino);
+}
+
+int ext4_fs_t::lookup_path(char const *path, uint32_t *ino, inode_t *inode)
+{
+    *ino = root_ino;
+
+    int status = read_inode(*ino, inode);
+
+    if (unlikely(status < 0))
+        return status;
+
+    char const *name_st = path;
+    char const *path_end = path + strlen(path);
+
+    for (char const *name_en; name_st < path_end; name_st = name_en + 1) {
+        name_en = (char const *)memchr(name_st, '/', path_end - name_st);
+
+        if (!name_en)
+            name_en = path_end;
+
+        size_t name_len = name_en - name_st;
+
+        // Skip empty components, from leading, trailing or double slashes
+        if (name_len == 0)
+            continue;
+
+        status = lookup_dir(inode, name_st, name_len, ino);
+
+        if (status < 0)
+            return status;
+
+        status = read_inode(*ino, inode);
+
+        if (unlikely(status < 0))
+            return status;
+    }
+
+    return 0;
+}
+
+ext4_fs_t::file_handle_t *ext4_fs_t::create_handle(
+        char const *path, errno_t& err)
+{
+    uint32_t ino;
+    inode_t inode;
+
+    int status = lookup_path(path, &ino, &inode);
+
+    if (unlikely(status < 0)) {
+        err = errno_t(-status);
+        return nullptr;
+    }
+
+    file_handle_t *file = handles.alloc();
+
+    if (unlikely(!file)) {
+        err = errno_t::EMFILE;
+        return nullptr;
+    }
+
+    file->fs = this;
+    file->ino = ino;
+    file->inode = inode;
+    file->cached_run = {};
+    file->direct = false;
+
+    return file;
+}
+
+void ext4_fs_t::fill_stat(fs_stat_t *st, uint32_t ino,
+                          inode_t const *inode) const
+{
+    st->st_dev = 0;
+    st->st_ino = ino;
+    st->st_mode = inode->i_mode;
+    st->st_nlink = inode->i_links_count;
+    st->st_uid = inode->i_uid | (inode->i_uid_high << 16);
+    st->st_gid = inode->i_gid | (inode->i_gid_high << 16);
+    st->st_rdev = 0;
+    st->st_size = inode_size(inode);
+    st->st_blksize = block_size;
+    st->st_blocks = inode_blocks(inode);
+    st->st_atime = inode->i_atime;
+    st->st_mtime = inode->i_mtime;
+    st->st_ctime = inode->i_ctime;
 }
 
 //
-// Sync files and directories and flush buffers
+// Directory hash functions
 
-int ext4_fs_t::fsync(fs_file_info_t *fi, int isdatasync)
+static _always_inline uint32_t ext4_rol32(uint32_t n, int bits)
 {
-    (void)isdatasync;
-    (void)fi;
-    return -int(errno_t::ENOSYS);
+    return (n << bits) | (n >> (32 - bits));
 }
 
-int ext4_fs_t::fsyncdir(fs_file_info_t *fi, int isdatasync)
+static void ext4_tea_transform(uint32_t *buf, uint32_t const *in)
 {
-    (void)isdatasync;
-    (void)fi;
-    return -int(errno_t::ENOSYS);
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0];
+    uint32_t b1 = buf[1];
+    uint32_t a = in[0];
+    uint32_t b = in[1];
+    uint32_t c = in[2];
+    uint32_t d = in[3];
+
+    for (int n = 0; n < 16; ++n) {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+
+    buf[0] += b0;
+    buf[1] += b1;
 }
 
-int ext4_fs_t::flush(fs_file_info_t *fi)
+static void ext4_half_md4_transform(uint32_t *buf, uint32_t const *in)
 {
-    (void)fi;
-    return -int(errno_t::ENOSYS);
+    uint32_t a = buf[0];
+    uint32_t b = buf[1];
+    uint32_t c = buf[2];
+    uint32_t d = buf[3];
+
+    auto f = [](uint32_t x, uint32_t y, uint32_t z) -> uint32_t {
+        return z ^ (x & (y ^ z));
+    };
+
+    auto g = [](uint32_t x, uint32_t y, uint32_t z) -> uint32_t {
+        return (x & y) + ((x ^ y) & z);
+    };
+
+    auto h = [](uint32_t x, uint32_t y, uint32_t z) -> uint32_t {
+        return x ^ y ^ z;
+    };
+
+    static constexpr uint32_t k2 = 013240474631U;
+    static constexpr uint32_t k3 = 015666365641U;
+
+    // Round 1
+    a = ext4_rol32(a + f(b, c, d) + in[0], 3);
+    d = ext4_rol32(d + f(a, b, c) + in[1], 7);
+    c = ext4_rol32(c + f(d, a, b) + in[2], 11);
+    b = ext4_rol32(b + f(c, d, a) + in[3], 19);
+    a = ext4_rol32(a + f(b, c, d) + in[4], 3);
+    d = ext4_rol32(d + f(a, b, c) + in[5], 7);
+    c = ext4_rol32(c + f(d, a, b) + in[6], 11);
+    b = ext4_rol32(b + f(c, d, a) + in[7], 19);
+
+    // Round 2
+    a = ext4_rol32(a + g(b, c, d) + in[1] + k2, 3);
+    d = ext4_rol32(d + g(a, b, c) + in[3] + k2, 5);
+    c = ext4_rol32(c + g(d, a, b) + in[5] + k2, 9);
+    b = ext4_rol32(b + g(c, d, a) + in[7] + k2, 13);
+    a = ext4_rol32(a + g(b, c, d) + in[0] + k2, 3);
+    d = ext4_rol32(d + g(a, b, c) + in[2] + k2, 5);
+    c = ext4_rol32(c + g(d, a, b) + in[4] + k2, 9);
+    b = ext4_rol32(b + g(c, d, a) + in[6] + k2, 13);
+
+    // Round 3
+    a = ext4_rol32(a + h(b, c, d) + in[3] + k3, 3);
+    d = ext4_rol32(d + h(a, b, c) + in[7] + k3, 9);
+    c = ext4_rol32(c + h(d, a, b) + in[2] + k3, 11);
+    b = ext4_rol32(b + h(c, d, a) + in[6] + k3, 15);
+    a = ext4_rol32(a + h(b, c, d) + in[1] + k3, 3);
+    d = ext4_rol32(d + h(a, b, c) + in[5] + k3, 9);
+    c = ext4_rol32(c + h(d, a, b) + in[0] + k3, 11);
+    b = ext4_rol32(b + h(c, d, a) + in[4] + k3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+static uint32_t ext4_legacy_hash(char const *name, size_t len, bool is_signed)
+{
+    uint32_t hash0 = 0x12a3fe2d;
+    uint32_t hash1 = 0x37abe8f9;
+
+    for (size_t i = 0; i < len; ++i) {
+        int c = is_signed ? int(int8_t(name[i])) : int(uint8_t(name[i]));
+        uint32_t hash = hash1 + (hash0 ^ uint32_t(c * 7152373));
+
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    return hash0 << 1;
+}
+
+// Pack the name into words, padded with a length dependent pattern
+static void ext4_str2hashbuf(char const *msg, size_t len,
+                             uint32_t *buf, int num, bool is_signed)
+{
+    uint32_t pad = uint32_t(len) | (uint32_t(len) << 8);
+    pad |= pad << 16;
+
+    uint32_t val = pad;
+
+    if (len > size_t(num) * 4)
+        len = num * 4;
+
+    for (size_t i = 0; i < len; ++i) {
+        int c = is_signed ? int(int8_t(msg[i])) : int(uint8_t(msg[i]));
+        val = uint32_t(c) + (val << 8);
+        if ((i & 3) == 3) {
+            *buf++ = val;
+            val = pad;
+            --num;
+        }
+    }
+
+    if (--num >= 0)
+        *buf++ = val;
+
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+uint32_t ext4_fs_t::dirhash(hash_version_t version, uint32_t const *seed,
+                            char const *name, size_t len)
+{
+    uint32_t buf[4] = {
+        0x67452301,
+        0xefcdab89,
+        0x98badcfe,
+        0x10325476
+    };
+
+    if (seed[0] | seed[1] | seed[2] | seed[3])
+        memcpy(buf, seed, sizeof(buf));
+
+    uint32_t in[8];
+    uint32_t hash;
+
+    bool is_signed = version < hash_version_t::LEGACY_UNSIGNED;
+
+    switch (version) {
+    case hash_version_t::LEGACY:
+    case hash_version_t::LEGACY_UNSIGNED:
+        hash = ext4_legacy_hash(name, len, is_signed);
+        break;
+
+    case hash_version_t::HALF_MD4:
+    case hash_version_t::HALF_MD4_UNSIGNED:
+        for (size_t ofs = 0; ofs < len; ofs += 32) {
+            ext4_str2hashbuf(name + ofs, len - ofs, in, 8, is_signed);
+            ext4_half_md4_transform(buf, in);
+        }
+        hash = buf[1];
+        break;
+
+    case hash_version_t::TEA:
+    case hash_version_t::TEA_UNSIGNED:
+        for (size_t ofs = 0; ofs < len; ofs += 16) {
+            ext4_str2hashbuf(name + ofs, len - ofs, in, 4, is_signed);
+            ext4_tea_transform(buf, in);
+        }
+        hash = buf[0];
+        break;
+
+    default:
+        hash = 0;
+        break;
+
+    }
+
+    hash &= ~1U;
+
+    // The end-of-directory marker is reserved
+    if (hash == (0x7FFFFFFFU << 1))
+        hash = (0x7FFFFFFFU - 1) << 1;
+
+    return hash;
+}
+
+// ---------------------------------------------------------------------------
+// Public interface
+// ---------------------------------------------------------------------------
+
+//
+// Startup and shutdown
+
+fs_base_t *ext4_factory_t::mount(fs_init_info_t *conn)
+{
+    if (ext4_mounts.empty())
+        ext4_fs_t::handles.create(512);
+
+    std::unique_ptr<ext4_fs_t> self(new ext4_fs_t);
+    if (self->mount(conn)) {
+        if (!ext4_mounts.push_back(self))
+            panic_oom();
+        return self.release();
+    }
+
+    return nullptr;
+}
+
+bool ext4_fs_t::mount(fs_init_info_t *conn)
+{
+    drive = conn->drive;
+    part_st = conn->part_st;
+    part_len = conn->part_len;
+
+    sector_size = drive->info(STORAGE_INFO_BLOCKSIZE);
+    sector_shift = bit_log2(sector_size);
+
+    mm_dev = (char*)mmap_register_device(
+                this, sector_size, part_len,
+                PROT_READ, &ext4_fs_t::mm_fault_handler);
+
+    if (!mm_dev)
+        return false;
+
+    if (!load_metadata()) {
+        unmount();
+        return false;
+    }
+
+    return true;
+}
+
+bool ext4_fs_t::load_metadata()
+{
+    // The superblock is always 1KB into the partition
+    memcpy(&sb, mm_dev + 1024, sizeof(sb));
+
+    if (sb.s_magic != magic) {
+        EXT4_TRACE("bad superblock magic %#x\n", sb.s_magic);
+        return false;
+    }
+
+    static constexpr superblock_t::feature_incompat_t supported_incompat =
+            superblock_t::feature_incompat_t::FILETYPE |
+            superblock_t::feature_incompat_t::RECOVER |
+            superblock_t::feature_incompat_t::EXTENTS |
+            superblock_t::feature_incompat_t::IS64BIT |
+            superblock_t::feature_incompat_t::MMP |
+            superblock_t::feature_incompat_t::FLEX_BG |
+            superblock_t::feature_incompat_t::BG_USE_META_CSUM |
+            superblock_t::feature_incompat_t::LARGEDIR;
+
+    superblock_t::feature_incompat_t unsupported =
+            sb.s_feature_incompat & ~supported_incompat;
+
+    if (uint32_t(unsupported)) {
+        EXT4_TRACE("unsupported incompatible features %#x\n",
+                   uint32_t(unsupported));
+        return false;
+    }
+
+    if (has_feature(superblock_t::feature_incompat_t::RECOVER))
+        EXT4_TRACE("journal needs recovery, contents may be stale\n");
+
+    block_shift = 10 + sb.s_log_block_size;
+    block_size = 1U << block_shift;
+
+    if (unlikely(block_shift > 16 || block_size < sector_size)) {
+        EXT4_TRACE("unsupported block size %u\n", block_size);
+        return false;
+    }
+
+    inode_size_bytes = sb.s_rev_level != superblock_t::rev_level_t::ORIGINAL
+            ? sb.s_inode_size
+            : 128;
+
+    bool is64 = has_feature(superblock_t::feature_incompat_t::IS64BIT);
+
+    blocks_count = sb.s_blocks_count_lo;
+    if (is64)
+        blocks_count |= uint64_t(sb.s_blocks_count_hi) << 32;
+
+    if (unlikely(sb.s_blocks_per_group == 0 || sb.s_inodes_per_group == 0 ||
+                 inode_size_bytes < 128 || inode_size_bytes > block_size))
+        return false;
+
+    group_count = (blocks_count - sb.s_first_data_block +
+                   sb.s_blocks_per_group - 1) / sb.s_blocks_per_group;
+
+    size_t desc_size = is64 && sb.s_desc_size >= sizeof(group_desc_t)
+            ? sb.s_desc_size
+            : offsetof(group_desc_t, bg_block_bitmap_hi);
+
+    // Decode the group descriptor table once, it is consulted
+    // for every inode lookup
+    if (!groups.resize(group_count))
+        return false;
+
+    char const *gdt = (char const *)
+            lookup_block(sb.s_first_data_block + 1);
+
+    for (uint32_t i = 0; i < group_count; ++i) {
+        group_desc_t desc{};
+        memcpy(&desc, gdt + size_t(i) * desc_size,
+               desc_size < sizeof(desc) ? desc_size : sizeof(desc));
+
+        groups[i].inode_table = desc.bg_inode_table_lo;
+        if (is64)
+            groups[i].inode_table |= uint64_t(desc.bg_inode_table_hi) << 32;
+    }
+
+    EXT4_TRACE("mounted %" PRIu64 " blocks of %u bytes, %u groups\n",
+               blocks_count, block_size, group_count);
+
+    return true;
+}
+
+void ext4_fs_t::unmount()
+{
+    munmap(mm_dev, part_len << sector_shift);
+    mm_dev = nullptr;
+}
+
+bool ext4_fs_t::is_boot() const
+{
+    return false;
+}
+
+//
+// Read directory entry information
+
+int ext4_fs_t::getattr(fs_cpath_t path, fs_stat_t* stbuf)
+{
+    uint32_t ino;
+    inode_t inode;
+
+    int status = lookup_path(path, &ino, &inode);
+
+    if (unlikely(status < 0))
+        return status;
+
+    fill_stat(stbuf, ino, &inode);
+
+    return 0;
+}
+
+int ext4_fs_t::access(fs_cpath_t path, int mask)
+{
+    (void)mask;
+
+    uint32_t ino;
+    inode_t inode;
+
+    return lookup_path(path, &ino, &inode);
+}
+
+int ext4_fs_t::readlink(fs_cpath_t path, char* buf, size_t size)
+{
+    uint32_t ino;
+    inode_t inode;
+
+    int status = lookup_path(path, &ino, &inode);
+
+    if (unlikely(status < 0))
+        return status;
+
+    if ((inode.i_mode & mode_type_mask) != mode_type_lnk)
+        return -int(errno_t::EINVAL);
+
+    uint64_t link_size = inode_size(&inode);
+
+    if (size > link_size)
+        size = link_size;
+
+    // Fast symlinks store the target in the block map
+    if (link_size < sizeof(inode.i_block) &&
+            !(inode.i_flags & inode_flag_extents)) {
+        memcpy(buf, inode.i_block, size);
+        return size;
+    }
+
+    if (unlikely(size > block_size))
+        size = block_size;
+
+    void const *block = dir_block(&inode, 0);
+
+    if (unlikely(!block))
+        return -int(errno_t::EIO);
+
+    memcpy(buf, block, size);
+
+    return size;
+}
+
+//
+// Scan directories
+
+int ext4_fs_t::opendir(fs_file_info_t **fi, fs_cpath_t path)
+{
+    errno_t err = errno_t::OK;
+
+    file_handle_t *file = create_handle(path, err);
+
+    if (!file)
+        return -int(err);
+
+    if (unlikely(!is_dir(&file->inode))) {
+        releasedir(file);
+        return -int(errno_t::ENOTDIR);
+    }
+
+    *fi = file;
+
+    return 0;
+}
+
+ssize_t ext4_fs_t::readdir(fs_file_info_t *fi, dirent_t *buf, off_t offset)
+{
+    file_handle_t *file = (file_handle_t*)fi;
+
+    if (unlikely(!is_dir(&file->inode)))
+        return -int(errno_t::ENOTDIR);
+
+    uint64_t dir_size = inode_size(&file->inode);
+
+    off_t pos = offset;
+
+    while (uint64_t(pos) < dir_size) {
+        uint32_t block_ofs = pos & (block_size - 1);
+
+        char const *block = (char const *)
+                dir_block(&file->inode, pos >> block_shift);
+
+        if (!block) {
+            // Skip hole
+            pos += block_size - block_ofs;
+            continue;
+        }
+
+        dir_entry_t const *de = (dir_entry_t const *)(block + block_ofs);
+
+        uint32_t len = rec_len(de);
+
+        if (unlikely(len < sizeof(dir_entry_t) ||
+                     block_ofs + len > block_size)) {
+            // Corrupt entry, skip the rest of the block
+            pos += block_size - block_ofs;
+            continue;
+        }
+
+        pos += len;
+
+        if (de->inode == 0)
+            continue;
+
+        buf->d_ino = de->inode;
+        memcpy(buf->d_name, de->name(), de->name_len);
+        buf->d_name[de->name_len] = 0;
+
+        return pos - offset;
+    }
+
+    memset(buf, 0, sizeof(*buf));
+
+    return 0;
+}
+
+int ext4_fs_t::releasedir(fs_file_info_t *fi)
+{
+    handles.free((file_handle_t*)fi);
+    return 0;
+}
+
+//
+// Open/close files
+
+int ext4_fs_t::open(fs_file_info_t **fi,
+                     fs_cpath_t path, int flags, mode_t mode)
+{
+    (void)mode;
+
+    if (flags & (O_WRONLY | O_CREAT | O_TRUNC | O_APPEND))
+        return -int(errno_t::EROFS);
+
+    errno_t err = errno_t::OK;
+
+    file_handle_t *file = create_handle(path, err);
+
+    if (!file)
+        return -int(err);
+
+    file->direct = (flags & O_DIRECT) != 0;
+
+    *fi = file;
+
+    return 0;
+}
+
+int ext4_fs_t::release(fs_file_info_t *fi)
+{
+    handles.free((file_handle_t*)fi);
+    return 0;
+}
+
+//
+// Read/write files
+
+ssize_t ext4_fs_t::read(fs_file_info_t *fi, char *buf,
+                        size_t size, off_t offset)
+{
+    fs_iovec_t iov{ buf, size };
+
+    return readv(fi, &iov, 1, offset);
+}
+
+// The extents are walked once for the whole vector, each run is copied
+// into as many segments as it covers. A failure after some data was
+// copied ends the read short, like a partial readv
+ssize_t ext4_fs_t::readv(fs_file_info_t *fi, fs_iovec_t const *iov,
+                         size_t iovcnt, off_t offset)
+{
+    static char const zeros[PAGESIZE] = {};
+
+    file_handle_t *file = (file_handle_t*)fi;
+
+    uint64_t file_size = inode_size(&file->inode);
+
+    if (unlikely(offset < 0))
+        return -int(errno_t::EINVAL);
+
+    if (uint64_t(offset) >= file_size)
+        return 0;
+
+    if (file->direct)
+        return direct_readv(file, iov, iovcnt, offset);
+
+    uint64_t remain = file_size - offset;
+    size_t total = 0;
+
+    // Position in the vector
+    size_t seg = 0;
+    size_t seg_ofs = 0;
+
+    while (remain > 0 && seg < iovcnt) {
+        if (seg_ofs == iov[seg].iov_len) {
+            ++seg;
+            seg_ofs = 0;
+            continue;
+        }
+
+        uint32_t lblk = offset >> block_shift;
+
+        block_run_t run;
+
+        file_handle_t::scoped_lock lock(file->run_lock);
+        run = file->cached_run;
+        lock.unlock();
+
+        if (run.len == 0 || lblk < run.lblk || lblk - run.lblk >= run.len) {
+            int status = map_block(&file->inode, lblk, &run);
+
+            if (unlikely(status < 0))
+                return total ? total : status;
+
+            if (unlikely(run.len == 0))
+                return total ? total : -int(errno_t::EIO);
+
+            lock.lock();
+            file->cached_run = run;
+            lock.unlock();
+        }
+
+        // Transfer as much of the extent as the segment takes
+        uint64_t run_ofs = offset - (uint64_t(run.lblk) << block_shift);
+        uint64_t run_bytes = uint64_t(run.len) << block_shift;
+        size_t avail = std::min(run_bytes - run_ofs, remain);
+
+        if (avail > iov[seg].iov_len - seg_ofs)
+            avail = iov[seg].iov_len - seg_ofs;
+
+        char *io = (char*)iov[seg].iov_base + seg_ofs;
+        bool user = mm_is_user_range(io, avail);
+
+        if (run.pblk) {
+            if (unlikely(run.pblk + run.len > blocks_count))
+                return total ? total : -int(errno_t::EIO);
+
+            char const *disk_data = (char const *)
+                    lookup_block(run.pblk) + run_ofs;
+
+            if (user) {
+                if (unlikely(!mm_copy_user(io, disk_data, avail)))
+                    return total ? total : -int(errno_t::EFAULT);
+            } else {
+                memcpy(io, disk_data, avail);
+            }
+        } else if (user) {
+            // Hole or uninitialized extent
+            for (size_t done = 0; done < avail; ) {
+                size_t chunk = avail - done < sizeof(zeros)
+                        ? avail - done
+                        : sizeof(zeros);
+
+                if (unlikely(!mm_copy_user(io + done, zeros, chunk)))
+                    return total ? total : -int(errno_t::EFAULT);
+
+                done += chunk;
+            }
+        } else {
+            memset(io, 0, avail);
+        }
+
+        offset += avail;
+        remain -= avail;
+        seg_ofs += avail;
+        total += avail;
+    }
+
+    return total;
+}
+
+// O_DIRECT vector, segments that continue each other in memory
+// are read with one walk of the extents
+ssize_t ext4_fs_t::direct_readv(file_handle_t *file, fs_iovec_t const *iov,
+                                size_t iovcnt, off_t offset)
+{
+    ssize_t total = 0;
+
+    for (size_t i = 0; i < iovcnt; ) {
+        size_t size;
+        size_t count = fs_iov_contig(iov + i, iovcnt - i, &size);
+
+        ssize_t got = direct_read(file, (char*)iov[i].iov_base,
+                                  size, offset + total);
+
+        if (unlikely(got < 0))
+            return total ? total : got;
+
+        total += got;
+
+        if (size_t(got) < size)
+            break;
+
+        i += count;
+    }
+
+    return total;
+}
+
+// O_DIRECT read. Each extent is handed to the drive with the caller's
+// buffer, so the device DMAs straight into it. Holes are zero filled.
+// The buffer, size and offset must be sector aligned. When aio is given,
+// extents complete through it while it has room, and it is always finished
+ssize_t ext4_fs_t::direct_read(file_handle_t *file, char *buf,
+                               size_t size, off_t offset, fs_aio_t *aio)
+{
+    // The device writes straight into the buffer, it stays mapped
+    // until the reads are done
+    ssize_t result = fs_direct_prepare(buf, size, true, aio);
+
+    if (likely(result >= 0)) {
+        result = direct_read_issue(file, buf, size, offset, aio);
+
+        if (!aio)
+            fs_direct_release(buf, size);
+    }
+
+    if (aio)
+        aio->finish(result >= 0 ? errno_t::OK : errno_t(-result));
+
+    return result;
+}
+
+ssize_t ext4_fs_t::direct_read_issue(file_handle_t *file, char *buf,
+                                     size_t size, off_t offset, fs_aio_t *aio)
+{
+    if (unlikely(((uintptr_t(buf) | size | offset) & (sector_size - 1))))
+        return -int(errno_t::EINVAL);
+
+    uint64_t file_size = inode_size(&file->inode);
+
+    // Short read at end of file, rounded up to a whole sector
+    size_t result_size = size;
+    if (size > file_size - offset) {
+        result_size = file_size - offset;
+        size = (result_size + sector_size - 1) & -sector_size;
+    }
+
+    int status;
+
+    static char const zeros[PAGESIZE] = {};
+
+    blocking_iocp_t iocps[8];
+    size_t inflight = 0;
+    errno_t err = errno_t::OK;
+
+    char *io = buf;
+
+    while (size > 0) {
+        block_run_t run;
+
+        status = map_block(&file->inode, offset >> block_shift, &run);
+
+        if (unlikely(status < 0)) {
+            err = errno_t(-status);
+            break;
+        }
+
+        uint64_t run_ofs = offset - (uint64_t(run.lblk) << block_shift);
+        uint64_t run_bytes = uint64_t(run.len) << block_shift;
+        size_t avail = run_bytes - run_ofs;
+
+        if (avail > size)
+            avail = size;
+
+        if (run.pblk) {
+            if (unlikely(run.pblk + run.len > blocks_count)) {
+                err = errno_t::EIO;
+                break;
+            }
+
+            if (inflight == countof(iocps)) {
+                for (size_t i = 0; i < inflight; ++i) {
+                    errno_t sub_err = iocps[i].wait();
+                    if (sub_err != errno_t::OK)
+                        err = sub_err;
+                    iocps[i].reset();
+                }
+                inflight = 0;
+
+                if (unlikely(err != errno_t::OK))
+                    break;
+            }
+
+            uint64_t lba = part_st +
+                    (((run.pblk << block_shift) + run_ofs) >> sector_shift);
+
+            iocp_t *sub = aio ? aio->sub_iocp() : nullptr;
+
+            err = drive->read_async(io, avail >> sector_shift,
+                                    lba, sub ? sub : &iocps[inflight]);
+
+            if (unlikely(err != errno_t::OK))
+                break;
+
+            if (sub)
+                aio->sub_issued();
+            else
+                ++inflight;
+        } else if (mm_is_user_range(io, avail)) {
+            // Hole or uninitialized extent
+            for (size_t done = 0; done < avail; ) {
+                size_t chunk = std::min(avail - done, sizeof(zeros));
+                if (unlikely(!mm_copy_user(io + done, zeros, chunk))) {
+                    err = errno_t::EFAULT;
+                    break;
+                }
+                done += chunk;
+            }
+
+            if (unlikely(err != errno_t::OK))
+                break;
+        } else {
+            memset(io, 0, avail);
+        }
+
+        offset += avail;
+        size -= avail;
+        io += avail;
+    }
+
+    for (size_t i = 0; i < inflight; ++i) {
+        errno_t sub_err = iocps[i].wait();
+        if (sub_err != errno_t::OK)
+            err = sub_err;
+    }
+
+    if (unlikely(err != errno_t::OK))
+        return -int(err);
+
+    return result_size;
+}
+
+ssize_t ext4_fs_t::read_async(fs_file_info_t *fi, char *buf, size_t size,
+                              off_t offset, fs_aio_t *aio)
+{
+    file_handle_t *file = (file_handle_t*)fi;
+
+    // Buffered reads, and the end of file cases, complete synchronously
+    if (!file->direct || offset < 0 ||
+            uint64_t(offset) >= inode_size(&file->inode))
+        return fs_base_t::read_async(fi, buf, size, offset, aio);
+
+    return direct_read(file, buf, size, offset, aio);
+}
+
+//
+// Query open files
+
+int ext4_fs_t::fstat(fs_file_info_t *fi, fs_stat_t *st)
+{
+    file_handle_t *file = (file_handle_t*)fi;
+
+    fill_stat(st, file->ino, &file->inode);
+
+    return 0;
 }
 
 //
@@ -561,8 +1980,29 @@ int ext4_fs_t::flush(fs_file_info_t *fi)
 
 int ext4_fs_t::statfs(fs_statvfs_t* stbuf)
 {
-    (void)stbuf;
-    return -int(errno_t::ENOSYS);
+    uint64_t free_blocks = sb.s_free_blocks_count_lo;
+    uint64_t reserved_blocks = sb.s_r_blocks_count_lo;
+
+    if (has_feature(superblock_t::feature_incompat_t::IS64BIT)) {
+        free_blocks |= uint64_t(sb.s_free_blocks_count_hi) << 32;
+        reserved_blocks |= uint64_t(sb.s_r_blocks_count_hi) << 32;
+    }
+
+    stbuf->f_bsize = block_size;
+    stbuf->f_frsize = block_size;
+    stbuf->f_blocks = blocks_count;
+    stbuf->f_bfree = free_blocks;
+    stbuf->f_bavail = free_blocks > reserved_blocks
+            ? free_blocks - reserved_blocks
+            : 0;
+    stbuf->f_files = sb.s_inodes_count;
+    stbuf->f_ffree = sb.s_free_inodes_count;
+    stbuf->f_favail = sb.s_free_inodes_count;
+    memcpy(&stbuf->f_fsid, sb.s_uuid, sizeof(stbuf->f_fsid));
+    stbuf->f_flag = 0;
+    stbuf->f_namemax = 255;
+
+    return 0;
 }
 
 //
@@ -580,31 +2020,48 @@ int ext4_fs_t::lock(
 //
 // Get block map
 
+// On input, *blockno is a block index in the file, in units of blocksize,
+// on output, it is the partition relative block index, or zero for a hole
 int ext4_fs_t::bmap(
         fs_cpath_t path, size_t blocksize, uint64_t* blockno)
 {
-    (void)path;
-    (void)blocksize;
-    (void)blockno;
-    return -int(errno_t::ENOSYS);
+    if (unlikely(blocksize == 0 || blocksize > block_size ||
+                 (blocksize & (blocksize - 1))))
+        return -int(errno_t::EINVAL);
+
+    uint32_t ino;
+    inode_t inode;
+
+    int status = lookup_path(path, &ino, &inode);
+
+    if (unlikely(status < 0))
+        return status;
+
+    uint64_t byte_ofs = *blockno * blocksize;
+
+    block_run_t run;
+    status = map_block(&inode, byte_ofs >> block_shift, &run);
+
+    if (unlikely(status < 0))
+        return status;
+
+    if (!run.pblk) {
+        *blockno = 0;
+        return 0;
+    }
+
+    uint64_t disk_ofs = ((run.pblk + ((byte_ofs >> block_shift) -
+                                      run.lblk)) << block_shift) +
+            (byte_ofs & (block_size - 1));
+
+    *blockno = disk_ofs / blocksize;
+
+    return 0;
 }
 
 //
 // Read/Write/Enumerate extended attributes
 
-int ext4_fs_t::setxattr(
-        fs_cpath_t path,
-        char const* name, char const* value,
-        size_t size, int flags)
-{
-    (void)path;
-    (void)name;
-    (void)value;
-    (void)size;
-    (void)flags;
-    return -int(errno_t::ENOSYS);
-}
-
 int ext4_fs_t::getxattr(
         fs_cpath_t path,
         char const* name, char* value,
@@ -657,33 +2114,3 @@ int ext4_fs_t::poll(fs_file_info_t *fi,
     (void)reventsp;
     return -int(errno_t::ENOSYS);
 }
-
-constexpr bool enable_bitwise(ext4_fs_t::superblock_t::state_t)
-{
-    return true;
-}
-
-constexpr bool enable_bitwise(ext4_fs_t::superblock_t::feature_compat_t)
-{
-    return true;
-}
-
-constexpr bool enable_bitwise(ext4_fs_t::superblock_t::feature_incompat_t)
-{
-    return true;
-}
-
-constexpr bool enable_bitwise(ext4_fs_t::superblock_t::feature_ro_compat_t)
-{
-    return true;
-}
-
-constexpr bool enable_bitwise(ext4_fs_t::superblock_t::mount_opts_t)
-{
-    return true;
-}
-
-constexpr bool enable_bitwise(ext4_fs_t::superblock_t::misc_flags_t)
-{
-    return true;
-}
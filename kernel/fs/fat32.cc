@@ -13,6 +13,7 @@
 #include "bootinfo.h"
 #include "inttypes.h"
 #include "cxxstring.h"
+#include "../libc/include/sys/fs.h"
 
 #define DEBUG_FAT32 1
 #if DEBUG_FAT32
@@ -26,6 +27,15 @@ typedef int32_t cluster_t;
 struct fat32_fs_t final : public fs_base_t {
     FS_BASE_RW_IMPL
 
+    ssize_t read_async(fs_file_info_t *fi, char *buf, size_t size,
+                       off_t offset, fs_aio_t *aio) override final;
+    ssize_t write_async(fs_file_info_t *fi, char const *buf, size_t size,
+                        off_t offset, fs_aio_t *aio) override final;
+    ssize_t readv(fs_file_info_t *fi, fs_iovec_t const *iov,
+                  size_t iovcnt, off_t offset) override final;
+    ssize_t writev(fs_file_info_t *fi, fs_iovec_t const *iov,
+                   size_t iovcnt, off_t offset) override final;
+
     fat32_fs_t();
 
     friend class fat32_factory_t;
@@ -42,6 +52,7 @@ struct fat32_fs_t final : public fs_base_t {
             , cached_offset(0)
             , cached_cluster(0)
             , dirty(false)
+            , direct(false)
         {
         }
 
@@ -58,6 +69,9 @@ struct fat32_fs_t final : public fs_base_t {
         off_t cached_offset;
         cluster_t cached_cluster;
         bool dirty;
+
+        // Opened with O_DIRECT, transfers bypass mm_dev
+        bool direct;
     };
 
     static pool_t<file_handle_t> handles;
@@ -132,6 +146,39 @@ struct fat32_fs_t final : public fs_base_t {
     int change_dirent_start(fat32_dir_union_t *dde, cluster_t start);
 
     int sync_fat_entry(cluster_t cluster);
+    int sync_fat_block(cluster_t block_index);
+
+    // Collects runs of freed clusters and trims them on the drive.
+    // Adjacent runs are merged into one request, and a few requests
+    // are kept in flight. Does nothing if the drive can't trim
+    class discard_batch_t {
+    public:
+        explicit discard_batch_t(fat32_fs_t *fs);
+        ~discard_batch_t();
+
+        void add(cluster_t cluster, cluster_t count);
+
+        // Issue the pending run and wait for everything in flight
+        errno_t flush();
+
+    private:
+        void issue();
+
+        static constexpr size_t max_inflight = 8;
+
+        fat32_fs_t *fs;
+        cluster_t run_st;
+        cluster_t run_len;
+        size_t inflight;
+        errno_t err;
+        blocking_iocp_t iocps[max_inflight];
+    };
+
+    int free_cluster_chain(cluster_t cluster, discard_batch_t &discard);
+    int truncate_cluster_chain(file_handle_t *file, off_t length,
+                               discard_batch_t &discard);
+    int extend_file(file_handle_t *file, off_t length);
+    int trim_free(fstrim_range *range);
 
     cluster_t transact_cluster(cluster_t prev_cluster,
                               fat32_dir_union_t *dde, cluster_t cluster);
@@ -145,6 +192,23 @@ struct fat32_fs_t final : public fs_base_t {
     ssize_t internal_rw(file_handle_t *file,
             void *buf, size_t size, off_t offset, bool read);
 
+    ssize_t internal_rwv(file_handle_t *file,
+            fs_iovec_t const *iov, size_t iovcnt, off_t offset, bool read);
+
+    void seek_cluster_chain(file_handle_t *file, off_t offset, bool append);
+
+    ssize_t direct_rw(file_handle_t *file,
+            void *buf, size_t size, off_t offset, bool read,
+            fs_aio_t *aio = nullptr);
+    ssize_t direct_rw_issue(file_handle_t *file,
+            void *buf, size_t size, off_t offset, bool read,
+            fs_aio_t *aio);
+
+    // Maximum size of one O_DIRECT device request, and how many
+    // requests may be in flight at once
+    static constexpr size_t direct_max_run = size_t(4) << 20;
+    static constexpr size_t direct_max_inflight = 8;
+
     void generate_unique_shortname(full_lfn_t& lfn, uint64_t dir_index);
 
     using lock_type = std::shared_mutex;
@@ -179,6 +243,9 @@ struct fat32_fs_t final : public fs_base_t {
     uint8_t block_shift;
     uint8_t fat_block_shift;
 
+    // The drive supports trim, freed clusters are discarded
+    bool have_trim;
+
     // Synthetic root directory entry
     // to allow code to refer to root as a
     // directory entry
@@ -719,10 +786,9 @@ off_t fat32_fs_t::walk_cluster_chain(
                     panic_oom();
             }
 
+            // Link it in, the step below moves onto it
             fat[c_clus] = alloc;
             fat2[c_clus] = alloc;
-
-            c_clus = alloc;
         }
 
         c_ofs += block_size;
@@ -1009,6 +1075,264 @@ int fat32_fs_t::sync_fat_entry(cluster_t cluster)
     return result;
 }
 
+int fat32_fs_t::sync_fat_block(cluster_t block_index)
+{
+    int result = msync(fat + (block_index << fat_block_shift),
+                       block_size, MS_SYNC);
+
+    if (likely(result >= 0))
+        return msync(fat2 + (block_index << fat_block_shift),
+                     block_size, MS_SYNC);
+
+    return result;
+}
+
+fat32_fs_t::discard_batch_t::discard_batch_t(fat32_fs_t *fs)
+    : fs(fs)
+    , run_st(0)
+    , run_len(0)
+    , inflight(0)
+    , err(errno_t::OK)
+{
+}
+
+fat32_fs_t::discard_batch_t::~discard_batch_t()
+{
+    flush();
+}
+
+void fat32_fs_t::discard_batch_t::add(cluster_t cluster, cluster_t count)
+{
+    if (!fs->have_trim)
+        return;
+
+    if (run_len && cluster == run_st + run_len) {
+        run_len += count;
+        return;
+    }
+
+    issue();
+
+    run_st = cluster;
+    run_len = count;
+}
+
+void fat32_fs_t::discard_batch_t::issue()
+{
+    if (!run_len)
+        return;
+
+    uint64_t run_ofs = fs->offsetof_cluster(run_st);
+    uint64_t run_size = uint64_t(run_len) << fs->block_shift <<
+            fs->sector_shift;
+
+    run_len = 0;
+
+    // Drop whole pages of the mapping, so stale dirty pages are never
+    // written back over the discarded blocks. Partial pages may hold
+    // live neighbouring clusters, leave them alone
+    uint64_t mm_st = (run_ofs + PAGESIZE - 1) & -PAGESIZE;
+    uint64_t mm_en = (run_ofs + run_size) & -PAGESIZE;
+
+    if (mm_st < mm_en)
+        madvise(fs->mm_dev + mm_st, mm_en - mm_st, MADV_DONTNEED);
+
+    if (inflight == max_inflight) {
+        for (size_t i = 0; i < inflight; ++i) {
+            errno_t sub_err = iocps[i].wait();
+            if (sub_err != errno_t::OK)
+                err = sub_err;
+            iocps[i].reset();
+        }
+        inflight = 0;
+    }
+
+    errno_t status = fs->drive->trim_async(
+                run_size >> fs->sector_shift,
+                fs->lba_st + (run_ofs >> fs->sector_shift),
+                &iocps[inflight]);
+
+    if (likely(status == errno_t::OK))
+        ++inflight;
+    else
+        err = status;
+}
+
+errno_t fat32_fs_t::discard_batch_t::flush()
+{
+    issue();
+
+    for (size_t i = 0; i < inflight; ++i) {
+        errno_t sub_err = iocps[i].wait();
+        if (sub_err != errno_t::OK)
+            err = sub_err;
+        iocps[i].reset();
+    }
+    inflight = 0;
+
+    errno_t result = err;
+    err = errno_t::OK;
+    return result;
+}
+
+// Free every cluster from cluster to the end of its chain,
+// the caller must have already unlinked the chain
+int fat32_fs_t::free_cluster_chain(cluster_t cluster,
+                                   discard_batch_t &discard)
+{
+    cluster_t sync_block = 0;
+    bool sync_pending = false;
+
+    while (!is_eof(cluster) && cluster < end_cluster) {
+        cluster_t next = fat[cluster] & 0x0FFFFFFF;
+
+        fat[cluster] = 0;
+        fat2[cluster] = 0;
+
+        cluster_t fat_block = cluster >> fat_block_shift;
+        if (sync_pending && sync_block != fat_block) {
+            int status = sync_fat_block(sync_block);
+            if (unlikely(status < 0))
+                return status;
+        }
+
+        sync_block = fat_block;
+        sync_pending = true;
+
+        discard.add(cluster, 1);
+
+        cluster = next;
+    }
+
+    if (sync_pending)
+        return sync_fat_block(sync_block);
+
+    return 0;
+}
+
+// Cut the chain after the cluster holding the last byte, and free the rest
+int fat32_fs_t::truncate_cluster_chain(file_handle_t *file, off_t length,
+                                       discard_batch_t &discard)
+{
+    cluster_t free_st;
+
+    if (length == 0) {
+        free_st = dirent_start_cluster(file->dirent);
+        dirent_start_cluster(file->dirent, 0);
+    } else {
+        seek_cluster_chain(file, length - 1, false);
+
+        cluster_t last = file->cached_cluster;
+
+        if (unlikely(is_eof(last) ||
+                     file->cached_offset + block_size < length))
+            return -int(errno_t::EIO);
+
+        free_st = fat[last] & 0x0FFFFFFF;
+
+        if (!is_eof(free_st)) {
+            fat[last] = 0x0FFFFFFF;
+            fat2[last] = 0x0FFFFFFF;
+
+            int status = sync_fat_entry(last);
+            if (unlikely(status < 0))
+                return status;
+        }
+    }
+
+    file->dirent->size = length;
+    file->cached_cluster = dirent_start_cluster(file->dirent);
+    file->cached_offset = 0;
+
+    // The directory entry must stop referring to the clusters
+    // before they are freed
+    int status = msync(file->dirent, sizeof(*file->dirent), MS_SYNC);
+    if (unlikely(status < 0))
+        return status;
+
+    return free_cluster_chain(free_st, discard);
+}
+
+int fat32_fs_t::extend_file(file_handle_t *file, off_t length)
+{
+    off_t old_size = file->dirent->size;
+
+    // Zero the tail of the last cluster, past the old end of file,
+    // newly allocated clusters are already zeroed
+    if (old_size & (block_size - 1)) {
+        seek_cluster_chain(file, old_size, false);
+
+        if (unlikely(is_eof(file->cached_cluster)))
+            return -int(errno_t::EIO);
+
+        off_t tail = old_size - file->cached_offset;
+        memset((char*)lookup_cluster(file->cached_cluster) + tail, 0,
+               block_size - tail);
+    }
+
+    seek_cluster_chain(file, length - 1, true);
+
+    if (unlikely(!file->cached_cluster ||
+                 file->cached_offset + block_size < length))
+        return -int(errno_t::ENOSPC);
+
+    file->dirent->size = length;
+
+    return msync(file->dirent, sizeof(*file->dirent), MS_SYNC);
+}
+
+// Trim runs of free clusters that lie in the given byte range of the
+// data area, and report the number of bytes trimmed in range->len
+int fat32_fs_t::trim_free(fstrim_range *range)
+{
+    if (!have_trim)
+        return -int(errno_t::EOPNOTSUPP);
+
+    uint64_t cluster_count = end_cluster - 2;
+
+    uint64_t first = (range->start + block_size - 1) >> block_shift >>
+            sector_shift;
+    uint64_t last = range->len < (cluster_count << block_shift <<
+                                  sector_shift)
+            ? (range->start + range->len) >> block_shift >> sector_shift
+            : cluster_count;
+
+    if (last > cluster_count)
+        last = cluster_count;
+
+    uint64_t min_run = std::max(uint64_t(1), (range->minlen +
+                                block_size - 1) >> block_shift >>
+                                sector_shift);
+
+    discard_batch_t discard(this);
+
+    uint64_t trimmed = 0;
+
+    for (uint64_t i = first; i < last; ) {
+        if (!is_free(fat[i + 2])) {
+            ++i;
+            continue;
+        }
+
+        uint64_t run = 1;
+        while (i + run < last && is_free(fat[i + run + 2]))
+            ++run;
+
+        if (run >= min_run) {
+            discard.add(i + 2, run);
+            trimmed += run;
+        }
+
+        i += run;
+    }
+
+    errno_t err = discard.flush();
+
+    range->len = trimmed << block_shift << sector_shift;
+
+    return err == errno_t::OK ? 0 : -int(err);
+}
+
 void fat32_fs_t::date_encode(uint16_t *date_field, uint16_t *time_field,
                              uint8_t *centisec_field, time_of_day_t tod)
 {
@@ -1120,6 +1444,7 @@ fat32_fs_t::file_handle_t *fat32_fs_t::create_handle(
 
     file->cached_cluster = dirent_start_cluster(&fde->short_entry);
     file->cached_offset = 0;
+    file->direct = (flags & O_DIRECT) != 0;
 
     return file;
 }
@@ -1239,6 +1564,255 @@ ssize_t fat32_fs_t::internal_rw(file_handle_t *file,
     return result;
 }
 
+// Position the cached cluster at the cluster containing offset
+void fat32_fs_t::seek_cluster_chain(
+        file_handle_t *file, off_t offset, bool append)
+{
+    if (file->cached_cluster &&
+            offset >= file->cached_offset &&
+            offset < file->cached_offset + block_size)
+        return;
+
+    if (!file->cached_cluster || offset < file->cached_offset) {
+        file->cached_cluster = dirent_start_cluster(file->dirent);
+        file->cached_offset = 0;
+    }
+
+    // Give an empty file its first cluster before walking
+    if (append && !file->cached_cluster)
+        walk_cluster_chain(file, 0, true);
+
+    // The walk starts from the cached position
+    if (file->cached_cluster)
+        walk_cluster_chain(file, offset - file->cached_offset, append);
+}
+
+// O_DIRECT transfer. The cluster chain is resolved into runs of
+// physically contiguous clusters, and the caller's buffer is handed
+// to the drive for each run, so the device DMAs straight to or from
+// the user pages. The buffer, size and offset must be sector aligned.
+// When aio is given, as many read runs as it has room for complete
+// through it instead of being waited for here, and aio is always
+// finished. Writes are always waited for, the mapped pages they make
+// stale have to be dropped while the caller still holds the lock
+ssize_t fat32_fs_t::direct_rw(file_handle_t *file,
+        void *buf, size_t size, off_t offset, bool read, fs_aio_t *aio)
+{
+    // The device transfers straight to and from the buffer, it stays
+    // mapped until the transfers are done
+    ssize_t result = fs_direct_prepare(buf, size, read, aio);
+
+    if (likely(result >= 0)) {
+        result = direct_rw_issue(file, buf, size, offset, read, aio);
+
+        if (!aio)
+            fs_direct_release(buf, size);
+    }
+
+    if (aio)
+        aio->finish(result >= 0 ? errno_t::OK : errno_t(-result));
+
+    return result;
+}
+
+ssize_t fat32_fs_t::direct_rw_issue(file_handle_t *file,
+        void *buf, size_t size, off_t offset, bool read, fs_aio_t *aio)
+{
+    if (unlikely(((uintptr_t(buf) | size | offset) & (sector_size - 1))))
+        return -int(errno_t::EINVAL);
+
+    // Short read at end of file, rounded up to a whole sector,
+    // the bytes past the end of file are unspecified
+    size_t result_size = size;
+
+    if (read) {
+        if (uint64_t(offset) >= file->dirent->size)
+            return 0;
+
+        if (size > file->dirent->size - uint64_t(offset)) {
+            result_size = file->dirent->size - offset;
+            size = (result_size + sector_size - 1) & -sector_size;
+        }
+    }
+
+    if (size == 0)
+        return 0;
+
+    int status;
+
+    if (!read) {
+        // Allocate the whole range up front
+        seek_cluster_chain(file, offset + size - 1, true);
+
+        if (unlikely(!file->cached_cluster ||
+                     uint64_t(file->cached_offset) + block_size <
+                     offset + size))
+            return -int(errno_t::ENOSPC);
+    }
+
+    seek_cluster_chain(file, offset, false);
+
+    blocking_iocp_t iocps[direct_max_inflight];
+    size_t inflight = 0;
+    errno_t err = errno_t::OK;
+
+    // Mapped pages each write made stale, dropped after it completes,
+    // so a fault can't read the old data back in while it is in flight
+    char *stale_st[direct_max_inflight];
+    size_t stale_len[direct_max_inflight];
+
+    char *io = (char*)buf;
+    size_t remain = size;
+
+    while (remain > 0 && err == errno_t::OK) {
+        if (unlikely(!file->cached_cluster || is_eof(file->cached_cluster))) {
+            err = errno_t::EIO;
+            break;
+        }
+
+        uint64_t run_st = offsetof_cluster(file->cached_cluster) +
+                (offset - file->cached_offset);
+        size_t run_size = file->cached_offset + block_size - offset;
+
+        // Extend the run through physically adjacent clusters
+        while (run_size < remain && run_size < direct_max_run) {
+            cluster_t next = fat[file->cached_cluster];
+
+            if (next != file->cached_cluster + 1)
+                break;
+
+            file->cached_cluster = next;
+            file->cached_offset += block_size;
+            run_size += block_size;
+        }
+
+        if (run_size > remain)
+            run_size = remain;
+
+        // Write back anything dirty in the mapping, so the device
+        // has current data for reads and writes don't get clobbered
+        // by a later writeback of stale pages
+        char *mm_st = mm_dev + (run_st & -PAGESIZE);
+        size_t mm_len = ((run_st + run_size + PAGESIZE - 1) & -PAGESIZE) -
+                (run_st & -PAGESIZE);
+
+        status = msync(mm_st, mm_len, MS_SYNC);
+        if (unlikely(status < 0)) {
+            err = errno_t(-status);
+            break;
+        }
+
+        uint64_t lba = lba_st + (run_st >> sector_shift);
+        int64_t count = run_size >> sector_shift;
+
+        if (inflight == direct_max_inflight) {
+            for (size_t i = 0; i < inflight; ++i) {
+                errno_t sub_err = iocps[i].wait();
+                if (sub_err != errno_t::OK)
+                    err = sub_err;
+                iocps[i].reset();
+
+                if (!read)
+                    madvise(stale_st[i], stale_len[i], MADV_DONTNEED);
+            }
+            inflight = 0;
+
+            if (unlikely(err != errno_t::OK))
+                break;
+        }
+
+        // Hand a read run to the caller's completion when it has room
+        iocp_t *sub = aio && read ? aio->sub_iocp() : nullptr;
+        iocp_t *iocp = sub ? sub : &iocps[inflight];
+
+        err = read
+                ? drive->read_async(io, count, lba, iocp)
+                : drive->write_async(io, count, lba, false, iocp);
+
+        if (unlikely(err != errno_t::OK))
+            break;
+
+        // The stale pages fault back in from disk once they are dropped
+        if (sub) {
+            aio->sub_issued();
+        } else {
+            stale_st[inflight] = mm_st;
+            stale_len[inflight] = mm_len;
+            ++inflight;
+        }
+
+        io += run_size;
+        offset += run_size;
+        remain -= run_size;
+
+        // Step to the next cluster, if the run ended on a boundary
+        if (remain > 0 && offset == file->cached_offset + block_size) {
+            file->cached_cluster = fat[file->cached_cluster];
+            file->cached_offset += block_size;
+        }
+    }
+
+    for (size_t i = 0; i < inflight; ++i) {
+        errno_t sub_err = iocps[i].wait();
+        if (sub_err != errno_t::OK)
+            err = sub_err;
+
+        if (!read)
+            madvise(stale_st[i], stale_len[i], MADV_DONTNEED);
+    }
+
+    if (unlikely(err != errno_t::OK))
+        return -int(err);
+
+    if (!read) {
+        if (file->dirent->size < offset)
+            file->dirent->size = offset;
+
+        time_of_day_t now = time_ofday();
+        date_encode(&file->dirent->modified_date,
+                    &file->dirent->modified_time, nullptr, now);
+
+        file->dirent->attr |= FAT_ATTR_ARCH;
+
+        file->dirty = true;
+    }
+
+    return result_size;
+}
+
+// Segments that continue each other in memory are transferred as one,
+// which for O_DIRECT makes them one device request per cluster run.
+// The cached cluster chain position carries over from one transfer
+// to the next, so only the first one can cause a chain walk
+ssize_t fat32_fs_t::internal_rwv(file_handle_t *file,
+        fs_iovec_t const *iov, size_t iovcnt, off_t offset, bool read)
+{
+    ssize_t total = 0;
+
+    for (size_t i = 0; i < iovcnt; ) {
+        size_t size;
+        size_t count = fs_iov_contig(iov + i, iovcnt - i, &size);
+
+        ssize_t xfer = file->direct
+                ? direct_rw(file, iov[i].iov_base, size,
+                            offset + total, read)
+                : internal_rw(file, iov[i].iov_base, size,
+                              offset + total, read);
+
+        if (unlikely(xfer < 0))
+            return total ? total : xfer;
+
+        total += xfer;
+
+        if (size_t(xfer) < size)
+            break;
+
+        i += count;
+    }
+
+    return total;
+}
+
 //
 // Startup and shutdown
 
@@ -1318,6 +1892,8 @@ bool fat32_fs_t::mount(fs_init_info_t *conn)
     fat2 = (cluster_t*)lookup_sector(bpb.first_fat_lba + bpb.sec_per_fat);
     end_cluster = (lba_en - cluster_ofs) >> bit_log2(bpb.sec_per_cluster);
 
+    have_trim = drive->info(STORAGE_INFO_HAVE_TRIM) != 0;
+
     //int fat_mismatches = 0;
     //for (int i = 0, e = fat_size >> bit_log2(sizeof(cluster_t)); i < e; ++i)
     //    fat_mismatches += fat[i] != fat2[i];
@@ -1664,7 +2240,12 @@ ssize_t fat32_fs_t::read(fs_file_info_t *fi,
 {
     read_lock lock(rwlock);
 
-    return internal_rw((file_handle_t*)fi, buf, size, offset, true);
+    file_handle_t *file = (file_handle_t*)fi;
+
+    if (file->direct)
+        return direct_rw(file, buf, size, offset, true);
+
+    return internal_rw(file, buf, size, offset, true);
 }
 
 ssize_t fat32_fs_t::write(fs_file_info_t *fi,
@@ -1674,7 +2255,64 @@ ssize_t fat32_fs_t::write(fs_file_info_t *fi,
 {
     write_lock lock(rwlock);
 
-    return internal_rw((file_handle_t*)fi, (char*)buf, size, offset, false);
+    file_handle_t *file = (file_handle_t*)fi;
+
+    if (file->direct)
+        return direct_rw(file, (char*)buf, size, offset, false);
+
+    return internal_rw(file, (char*)buf, size, offset, false);
+}
+
+ssize_t fat32_fs_t::read_async(fs_file_info_t *fi,
+                               char *buf,
+                               size_t size,
+                               off_t offset,
+                               fs_aio_t *aio)
+{
+    file_handle_t *file = (file_handle_t*)fi;
+
+    if (!file->direct)
+        return fs_base_t::read_async(fi, buf, size, offset, aio);
+
+    read_lock lock(rwlock);
+
+    return direct_rw(file, buf, size, offset, true, aio);
+}
+
+ssize_t fat32_fs_t::write_async(fs_file_info_t *fi,
+                                char const *buf,
+                                size_t size,
+                                off_t offset,
+                                fs_aio_t *aio)
+{
+    file_handle_t *file = (file_handle_t*)fi;
+
+    if (!file->direct)
+        return fs_base_t::write_async(fi, buf, size, offset, aio);
+
+    write_lock lock(rwlock);
+
+    return direct_rw(file, (char*)buf, size, offset, false, aio);
+}
+
+ssize_t fat32_fs_t::readv(fs_file_info_t *fi,
+                          fs_iovec_t const *iov,
+                          size_t iovcnt,
+                          off_t offset)
+{
+    read_lock lock(rwlock);
+
+    return internal_rwv((file_handle_t*)fi, iov, iovcnt, offset, true);
+}
+
+ssize_t fat32_fs_t::writev(fs_file_info_t *fi,
+                           fs_iovec_t const *iov,
+                           size_t iovcnt,
+                           off_t offset)
+{
+    write_lock lock(rwlock);
+
+    return internal_rwv((file_handle_t*)fi, iov, iovcnt, offset, false);
 }
 
 int fat32_fs_t::ftruncate(fs_file_info_t *fi,
@@ -1682,9 +2320,38 @@ int fat32_fs_t::ftruncate(fs_file_info_t *fi,
 {
     write_lock lock(rwlock);
 
-    (void)offset;
-    (void)fi;
-    return -int(errno_t::ENOSYS);
+    file_handle_t *file = (file_handle_t*)fi;
+
+    if (unlikely(offset < 0))
+        return -int(errno_t::EINVAL);
+
+    if (unlikely(file->dirent->attr & FAT_ATTR_DIR))
+        return -int(errno_t::EISDIR);
+
+    // The size field is 32 bits
+    if (unlikely(offset > off_t(0xFFFFFFFFU)))
+        return -int(errno_t::EFBIG);
+
+    int status = 0;
+
+    if (uint64_t(offset) < file->dirent->size) {
+        discard_batch_t discard(this);
+        status = truncate_cluster_chain(file, offset, discard);
+    } else if (uint64_t(offset) > file->dirent->size) {
+        status = extend_file(file, offset);
+    }
+
+    if (likely(status >= 0)) {
+        time_of_day_t now = time_ofday();
+        date_encode(&file->dirent->modified_date,
+                    &file->dirent->modified_time, nullptr, now);
+
+        file->dirent->attr |= FAT_ATTR_ARCH;
+
+        file->dirty = true;
+    }
+
+    return status < 0 ? status : 0;
 }
 
 //
@@ -1827,12 +2494,17 @@ int fat32_fs_t::ioctl(fs_file_info_t *fi,
 {
     write_lock lock(rwlock);
 
-    (void)cmd;
     (void)arg;
     (void)fi;
     (void)flags;
-    (void)data;
-    return -int(errno_t::ENOSYS);
+
+    switch (unsigned(cmd)) {
+    case FITRIM:
+        return trim_free((fstrim_range*)data);
+
+    default:
+        return -int(errno_t::ENOSYS);
+    }
 }
 
 //
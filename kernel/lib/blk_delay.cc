@@ -0,0 +1,332 @@
+#include "blk_delay.h"
+#include "pool.h"
+#include "mutex.h"
+#include "thread.h"
+#include "time.h"
+#include "unique_ptr.h"
+
+// Requests each device can delay at once from its pool, any more
+// are allocated from the heap, so every request sees the latency
+static constexpr uint32_t blk_delay_max_requests = 512;
+
+// A sleeping thread can't be woken early, so the worker sleeps in
+// slices of the latency and looks for an earlier head after each one.
+// Requests complete at most this fraction of the latency late
+static constexpr uint64_t blk_delay_slice_div = 16;
+static constexpr uint64_t blk_delay_slice_min_ns = 20000;
+
+class blk_delay_t;
+
+struct blk_delay_request_t {
+    explicit blk_delay_request_t(blk_delay_t *owner)
+        : owner(owner)
+        , next(nullptr)
+        , caller(nullptr)
+        , due_ns(0)
+        , err(errno_t::OK)
+        , from_heap(false)
+    {
+    }
+
+    blk_delay_t *owner;
+    blk_delay_request_t *next;
+    iocp_t *caller;
+    uint64_t due_ns;
+    errno_t err;
+
+    // Allocated because the pool was exhausted
+    bool from_heap;
+
+    // Completion of the request sent to the wrapped device
+    iocp_t dev_iocp;
+};
+
+class blk_delay_t final : public storage_dev_base_t {
+public:
+    blk_delay_t(storage_dev_base_t *dev,
+                uint64_t latency_ns, uint32_t queue_depth);
+
+    bool init();
+
+    STORAGE_DEV_IMPL
+
+    void plug() override final;
+    void unplug() override final;
+    void kick() override final;
+
+    bool poll() override final;
+    void set_poll_ns(uint64_t ns) override final;
+    uint64_t get_poll_ns() const override final;
+
+private:
+    using lock_type = std::mcslock;
+    using scoped_lock = std::unique_lock<lock_type>;
+
+    blk_delay_request_t *start(iocp_t *caller);
+    void free_request(blk_delay_request_t *req);
+    errno_t started(blk_delay_request_t *req, iocp_t *caller, errno_t err);
+
+    static void completion(errno_t const& err, uintptr_t arg);
+    void completed(blk_delay_request_t *req, errno_t err);
+
+    static int worker(void *arg);
+    void worker();
+
+    storage_dev_base_t *dev;
+    uint64_t latency_ns;
+    uint32_t queue_depth;
+
+    pool_t<blk_delay_request_t> requests;
+
+    lock_type lock;
+    std::condition_variable not_empty;
+
+    // Completed requests, in due order
+    blk_delay_request_t *head;
+
+    // Longest sleep before checking whether the head changed
+    uint64_t slice_ns;
+};
+
+blk_delay_t::blk_delay_t(storage_dev_base_t *dev,
+                         uint64_t latency_ns, uint32_t queue_depth)
+    : dev(dev)
+    , latency_ns(latency_ns)
+    , queue_depth(queue_depth ? queue_depth : 1)
+    , head(nullptr)
+    , slice_ns(std::max(latency_ns / blk_delay_slice_div,
+                        blk_delay_slice_min_ns))
+{
+}
+
+bool blk_delay_t::init()
+{
+    if (!requests.create(blk_delay_max_requests))
+        return false;
+
+    return thread_create(&blk_delay_t::worker, this, 0, false) >= 0;
+}
+
+blk_delay_request_t *blk_delay_t::start(iocp_t *caller)
+{
+    blk_delay_request_t *req = requests.alloc(this);
+
+    if (unlikely(!req)) {
+        req = new blk_delay_request_t(this);
+
+        if (unlikely(!req))
+            return nullptr;
+
+        req->from_heap = true;
+    }
+
+    req->caller = caller;
+    req->due_ns = time_ns() + latency_ns;
+    req->dev_iocp.reset(&blk_delay_t::completion, uintptr_t(req));
+
+    return req;
+}
+
+void blk_delay_t::free_request(blk_delay_request_t *req)
+{
+    if (unlikely(req->from_heap))
+        delete req;
+    else
+        requests.free(req);
+}
+
+errno_t blk_delay_t::started(blk_delay_request_t *req,
+                             iocp_t *caller, errno_t err)
+{
+    if (unlikely(err != errno_t::OK)) {
+        // Never reached the device
+        free_request(req);
+        return err;
+    }
+
+    // req may already be completed and freed
+    caller->set_expect(1);
+
+    return errno_t::OK;
+}
+
+void blk_delay_t::completion(errno_t const& err, uintptr_t arg)
+{
+    blk_delay_request_t *req = (blk_delay_request_t*)arg;
+    req->owner->completed(req, err);
+}
+
+void blk_delay_t::completed(blk_delay_request_t *req, errno_t err)
+{
+    req->err = err;
+
+    scoped_lock hold(lock);
+
+    // Usually due after everything already waiting
+    blk_delay_request_t **link = &head;
+    while (*link && (*link)->due_ns <= req->due_ns)
+        link = &(*link)->next;
+
+    req->next = *link;
+    *link = req;
+
+    if (link == &head)
+        not_empty.notify_one();
+}
+
+int blk_delay_t::worker(void *arg)
+{
+    ((blk_delay_t*)arg)->worker();
+    return 0;
+}
+
+void blk_delay_t::worker()
+{
+    scoped_lock hold(lock);
+
+    for (;;) {
+        while (!head)
+            not_empty.wait(hold);
+
+        uint64_t due_ns = head->due_ns;
+        uint64_t now = time_ns();
+
+        if (now < due_ns) {
+            // A request due sooner may become the head meanwhile
+            hold.unlock();
+            thread_sleep_until(std::min(due_ns, now + slice_ns));
+            hold.lock();
+            continue;
+        }
+
+        blk_delay_request_t *req = head;
+        head = req->next;
+
+        hold.unlock();
+
+        iocp_t *caller = req->caller;
+        errno_t err = req->err;
+
+        free_request(req);
+
+        caller->set_result(err);
+        caller->invoke();
+
+        hold.lock();
+    }
+}
+
+void blk_delay_t::cleanup_dev()
+{
+    dev->cleanup_dev();
+}
+
+errno_t blk_delay_t::read_async(void *data, int64_t count,
+                                uint64_t lba, iocp_t *iocp)
+{
+    blk_delay_request_t *req = start(iocp);
+
+    if (unlikely(!req))
+        return errno_t::ENOMEM;
+
+    return started(req, iocp, dev->read_async(
+                       data, count, lba, &req->dev_iocp));
+}
+
+errno_t blk_delay_t::write_async(void const *data, int64_t count,
+                                 uint64_t lba, bool fua, iocp_t *iocp)
+{
+    blk_delay_request_t *req = start(iocp);
+
+    if (unlikely(!req))
+        return errno_t::ENOMEM;
+
+    return started(req, iocp, dev->write_async(
+                       data, count, lba, fua, &req->dev_iocp));
+}
+
+errno_t blk_delay_t::trim_async(int64_t count, uint64_t lba, iocp_t *iocp)
+{
+    blk_delay_request_t *req = start(iocp);
+
+    if (unlikely(!req))
+        return errno_t::ENOMEM;
+
+    return started(req, iocp, dev->trim_async(
+                       count, lba, &req->dev_iocp));
+}
+
+errno_t blk_delay_t::flush_async(iocp_t *iocp)
+{
+    blk_delay_request_t *req = start(iocp);
+
+    if (unlikely(!req))
+        return errno_t::ENOMEM;
+
+    return started(req, iocp, dev->flush_async(&req->dev_iocp));
+}
+
+long blk_delay_t::info(storage_dev_info_t key)
+{
+    switch (key) {
+    case STORAGE_INFO_QUEUE_COUNT:
+        return 1;
+
+    case STORAGE_INFO_QUEUE_DEPTH: {
+        long queue_count = dev->info(STORAGE_INFO_QUEUE_COUNT);
+        long dev_depth = dev->info(STORAGE_INFO_QUEUE_DEPTH);
+
+        if (queue_count > 0 && dev_depth > 0 &&
+                queue_count * dev_depth < long(queue_depth))
+            return queue_count * dev_depth;
+
+        return queue_depth;
+    }
+
+    default:
+        return dev->info(key);
+    }
+}
+
+void blk_delay_t::plug()
+{
+    dev->plug();
+}
+
+void blk_delay_t::unplug()
+{
+    dev->unplug();
+}
+
+void blk_delay_t::kick()
+{
+    dev->kick();
+}
+
+bool blk_delay_t::poll()
+{
+    return dev->poll();
+}
+
+void blk_delay_t::set_poll_ns(uint64_t ns)
+{
+    dev->set_poll_ns(ns);
+}
+
+uint64_t blk_delay_t::get_poll_ns() const
+{
+    return dev->get_poll_ns();
+}
+
+storage_dev_base_t *blk_delay_create(storage_dev_base_t *dev,
+                                     uint64_t latency_ns,
+                                     uint32_t queue_depth)
+{
+    std::unique_ptr<blk_delay_t> delay(
+                new blk_delay_t(dev, latency_ns, queue_depth));
+
+    if (unlikely(!delay || !delay->init()))
+        return nullptr;
+
+    return delay.release();
+}
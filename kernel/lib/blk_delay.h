@@ -0,0 +1,23 @@
+#pragma once
+#include "dev_storage.h"
+
+// Synthetic latency device
+//
+// Wraps a storage device, passes every request straight through to it,
+// and holds each completion back until latency_ns after the request
+// was submitted. A RAM disk behind one behaves like a slower device
+// with a deterministic service time, and a real device behind one
+// behaves like a slower device of the same kind.
+//
+// The reported queue depth is clamped to queue_depth, the block layer
+// keeps at most that many of the requests it schedules in flight.
+// Requests the block layer passes through immediately, on user memory,
+// and trims and flushes, are delayed but not held back.
+//
+// Completions are released in due order by one thread per device,
+// so the added latency is rounded up to the scheduler's wakeup
+// granularity.
+
+storage_dev_base_t *blk_delay_create(storage_dev_base_t *dev,
+                                     uint64_t latency_ns,
+                                     uint32_t queue_depth);
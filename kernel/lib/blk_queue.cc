@@ -0,0 +1,1152 @@
+#include "blk_queue.h"
+#include "bitsearch.h"
+#include "work_queue.h"
+#include "thread.h"
+#include "time.h"
+#include "mm.h"
+#include "printk.h"
+#include "inttypes.h"
+#include "callout.h"
+#include "unique_ptr.h"
+#include "fs/devfs.h"
+
+#define DEBUG_BLK_QUEUE 0
+#if DEBUG_BLK_QUEUE
+#define BLK_TRACE(...) printdbg("blk: " __VA_ARGS__)
+#else
+#define BLK_TRACE(...) ((void)0)
+#endif
+
+// Requests each queue can track, including merged ones
+static constexpr uint32_t blk_max_requests = 1024;
+
+// Never let the driver have more than this many requests outstanding
+static constexpr uint32_t blk_max_inflight = 256;
+
+// Deadline policy expiry times
+static constexpr uint64_t blk_read_expire_ns = 50000000;
+static constexpr uint64_t blk_write_expire_ns = 500000000;
+
+static std::vector<blk_queue_t*> blk_queues;
+
+struct blk_request_t {
+    explicit blk_request_t(blk_queue_t *queue)
+        : queue(queue)
+        , next(nullptr)
+        , prev(nullptr)
+        , fifo_next(nullptr)
+        , fifo_prev(nullptr)
+        , merged(nullptr)
+        , merge_next(nullptr)
+    {
+    }
+
+    blk_queue_t *queue;
+
+    // Scheduler links
+    blk_request_t *next;
+    blk_request_t *prev;
+    blk_request_t *fifo_next;
+    blk_request_t *fifo_prev;
+
+    // Requests merged into this one, they complete along with it
+    blk_request_t *merged;
+    blk_request_t *merge_next;
+
+    char *data;
+    int64_t count;
+    uint64_t lba;
+    iocp_t *caller;
+    uint64_t submit_ns;
+    uint64_t expire_ns;
+    blk_op_t op;
+    bool fua;
+    uint16_t cpu;
+
+    // Completion of the request sent to the driver
+    iocp_t dev_iocp;
+};
+
+//
+// Schedulers, all called with the queue lock held
+
+class blk_sched_t {
+public:
+    blk_sched_t(size_t max_merge_blocks, uint8_t log2_blocksize)
+        : max_merge_blocks(max_merge_blocks)
+        , log2_blocksize(log2_blocksize)
+        , count(0)
+    {
+    }
+
+    virtual ~blk_sched_t() {}
+
+    // Queue the request, or merge it into a queued request.
+    // Returns true if it was merged
+    virtual bool insert(blk_request_t *req) = 0;
+
+    // Remove and return the next request to dispatch, null if empty
+    virtual blk_request_t *next(uint64_t now) = 0;
+
+    size_t size() const
+    {
+        return count;
+    }
+
+protected:
+    bool back_merge(blk_request_t *into, blk_request_t *req);
+    bool front_merge(blk_request_t *into, blk_request_t *req);
+
+    size_t max_merge_blocks;
+    uint8_t log2_blocksize;
+
+    // Number of queued requests, not counting merged ones
+    size_t count;
+
+private:
+    bool can_merge(blk_request_t *into, blk_request_t *req);
+    static void link_merged(blk_request_t *into, blk_request_t *req);
+};
+
+bool blk_sched_t::can_merge(blk_request_t *into, blk_request_t *req)
+{
+    return into->op == req->op &&
+            into->op <= BLK_OP_WRITE &&
+            into->fua == req->fua &&
+            uint64_t(into->count + req->count) <= max_merge_blocks;
+}
+
+void blk_sched_t::link_merged(blk_request_t *into, blk_request_t *req)
+{
+    // Adopt anything already merged into req
+    blk_request_t *last = req;
+    while (last->merge_next)
+        last = last->merge_next;
+    last->merge_next = req->merged;
+    req->merged = nullptr;
+
+    last = req;
+    while (last->merge_next)
+        last = last->merge_next;
+    last->merge_next = into->merged;
+    into->merged = req;
+}
+
+// req immediately follows into, on the disk and in memory
+bool blk_sched_t::back_merge(blk_request_t *into, blk_request_t *req)
+{
+    if (!can_merge(into, req) ||
+            into->lba + into->count != req->lba ||
+            into->data + (into->count << log2_blocksize) != req->data)
+        return false;
+
+    into->count += req->count;
+    link_merged(into, req);
+
+    return true;
+}
+
+// req immediately precedes into, on the disk and in memory
+bool blk_sched_t::front_merge(blk_request_t *into, blk_request_t *req)
+{
+    if (!can_merge(into, req) ||
+            req->lba + req->count != into->lba ||
+            req->data + (req->count << log2_blocksize) != into->data)
+        return false;
+
+    into->lba = req->lba;
+    into->data = req->data;
+    into->count += req->count;
+    link_merged(into, req);
+
+    return true;
+}
+
+// Single FIFO
+class blk_sched_none_t final : public blk_sched_t {
+public:
+    using blk_sched_t::blk_sched_t;
+
+    bool insert(blk_request_t *req) override final;
+    blk_request_t *next(uint64_t now) override final;
+
+private:
+    blk_request_t *head = nullptr;
+    blk_request_t *tail = nullptr;
+};
+
+bool blk_sched_none_t::insert(blk_request_t *req)
+{
+    if (tail && back_merge(tail, req))
+        return true;
+
+    req->next = nullptr;
+    if (tail)
+        tail->next = req;
+    else
+        head = req;
+    tail = req;
+    ++count;
+
+    return false;
+}
+
+blk_request_t *blk_sched_none_t::next(uint64_t)
+{
+    blk_request_t *req = head;
+
+    if (req) {
+        head = req->next;
+        if (!head)
+            tail = nullptr;
+        --count;
+    }
+
+    return req;
+}
+
+// One FIFO per CPU, so each submitter's requests stay in order and
+// merge with each other, without sorting
+class blk_sched_mq_t final : public blk_sched_t {
+public:
+    blk_sched_mq_t(size_t max_merge_blocks, uint8_t log2_blocksize);
+
+    bool init();
+
+    bool insert(blk_request_t *req) override final;
+    blk_request_t *next(uint64_t now) override final;
+
+private:
+    struct fifo_t {
+        blk_request_t *head = nullptr;
+        blk_request_t *tail = nullptr;
+    };
+
+    std::unique_ptr<fifo_t[]> fifos;
+    size_t fifo_count;
+    size_t cursor;
+};
+
+blk_sched_mq_t::blk_sched_mq_t(size_t max_merge_blocks,
+                               uint8_t log2_blocksize)
+    : blk_sched_t(max_merge_blocks, log2_blocksize)
+    , fifo_count(0)
+    , cursor(0)
+{
+}
+
+bool blk_sched_mq_t::init()
+{
+    fifo_count = thread_get_cpu_count();
+    fifos.reset(new fifo_t[fifo_count]);
+    return fifos != nullptr;
+}
+
+bool blk_sched_mq_t::insert(blk_request_t *req)
+{
+    fifo_t& fifo = fifos[req->cpu % fifo_count];
+
+    if (fifo.tail && back_merge(fifo.tail, req))
+        return true;
+
+    req->next = nullptr;
+    if (fifo.tail)
+        fifo.tail->next = req;
+    else
+        fifo.head = req;
+    fifo.tail = req;
+    ++count;
+
+    return false;
+}
+
+blk_request_t *blk_sched_mq_t::next(uint64_t)
+{
+    if (!count)
+        return nullptr;
+
+    for (size_t i = 0; i < fifo_count; ++i) {
+        fifo_t& fifo = fifos[cursor];
+
+        if (++cursor == fifo_count)
+            cursor = 0;
+
+        blk_request_t *req = fifo.head;
+
+        if (req) {
+            fifo.head = req->next;
+            if (!fifo.head)
+                fifo.tail = nullptr;
+            --count;
+            return req;
+        }
+    }
+
+    return nullptr;
+}
+
+// Requests are kept sorted by LBA and dispatched in ascending order,
+// wrapping around at the end. Reads and writes are also kept in
+// submission order, and the oldest one is dispatched first when
+// it has waited past its deadline, so nothing starves
+class blk_sched_deadline_t final : public blk_sched_t {
+public:
+    using blk_sched_t::blk_sched_t;
+
+    bool insert(blk_request_t *req) override final;
+    blk_request_t *next(uint64_t now) override final;
+
+private:
+    struct fifo_t {
+        blk_request_t *head = nullptr;
+        blk_request_t *tail = nullptr;
+    };
+
+    void remove(blk_request_t *req);
+
+    // Sorted by LBA
+    blk_request_t *head = nullptr;
+    blk_request_t *tail = nullptr;
+
+    // The next request in elevator order, null to wrap around
+    blk_request_t *cursor = nullptr;
+    uint64_t position = 0;
+
+    // Read and write submission order
+    fifo_t fifos[2];
+};
+
+bool blk_sched_deadline_t::insert(blk_request_t *req)
+{
+    // Find the first request after req, searching from the end
+    // because streams mostly ascend
+    blk_request_t *after = nullptr;
+    blk_request_t *before = tail;
+
+    while (before && before->lba > req->lba) {
+        after = before;
+        before = before->prev;
+    }
+
+    if (before && back_merge(before, req))
+        return true;
+
+    if (after && front_merge(after, req))
+        return true;
+
+    req->prev = before;
+    req->next = after;
+
+    if (before)
+        before->next = req;
+    else
+        head = req;
+
+    if (after)
+        after->prev = req;
+    else
+        tail = req;
+
+    if (req->lba >= position && (!cursor || req->lba < cursor->lba))
+        cursor = req;
+
+    fifo_t& fifo = fifos[req->op == BLK_OP_WRITE];
+
+    req->fifo_next = nullptr;
+    req->fifo_prev = fifo.tail;
+    if (fifo.tail)
+        fifo.tail->fifo_next = req;
+    else
+        fifo.head = req;
+    fifo.tail = req;
+
+    ++count;
+
+    return false;
+}
+
+void blk_sched_deadline_t::remove(blk_request_t *req)
+{
+    if (cursor == req)
+        cursor = req->next;
+
+    if (req->prev)
+        req->prev->next = req->next;
+    else
+        head = req->next;
+
+    if (req->next)
+        req->next->prev = req->prev;
+    else
+        tail = req->prev;
+
+    fifo_t& fifo = fifos[req->op == BLK_OP_WRITE];
+
+    if (req->fifo_prev)
+        req->fifo_prev->fifo_next = req->fifo_next;
+    else
+        fifo.head = req->fifo_next;
+
+    if (req->fifo_next)
+        req->fifo_next->fifo_prev = req->fifo_prev;
+    else
+        fifo.tail = req->fifo_prev;
+
+    --count;
+}
+
+blk_request_t *blk_sched_deadline_t::next(uint64_t now)
+{
+    if (!head)
+        return nullptr;
+
+    blk_request_t *req;
+
+    if (fifos[0].head && fifos[0].head->expire_ns <= now)
+        req = fifos[0].head;
+    else if (fifos[1].head && fifos[1].head->expire_ns <= now)
+        req = fifos[1].head;
+    else if (cursor)
+        req = cursor;
+    else
+        req = head;
+
+    remove(req);
+
+    // Continue the sweep from the end of this request
+    position = req->lba + req->count;
+    cursor = req->next;
+
+    return req;
+}
+
+//
+// Latency histogram
+
+void blk_hist_t::add(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    size_t bucket = us > 1 ? bit_msb_set_64(us) : 0;
+    if (bucket >= bucket_count)
+        bucket = bucket_count - 1;
+    ++buckets[bucket];
+}
+
+uint64_t blk_hist_t::total() const
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < bucket_count; ++i)
+        sum += buckets[i];
+    return sum;
+}
+
+uint64_t blk_hist_t::percentile(unsigned pct) const
+{
+    uint64_t sum = total();
+
+    if (!sum)
+        return 0;
+
+    // Rank of the sample, rounded up
+    uint64_t rank = (sum * pct + 99) / 100;
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < bucket_count; ++i) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return (UINT64_C(2) << i) * 1000;
+    }
+
+    return (UINT64_C(2) << (bucket_count - 1)) * 1000;
+}
+
+//
+// Queue
+
+blk_queue_t::blk_queue_t(storage_dev_base_t *dev)
+    : dev(dev)
+    , sched(nullptr)
+    , policy(blk_policy_t::none)
+    , log2_blocksize(9)
+    , max_inflight(1)
+    , inflight(0)
+    , plug_count(0)
+    , max_merge_blocks(0)
+    , poll_ns(0)
+    , run_pending(false)
+    , barrier_active(false)
+    , request_waiters(0)
+    , held_head(nullptr)
+    , held_tail(nullptr)
+    , stats{}
+{
+}
+
+blk_queue_t::~blk_queue_t()
+{
+    assert(inflight == 0);
+    delete sched;
+}
+
+bool blk_queue_t::init()
+{
+    long block_size = dev->info(STORAGE_INFO_BLOCKSIZE);
+    if (block_size <= 0)
+        block_size = 512;
+
+    log2_blocksize = bit_msb_set_64(block_size);
+    long max_transfer = dev->info(STORAGE_INFO_MAX_TRANSFER);
+    if (max_transfer <= 0)
+        max_transfer = max_merge_bytes;
+
+    max_merge_blocks = size_t(max_transfer) >> log2_blocksize;
+
+    long queue_count = dev->info(STORAGE_INFO_QUEUE_COUNT);
+    long queue_depth = dev->info(STORAGE_INFO_QUEUE_DEPTH);
+
+    if (queue_count <= 0)
+        queue_count = 1;
+
+    if (queue_depth <= 0)
+        queue_depth = 1;
+
+    max_inflight = std::min(uint64_t(queue_count) * queue_depth,
+                            uint64_t(blk_max_inflight));
+
+    if (!requests.create(blk_max_requests))
+        return false;
+
+    stats.start_ns = time_ns();
+
+    // Deep multiqueue devices gain nothing from sorting
+    return set_policy(max_inflight >= 64
+                      ? blk_policy_t::mq
+                      : blk_policy_t::deadline);
+}
+
+bool blk_queue_t::set_policy(blk_policy_t new_policy)
+{
+    blk_sched_t *new_sched;
+
+    switch (new_policy) {
+    case blk_policy_t::none:
+        new_sched = new blk_sched_none_t(max_merge_blocks, log2_blocksize);
+        break;
+
+    case blk_policy_t::deadline:
+        new_sched = new blk_sched_deadline_t(
+                    max_merge_blocks, log2_blocksize);
+        break;
+
+    case blk_policy_t::mq:
+    {
+        blk_sched_mq_t *mq = new blk_sched_mq_t(
+                    max_merge_blocks, log2_blocksize);
+        if (mq && !mq->init()) {
+            delete mq;
+            mq = nullptr;
+        }
+        new_sched = mq;
+        break;
+    }
+
+    default:
+        return false;
+    }
+
+    if (unlikely(!new_sched))
+        return false;
+
+    scoped_lock hold(lock);
+
+    // Move anything queued over to the new scheduler
+    blk_sched_t *old_sched = sched;
+    if (old_sched) {
+        while (blk_request_t *req = old_sched->next(UINT64_MAX)) {
+            if (new_sched->insert(req))
+                ++stats.merges;
+        }
+    }
+
+    sched = new_sched;
+    policy = new_policy;
+
+    hold.unlock();
+
+    delete old_sched;
+
+    BLK_TRACE("%s using %s scheduler, %u in flight\n",
+              (char const *)dev->info(STORAGE_INFO_NAME),
+              blk_policy_name(new_policy), max_inflight);
+
+    return true;
+}
+
+blk_policy_t blk_queue_t::get_policy() const
+{
+    return policy;
+}
+
+void blk_queue_t::get_stats(blk_stats_t *result)
+{
+    scoped_lock hold(lock);
+    *result = stats;
+    result->inflight = inflight;
+}
+
+void blk_queue_t::peek_stats(blk_stats_t *result) const
+{
+    *result = stats;
+    result->inflight = atomic_ld_acq(&inflight);
+}
+
+storage_dev_base_t *blk_queue_t::get_dev() const
+{
+    return dev;
+}
+
+// Out of requests, wait for one to complete. Nothing may pass
+// the queue unaccounted, barriers would not see it in flight
+blk_request_t *blk_queue_t::alloc_request()
+{
+    blk_request_t *req = requests.alloc(this);
+
+    if (likely(req))
+        return req;
+
+    scoped_lock hold(lock);
+
+    ++stats.overflows;
+
+    // Registered before retrying, so a free after the retry notifies
+    atomic_inc(&request_waiters);
+
+    while (!(req = requests.alloc(this)))
+        wait_cond.wait(hold);
+
+    atomic_dec(&request_waiters);
+
+    return req;
+}
+
+void blk_queue_t::free_request(blk_request_t *req)
+{
+    requests.free(req);
+
+    if (unlikely(atomic_ld_acq(&request_waiters))) {
+        scoped_lock hold(lock);
+        wait_cond.notify_all();
+    }
+}
+
+errno_t blk_queue_t::submit(blk_op_t op, void *data, int64_t count,
+                            uint64_t lba, bool fua, iocp_t *iocp)
+{
+    blk_request_t *req = alloc_request();
+
+    req->op = op;
+    req->data = (char*)data;
+    req->count = count;
+    req->lba = lba;
+    req->fua = fua;
+    req->caller = iocp;
+    req->cpu = thread_cpu_number();
+    req->submit_ns = time_ns();
+    req->expire_ns = req->submit_ns + (op == BLK_OP_WRITE
+                                       ? blk_write_expire_ns
+                                       : blk_read_expire_ns);
+
+    bool barrier = op > BLK_OP_WRITE;
+
+    bool direct = !barrier &&
+            mm_is_user_range(data, size_t(count) << log2_blocksize);
+
+    scoped_lock hold(lock);
+
+    ++stats.requests[op];
+    stats.bytes[op] += uint64_t(count) << log2_blocksize;
+
+    if (direct) {
+        // Can't be held, it has to be issued from this thread
+        while (held_head || barrier_active)
+            wait_cond.wait(hold);
+
+        account_dispatch_locked();
+        hold.unlock();
+
+        errno_t err = issue(req);
+
+        if (unlikely(err != errno_t::OK)) {
+            hold.lock();
+            --inflight;
+            if (held_head)
+                run_locked(hold);
+            hold.unlock();
+            free_request(req);
+        }
+
+        return err;
+    }
+
+    if (barrier || held_head) {
+        // Held in order behind the oldest pending barrier
+        if (barrier && (held_head || sched->size() || inflight))
+            ++stats.barrier_waits;
+
+        hold_locked(req);
+        run_locked(hold);
+        return errno_t::OK;
+    }
+
+    if (sched->insert(req))
+        ++stats.merges;
+
+    if (plug_count && sched->size() < max_plugged) {
+        ++stats.plugged;
+        return errno_t::OK;
+    }
+
+    run_locked(hold);
+
+    return errno_t::OK;
+}
+
+void blk_queue_t::hold_locked(blk_request_t *req)
+{
+    req->next = nullptr;
+    if (held_tail)
+        held_tail->next = req;
+    else
+        held_head = req;
+    held_tail = req;
+}
+
+// Move held requests to the scheduler up to the oldest barrier.
+// Returns the barrier, accounted as dispatched, once everything
+// before it has completed
+blk_request_t *blk_queue_t::release_held_locked()
+{
+    while (held_head && !barrier_active) {
+        blk_request_t *req = held_head;
+
+        if (req->op > BLK_OP_WRITE && (sched->size() || inflight))
+            return nullptr;
+
+        held_head = req->next;
+        if (!held_head) {
+            held_tail = nullptr;
+
+            // Requests on user memory may be waiting for it to empty
+            wait_cond.notify_all();
+        }
+
+        if (req->op > BLK_OP_WRITE) {
+            barrier_active = true;
+            account_dispatch_locked();
+            return req;
+        }
+
+        if (sched->insert(req))
+            ++stats.merges;
+    }
+
+    return nullptr;
+}
+
+void blk_queue_t::account_dispatch_locked()
+{
+    ++stats.dispatches;
+
+    if (++inflight > stats.max_inflight)
+        stats.max_inflight = inflight;
+
+    size_t bucket = bit_msb_set_32(inflight);
+    if (bucket >= blk_stats_t::depth_bucket_count)
+        bucket = blk_stats_t::depth_bucket_count - 1;
+    ++stats.depth[bucket];
+}
+
+errno_t blk_queue_t::issue(blk_request_t *req)
+{
+    req->dev_iocp.reset(&blk_queue_t::completion, uintptr_t(req));
+
+    switch (req->op) {
+    case BLK_OP_READ:
+        return dev->read_async(req->data, req->count,
+                               req->lba, &req->dev_iocp);
+    case BLK_OP_WRITE:
+        return dev->write_async(req->data, req->count,
+                                req->lba, req->fua, &req->dev_iocp);
+    case BLK_OP_TRIM:
+        return dev->trim_async(req->count, req->lba, &req->dev_iocp);
+    case BLK_OP_FLUSH:
+        return dev->flush_async(&req->dev_iocp);
+    default:
+        return errno_t::EINVAL;
+    }
+}
+
+// Dispatch queued requests while the driver has room
+void blk_queue_t::run_locked(scoped_lock& hold)
+{
+    if (blk_request_t *barrier = release_held_locked()) {
+        // Nothing else is queued or in flight
+        hold.unlock();
+
+        errno_t err = issue(barrier);
+
+        if (unlikely(err != errno_t::OK)) {
+            barrier->dev_iocp.reset(nullptr);
+            complete(barrier, err);
+        }
+
+        hold.lock();
+        return;
+    }
+
+    // A pending barrier needs everything before it dispatched
+    if (plug_count && sched->size() < max_plugged && !held_head)
+        return;
+
+    uint64_t now = time_ns();
+
+    // Let the driver batch its doorbell writes across the whole run
+    bool batch = sched->size() > 1 && inflight + 1 < max_inflight;
+
+    if (batch)
+        dev->plug();
+
+    while (inflight < max_inflight) {
+        blk_request_t *req = sched->next(now);
+
+        if (!req)
+            break;
+
+        account_dispatch_locked();
+
+        hold.unlock();
+
+        errno_t err = issue(req);
+
+        if (unlikely(err != errno_t::OK)) {
+            // Never reached the driver, fail it and everything merged
+            req->dev_iocp.reset(nullptr);
+            complete(req, err);
+        }
+
+        hold.lock();
+    }
+
+    if (batch) {
+        hold.unlock();
+        dev->unplug();
+        hold.lock();
+    }
+}
+
+// Dispatch from a worker, drivers complete requests while
+// holding their own locks, so never submit from a completion
+void blk_queue_t::run_later()
+{
+    if (atomic_xchg(&run_pending, true))
+        return;
+
+    workq::enqueue([this] {
+        atomic_st_rel(&run_pending, false);
+        scoped_lock hold(lock);
+        run_locked(hold);
+    });
+}
+
+void blk_queue_t::complete(blk_request_t *req, errno_t err)
+{
+    uint64_t now = time_ns();
+
+    blk_request_t *merged = req->merged;
+
+    scoped_lock hold(lock);
+
+    stats.latency[req->op].add(now - req->submit_ns);
+    for (blk_request_t *it = merged; it; it = it->merge_next)
+        stats.latency[it->op].add(now - it->submit_ns);
+
+    --inflight;
+
+    if (req->op > BLK_OP_WRITE) {
+        barrier_active = false;
+        wait_cond.notify_all();
+    }
+
+    // The oldest barrier may be waiting for this one to complete
+    bool more = sched->size() != 0 || held_head;
+
+    hold.unlock();
+
+    while (req) {
+        iocp_t *caller = req->caller;
+
+        free_request(req);
+
+        caller->set_result(err);
+        caller->set_expect(1);
+        caller->invoke();
+
+        req = merged;
+        merged = merged ? merged->merge_next : nullptr;
+    }
+
+    if (more)
+        run_later();
+}
+
+void blk_queue_t::completion(errno_t const& err, uintptr_t arg)
+{
+    blk_request_t *req = (blk_request_t*)arg;
+    req->queue->complete(req, err);
+}
+
+void blk_queue_t::plug()
+{
+    scoped_lock hold(lock);
+    ++plug_count;
+}
+
+void blk_queue_t::unplug()
+{
+    scoped_lock hold(lock);
+    assert(plug_count > 0);
+    if (--plug_count == 0)
+        run_locked(hold);
+}
+
+void blk_queue_t::kick()
+{
+    scoped_lock hold(lock);
+
+    if (!sched->size())
+        return;
+
+    // Let everything queued so far through, even if plugged
+    uint32_t saved_plug_count = plug_count;
+    plug_count = 0;
+    run_locked(hold);
+    plug_count = saved_plug_count;
+}
+
+bool blk_queue_t::poll()
+{
+    return dev->poll();
+}
+
+void blk_queue_t::set_poll_ns(uint64_t ns)
+{
+    atomic_st_rel(&poll_ns, ns);
+}
+
+uint64_t blk_queue_t::get_poll_ns() const
+{
+    return atomic_ld_acq(&poll_ns);
+}
+
+void blk_queue_t::cleanup_dev()
+{
+    dev->cleanup_dev();
+}
+
+errno_t blk_queue_t::read_async(void *data, int64_t count,
+                                uint64_t lba, iocp_t *iocp)
+{
+    return submit(BLK_OP_READ, data, count, lba, false, iocp);
+}
+
+errno_t blk_queue_t::write_async(void const *data, int64_t count,
+                                 uint64_t lba, bool fua, iocp_t *iocp)
+{
+    return submit(BLK_OP_WRITE, (void*)data, count, lba, fua, iocp);
+}
+
+errno_t blk_queue_t::trim_async(int64_t count, uint64_t lba, iocp_t *iocp)
+{
+    return submit(BLK_OP_TRIM, nullptr, count, lba, false, iocp);
+}
+
+errno_t blk_queue_t::flush_async(iocp_t *iocp)
+{
+    return submit(BLK_OP_FLUSH, nullptr, 0, 0, false, iocp);
+}
+
+long blk_queue_t::info(storage_dev_info_t key)
+{
+    return dev->info(key);
+}
+
+blk_queue_t *blk_queue_create(storage_dev_base_t *dev)
+{
+    std::unique_ptr<blk_queue_t> queue(new blk_queue_t(dev));
+
+    if (unlikely(!queue || !queue->init()))
+        return nullptr;
+
+    if (unlikely(!blk_queues.push_back(queue.get())))
+        return nullptr;
+
+    return queue.release();
+}
+
+size_t blk_queue_count()
+{
+    return blk_queues.size();
+}
+
+blk_queue_t *blk_queue_get(size_t index)
+{
+    return index < blk_queues.size() ? blk_queues[index] : nullptr;
+}
+
+char const *blk_policy_name(blk_policy_t policy)
+{
+    switch (policy) {
+    case blk_policy_t::none:
+        return "none";
+    case blk_policy_t::deadline:
+        return "deadline";
+    case blk_policy_t::mq:
+        return "mq";
+    default:
+        return "?";
+    }
+}
+
+char const *blk_op_name(blk_op_t op)
+{
+    switch (op) {
+    case BLK_OP_READ:
+        return "read";
+    case BLK_OP_WRITE:
+        return "write";
+    case BLK_OP_TRIM:
+        return "trim";
+    case BLK_OP_FLUSH:
+        return "flush";
+    default:
+        return "?";
+    }
+}
+
+//
+// Statistics text, served as /dev/blkstat and by the debugger
+
+// Appends to a buffer that may be too small, keeping track of
+// how long the whole text would have been
+struct blk_stats_writer_t {
+    char *buf;
+    size_t size;
+    size_t len;
+
+    _printf_format(2, 3)
+    void printf(char const *format, ...)
+    {
+        va_list ap;
+        va_start(ap, format);
+        size_t avail = len < size ? size - len : 0;
+        len += vsnprintf(avail ? buf + len : nullptr, avail, format, ap);
+        va_end(ap);
+    }
+};
+
+static void blk_stats_format_hist(blk_stats_writer_t& out,
+                                  blk_hist_t const& hist)
+{
+    for (size_t i = 0; i < blk_hist_t::bucket_count; ++i) {
+        if (hist.buckets[i])
+            out.printf(" <%" PRIu64 "us:%" PRIu64,
+                       UINT64_C(2) << i, hist.buckets[i]);
+    }
+}
+
+static void blk_stats_format_queue(blk_stats_writer_t& out, size_t index,
+                                   blk_queue_t *queue, bool nolock)
+{
+    blk_stats_t st;
+
+    if (nolock)
+        queue->peek_stats(&st);
+    else
+        queue->get_stats(&st);
+
+    storage_dev_base_t *dev = queue->get_dev();
+
+    uint64_t elap_ns = time_ns() - st.start_ns;
+
+    out.printf("blk%zu %s policy=%s inflight=%u max_inflight=%u"
+               " dispatches=%" PRIu64 " merges=%" PRIu64
+               " plugged=%" PRIu64 " overflows=%" PRIu64
+               " barrier_waits=%" PRIu64 " uptime_ms=%" PRIu64 "\n",
+               index, (char const *)dev->info(STORAGE_INFO_NAME),
+               blk_policy_name(queue->get_policy()),
+               st.inflight, st.max_inflight, st.dispatches, st.merges,
+               st.plugged, st.overflows, st.barrier_waits,
+               elap_ns / 1000000);
+
+    for (size_t op = 0; op < BLK_OP_COUNT; ++op) {
+        blk_hist_t const& hist = st.latency[op];
+
+        out.printf("  %-5s ios=%" PRIu64 " bytes=%" PRIu64
+                   " avg_KBps=%" PRIu64 " p50_us=%" PRIu64
+                   " p99_us=%" PRIu64 "\n",
+                   blk_op_name(blk_op_t(op)), st.requests[op], st.bytes[op],
+                   elap_ns ? st.bytes[op] * 1000000 / elap_ns : 0,
+                   hist.percentile(50) / 1000, hist.percentile(99) / 1000);
+
+        if (hist.total()) {
+            out.printf("  %-5s latency", blk_op_name(blk_op_t(op)));
+            blk_stats_format_hist(out, hist);
+            out.printf("\n");
+        }
+    }
+
+    out.printf("  depth");
+    for (size_t i = 0; i < blk_stats_t::depth_bucket_count; ++i) {
+        if (st.depth[i])
+            out.printf(" %u-%u:%" PRIu64, 1U << i, (2U << i) - 1,
+                       st.depth[i]);
+    }
+    out.printf("\n");
+}
+
+size_t blk_stats_format(char *buf, size_t size, bool nolock)
+{
+    blk_stats_writer_t out{ buf, size, 0 };
+
+    for (size_t i = 0; i < blk_queues.size(); ++i)
+        blk_stats_format_queue(out, i, blk_queues[i], nolock);
+
+    return out.len;
+}
+
+void blk_dump_stats()
+{
+    size_t len = blk_stats_format(nullptr, 0, false);
+
+    ext::unique_ptr_free<char> text((char*)malloc(len + 1));
+
+    if (!text)
+        return;
+
+    blk_stats_format(text, len + 1, false);
+
+    printk("%s", text.get());
+}
+
+static size_t blk_stats_snapshot(char *buf, size_t size)
+{
+    return blk_stats_format(buf, size, false);
+}
+
+static void blk_stats_register(void *)
+{
+    devfs_add_snapshot("blkstat", blk_stats_snapshot);
+}
+
+REGISTER_CALLOUT(blk_stats_register, nullptr,
+                 callout_type_t::storage_dev, "001");
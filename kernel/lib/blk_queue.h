@@ -0,0 +1,207 @@
+#pragma once
+#include "dev_storage.h"
+#include "pool.h"
+#include "mutex.h"
+
+// Block I/O scheduling layer
+//
+// Every storage device found by a storage interface is wrapped in a
+// blk_queue_t before it is made visible through storage_dev_open, so
+// filesystems and the device mapping page fault path never call a driver
+// directly. The queue limits the number of requests in flight to what
+// the driver reports through info, holds the rest in a pluggable
+// scheduler where adjacent requests are merged, and keeps latency
+// histograms.
+//
+// Drivers translate buffer addresses in the submitting thread's address
+// space, so requests on user memory are never held back, they are passed
+// to the driver immediately and only accounted.
+//
+// Trim and flush are barriers. Everything submitted before one is
+// dispatched and completed before it is sent to the driver, and
+// everything submitted after it waits until it completes, so a flush
+// covers every earlier write and a trim is never reordered with
+// overlapping writes. Requests on user memory that arrive while a
+// barrier is pending wait in the submitting thread.
+
+enum struct blk_policy_t : uint8_t {
+    // FIFO, merges with the most recently queued request
+    none,
+
+    // Sorted by LBA and dispatched in one-way elevator order,
+    // unless the oldest read or write has passed its deadline
+    deadline,
+
+    // One FIFO per CPU, dispatched round robin
+    mq
+};
+
+enum blk_op_t : uint8_t {
+    BLK_OP_READ,
+    BLK_OP_WRITE,
+    BLK_OP_TRIM,
+    BLK_OP_FLUSH,
+    BLK_OP_COUNT
+};
+
+// Log2 latency histogram. Bucket n counts latencies from 2^n up to
+// 2^(n+1) microseconds, bucket 0 also counts anything shorter, and the
+// last bucket also counts anything longer
+struct blk_hist_t {
+    static constexpr size_t bucket_count = 24;
+
+    void add(uint64_t ns);
+
+    // Upper bound of the bucket holding the given percentile, in ns
+    uint64_t percentile(unsigned pct) const;
+
+    uint64_t total() const;
+
+    uint64_t buckets[bucket_count];
+};
+
+struct blk_stats_t {
+    // Depth bucket n counts dispatches that found from 2^n up to
+    // 2^(n+1)-1 requests in flight, including the dispatched one
+    static constexpr size_t depth_bucket_count = 9;
+
+    // When the counters started, from time_ns
+    uint64_t start_ns;
+
+    uint64_t requests[BLK_OP_COUNT];
+    uint64_t bytes[BLK_OP_COUNT];
+
+    // Requests merged into another queued request
+    uint64_t merges;
+
+    // Requests sent to the driver, after merging
+    uint64_t dispatches;
+
+    // Requests held back by a plug
+    uint64_t plugged;
+
+    // Submits that waited because the request pool was exhausted
+    uint64_t overflows;
+
+    // Trims and flushes that had to wait for earlier requests
+    uint64_t barrier_waits;
+
+    uint32_t inflight;
+    uint32_t max_inflight;
+
+    uint64_t depth[depth_bucket_count];
+
+    // Submit to completion, including time spent queued
+    blk_hist_t latency[BLK_OP_COUNT];
+};
+
+struct blk_request_t;
+class blk_sched_t;
+
+class blk_queue_t final : public storage_dev_base_t {
+public:
+    explicit blk_queue_t(storage_dev_base_t *dev);
+    ~blk_queue_t();
+
+    bool init();
+
+    STORAGE_DEV_IMPL
+
+    void plug() override final;
+    void unplug() override final;
+    void kick() override final;
+
+    bool poll() override final;
+    void set_poll_ns(uint64_t ns) override final;
+    uint64_t get_poll_ns() const override final;
+
+    bool set_policy(blk_policy_t policy);
+    blk_policy_t get_policy() const;
+
+    void get_stats(blk_stats_t *stats);
+
+    // Copy the counters without taking the queue lock, for the
+    // debugger, which may have stopped a CPU that holds it
+    void peek_stats(blk_stats_t *stats) const;
+
+    storage_dev_base_t *get_dev() const;
+
+private:
+    using lock_type = std::mcslock;
+    using scoped_lock = std::unique_lock<lock_type>;
+
+    // Merged requests are limited to this many bytes,
+    // or to the device's maximum transfer if it reports one
+    static constexpr size_t max_merge_bytes = size_t(256) << 10;
+
+    // A plugged queue holds at most this many requests
+    static constexpr size_t max_plugged = 32;
+
+    errno_t submit(blk_op_t op, void *data, int64_t count,
+                   uint64_t lba, bool fua, iocp_t *iocp);
+
+    errno_t issue(blk_request_t *req);
+
+    blk_request_t *alloc_request();
+    void free_request(blk_request_t *req);
+
+    void hold_locked(blk_request_t *req);
+    blk_request_t *release_held_locked();
+
+    void account_dispatch_locked();
+
+    void run_locked(scoped_lock& hold);
+    void run_later();
+
+    void complete(blk_request_t *req, errno_t err);
+    static void completion(errno_t const& err, uintptr_t arg);
+
+    storage_dev_base_t *dev;
+    blk_sched_t *sched;
+    blk_policy_t policy;
+
+    uint8_t log2_blocksize;
+    uint32_t max_inflight;
+    uint32_t inflight;
+    uint32_t plug_count;
+    size_t max_merge_blocks;
+    uint64_t poll_ns;
+    bool run_pending;
+
+    // A trim or flush has been sent to the driver
+    bool barrier_active;
+
+    // Submits waiting for a free request
+    uint32_t request_waiters;
+
+    // The oldest pending trim or flush and everything submitted
+    // after it, in submission order
+    blk_request_t *held_head;
+    blk_request_t *held_tail;
+
+    pool_t<blk_request_t> requests;
+
+    lock_type lock;
+
+    // Signalled when a barrier completes and when requests are freed
+    std::condition_variable wait_cond;
+
+    blk_stats_t stats;
+};
+
+blk_queue_t *blk_queue_create(storage_dev_base_t *dev);
+
+size_t blk_queue_count();
+blk_queue_t *blk_queue_get(size_t index);
+
+char const *blk_policy_name(blk_policy_t policy);
+
+char const *blk_op_name(blk_op_t op);
+
+// Format the counters of every queue as text, like snprintf, returns
+// the length the whole text needs. With nolock, the counters are read
+// without taking any queue lock
+size_t blk_stats_format(char *buf, size_t size, bool nolock);
+
+// Print the counters of every queue
+void blk_dump_stats();
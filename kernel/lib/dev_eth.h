@@ -4,21 +4,89 @@
 
 #include "dev_registration.h"
 #include "eth_q.h"
+#include "eth_tx.h"
 
 struct eth_dev_factory_t {
     eth_dev_factory_t(char const *name);
     virtual int detect(eth_dev_base_t ***result) = 0;
 };
 
-struct eth_dev_base_t {
+// Polled receive ring, see eth_rx.h. A single queue NIC is its
+// own receive ring, a multiqueue NIC has one for each ring
+struct eth_rx_queue_t {
+    // Take at most budget frames from the receive ring, pass them
+    // to eth_rx_deliver, and return how many were taken. Called
+    // with the receive interrupt masked
+    virtual int rx_poll(int budget) { (void)budget; return 0; }
+
+    // Unmask the receive interrupt after rx_poll drained the ring.
+    // Frames that arrived since then must not be left waiting for
+    // the next interrupt, the driver calls eth_rx_schedule for them
+    virtual void rx_irq_unmask() {}
+
+    // Set while a receive poll is queued or running
+    bool volatile rx_poll_scheduled = false;
+};
+
+// Transmit ring, see eth_tx.h. The transmit layer calls these on
+// one CPU at a time, with interrupts disabled
+struct eth_tx_queue_t {
+    // Post up to count frames to the ring without notifying the
+    // device, return how many fit. Posted frames belong to the ring
+    virtual size_t tx_post(ethq_pkt_t **pkts, size_t count) = 0;
+
+    // Notify the device of the frames posted since the last kick
+    virtual void tx_kick() {}
+
+    // Call the callbacks of completed frames and release them. Returns
+    // the total of their ethq_pkt_total_size from before tx_post
+    virtual size_t tx_reclaim() = 0;
+
+    // Frames are waiting for completions. Unless the device always
+    // interrupts on completion, enable that, and call eth_tx_complete
+    // from the interrupt. Returns true if frames already completed
+    virtual bool tx_wait() { return false; }
+
+    eth_tx_state_t tx_state;
+};
+
+// Offloads reported by get_offloads
+
+// Fills in the checksum of ETHQ_OFFLOAD_CSUM packets
+#define ETH_DEV_OFFLOAD_TX_CSUM     (1U<<0)
+
+// Segments ETHQ_OFFLOAD_TSO4 packets into gso_size segments
+#define ETH_DEV_OFFLOAD_TSO4        (1U<<1)
+
+// Marks received packets with good checksums ETHQ_OFFLOAD_CSUM_OK
+#define ETH_DEV_OFFLOAD_RX_CSUM     (1U<<2)
+
+struct eth_dev_base_t : public eth_rx_queue_t {
     // Set/get dimensions
     virtual int send(ethq_pkt_t *pkt) = 0;
 
+    // Send count frames, with one doorbell if the driver can. Returns
+    // how many were queued, like send for each of them
+    virtual size_t send_batch(ethq_pkt_t **pkts, size_t count)
+    {
+        size_t sent = 0;
+        for (size_t i = 0; i < count; ++i)
+            sent += send(pkts[i]);
+        return sent;
+    }
+
     virtual void get_mac(void *mac_addr) = 0;
     virtual void set_mac(void const *mac_addr) = 0;
 
     virtual int get_promiscuous() = 0;
     virtual void set_promiscuous(int promiscuous) = 0;
+
+    // ETH_DEV_OFFLOAD_* bits
+    virtual unsigned get_offloads() { return 0; }
+
+    // Receive rings in use. A NIC with more than one spreads
+    // flows across them by hash, see rss.h
+    virtual size_t rx_queue_count() { return 1; }
 };
 
 #define ETH_DEV_IMPL                                        \
@@ -1,10 +1,20 @@
 #include "dev_storage.h"
+#include "blk_queue.h"
+#include "blk_delay.h"
 
 #include "printk.h"
 #include "string.h"
 #include "assert.h"
 #include "vector.h"
 #include "cpu/control_regs.h"
+#include "time.h"
+#include "mm.h"
+#include "process.h"
+
+// Put a synthetic latency device in front of every storage device,
+// to see how the layers above behave on slower hardware. 0 disables it
+#define STORAGE_DELAY_NS        0
+#define STORAGE_DELAY_DEPTH     32
 
 #define DEBUG_STORAGE   0
 #if DEBUG_STORAGE
@@ -84,8 +94,21 @@ void probe_storage_factory(storage_if_factory_t *factory)
         for (unsigned k = 0; k < dev_list.size(); ++k) {
             // Calculate pointer to storage device instance
             storage_dev_base_t *dev = dev_list[k];
+
+            if (STORAGE_DELAY_NS) {
+                dev = blk_delay_create(dev, STORAGE_DELAY_NS,
+                                       STORAGE_DELAY_DEPTH);
+                if (!dev)
+                    panic_oom();
+            }
+
+            // Everything above the driver goes through the block layer
+            storage_dev_base_t *queue = blk_queue_create(dev);
+            if (!queue)
+                panic_oom();
+
             // Store device instance
-            if (!storage_devs.push_back(dev))
+            if (!storage_devs.push_back(queue))
                 panic_oom();
         }
     }
@@ -149,6 +172,18 @@ fs_base_t *fs_from_id(size_t id)
             : nullptr;
 }
 
+size_t fs_mount_count()
+{
+    return fs_mounts.size();
+}
+
+char const *fs_name_from_id(size_t id)
+{
+    return id < fs_mounts.size()
+            ? fs_mounts[id].reg->name
+            : nullptr;
+}
+
 void part_register_factory(char const *name, part_factory_t *factory)
 {
     if (!part_factories.push_back(factory))
@@ -194,6 +229,187 @@ static void invoke_part_factories(void *arg)
 REGISTER_CALLOUT(invoke_part_factories, nullptr,
                  callout_type_t::partition_probe, "000");
 
+int fs_direct_prepare(void *buf, size_t size, bool dev_writes,
+                      fs_aio_t *aio)
+{
+    if (!size || !mm_is_user_range(buf, size))
+        return 0;
+
+    // The drivers translate buffers with mphysranges, which only
+    // faults pages in for reading. Pinning faults them in writable
+    // when the device writes, so it never writes a shared zero page
+    if (unlikely(!mm_pin_user(buf, size, dev_writes)))
+        return -int(errno_t::EFAULT);
+
+    if (aio)
+        aio->pinned(buf, size, thread_current_process()->mmu_context);
+
+    return 0;
+}
+
+void fs_direct_release(void *buf, size_t size)
+{
+    if (size && mm_is_user_range(buf, size))
+        mm_unpin_user(buf, size, 0);
+}
+
+size_t fs_iov_contig(fs_iovec_t const *iov, size_t iovcnt, size_t *size)
+{
+    size_t count = 1;
+    size_t len = iov[0].iov_len;
+
+    while (count < iovcnt && (char*)iov[0].iov_base + len ==
+           iov[count].iov_base) {
+        len += iov[count].iov_len;
+        ++count;
+    }
+
+    *size = len;
+
+    return count;
+}
+
+ssize_t fs_base_t::readv(fs_file_info_t *fi, fs_iovec_t const *iov,
+                         size_t iovcnt, off_t offset)
+{
+    ssize_t total = 0;
+
+    for (size_t i = 0; i < iovcnt; ) {
+        size_t size;
+        size_t count = fs_iov_contig(iov + i, iovcnt - i, &size);
+
+        ssize_t got = read(fi, (char*)iov[i].iov_base, size, offset + total);
+
+        // Report partial success if anything was transferred
+        if (unlikely(got < 0))
+            return total ? total : got;
+
+        total += got;
+
+        if (size_t(got) < size)
+            break;
+
+        i += count;
+    }
+
+    return total;
+}
+
+ssize_t fs_base_t::writev(fs_file_info_t *fi, fs_iovec_t const *iov,
+                          size_t iovcnt, off_t offset)
+{
+    ssize_t total = 0;
+
+    for (size_t i = 0; i < iovcnt; ) {
+        size_t size;
+        size_t count = fs_iov_contig(iov + i, iovcnt - i, &size);
+
+        ssize_t put = write(fi, (char const *)iov[i].iov_base,
+                            size, offset + total);
+
+        if (unlikely(put < 0))
+            return total ? total : put;
+
+        total += put;
+
+        if (size_t(put) < size)
+            break;
+
+        i += count;
+    }
+
+    return total;
+}
+
+ssize_t fs_base_t::read_async(fs_file_info_t *fi, char *buf, size_t size,
+                              off_t offset, fs_aio_t *aio)
+{
+    ssize_t result = read(fi, buf, size, offset);
+    aio->finish(result >= 0 ? errno_t::OK : errno_t(-result));
+    return result;
+}
+
+ssize_t fs_base_t::write_async(fs_file_info_t *fi, char const *buf,
+                               size_t size, off_t offset, fs_aio_t *aio)
+{
+    ssize_t result = write(fi, buf, size, offset);
+    aio->finish(result >= 0 ? errno_t::OK : errno_t(-result));
+    return result;
+}
+
+fs_aio_t::fs_aio_t()
+    : sub_count(0)
+    , callback(nullptr)
+    , callback_arg(0)
+    , pin_st(nullptr)
+    , pin_len(0)
+    , pin_context(0)
+{
+}
+
+void fs_aio_t::reset(iocp_t::callback_t callback, uintptr_t arg)
+{
+    this->callback = callback;
+    callback_arg = arg;
+    pin_st = nullptr;
+    pin_len = 0;
+    iocp.reset(&fs_aio_t::done_handler, uintptr_t(this));
+    sub_count = 0;
+}
+
+void fs_aio_t::pinned(void *st, size_t len, uintptr_t mmu_context)
+{
+    pin_st = st;
+    pin_len = len;
+    pin_context = mmu_context;
+}
+
+void fs_aio_t::done_handler(errno_t const& err, uintptr_t arg)
+{
+    fs_aio_t *self = (fs_aio_t*)arg;
+
+    if (self->pin_len)
+        mm_unpin_user(self->pin_st, self->pin_len, self->pin_context);
+
+    self->callback(err, self->callback_arg);
+}
+
+iocp_t *fs_aio_t::sub_iocp()
+{
+    if (unlikely(sub_count == max_sub))
+        return nullptr;
+
+    iocp_t *result = sub + sub_count;
+    result->reset(&fs_aio_t::sub_handler, uintptr_t(this));
+    return result;
+}
+
+void fs_aio_t::sub_issued()
+{
+    assert(sub_count < max_sub);
+    ++sub_count;
+}
+
+void fs_aio_t::finish(errno_t status)
+{
+    if (status != errno_t::OK || !sub_count)
+        iocp.set_result(status);
+
+    if (sub_count) {
+        iocp.set_expect(sub_count);
+    } else {
+        iocp.set_expect(1);
+        iocp.invoke();
+    }
+}
+
+void fs_aio_t::sub_handler(errno_t const& err, uintptr_t arg)
+{
+    fs_aio_t *self = (fs_aio_t*)arg;
+    self->iocp.set_result(err);
+    self->iocp.invoke();
+}
+
 fs_factory_t::fs_factory_t(char const *factory_name)
     : name(factory_name)
 {
@@ -227,26 +443,49 @@ void part_factory_t::register_factory(void *p)
     part_register_factory(instance->name, instance);
 }
 
-int storage_dev_base_t::read_blocks(void *data, int64_t count, uint64_t lba)
+errno_t storage_dev_base_t::wait(blocking_iocp_t &block, int64_t poll_ns)
+{
+    kick();
+
+    if (poll_ns < 0)
+        poll_ns = get_poll_ns();
+
+    if (poll_ns > 0 && !block.is_done()) {
+        // Hybrid polling, spin for a while, then sleep
+        // and let the interrupt wake us
+        uint64_t deadline = time_ns() + poll_ns;
+
+        do {
+            if (!poll())
+                pause();
+        } while (!block.is_done() && time_ns() < deadline);
+    }
+
+    return block.wait();
+}
+
+int storage_dev_base_t::read_blocks(void *data, int64_t count, uint64_t lba,
+                                    int64_t poll_ns)
 {
     blocking_iocp_t block;
     errno_t err = read_async(data, count, lba, &block);
     if (unlikely(err != errno_t::OK))
         return -int64_t(err);
-    err = block.wait();
+    err = wait(block, poll_ns);
     if (unlikely(err != errno_t::OK))
         return -int64_t(err);
     return count;
 }
 
 int storage_dev_base_t::write_blocks(
-        const void *data, int64_t count, uint64_t lba, bool fua)
+        const void *data, int64_t count, uint64_t lba, bool fua,
+        int64_t poll_ns)
 {
     blocking_iocp_t block;
     errno_t err = write_async(data, count, lba, fua, &block);
     if (unlikely(err != errno_t::OK))
         return -int64_t(err);
-    err = block.wait();
+    err = wait(block, poll_ns);
     if (unlikely(err != errno_t::OK))
         return -int64_t(err);
     return count;
@@ -257,6 +496,7 @@ int64_t storage_dev_base_t::trim_blocks(int64_t count, uint64_t lba)
     errno_t err = trim_async(count, lba, &block);
     if (unlikely(err != errno_t::OK))
         return -int64_t(err);
+    kick();
     err = block.wait();
     if (unlikely(err != errno_t::OK))
         return -int64_t(err);
@@ -269,6 +509,7 @@ int storage_dev_base_t::flush()
     errno_t err = flush_async(&block);
     if (unlikely(err != errno_t::OK))
         return -int64_t(err);
+    kick();
     err = block.wait();
     if (unlikely(err != errno_t::OK))
         return -int64_t(err);
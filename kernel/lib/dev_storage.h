@@ -20,7 +20,15 @@ enum storage_dev_info_t : uint32_t {
     STORAGE_INFO_NONE = 0,
     STORAGE_INFO_BLOCKSIZE,
     STORAGE_INFO_HAVE_TRIM,
-    STORAGE_INFO_NAME
+    STORAGE_INFO_NAME,
+
+    // Number of hardware queues, and how many requests
+    // each of them can have outstanding
+    STORAGE_INFO_QUEUE_COUNT,
+    STORAGE_INFO_QUEUE_DEPTH,
+
+    // Largest transfer the device handles in one command, in bytes
+    STORAGE_INFO_MAX_TRANSFER
 };
 
 struct storage_dev_base_t {
@@ -44,17 +52,66 @@ struct storage_dev_base_t {
 
     virtual errno_t flush_async(iocp_t *iocp) = 0;
 
-    // Synchronous wrappers
+    // Synchronous wrappers. poll_ns overrides the device polling
+    // budget for this request, -1 uses get_poll_ns, 0 never polls
 
-    int read_blocks(void *data, int64_t count, uint64_t lba);
+    int read_blocks(void *data, int64_t count, uint64_t lba,
+                    int64_t poll_ns = -1);
 
-    int write_blocks(void const *data, int64_t count, uint64_t lba, bool fua);
+    int write_blocks(void const *data, int64_t count, uint64_t lba, bool fua,
+                     int64_t poll_ns = -1);
 
     virtual int64_t trim_blocks(int64_t count, uint64_t lba);
 
     virtual int flush();
 
+    // Waits for a request issued with block to complete. Spins on poll
+    // for up to poll_ns before sleeping until the completion interrupt
+    errno_t wait(blocking_iocp_t& block, int64_t poll_ns = -1);
+
     virtual long info(storage_dev_info_t key) = 0;
+
+    //
+    // Batching hints. Requests issued between plug and unplug may be
+    // held back so they can be merged and dispatched together. kick
+    // dispatches anything held back, it is called before blocking on
+    // a request. Drivers ignore these, the block layer implements them
+
+    virtual void plug() {}
+    virtual void unplug() {}
+    virtual void kick() {}
+
+    //
+    // Polled completion. poll reaps completed requests on the calling
+    // CPU's hardware queue without waiting for an interrupt, and
+    // returns true if any were found. Drivers that can't poll
+    // return false. The polling budget is set per device, the
+    // block layer implements it
+
+    virtual bool poll() { return false; }
+    virtual void set_poll_ns(uint64_t ns) { (void)ns; }
+    virtual uint64_t get_poll_ns() const { return 0; }
+};
+
+// Plugs a device for the lifetime of the object
+class storage_plug_t {
+public:
+    explicit storage_plug_t(storage_dev_base_t *dev)
+        : dev(dev)
+    {
+        dev->plug();
+    }
+
+    ~storage_plug_t()
+    {
+        dev->unplug();
+    }
+
+    storage_plug_t(storage_plug_t const&) = delete;
+    storage_plug_t& operator=(storage_plug_t const&) = delete;
+
+private:
+    storage_dev_base_t *dev;
 };
 
 #define STORAGE_DEV_IMPL                                \
@@ -142,6 +199,61 @@ struct fs_statvfs_t;
 
 struct fs_flock_t;
 
+// Same layout as struct iovec
+struct fs_iovec_t {
+    void *iov_base;
+    size_t iov_len;
+};
+
+C_ASSERT(sizeof(fs_iovec_t) == 16);
+
+// Segments from the start of the vector that continue each other in
+// memory, so one transfer covers them. Returns how many, at least one,
+// and their total length in size
+size_t fs_iov_contig(fs_iovec_t const *iov, size_t iovcnt, size_t *size);
+
+// Asynchronous file request. The filesystem issues its device requests
+// with the sub completions, each of which forwards into iocp, and iocp
+// is invoked once after the whole transfer has completed
+struct fs_aio_t {
+    static constexpr size_t max_sub = 8;
+
+    fs_aio_t();
+
+    void reset(iocp_t::callback_t callback, uintptr_t arg);
+
+    // Returns the next unused sub completion, or null if all are used
+    iocp_t *sub_iocp();
+
+    // Marks the sub completion returned by sub_iocp as issued
+    void sub_issued();
+
+    // Called once after all device requests are issued. A request that
+    // was completed synchronously has no sub requests, then status
+    // is the result
+    void finish(errno_t status = errno_t::OK);
+
+    // Records a buffer pinned with mm_pin_user for the transfer, it is
+    // unpinned once the transfer completes, before the callback runs
+    void pinned(void *st, size_t len, uintptr_t mmu_context);
+
+    iocp_t iocp;
+
+private:
+    static void sub_handler(errno_t const& err, uintptr_t arg);
+    static void done_handler(errno_t const& err, uintptr_t arg);
+
+    iocp_t sub[max_sub];
+    size_t sub_count;
+
+    iocp_t::callback_t callback;
+    uintptr_t callback_arg;
+
+    void *pin_st;
+    size_t pin_len;
+    uintptr_t pin_context;
+};
+
 typedef uint64_t fs_timespec_t;
 
 typedef uint64_t fs_dev_t;
@@ -281,6 +393,40 @@ struct fs_base_t {
     virtual int ftruncate(fs_file_info_t *fi,
                      off_t offset) = 0;
 
+    //
+    // Scatter/gather read/write files, the whole vector is transferred
+    // at consecutive file offsets. The default implementation calls
+    // read or write once per run of segments contiguous in memory,
+    // filesystems override these to transfer the whole vector under
+    // one lock acquisition or one walk of the file's block map
+
+    virtual ssize_t readv(fs_file_info_t *fi,
+                          fs_iovec_t const *iov,
+                          size_t iovcnt,
+                          off_t offset);
+    virtual ssize_t writev(fs_file_info_t *fi,
+                           fs_iovec_t const *iov,
+                           size_t iovcnt,
+                           off_t offset);
+
+    //
+    // Asynchronous read/write files. Returns the number of bytes the
+    // request will transfer, or a negated errno. aio->iocp is invoked
+    // exactly once either way. The default implementation transfers
+    // synchronously in the caller's context, filesystems override
+    // these to queue device requests without blocking
+
+    virtual ssize_t read_async(fs_file_info_t *fi,
+                               char *buf,
+                               size_t size,
+                               off_t offset,
+                               fs_aio_t *aio);
+    virtual ssize_t write_async(fs_file_info_t *fi,
+                                char const *buf,
+                                size_t size,
+                                off_t offset,
+                                fs_aio_t *aio);
+
     //
     // Query open file
 
@@ -423,6 +569,17 @@ class fs_base_ro_t : public fs_base_t {
 
 void fs_register_factory(char const *name, fs_factory_t *fs);
 
+// Fault in and pin every page of an O_DIRECT user buffer before
+// handing it to a driver, writable if the device will write into it.
+// The pages stay mapped until fs_direct_release, or until aio
+// completes when it is given. Returns a negated errno if the buffer
+// is not accessible
+int fs_direct_prepare(void *buf, size_t size, bool dev_writes,
+                      fs_aio_t *aio = nullptr);
+
+// Unpin a buffer prepared without aio, once the device is done with it
+void fs_direct_release(void *buf, size_t size);
+
 //
 // Partitioning scheme (MBR, UEFI, etc)
 
@@ -444,5 +601,7 @@ void part_register_factory(char const *name, part_factory_t *factory);
 
 void fs_mount(char const *fs_name, fs_init_info_t *info);
 fs_base_t *fs_from_id(size_t id);
+size_t fs_mount_count();
+char const *fs_name_from_id(size_t id);
 
 void probe_storage_factory(storage_if_factory_t *factory);
@@ -81,6 +81,12 @@ public:
     int send(void const *data, uint32_t length) const;
     int send_async(void const *data, uint32_t length, usb_iocp_t *iocp) const;
 
+    // Transfers on a stream of a pipe allocated with alloc_stream_pipe
+    int stream_recv_async(uint16_t stream_id, void *data,
+                          uint32_t length, usb_iocp_t *iocp) const;
+    int stream_send_async(uint16_t stream_id, void const *data,
+                          uint32_t length, usb_iocp_t *iocp) const;
+
     int clear_ep_halt(usb_pipe_t const& target);
 
     bool add_hub_port(int port);
@@ -125,6 +131,21 @@ public:
     bool alloc_pipe(int slotid, const usb_desc_iface *iface,
                     usb_desc_ep const* ep, usb_pipe_t &pipe);
 
+    // Allocate a SuperSpeed bulk pipe with up to max_streams streams,
+    // numbered from 1. Returns the number of streams enabled, 0 if the
+    // controller does not support streams and the pipe was allocated
+    // without them, or a negated completion code on error
+    virtual int alloc_stream_pipe(int slotid, usb_pipe_t &pipe,
+                                  int epid, int cfg_value,
+                                  int iface_num, int alt_iface,
+                                  int max_packet_sz, int max_burst,
+                                  int max_streams) = 0;
+
+    int alloc_stream_pipe(int slotid, usb_desc_iface const *iface,
+                          usb_desc_ep const *ep,
+                          usb_desc_ep_companion const *epc,
+                          int max_streams, usb_pipe_t &pipe);
+
     virtual int send_control(
             int slotid, uint8_t request_type, uint8_t request,
             uint16_t value, uint16_t index, uint16_t length, void *data) = 0;
@@ -29,6 +29,11 @@ struct dirent_t {
 #define S_ISGID  02000 // set-group-ID bit (see stat(2))
 #define S_ISVTX  01000 // sticky bit (see stat(2))
 
+#define S_IFMT   0170000 // file type mask
+#define S_IFDIR  0040000 // directory
+#define S_IFREG  0100000 // regular file
+#define S_IFSOCK 0140000 // socket
+
 //
 // open flags
 
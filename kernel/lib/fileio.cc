@@ -7,6 +7,9 @@
 #include "string.h"
 #include "vector.h"
 #include "mutex.h"
+#include "cpu/atomic.h"
+#include "unique_ptr.h"
+#include "fs/devfs.h"
 
 #define DEBUG_FILEHANDLE 1
 #if DEBUG_FILEHANDLE
@@ -26,9 +29,19 @@ struct filetab_t {
     fs_base_t *fs;
     off_t pos;
     filetab_t *next_free;
+
+    // Zero while the entry is free or still being opened. Lookups only
+    // succeed while it is nonzero, and each I/O operation holds a
+    // reference for its duration, so a racing close can't release
+    // the file out from under it
     int refcount;
+    bool is_dir;
 };
 
+// The table is allocated once and never moves, so lookups can index it
+// without a lock. The lock only protects the free list
+static constexpr size_t file_table_max = 1000;
+
 using file_table_lock_type = std::mcslock;
 using file_table_scoped_lock = std::unique_lock<file_table_lock_type>;
 static file_table_lock_type file_table_lock;
@@ -38,79 +51,138 @@ static filetab_t *file_table_ff;
 static void file_init(void *)
 {
     file_table_scoped_lock lock(file_table_lock);
-    if (!file_table.reserve(1000))
+    if (!file_table.reserve(file_table_max))
         panic_oom();
+
+    for (size_t i = 0; i < file_table_max; ++i) {
+        if (!file_table.emplace_back())
+            panic_oom();
+    }
+
+    // Thread all entries onto the free list, lowest id first
+    for (size_t i = file_table_max; i > 0; --i) {
+        filetab_t *item = &file_table[i - 1];
+        item->refcount = 0;
+        item->next_free = file_table_ff;
+        file_table_ff = item;
+    }
 }
 
 static fs_base_t *file_fs_from_path(char const *path)
 {
-    (void)path;
+    // Paths under /dev are served by devfs
+    if (!strncmp(path, "/dev", 4) && (path[4] == 0 || path[4] == '/'))
+        return devfs_get();
+
     return fs_from_id(0);
 }
 
+// The returned entry is not visible to lookups until it is published
 static filetab_t *file_new_filetab(void)
 {
     file_table_scoped_lock lock(file_table_lock);
-    filetab_t *item = nullptr;
-    if (file_table_ff) {
-        // Reuse freed item
-        item = file_table_ff;
+    filetab_t *item = file_table_ff;
+    if (likely(item)) {
         file_table_ff = item->next_free;
         item->next_free = nullptr;
-    } else if (file_table.size() < file_table.capacity()) {
-        // Add another item
-        if (!file_table.emplace_back())
-            return nullptr;
-        item = &file_table.back();
-    } else {
-        return nullptr;
+        assert(item->refcount == 0);
     }
-    assert(item->refcount == 0);
-    item->refcount = 1;
     return item;
 }
 
-static bool file_del_filetab(filetab_t *item)
+static void file_free_filetab(filetab_t *item)
 {
     file_table_scoped_lock lock(file_table_lock);
-    assert(item->refcount != 0);
-    if (--item->refcount == 0) {
-        item->next_free = file_table_ff;
-        file_table_ff = item;
-        return true;
-    }
+    assert(item->refcount == 0);
+    item->next_free = file_table_ff;
+    file_table_ff = item;
+}
 
-    return false;
+// Make a fully initialized entry visible to lookups
+static int file_publish_filetab(filetab_t *item)
+{
+    atomic_st_rel(&item->refcount, 1);
+    return item - file_table.data();
 }
 
-bool file_ref_filetab(int id)
+// Drop a reference, the last one releases the file and frees the entry
+static int file_unref_filetab(filetab_t *item)
 {
-    file_table_scoped_lock lock(file_table_lock);
-    if (id >= 0 && size_t(id) < file_table.size()) {
-        assert(file_table[id].refcount > 0);
-        ++file_table[id].refcount;
-        return true;
-    }
+    if (atomic_dec(&item->refcount) > 0)
+        return 0;
 
-    return false;
-}
+    int status = item->is_dir
+            ? item->fs->releasedir(item->fi)
+            : item->fs->release(item->fi);
 
-REGISTER_CALLOUT(file_init, nullptr, callout_type_t::partition_probe, "999");
+    file_free_filetab(item);
+
+    return status;
+}
 
+// Take a reference to the entry, unless it is free
 static filetab_t *file_fh_from_id(int id)
 {
-    file_table_scoped_lock lock(file_table_lock);
-    filetab_t *item = nullptr;
-    if (likely(id >= 0 && size_t(id) < file_table.size())) {
-        item = &file_table[id];
+    if (unlikely(id < 0 || size_t(id) >= file_table_max))
+        return nullptr;
+
+    filetab_t *item = &file_table[id];
 
-        if (likely(item->refcount > 0))
+    int refs = atomic_ld_acq(&item->refcount);
+
+    while (likely(refs > 0)) {
+        if (likely(atomic_cmpxchg_upd(&item->refcount, &refs, refs + 1)))
             return item;
-        assert(!"Zero ref count!");
     }
+
     return nullptr;
 }
 
+bool file_ref_filetab(int id)
+{
+    return file_fh_from_id(id) != nullptr;
+}
+
+// Drop a reference taken with file_ref_filetab
+int file_unref_filetab(int id)
+{
+    assert(id >= 0 && size_t(id) < file_table_max);
+    return file_unref_filetab(&file_table[id]);
+}
+
+REGISTER_CALLOUT(file_init, nullptr, callout_type_t::partition_probe, "999");
+
+// Holds a reference to an open file for the duration of one operation
+class filetab_ref_t {
+public:
+    explicit filetab_ref_t(int id)
+        : item(file_fh_from_id(id))
+    {
+    }
+
+    filetab_ref_t(filetab_ref_t const&) = delete;
+    filetab_ref_t& operator=(filetab_ref_t const&) = delete;
+
+    ~filetab_ref_t()
+    {
+        if (item)
+            file_unref_filetab(item);
+    }
+
+    filetab_t *operator->() const
+    {
+        return item;
+    }
+
+    explicit operator bool() const
+    {
+        return item != nullptr;
+    }
+
+private:
+    filetab_t *item;
+};
+
 int file_creat(char const *path, mode_t mode)
 {
     return file_open(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
@@ -125,24 +197,55 @@ int file_open(char const *path, int flags, mode_t mode)
 
     filetab_t *fh = file_new_filetab();
 
-    int id = fh - file_table.data();
-
     if (unlikely(!fh))
         return -int(errno_t::ENFILE);
 
     int status = fs->open(&fh->fi, path, flags, mode);
     if (unlikely(status < 0)) {
         FILEHANDLE_TRACE("open failed on %s, status=%d\n", path, status);
-        file_del_filetab(fh);
+        file_free_filetab(fh);
         return status;
     }
 
+    fh->fs = fs;
+    fh->pos = 0;
+    fh->is_dir = false;
+
+    int id = file_publish_filetab(fh);
+
     FILEHANDLE_TRACE("opened %s, fd=%d\n", path, id);
 
+    return id;
+}
+
+int file_open_handle(fs_base_t *fs, fs_file_info_t *fi)
+{
+    filetab_t *fh = file_new_filetab();
+
+    if (unlikely(!fh))
+        return -int(errno_t::ENFILE);
+
+    fh->fi = fi;
     fh->fs = fs;
     fh->pos = 0;
+    fh->is_dir = false;
 
-    return id;
+    return file_publish_filetab(fh);
+}
+
+fs_file_info_t *file_handle_ref(int id, fs_base_t const *fs)
+{
+    filetab_t *fh = file_fh_from_id(id);
+
+    if (unlikely(!fh))
+        return nullptr;
+
+    if (unlikely(fh->fs != fs || fh->is_dir)) {
+        file_unref_filetab(fh);
+        return nullptr;
+    }
+
+    return fh->fi;
 }
 
 int file_close(int id)
@@ -151,11 +254,9 @@ int file_close(int id)
     if (unlikely(!fh))
         return -int(errno_t::EBADF);
 
-    int status = 0;
-
-    fs_file_info_t *saved_file_info = fh->fi;
-    if (file_del_filetab(fh))
-        status = fh->fs->release(saved_file_info);
+    // Drop the lookup reference, then the open reference
+    file_unref_filetab(fh);
+    int status = file_unref_filetab(fh);
 
     FILEHANDLE_TRACE("closed fd=%d\n", id);
 
@@ -164,7 +265,7 @@ int file_close(int id)
 
 ssize_t file_pread(int id, void *buf, size_t bytes, off_t ofs)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    filetab_ref_t fh(id);
     if (unlikely(!fh))
         return -int(errno_t::EBADF);
 
@@ -173,16 +274,41 @@ ssize_t file_pread(int id, void *buf, size_t bytes, off_t ofs)
 
 ssize_t file_pwrite(int id, void const *buf, size_t bytes, off_t ofs)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    filetab_ref_t fh(id);
     if (unlikely(!fh))
         return -int(errno_t::EBADF);
 
     return fh->fs->write(fh->fi, (char*)buf, bytes, ofs);
 }
 
+// aio->iocp is invoked exactly once, even when the id is bad
+ssize_t file_read_async(int id, void *buf, size_t bytes, off_t ofs,
+                        fs_aio_t *aio)
+{
+    filetab_ref_t fh(id);
+    if (unlikely(!fh)) {
+        aio->finish(errno_t::EBADF);
+        return -int(errno_t::EBADF);
+    }
+
+    return fh->fs->read_async(fh->fi, (char*)buf, bytes, ofs, aio);
+}
+
+ssize_t file_write_async(int id, void const *buf, size_t bytes, off_t ofs,
+                         fs_aio_t *aio)
+{
+    filetab_ref_t fh(id);
+    if (unlikely(!fh)) {
+        aio->finish(errno_t::EBADF);
+        return -int(errno_t::EBADF);
+    }
+
+    return fh->fs->write_async(fh->fi, (char const*)buf, bytes, ofs, aio);
+}
+
 int file_syncfs(int id)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    filetab_ref_t fh(id);
     if (unlikely(!fh))
         return -int(errno_t::EBADF);
 
@@ -191,7 +317,7 @@ int file_syncfs(int id)
 
 off_t file_seek(int id, off_t ofs, int whence)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    filetab_ref_t fh(id);
     if (unlikely(!fh))
         return -int(errno_t::EBADF);
 
@@ -239,7 +365,7 @@ off_t file_seek(int id, off_t ofs, int whence)
 
 int file_ftruncate(int id, off_t size)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    filetab_ref_t fh(id);
     if (unlikely(!fh))
         return -int(errno_t::EBADF);
 
@@ -248,7 +374,7 @@ int file_ftruncate(int id, off_t size)
 
 int file_ioctl(int id, int cmd, void* arg, unsigned int flags, void* data)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    filetab_ref_t fh(id);
     if (unlikely(!fh))
         return -int(errno_t::EBADF);
 
@@ -257,7 +383,7 @@ int file_ioctl(int id, int cmd, void* arg, unsigned int flags, void* data)
 
 ssize_t file_read(int id, void *buf, size_t bytes)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    filetab_ref_t fh(id);
     if (unlikely(!fh))
         return -int(errno_t::EBADF);
 
@@ -270,7 +396,7 @@ ssize_t file_read(int id, void *buf, size_t bytes)
 
 ssize_t file_write(int id, void const *buf, size_t bytes)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    filetab_ref_t fh(id);
     if (unlikely(!fh))
         return -int(errno_t::EBADF);
 
@@ -281,9 +407,120 @@ ssize_t file_write(int id, void const *buf, size_t bytes)
     return size;
 }
 
+ssize_t file_readv(int id, fs_iovec_t const *iov, size_t iovcnt)
+{
+    filetab_ref_t fh(id);
+    if (unlikely(!fh))
+        return -int(errno_t::EBADF);
+
+    ssize_t size = fh->fs->readv(fh->fi, iov, iovcnt, fh->pos);
+    if (size >= 0)
+        fh->pos += size;
+
+    return size;
+}
+
+ssize_t file_writev(int id, fs_iovec_t const *iov, size_t iovcnt)
+{
+    filetab_ref_t fh(id);
+    if (unlikely(!fh))
+        return -int(errno_t::EBADF);
+
+    ssize_t size = fh->fs->writev(fh->fi, iov, iovcnt, fh->pos);
+    if (size >= 0)
+        fh->pos += size;
+
+    return size;
+}
+
+ssize_t file_preadv(int id, fs_iovec_t const *iov, size_t iovcnt, off_t ofs)
+{
+    filetab_ref_t fh(id);
+    if (unlikely(!fh))
+        return -int(errno_t::EBADF);
+
+    return fh->fs->readv(fh->fi, iov, iovcnt, ofs);
+}
+
+ssize_t file_pwritev(int id, fs_iovec_t const *iov,
+                     size_t iovcnt, off_t ofs)
+{
+    filetab_ref_t fh(id);
+    if (unlikely(!fh))
+        return -int(errno_t::EBADF);
+
+    return fh->fs->writev(fh->fi, iov, iovcnt, ofs);
+}
+
+// Copy between two open files through a kernel buffer, the data never
+// crosses into user space. If an offset pointer is null, the file
+// position is used and advanced, otherwise the pointed-to offset is
+// used and advanced and the file position is left alone
+ssize_t file_copy_range(int in_id, off_t *in_ofs,
+                        int out_id, off_t *out_ofs, size_t size)
+{
+    static constexpr size_t chunk_size = 64 << 10;
+
+    filetab_ref_t in(in_id);
+    if (unlikely(!in))
+        return -int(errno_t::EBADF);
+
+    filetab_ref_t out(out_id);
+    if (unlikely(!out))
+        return -int(errno_t::EBADF);
+
+    ext::unique_mmap<char> buf;
+    if (unlikely(!buf.mmap(size < chunk_size ? size : chunk_size)))
+        return -int(errno_t::ENOMEM);
+
+    off_t rd_pos = in_ofs ? *in_ofs : in->pos;
+    off_t wr_pos = out_ofs ? *out_ofs : out->pos;
+    ssize_t total = 0;
+
+    while (size > 0) {
+        size_t xfer = size < chunk_size ? size : chunk_size;
+
+        ssize_t got = in->fs->read(in->fi, buf.get(), xfer, rd_pos);
+        if (unlikely(got <= 0)) {
+            if (got < 0 && total == 0)
+                total = got;
+            break;
+        }
+
+        ssize_t put = out->fs->write(out->fi, buf.get(), got, wr_pos);
+        if (unlikely(put < 0)) {
+            if (total == 0)
+                total = put;
+            break;
+        }
+
+        rd_pos += put;
+        wr_pos += put;
+        total += put;
+        size -= put;
+
+        if (unlikely(put < got || size_t(got) < xfer))
+            break;
+    }
+
+    if (total > 0) {
+        if (in_ofs)
+            *in_ofs = rd_pos;
+        else
+            in->pos = rd_pos;
+
+        if (out_ofs)
+            *out_ofs = wr_pos;
+        else
+            out->pos = wr_pos;
+    }
+
+    return total;
+}
+
 int file_fsync(int id)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    filetab_ref_t fh(id);
     if (unlikely(!fh))
         return -int(errno_t::EBADF);
 
@@ -292,7 +529,7 @@ int file_fsync(int id)
 
 int file_fdatasync(int id)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    filetab_ref_t fh(id);
     if (unlikely(!fh))
         return -int(errno_t::EBADF);
 
@@ -311,23 +548,22 @@ int file_opendir(char const *path)
     if (unlikely(!fh))
         return -int(errno_t::ENFILE);
 
-    fh->fs = fs;
-
-    int status = fh->fs->opendir(&fh->fi, path);
+    int status = fs->opendir(&fh->fi, path);
     if (unlikely(status < 0)) {
-        file_del_filetab(fh);
+        file_free_filetab(fh);
         return status;
     }
 
     fh->fs = fs;
     fh->pos = 0;
+    fh->is_dir = true;
 
-    return fh - file_table.data();
+    return file_publish_filetab(fh);
 }
 
 ssize_t file_readdir_r(int id, dirent_t *buf, dirent_t **result)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    filetab_ref_t fh(id);
     if (unlikely(!fh))
         return -int(errno_t::EBADF);
 
@@ -344,7 +580,7 @@ ssize_t file_readdir_r(int id, dirent_t *buf, dirent_t **result)
 
 off_t file_telldir(int id)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    filetab_ref_t fh(id);
     if (unlikely(!fh))
         return -int(errno_t::EBADF);
 
@@ -353,7 +589,7 @@ off_t file_telldir(int id)
 
 off_t file_seekdir(int id, off_t ofs)
 {
-    filetab_t *fh = file_fh_from_id(id);
+    filetab_ref_t fh(id);
     if (unlikely(!fh))
         return -int(errno_t::EBADF);
 
@@ -363,17 +599,7 @@ off_t file_seekdir(int id, off_t ofs)
 
 int file_closedir(int id)
 {
-    filetab_t *fh = file_fh_from_id(id);
-    if (unlikely(!fh))
-        return -int(errno_t::EBADF);
-
-    int status = 0;
-
-    fs_file_info_t *saved_file_info = fh->fi;
-    if (file_del_filetab(fh))
-        status = fh->fs->releasedir(saved_file_info);
-
-    return status;
+    return file_close(id);
 }
 
 int file_mkdir(char const *path, mode_t mode)
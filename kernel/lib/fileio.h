@@ -2,6 +2,11 @@
 #include "types.h"
 #include "dirent.h"
 
+struct fs_iovec_t;
+struct fs_aio_t;
+struct fs_base_t;
+class fs_file_info_t;
+
 #define SEEK_SET    0
 #define SEEK_CUR    1
 #define SEEK_END    2
@@ -9,14 +14,34 @@
 #define SEEK_HOLE   4
 
 bool file_ref_filetab(int id);
+int file_unref_filetab(int id);
 
 int file_creat(char const *path, mode_t mode);
 int file_open(char const *path, int flags, mode_t mode = 0);
+
+// Open a file that has no path, like a socket. On failure the
+// caller still owns fi
+int file_open_handle(fs_base_t *fs, fs_file_info_t *fi);
+
+// Take a reference to the handle of an open file, if the file belongs
+// to fs. The reference is dropped with file_unref_filetab
+fs_file_info_t *file_handle_ref(int id, fs_base_t const *fs);
 int file_close(int id);
 ssize_t file_read(int id, void *buf, size_t bytes);
 ssize_t file_write(int id, void const *buf, size_t bytes);
 ssize_t file_pread(int id, void *buf, size_t bytes, off_t ofs);
 ssize_t file_pwrite(int id, const void *buf, size_t bytes, off_t ofs);
+ssize_t file_readv(int id, fs_iovec_t const *iov, size_t iovcnt);
+ssize_t file_writev(int id, fs_iovec_t const *iov, size_t iovcnt);
+ssize_t file_preadv(int id, fs_iovec_t const *iov, size_t iovcnt, off_t ofs);
+ssize_t file_pwritev(int id, fs_iovec_t const *iov,
+                     size_t iovcnt, off_t ofs);
+ssize_t file_read_async(int id, void *buf, size_t bytes, off_t ofs,
+                        fs_aio_t *aio);
+ssize_t file_write_async(int id, void const *buf, size_t bytes, off_t ofs,
+                         fs_aio_t *aio);
+ssize_t file_copy_range(int in_id, off_t *in_ofs,
+                        int out_id, off_t *out_ofs, size_t size);
 off_t file_seek(int id, off_t ofs, int whence);
 int file_ftruncate(int id, off_t size);
 int file_fsync(int id);
@@ -0,0 +1,517 @@
+#include "ioring.h"
+#include "dev_storage.h"
+#include "fileio.h"
+#include "process.h"
+#include "thread.h"
+#include "mm.h"
+#include "mutex.h"
+#include "vector.h"
+#include "unique_ptr.h"
+#include "cpu/atomic.h"
+#include "../libc/include/sys/io_ring.h"
+
+// Requests complete into a kernel side list from whatever context the
+// driver completes them in. They are copied out to the completion queue
+// in process context, by ioring_enter, because the ring is user memory.
+// Each in flight request holds a reference to its open file, so closing
+// the descriptor does not tear the file out from under the device
+
+struct ioring_t;
+
+struct ioring_op_t {
+    fs_aio_t aio;
+    ioring_t *ring;
+    ioring_op_t *next;
+    uint64_t user_data;
+    ssize_t result;
+    errno_t err;
+    int file_id;
+};
+
+struct ioring_t {
+    using lock_type = std::mcslock;
+    using scoped_lock = std::unique_lock<lock_type>;
+    using enter_lock_type = std::mutex;
+    using enter_scoped_lock = std::unique_lock<enter_lock_type>;
+
+    ioring_t();
+    ~ioring_t();
+
+    bool init(pid_t owner, io_ring_hdr *user_hdr, uint32_t entries);
+
+    int enter(unsigned to_submit, unsigned min_complete);
+
+    void drain();
+
+private:
+    static void completion(errno_t const& err, uintptr_t arg);
+
+    bool submit(io_ring_sqe const& sqe);
+    size_t reap(uint32_t cq_head);
+    bool publish();
+
+    ioring_op_t *alloc_op();
+    void free_op(ioring_op_t *op);
+
+public:
+    pid_t owner;
+    int refcount;
+
+private:
+    io_ring_hdr *user_hdr;
+    io_ring_sqe *user_sqes;
+    io_ring_cqe *user_cqes;
+
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+
+    // The kernel owns these, they are only ever written to the ring
+    uint32_t sq_head;
+    uint32_t cq_tail;
+    uint32_t sq_dropped;
+    uint32_t cq_overflow;
+
+    std::unique_ptr<ioring_op_t[]> ops;
+    ioring_op_t *free_ops;
+
+    // Serializes submission and reaping, protects the free list
+    // and the inflight count
+    enter_lock_type enter_lock;
+    size_t inflight;
+
+    // Protects the completed list
+    lock_type lock;
+    std::condition_variable done_cond;
+    ioring_op_t *done_first;
+    ioring_op_t *done_last;
+};
+
+using ioring_table_lock_type = std::mcslock;
+using ioring_table_scoped_lock = std::unique_lock<ioring_table_lock_type>;
+static ioring_table_lock_type ioring_table_lock;
+static std::vector<ioring_t*> ioring_table;
+
+ioring_t::ioring_t()
+    : owner(0)
+    , refcount(1)
+    , user_hdr(nullptr)
+    , user_sqes(nullptr)
+    , user_cqes(nullptr)
+    , sq_entries(0)
+    , cq_entries(0)
+    , sq_head(0)
+    , cq_tail(0)
+    , sq_dropped(0)
+    , cq_overflow(0)
+    , free_ops(nullptr)
+    , inflight(0)
+    , done_first(nullptr)
+    , done_last(nullptr)
+{
+}
+
+ioring_t::~ioring_t()
+{
+    assert(inflight == 0);
+}
+
+bool ioring_t::init(pid_t owner, io_ring_hdr *user_hdr, uint32_t entries)
+{
+    this->owner = owner;
+    this->user_hdr = user_hdr;
+    sq_entries = entries;
+    cq_entries = entries * 2;
+    user_sqes = (io_ring_sqe*)(user_hdr + 1);
+    user_cqes = (io_ring_cqe*)(user_sqes + sq_entries);
+
+    // One request per completion queue entry, so a completion queue
+    // that the process keeps drained never backs up
+    ops.reset(new ioring_op_t[cq_entries]);
+    if (unlikely(!ops))
+        return false;
+
+    for (size_t i = cq_entries; i > 0; --i)
+        free_op(&ops[i - 1]);
+
+    io_ring_hdr hdr{};
+    hdr.sq_mask = sq_entries - 1;
+    hdr.sq_entries = sq_entries;
+    hdr.cq_mask = cq_entries - 1;
+    hdr.cq_entries = cq_entries;
+
+    return mm_copy_user(user_hdr, &hdr, sizeof(hdr));
+}
+
+ioring_op_t *ioring_t::alloc_op()
+{
+    ioring_op_t *op = free_ops;
+    if (likely(op))
+        free_ops = op->next;
+    return op;
+}
+
+void ioring_t::free_op(ioring_op_t *op)
+{
+    op->next = free_ops;
+    free_ops = op;
+}
+
+// Invoked once per request, possibly from interrupt context
+void ioring_t::completion(errno_t const& err, uintptr_t arg)
+{
+    ioring_op_t *op = (ioring_op_t*)arg;
+    ioring_t *ring = op->ring;
+
+    op->err = err;
+
+    scoped_lock hold(ring->lock);
+    op->next = nullptr;
+    if (ring->done_last)
+        ring->done_last->next = op;
+    else
+        ring->done_first = op;
+    ring->done_last = op;
+    ring->done_cond.notify_all();
+}
+
+// Returns false if the entry was malformed and never issued
+bool ioring_t::submit(io_ring_sqe const& sqe)
+{
+    ioring_op_t *op = alloc_op();
+    assert(op);
+
+    op->ring = this;
+    op->user_data = sqe.user_data;
+    op->result = 0;
+    op->err = errno_t::OK;
+    op->file_id = -1;
+    op->aio.reset(&ioring_t::completion, uintptr_t(op));
+
+    if (sqe.opcode == IO_RING_OP_NOP) {
+        ++inflight;
+        op->aio.finish();
+        return true;
+    }
+
+    if (unlikely(sqe.opcode > IO_RING_OP_FSYNC || sqe.flags)) {
+        free_op(op);
+        return false;
+    }
+
+    ++inflight;
+
+    int id = fast_cur_process()->fd_to_id(sqe.fd);
+
+    if (unlikely(id < 0 || !file_ref_filetab(id))) {
+        op->aio.finish(errno_t::EBADF);
+        return true;
+    }
+
+    op->file_id = id;
+
+    void *buf = (void*)sqe.addr;
+    ssize_t result;
+
+    switch (sqe.opcode) {
+    case IO_RING_OP_READ:
+    case IO_RING_OP_WRITE:
+        if (unlikely(!mm_is_user_range(buf, sqe.len))) {
+            op->aio.finish(errno_t::EFAULT);
+            break;
+        }
+
+        result = sqe.opcode == IO_RING_OP_READ
+                ? file_read_async(id, buf, sqe.len, sqe.off, &op->aio)
+                : file_write_async(id, buf, sqe.len, sqe.off, &op->aio);
+
+        // The completion may already be on the list, but only
+        // this thread reaps, and only after submitting
+        op->result = result;
+        break;
+
+    case IO_RING_OP_FSYNC:
+        result = file_fsync(id);
+        op->aio.finish(result >= 0 ? errno_t::OK : errno_t(-result));
+        break;
+    }
+
+    return true;
+}
+
+// Move completions into the completion queue, as many as fit.
+// Returns the number of completions moved
+size_t ioring_t::reap(uint32_t cq_head)
+{
+    scoped_lock hold(lock);
+
+    size_t count = 0;
+
+    while (done_first) {
+        if (unlikely(cq_tail - cq_head >= cq_entries)) {
+            // They stay on the list until the process makes room
+            ++cq_overflow;
+            break;
+        }
+
+        ioring_op_t *op = done_first;
+        done_first = op->next;
+        if (!done_first)
+            done_last = nullptr;
+
+        hold.unlock();
+
+        io_ring_cqe cqe{};
+        cqe.user_data = op->user_data;
+        cqe.res = op->err == errno_t::OK
+                ? op->result
+                : -int64_t(op->err);
+
+        mm_copy_user(user_cqes + (cq_tail & (cq_entries - 1)),
+                     &cqe, sizeof(cqe));
+        ++cq_tail;
+        ++count;
+
+        if (op->file_id >= 0)
+            file_unref_filetab(op->file_id);
+
+        hold.lock();
+
+        free_op(op);
+        --inflight;
+    }
+
+    return count;
+}
+
+// Write the kernel owned indices and counters to the ring
+bool ioring_t::publish()
+{
+    atomic_barrier();
+
+    return mm_copy_user(&user_hdr->sq_head, &sq_head, sizeof(sq_head)) &&
+            mm_copy_user(&user_hdr->cq_tail, &cq_tail, sizeof(cq_tail)) &&
+            mm_copy_user(&user_hdr->sq_dropped, &sq_dropped,
+                         sizeof(sq_dropped)) &&
+            mm_copy_user(&user_hdr->cq_overflow, &cq_overflow,
+                         sizeof(cq_overflow));
+}
+
+int ioring_t::enter(unsigned to_submit, unsigned min_complete)
+{
+    enter_scoped_lock enter_hold(enter_lock);
+
+    uint32_t sq_tail;
+    uint32_t cq_head;
+
+    if (unlikely(!mm_copy_user(&sq_tail, &user_hdr->sq_tail,
+                               sizeof(sq_tail)) ||
+                 !mm_copy_user(&cq_head, &user_hdr->cq_head,
+                               sizeof(cq_head))))
+        return -int(errno_t::EFAULT);
+
+    if (unlikely(sq_tail - sq_head > sq_entries ||
+                 cq_tail - cq_head > cq_entries))
+        return -int(errno_t::EINVAL);
+
+    uint32_t available = sq_tail - sq_head;
+
+    if (to_submit > available)
+        to_submit = available;
+
+    unsigned submitted = 0;
+
+    while (submitted < to_submit && free_ops) {
+        io_ring_sqe sqe;
+
+        if (unlikely(!mm_copy_user(
+                         &sqe, user_sqes + (sq_head & (sq_entries - 1)),
+                         sizeof(sqe))))
+            break;
+
+        ++sq_head;
+
+        if (likely(submit(sqe)))
+            ++submitted;
+        else
+            ++sq_dropped;
+    }
+
+    // Wait for enough completions to be in the completion queue, or
+    // until there is nothing left that could complete
+    for (;;) {
+        reap(cq_head);
+
+        if (cq_tail - cq_head >= min_complete ||
+                cq_tail - cq_head == cq_entries)
+            break;
+
+        scoped_lock hold(lock);
+
+        if (done_first)
+            continue;
+
+        if (inflight == 0)
+            break;
+
+        done_cond.wait(hold);
+    }
+
+    if (unlikely(!publish()))
+        return -int(errno_t::EFAULT);
+
+    return submitted;
+}
+
+// Wait for every outstanding request, the results are discarded
+void ioring_t::drain()
+{
+    scoped_lock hold(lock);
+
+    while (inflight) {
+        while (!done_first)
+            done_cond.wait(hold);
+
+        ioring_op_t *op = done_first;
+        done_first = op->next;
+        if (!done_first)
+            done_last = nullptr;
+
+        if (op->file_id >= 0) {
+            hold.unlock();
+            file_unref_filetab(op->file_id);
+            hold.lock();
+        }
+
+        free_op(op);
+        --inflight;
+    }
+}
+
+// Returns the ring with a reference held, if it belongs to the caller
+static ioring_t *ioring_lookup(int ring_id)
+{
+    pid_t pid = fast_cur_process()->pid;
+
+    ioring_table_scoped_lock lock(ioring_table_lock);
+
+    if (unlikely(ring_id < 0 || size_t(ring_id) >= ioring_table.size()))
+        return nullptr;
+
+    ioring_t *ring = ioring_table[ring_id];
+
+    if (unlikely(!ring || ring->owner != pid))
+        return nullptr;
+
+    atomic_inc(&ring->refcount);
+
+    return ring;
+}
+
+// The last reference waits for outstanding requests and frees the ring
+static void ioring_release(ioring_t *ring)
+{
+    if (atomic_dec(&ring->refcount) > 0)
+        return;
+
+    ring->drain();
+
+    delete ring;
+}
+
+int ioring_setup(unsigned entries, void *user_ring)
+{
+    if (unlikely(entries == 0 || entries > IO_RING_MAX_ENTRIES ||
+                 (entries & (entries - 1))))
+        return -int(errno_t::EINVAL);
+
+    if (unlikely(uintptr_t(user_ring) & (alignof(io_ring_hdr) - 1)))
+        return -int(errno_t::EINVAL);
+
+    if (unlikely(!mm_is_user_range(user_ring,
+                                   IO_RING_SIZE(entries, entries * 2))))
+        return -int(errno_t::EFAULT);
+
+    std::unique_ptr<ioring_t> ring(new ioring_t);
+    if (unlikely(!ring))
+        return -int(errno_t::ENOMEM);
+
+    if (unlikely(!ring->init(fast_cur_process()->pid,
+                             (io_ring_hdr*)user_ring, entries)))
+        return -int(errno_t::ENOMEM);
+
+    ioring_table_scoped_lock lock(ioring_table_lock);
+
+    // Reuse a destroyed slot if there is one
+    std::vector<ioring_t*>::iterator it = std::find(
+                ioring_table.begin(), ioring_table.end(), nullptr);
+
+    if (it != ioring_table.end()) {
+        *it = ring.release();
+        return it - ioring_table.begin();
+    }
+
+    if (unlikely(!ioring_table.push_back(ring.get())))
+        return -int(errno_t::ENOMEM);
+
+    ring.release();
+
+    return ioring_table.size() - 1;
+}
+
+int ioring_enter(int ring_id, unsigned to_submit, unsigned min_complete)
+{
+    ioring_t *ring = ioring_lookup(ring_id);
+
+    if (unlikely(!ring))
+        return -int(errno_t::EBADF);
+
+    int result = ring->enter(to_submit, min_complete);
+
+    ioring_release(ring);
+
+    return result;
+}
+
+int ioring_destroy(int ring_id)
+{
+    ioring_t *ring = ioring_lookup(ring_id);
+
+    if (unlikely(!ring))
+        return -int(errno_t::EBADF);
+
+    ioring_table_scoped_lock lock(ioring_table_lock);
+    bool owned = ioring_table[ring_id] == ring;
+    if (owned)
+        ioring_table[ring_id] = nullptr;
+    lock.unlock();
+
+    // Drop the table's reference, if this call removed it
+    if (owned)
+        ioring_release(ring);
+
+    ioring_release(ring);
+
+    return 0;
+}
+
+// Called by the last thread of a process as it exits, while its address
+// space is still intact, because outstanding transfers target it
+void ioring_process_exit(pid_t pid)
+{
+    ioring_table_scoped_lock lock(ioring_table_lock);
+
+    for (size_t i = 0; i < ioring_table.size(); ++i) {
+        ioring_t *ring = ioring_table[i];
+
+        if (!ring || ring->owner != pid)
+            continue;
+
+        ioring_table[i] = nullptr;
+
+        // Draining blocks, no other thread of the process is left to
+        // hold a reference, so this is the last one
+        lock.unlock();
+        ioring_release(ring);
+        lock.lock();
+    }
+}
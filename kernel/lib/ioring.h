@@ -0,0 +1,13 @@
+#pragma once
+#include "types.h"
+
+// Submission/completion ring asynchronous file I/O. The ring itself is
+// in the process' memory, see sys/io_ring.h for the layout. All
+// functions return a negated errno on failure
+
+int ioring_setup(unsigned entries, void *user_ring);
+int ioring_enter(int ring_id, unsigned to_submit, unsigned min_complete);
+int ioring_destroy(int ring_id);
+
+// Destroy every ring of an exiting process, waiting for its requests
+void ioring_process_exit(pid_t pid);
@@ -391,3 +391,13 @@ bool mm_copy_user(void *dst, void const *src, size_t size);
 
 extern "C" _const
 bool mm_is_user_range(void *buf, size_t size);
+
+// Fault in a user range, writable if write is set, and pin its pages.
+// munmap and madvise wait for a pinned page to be unpinned before they
+// take it away, so a device can transfer to and from it meanwhile.
+// Returns false if any page is not accessible, with none pinned
+bool mm_pin_user(void *addr, size_t len, bool write);
+
+// Unpin a range pinned with mm_pin_user. mmu_context is the page
+// directory of the process that pinned it, 0 for the current one
+void mm_unpin_user(void *addr, size_t len, uintptr_t mmu_context);
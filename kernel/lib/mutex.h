@@ -315,6 +315,13 @@ public:
         locked = true;
     }
 
+    bool try_lock() noexcept
+    {
+        assert(!locked);
+        locked = m->try_lock();
+        return locked;
+    }
+
     void unlock() noexcept
     {
         if (locked) {
@@ -3,10 +3,11 @@
 #include "cpu/thread_impl.h"
 #include "thread.h"
 #include "desc_alloc.h"
-#include "cpu/thread_impl.h"
-#include "desc_alloc.h"
-#include "thread.h"
+#include "cpu/atomic.h"
 
+// Per-process mapping from file descriptors to open file table ids.
+// Lookups are lock-free, each slot is read with a single atomic load,
+// and only descriptor allocation takes the desc_alloc lock
 struct fd_table_t
 {
     static constexpr ssize_t max_file = 4096;
@@ -18,7 +19,7 @@ struct fd_table_t
         int16_t flags;
 
         entry_t()
-            : id(0)
+            : id(-1)
             , flags(0)
         {
         }
@@ -31,18 +32,18 @@ struct fd_table_t
 
         void set(int16_t id, int16_t flags)
         {
-            this->id = id;
             this->flags = flags;
+            atomic_st_rel(&this->id, id);
         }
 
         operator int16_t() const
         {
-            return id;
+            return atomic_ld_acq(&id);
         }
 
         entry_t& operator=(int16_t id)
         {
-            this->id = id;
+            atomic_st_rel(&this->id, id);
             return *this;
         }
 
@@ -57,6 +58,31 @@ struct fd_table_t
         }
     };
 
+    // Returns the open file id, or -1 if the descriptor is not open
+    int lookup(int fd) const
+    {
+        if (unlikely(fd < 0 || fd >= max_file))
+            return -1;
+
+        return atomic_ld_acq(&ids[fd].id);
+    }
+
+    // Atomically detach the descriptor, returns the open file id it
+    // referred to, or -1 if it was not open. Only one of several
+    // racing closes of the same descriptor gets the id
+    int remove(int fd)
+    {
+        if (unlikely(fd < 0 || fd >= max_file))
+            return -1;
+
+        int id = atomic_xchg(&ids[fd].id, int16_t(-1));
+
+        if (id >= 0)
+            desc_alloc.free(fd);
+
+        return id;
+    }
+
     entry_t ids[max_file];
 };
 
@@ -129,14 +155,12 @@ struct process_t
 
     bool valid_fd(int fd)
     {
-        return fd >= 0 &&
-                fd < fd_table_t::max_file &&
-                ids.ids[fd] >= 0;
+        return ids.lookup(fd) >= 0;
     }
 
     int fd_to_id(int fd)
     {
-        return valid_fd(fd) ? ids.ids[fd].id : -1;
+        return ids.lookup(fd);
     }
 
     enum struct state_t {
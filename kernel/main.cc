@@ -27,6 +27,7 @@
 #include "framebuffer.h"
 #include "math.h"
 #include "dev_storage.h"
+#include "blk_queue.h"
 #include "unique_ptr.h"
 #include "priorityqueue.h"
 #include "device/serial-uart.h"
@@ -38,6 +39,9 @@
 #include "inttypes.h"
 #include "work_queue.h"
 #include "cpu/except_asm.h"
+#include "net/udp.h"
+#include "net/tcp.h"
+#include "net/inet_csum.h"
 
 #include "bootloader.h"
 
@@ -67,6 +71,16 @@ char kernel_stack[kernel_stack_size] _section(".bspstk");
 #define ENABLE_STRESS_HEAP_BOTH     0
 #define ENABLE_FIND_VBE             0
 #define ENABLE_UNWIND               1
+#define ENABLE_FS_BENCH             0
+#define ENABLE_FD_SCALE_BENCH       0
+#define ENABLE_BLK_POLL_BENCH       0
+#define ENABLE_BLK_MT_BENCH         0
+#define ENABLE_NET_LOOPBACK_BENCH   0
+#define ENABLE_CSUM_BENCH           0
+
+// File read by the filesystem benchmarks on every mounted filesystem,
+// put the same file on each partition of the disk image to compare them
+#define FS_BENCH_FILE               "bench.bin"
 
 #if ENABLE_STRESS_HEAP_SMALL
 #define STRESS_HEAP_MINSIZE         64
@@ -800,7 +814,686 @@ void test_filesystem()
 }
 #endif
 
-void test_spawn()
+#if ENABLE_FS_BENCH
+// Sequential read throughput of every mounted filesystem.
+// The first pass demand-pages the device mapping, the second pass
+// reads from the page cache and measures filesystem overhead
+static int fs_bench_thread(void *)
+{
+    size_t constexpr chunk_size = 1 << 20;
+
+    char *buf = (char*)mmap(nullptr, chunk_size,
+                            PROT_READ | PROT_WRITE, 0, -1, 0);
+
+    if (buf == MAP_FAILED) {
+        printk("fs bench: buffer allocation failed\n");
+        return 0;
+    }
+
+    for (size_t id = 0, count = fs_mount_count(); id < count; ++id) {
+        fs_base_t *fs = fs_from_id(id);
+        char const *fs_name = fs_name_from_id(id);
+
+        for (int pass = 0; pass < 2; ++pass) {
+            fs_file_info_t *fi = nullptr;
+
+            int status = fs->open(&fi, FS_BENCH_FILE, O_RDONLY, 0);
+
+            if (status < 0) {
+                printk("fs bench: %s: open %s failed, status=%d\n",
+                       fs_name, FS_BENCH_FILE, status);
+                break;
+            }
+
+            uint64_t total = 0;
+            uint64_t st = time_ns();
+
+            for (ssize_t got; (got = fs->read(
+                                   fi, buf, chunk_size, total)) > 0; )
+                total += got;
+
+            uint64_t elap = time_ns() - st;
+
+            fs->release(fi);
+
+            printk("fs bench: %s: %s pass, %" PRIu64 " bytes"
+                   " in %" PRIu64 "us, %" PRIu64 " KB/s\n",
+                   fs_name, pass ? "warm" : "cold", total, elap / 1000,
+                   elap ? total * 1000000000 / elap / 1024 : 0);
+        }
+    }
+
+    munmap(buf, chunk_size);
+
+    return 0;
+}
+#endif
+
+#if ENABLE_FD_SCALE_BENCH || ENABLE_BLK_MT_BENCH
+// Time worker on 1, 2, 4... threads up to the CPU count, thread i gets
+// params[i]. prepare(threads) fills the params before each pass and
+// report(threads, elap_ns) follows it, either returning false stops
+template<typename T, typename P, typename R>
+static void bench_thread_sweep(int (*worker)(void *), T *params,
+                               P prepare, R report)
+{
+    int cpu_count = thread_cpu_count();
+
+    std::vector<thread_t> tids;
+
+    if (!tids.resize(cpu_count))
+        panic_oom();
+
+    for (int threads = 1; threads <= cpu_count; threads <<= 1) {
+        if (!prepare(threads))
+            break;
+
+        uint64_t st = time_ns();
+
+        for (int i = 0; i < threads; ++i)
+            tids[i] = thread_create(worker, &params[i], 0, false);
+
+        for (int i = 0; i < threads; ++i)
+            thread_wait(tids[i]);
+
+        uint64_t elap = time_ns() - st;
+
+        if (!report(threads, elap))
+            break;
+    }
+}
+#endif
+
+#if ENABLE_FD_SCALE_BENCH
+// Many threads doing tiny preads on their own descriptors. Descriptor
+// lookup dominates, so this shows how it scales with thread count
+struct fd_scale_bench_t {
+    int fd;
+    int cpu;
+    uint64_t ops;
+};
+
+static int fd_scale_bench_worker(void *arg)
+{
+    fd_scale_bench_t *param = (fd_scale_bench_t*)arg;
+
+    thread_set_affinity(thread_get_id(), UINT64_C(1) << param->cpu);
+
+    char buf[64];
+
+    for (uint64_t i = 0; i < param->ops; ++i)
+        file_pread(param->fd, buf, sizeof(buf), (i & 63) * sizeof(buf));
+
+    return 0;
+}
+
+static int fd_scale_bench_thread(void *)
+{
+    size_t constexpr ops_per_thread = 200000;
+
+    int cpu_count = thread_cpu_count();
+
+    std::vector<fd_scale_bench_t> params;
+
+    if (!params.resize(cpu_count))
+        panic_oom();
+
+    bench_thread_sweep(fd_scale_bench_worker, params.data(), [&](int threads) {
+        for (int i = 0; i < threads; ++i) {
+            params[i].fd = file_open(FS_BENCH_FILE, O_RDONLY);
+            params[i].cpu = i;
+            params[i].ops = ops_per_thread;
+
+            if (params[i].fd < 0) {
+                printk("fd scale bench: open %s failed, status=%d\n",
+                       FS_BENCH_FILE, params[i].fd);
+
+                while (i > 0)
+                    file_close(params[--i].fd);
+
+                return false;
+            }
+        }
+
+        return true;
+    }, [&](int threads, uint64_t elap) {
+        for (int i = 0; i < threads; ++i)
+            file_close(params[i].fd);
+
+        uint64_t total = ops_per_thread * threads;
+
+        printk("fd scale bench: %d threads, %" PRIu64 " reads"
+               " in %" PRIu64 "us, %" PRIu64 " reads/s\n",
+               threads, total, elap / 1000,
+               elap ? total * 1000000000 / elap : 0);
+
+        return true;
+    });
+
+    return 0;
+}
+#endif
+
+#if ENABLE_BLK_POLL_BENCH
+// Random 4KB reads at queue depth 1 on every storage device, comparing
+// read latency with interrupt completion and with hybrid polling.
+// Latencies are counted in 1us buckets, the last one counts the rest
+static uint32_t blk_poll_bench_hist[1024];
+
+static uint64_t blk_poll_bench_percentile(unsigned pct, uint64_t total)
+{
+    size_t constexpr bucket_count = countof(blk_poll_bench_hist);
+
+    uint64_t rank = (total * pct + 99) / 100;
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < bucket_count; ++i) {
+        seen += blk_poll_bench_hist[i];
+        if (seen >= rank)
+            return i;
+    }
+
+    return bucket_count - 1;
+}
+
+static int blk_poll_bench_thread(void *)
+{
+    size_t constexpr io_size = 4096;
+    size_t constexpr io_count = 10000;
+
+    // Reads are spread over the first 64MB of each device
+    uint64_t constexpr span = uint64_t(64) << 20;
+
+    // Polling budget for each pass, in ns, 0 waits for the interrupt
+    static int64_t constexpr poll_budgets[] = { 0, 20000, 100000 };
+
+    char *buf = (char*)mmap(nullptr, io_size,
+                            PROT_READ | PROT_WRITE, 0, -1, 0);
+
+    if (buf == MAP_FAILED) {
+        printk("blk poll bench: buffer allocation failed\n");
+        return 0;
+    }
+
+    uint64_t seed = time_ns();
+
+    for (size_t id = 0, count = storage_dev_count(); id < count; ++id) {
+        storage_dev_base_t *drive = storage_dev_open(id);
+
+        long sector_size = drive->info(STORAGE_INFO_BLOCKSIZE);
+        char const *name = (char const *)drive->info(STORAGE_INFO_NAME);
+
+        if (sector_size <= 0 || io_size % sector_size) {
+            storage_dev_close(drive);
+            continue;
+        }
+
+        int64_t sectors = io_size / sector_size;
+        int io_span = span / io_size;
+
+        for (int64_t poll_ns : poll_budgets) {
+            memset(blk_poll_bench_hist, 0, sizeof(blk_poll_bench_hist));
+
+            int status = 0;
+
+            for (size_t i = 0; i < io_count; ++i) {
+                uint64_t lba = rand_r_range(&seed, 0, io_span - 1) * sectors;
+
+                uint64_t st = time_ns();
+                status = drive->read_blocks(buf, sectors, lba, poll_ns);
+                uint64_t elap = time_ns() - st;
+
+                if (status < 0)
+                    break;
+
+                size_t us = std::min(elap / 1000,
+                                     countof(blk_poll_bench_hist) - 1);
+                ++blk_poll_bench_hist[us];
+            }
+
+            if (status < 0) {
+                printk("blk poll bench: %s: read failed, status=%d\n",
+                       name, status);
+                break;
+            }
+
+            printk("blk poll bench: %s: poll %" PRId64 "us,"
+                   " p50 %" PRIu64 "us, p99 %" PRIu64 "us\n",
+                   name, poll_ns / 1000,
+                   blk_poll_bench_percentile(50, io_count),
+                   blk_poll_bench_percentile(99, io_count));
+        }
+
+        storage_dev_close(drive);
+    }
+
+    blk_dump_stats();
+
+    munmap(buf, io_size);
+
+    return 0;
+}
+#endif
+
+#if ENABLE_BLK_MT_BENCH
+// Random 4KB reads from one thread per CPU on every storage device,
+// with 1, 2, 4... threads, to show how submission scales across queues
+struct blk_mt_bench_t {
+    storage_dev_base_t *drive;
+    char *buf;
+    int64_t sectors;
+    int io_span;
+    int cpu;
+    int status;
+};
+
+static int blk_mt_bench_worker(void *arg)
+{
+    size_t constexpr io_count = 20000;
+
+    blk_mt_bench_t *param = (blk_mt_bench_t*)arg;
+
+    thread_set_affinity(thread_get_id(), UINT64_C(1) << param->cpu);
+
+    uint64_t seed = time_ns() + param->cpu;
+
+    for (size_t i = 0; i < io_count; ++i) {
+        uint64_t lba = rand_r_range(&seed, 0, param->io_span - 1) *
+                param->sectors;
+
+        param->status = param->drive->read_blocks(
+                    param->buf, param->sectors, lba);
+
+        if (param->status < 0)
+            break;
+    }
+
+    return 0;
+}
+
+static int blk_mt_bench_thread(void *)
+{
+    size_t constexpr io_size = 4096;
+    size_t constexpr io_count = 20000;
+
+    // Reads are spread over the first 64MB of each device
+    uint64_t constexpr span = uint64_t(64) << 20;
+
+    int cpu_count = thread_cpu_count();
+
+    std::vector<blk_mt_bench_t> params;
+
+    if (!params.resize(cpu_count))
+        panic_oom();
+
+    for (int i = 0; i < cpu_count; ++i) {
+        params[i].buf = (char*)mmap(nullptr, io_size,
+                                    PROT_READ | PROT_WRITE, 0, -1, 0);
+
+        if (params[i].buf == MAP_FAILED) {
+            printk("blk mt bench: buffer allocation failed\n");
+            return 0;
+        }
+    }
+
+    for (size_t id = 0, count = storage_dev_count(); id < count; ++id) {
+        storage_dev_base_t *drive = storage_dev_open(id);
+
+        long sector_size = drive->info(STORAGE_INFO_BLOCKSIZE);
+        char const *name = (char const *)drive->info(STORAGE_INFO_NAME);
+
+        if (sector_size <= 0 || io_size % sector_size) {
+            storage_dev_close(drive);
+            continue;
+        }
+
+        bench_thread_sweep(blk_mt_bench_worker, params.data(),
+                           [&](int threads) {
+            for (int i = 0; i < threads; ++i) {
+                params[i].drive = drive;
+                params[i].sectors = io_size / sector_size;
+                params[i].io_span = span / io_size;
+                params[i].cpu = i;
+                params[i].status = 0;
+            }
+
+            return true;
+        }, [&](int threads, uint64_t elap) {
+            int status = 0;
+            for (int i = 0; i < threads; ++i) {
+                if (params[i].status < 0)
+                    status = params[i].status;
+            }
+
+            if (status < 0) {
+                printk("blk mt bench: %s: read failed, status=%d\n",
+                       name, status);
+                return false;
+            }
+
+            uint64_t total = io_count * threads;
+
+            printk("blk mt bench: %s: %d threads, %" PRIu64 " reads"
+                   " in %" PRIu64 "us, %" PRIu64 " IOPS\n",
+                   name, threads, total, elap / 1000,
+                   elap ? total * 1000000000 / elap : 0);
+
+            return true;
+        });
+
+        storage_dev_close(drive);
+    }
+
+    blk_dump_stats();
+
+    for (int i = 0; i < cpu_count; ++i)
+        munmap(params[i].buf, io_size);
+
+    return 0;
+}
+#endif
+
+#if ENABLE_NET_LOOPBACK_BENCH
+// UDP packet rate, TCP throughput and TCP round trip latency over the
+// loopback interface, which measures the protocol stack without a NIC
+
+static constexpr uint32_t net_bench_ip = IPV4_ADDR32(127U, 0U, 0U, 1U);
+
+struct net_bench_udp_t {
+    udp_sock_t *rx;
+    uint64_t received;
+    bool volatile done;
+};
+
+static int net_bench_udp_receiver(void *arg)
+{
+    net_bench_udp_t *param = (net_bench_udp_t*)arg;
+
+    char buf[64];
+    fs_iovec_t iov{ buf, sizeof(buf) };
+
+    // The sender ends with one byte datagrams
+    for (;;) {
+        ssize_t size = udp_recv(param->rx, &iov, 1,
+                                nullptr, nullptr, false);
+
+        if (size < 0 || size == 1)
+            break;
+
+        ++param->received;
+    }
+
+    atomic_st_rel(&param->done, true);
+
+    return 0;
+}
+
+static void net_bench_udp()
+{
+    size_t constexpr msg_count = 200000;
+    size_t constexpr msg_size = 18;
+
+    ipv4_addr_t rx_addr{ net_bench_ip, 7000, 0 };
+
+    net_bench_udp_t param{};
+    udp_sock_t *tx = nullptr;
+
+    if (udp_open(&param.rx) != errno_t::OK ||
+            udp_bind(param.rx, &rx_addr) != errno_t::OK ||
+            udp_open(&tx) != errno_t::OK) {
+        printk("net bench: udp setup failed\n");
+        if (param.rx)
+            udp_close(param.rx);
+        return;
+    }
+
+    thread_t rx_tid = thread_create(net_bench_udp_receiver,
+                                    &param, 0, false);
+
+    char buf[msg_size] = {};
+    fs_iovec_t iov{ buf, sizeof(buf) };
+
+    uint64_t sent = 0;
+    uint64_t st = time_ns();
+
+    for (size_t i = 0; i < msg_count; ++i)
+        sent += udp_send(tx, &iov, 1, &rx_addr) > 0;
+
+    uint64_t send_elap = time_ns() - st;
+
+    // Datagrams may be dropped, keep ending until the receiver sees it
+    iov.iov_len = 1;
+    while (!atomic_ld_acq(&param.done)) {
+        udp_send(tx, &iov, 1, &rx_addr);
+        thread_sleep_for(1);
+    }
+
+    uint64_t elap = time_ns() - st;
+
+    thread_wait(rx_tid);
+
+    udp_close(tx);
+    udp_close(param.rx);
+
+    printk("net bench: udp %zu byte datagrams,"
+           " sent %" PRIu64 " pps, received %" PRIu64 " pps,"
+           " %" PRIu64 " of %" PRIu64 " lost\n",
+           msg_size,
+           send_elap ? sent * 1000000000 / send_elap : 0,
+           elap ? param.received * 1000000000 / elap : 0,
+           sent - param.received, sent);
+}
+
+struct net_bench_tcp_t {
+    tcp_sock_t *listener;
+    size_t total;
+    size_t chunk;
+    size_t round_trips;
+    int status;
+};
+
+// Echoes round trips, then receives the bulk transfer
+static int net_bench_tcp_server(void *arg)
+{
+    net_bench_tcp_t *param = (net_bench_tcp_t*)arg;
+
+    tcp_sock_t *conn;
+    errno_t err = tcp_accept(param->listener, &conn, false);
+
+    if (err != errno_t::OK) {
+        param->status = -int(err);
+        return 0;
+    }
+
+    tcp_set_nodelay(conn, true);
+
+    char ch;
+    for (size_t i = 0; i < param->round_trips; ++i) {
+        if (tcp_recv(conn, &ch, 1, false) != 1 ||
+                tcp_send(conn, &ch, 1, false) != 1) {
+            param->status = -1;
+            break;
+        }
+    }
+
+    std::unique_ptr<char[]> buf(new char[param->chunk]);
+
+    for (size_t got = 0; param->status == 0 && got < param->total; ) {
+        ssize_t size = tcp_recv(conn, buf, param->chunk, false);
+
+        if (size <= 0) {
+            param->status = size < 0 ? int(size) : -1;
+            break;
+        }
+
+        got += size;
+    }
+
+    tcp_close(conn);
+
+    return 0;
+}
+
+static void net_bench_tcp()
+{
+    size_t constexpr round_trips = 10000;
+    size_t constexpr total = size_t(256) << 20;
+    size_t constexpr chunk = 65536;
+
+    ipv4_addr_t addr{ net_bench_ip, 7001, 0 };
+
+    net_bench_tcp_t param{};
+    param.total = total;
+    param.chunk = chunk;
+    param.round_trips = round_trips;
+
+    errno_t err = tcp_listen(&param.listener, &addr, 1);
+
+    if (err != errno_t::OK) {
+        printk("net bench: tcp listen failed, err=%d\n", int(err));
+        return;
+    }
+
+    thread_t server_tid = thread_create(net_bench_tcp_server,
+                                        &param, 0, false);
+
+    tcp_sock_t *conn;
+    err = tcp_connect(&conn, &addr, false);
+
+    if (err != errno_t::OK) {
+        printk("net bench: tcp connect failed, err=%d\n", int(err));
+        tcp_close(param.listener);
+        return;
+    }
+
+    tcp_set_nodelay(conn, true);
+
+    char ch = 0;
+    uint64_t st = time_ns();
+
+    for (size_t i = 0; i < round_trips; ++i) {
+        if (tcp_send(conn, &ch, 1, false) != 1 ||
+                tcp_recv(conn, &ch, 1, false) != 1)
+            break;
+    }
+
+    uint64_t rtt_elap = time_ns() - st;
+
+    std::unique_ptr<char[]> buf(new char[chunk]);
+    memset(buf, 0, chunk);
+
+    st = time_ns();
+
+    for (size_t sent = 0; sent < total; ) {
+        ssize_t size = tcp_send(conn, buf, chunk, false);
+
+        if (size <= 0)
+            break;
+
+        sent += size;
+    }
+
+    thread_wait(server_tid);
+
+    uint64_t elap = time_ns() - st;
+
+    tcp_close(conn);
+    tcp_close(param.listener);
+
+    if (param.status < 0) {
+        printk("net bench: tcp transfer failed, status=%d\n",
+               param.status);
+        return;
+    }
+
+    printk("net bench: tcp %zu round trips, %" PRIu64 "ns average\n",
+           round_trips, rtt_elap / round_trips);
+
+    printk("net bench: tcp %zuMB in %" PRIu64 "us, %" PRIu64 "MB/s\n",
+           total >> 20, elap / 1000,
+           elap ? (uint64_t(total) * 1000000000 / elap) >> 20 : 0);
+}
+
+static int net_bench_thread(void *)
+{
+    net_bench_udp();
+    net_bench_tcp();
+    return 0;
+}
+#endif
+
+#if ENABLE_CSUM_BENCH
+// Internet checksum throughput of each implementation at packet sizes.
+// Runs in a thread with an FPU context, so the vector versions are used
+
+static int csum_bench_thread(void *)
+{
+    static size_t constexpr sizes[] = { 64, 256, 576, 1500, 4096, 65536 };
+
+    static struct {
+        char const *name;
+        uint64_t (*fn)(void const *, size_t, uint64_t);
+    } constexpr impls[] = {
+        { "generic", inet_csum_partial_generic },
+        { "sse2", inet_csum_partial_sse2 },
+        { "avx2", inet_csum_partial_avx2 }
+    };
+
+    // Bytes summed for each measurement
+    size_t constexpr total = size_t(64) << 20;
+
+    size_t constexpr buf_size = 65536 + 8;
+
+    char *buf = (char*)mmap(nullptr, buf_size,
+                            PROT_READ | PROT_WRITE, 0, -1, 0);
+
+    if (buf == MAP_FAILED) {
+        printk("csum bench: buffer allocation failed\n");
+        return 0;
+    }
+
+    for (size_t i = 0; i < buf_size; ++i)
+        buf[i] = char(i * 131);
+
+    for (size_t size : sizes) {
+        uint16_t expect = inet_csum_fold(
+                    inet_csum_partial_generic(buf + 1, size, 0));
+
+        for (auto const& impl : impls) {
+            if (impl.fn == inet_csum_partial_avx2 &&
+                    !(cpuid_has_avx() && cpuid_has_avx2()))
+                continue;
+
+            // Odd start, like a payload after an ethernet header
+            if (inet_csum_fold(impl.fn(buf + 1, size, 0)) != expect) {
+                printk("csum bench: %s mismatch at %zu bytes\n",
+                       impl.name, size);
+                continue;
+            }
+
+            uint64_t sum = 0;
+            uint64_t st = time_ns();
+
+            for (size_t done = 0; done < total; done += size)
+                sum = impl.fn(buf + 1, size, sum);
+
+            uint64_t elap = time_ns() - st;
+
+            printk("csum bench: %s %5zu bytes, %" PRIu64 "MB/s (%#x)\n",
+                   impl.name, size,
+                   elap ? (uint64_t(total) * 1000000000 / elap) >> 20 : 0,
+                   inet_csum_fold(sum));
+        }
+    }
+
+    munmap(buf, buf_size);
+
+    return 0;
+}
+#endif
+
+#if ENABLE_SPAWN_STRESS > 0
+static void test_spawn()
 {
     printk("Starting spawn stress with %d threads\n", ENABLE_SPAWN_STRESS);
     for (size_t i = 0; i < ENABLE_SPAWN_STRESS; ++i) {
@@ -813,6 +1506,7 @@ void test_spawn()
         assert(spawn_result == 0 || pid < 0);
     }
 }
+#endif
 
 static int init_thread(void *)
 {
@@ -915,6 +1609,36 @@ static int init_thread(void *)
     test_filesystem();
 #endif
 
+#if ENABLE_FS_BENCH
+    printk("Running filesystem read benchmark\n");
+    thread_create(fs_bench_thread, nullptr, 0, false);
+#endif
+
+#if ENABLE_FD_SCALE_BENCH
+    printk("Running file descriptor scaling benchmark\n");
+    thread_create(fd_scale_bench_thread, nullptr, 0, false);
+#endif
+
+#if ENABLE_BLK_POLL_BENCH
+    printk("Running storage polling latency benchmark\n");
+    thread_create(blk_poll_bench_thread, nullptr, 0, false);
+#endif
+
+#if ENABLE_BLK_MT_BENCH
+    printk("Running storage concurrent reader benchmark\n");
+    thread_create(blk_mt_bench_thread, nullptr, 0, false);
+#endif
+
+#if ENABLE_NET_LOOPBACK_BENCH
+    printk("Running loopback network benchmark\n");
+    thread_create(net_bench_thread, nullptr, 0, false);
+#endif
+
+#if ENABLE_CSUM_BENCH
+    printk("Running checksum benchmark\n");
+    thread_create(csum_bench_thread, nullptr, 0, true);
+#endif
+
     printk("Running mprotect self test\n");
     mprotect_test(nullptr);
 
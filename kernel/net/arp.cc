@@ -1,6 +1,564 @@
 #include "arp.h"
+#include "ipv4.h"
+#include "dev_eth.h"
+#include "thread.h"
+#include "time.h"
+#include "mutex.h"
+#include "string.h"
+#include "bswap.h"
+#include "printk.h"
+#include "cpu/atomic.h"
 
-void arp_frame_received(ethq_pkt_t *pkt)
+// Neighbor cache
+//
+// A set associative table keyed by interface and IPv4 address. Writers
+// lock the set, readers don't lock. They read an entry between two
+// loads of its sequence number, which is odd while a writer changes
+// it, and retry if it changed. Entries are reused, never freed, so a
+// reader never follows a pointer into freed memory
+
+#define DEBUG_ARP   0
+#if DEBUG_ARP
+#define ARP_TRACE(...) printdbg("arp: " __VA_ARGS__)
+#else
+#define ARP_TRACE(...) ((void)0)
+#endif
+
+// Sets, as a power of two, and entries in each set
+#define ARP_SET_BITS        6
+#define ARP_WAYS            8
+
+// Packets held for a neighbor while it is resolved, more are dropped
+#define ARP_PENDING_MAX     16
+
+// Requests sent before giving up on a neighbor
+#define ARP_REQUEST_MAX     3
+
+// Milliseconds between requests, and between aging passes
+#define ARP_RETRY_MS        1000
+
+// A confirmed neighbor is used this long before it is confirmed again
+#define ARP_REACHABLE_MS    30000
+
+// A neighbor not used for this long is forgotten
+#define ARP_UNUSED_MS       60000
+
+enum struct arp_state_t : uint8_t {
+    FREE,
+
+    // Requested, packets wait for the reply
+    INCOMPLETE,
+
+    // Confirmed recently
+    REACHABLE,
+
+    // Still used, and confirmed again when it is
+    STALE
+};
+
+struct arp_entry_t {
+    // Odd while a writer changes the fields readers look at
+    uint32_t seq;
+
+    uint32_t ip;
+    eth_dev_base_t *nic;
+    uint8_t mac[6];
+    arp_state_t state;
+
+    // Requests sent without a reply
+    uint8_t requests;
+
+    // Source address of the requests
+    uint32_t s_ip;
+
+    // Milliseconds, when it was last confirmed or requested,
+    // and when a packet last used it
+    uint64_t updated;
+    uint64_t used;
+
+    // Packets waiting for the reply, linked through next
+    ethq_pkt_t *pending_head;
+    ethq_pkt_t *pending_tail;
+    size_t pending_count;
+};
+
+struct arp_set_t {
+    using lock_type = std::spinlock;
+    using scoped_lock = std::unique_lock<lock_type>;
+    lock_type lock;
+
+    arp_entry_t ways[ARP_WAYS];
+};
+
+static arp_set_t arp_sets[1 << ARP_SET_BITS];
+
+static bool arp_aging_started;
+
+static int arp_aging_thread(void *);
+
+static _always_inline uint64_t arp_now_ms()
+{
+    return time_ns() / 1000000;
+}
+
+static _always_inline arp_set_t *arp_set_of(uint32_t ip)
+{
+    return arp_sets + ((ip * UINT32_C(0x9E3779B1)) >> (32 - ARP_SET_BITS));
+}
+
+static _always_inline void arp_write_begin(arp_entry_t *ent)
+{
+    atomic_st_rel(&ent->seq, ent->seq + 1);
+    atomic_barrier();
+}
+
+static _always_inline void arp_write_end(arp_entry_t *ent)
+{
+    atomic_barrier();
+    atomic_st_rel(&ent->seq, ent->seq + 1);
+}
+
+// Read the MAC and state of an entry if it is the one for nic and ip
+static bool arp_read(arp_entry_t const *ent, eth_dev_base_t *nic,
+                     uint32_t ip, void *mac, arp_state_t *state)
+{
+    for (;;) {
+        uint32_t seq = atomic_ld_acq(&ent->seq);
+
+        if (unlikely(seq & 1)) {
+            pause();
+            continue;
+        }
+
+        bool match = ent->ip == ip && ent->nic == nic &&
+                ent->state != arp_state_t::FREE;
+
+        if (match) {
+            memcpy(mac, ent->mac, sizeof(ent->mac));
+            *state = ent->state;
+        }
+
+        atomic_lfence();
+
+        if (likely(atomic_ld_acq(&ent->seq) == seq))
+            return match;
+    }
+}
+
+static arp_entry_t *arp_find(arp_set_t *set, eth_dev_base_t *nic,
+                             uint32_t ip, void *mac, arp_state_t *state)
+{
+    for (arp_entry_t& ent : set->ways) {
+        if (arp_read(&ent, nic, ip, mac, state))
+            return &ent;
+    }
+
+    return nullptr;
+}
+
+static arp_entry_t *arp_find_locked(arp_set_t *set,
+                                    eth_dev_base_t *nic, uint32_t ip)
 {
-    (void)pkt;
+    for (arp_entry_t& ent : set->ways) {
+        if (ent.state != arp_state_t::FREE &&
+                ent.ip == ip && ent.nic == nic)
+            return &ent;
+    }
+
+    return nullptr;
+}
+
+// A free entry, or the least recently used one that isn't waiting
+// for a reply, nullptr if every one of them is
+static arp_entry_t *arp_alloc_locked(arp_set_t *set)
+{
+    arp_entry_t *victim = nullptr;
+
+    for (arp_entry_t& ent : set->ways) {
+        if (ent.state == arp_state_t::FREE)
+            return &ent;
+
+        if (ent.state != arp_state_t::INCOMPLETE &&
+                (!victim || ent.used < victim->used))
+            victim = &ent;
+    }
+
+    return victim;
+}
+
+// Forget a neighbor, the caller takes the packets waiting for it first
+static void arp_free_locked(arp_entry_t *ent)
+{
+    arp_write_begin(ent);
+    ent->state = arp_state_t::FREE;
+    ent->ip = 0;
+    ent->nic = nullptr;
+    arp_write_end(ent);
+
+    ent->pending_head = nullptr;
+    ent->pending_tail = nullptr;
+    ent->pending_count = 0;
+}
+
+// Fail a list of packets linked through next, like a NIC that
+// dropped them
+static void arp_drop(ethq_pkt_t *pkt)
+{
+    while (pkt) {
+        ethq_pkt_t *next = pkt->next;
+        pkt->next = nullptr;
+
+        if (pkt->callback)
+            pkt->callback(pkt, 1, pkt->callback_arg);
+        ethq_pkt_release(pkt);
+
+        pkt = next;
+    }
+}
+
+static void arp_aging_start()
+{
+    if (likely(atomic_ld_acq(&arp_aging_started)))
+        return;
+
+    if (!atomic_cmpxchg(&arp_aging_started, false, true))
+        thread_create(arp_aging_thread, nullptr, 0, false);
+}
+
+void arp_packet_send(eth_dev_base_t *nic, uint16_t oper,
+                     void const *d_mac, uint32_t s_ip,
+                     void const *target_mac, uint32_t target_ip)
+{
+    ethq_pkt_t *pkt = ethq_pkt_acquire();
+
+    if (unlikely(!pkt))
+        return;
+
+    arp_packet_t *ap = (arp_packet_t*)&pkt->pkt;
+
+    memcpy(ap->eth_hdr.d_mac, d_mac, sizeof(ap->eth_hdr.d_mac));
+    nic->get_mac(ap->eth_hdr.s_mac);
+    ap->eth_hdr.len_ethertype = htons(ETHERTYPE_ARP);
+
+    // Ethernet and IPv4
+    ap->htype = htons(1);
+    ap->ptype = htons(ETHERTYPE_IPv4);
+    ap->hlen = 6;
+    ap->plen = 4;
+    ap->oper = htons(oper);
+
+    memcpy(ap->source_mac, ap->eth_hdr.s_mac, sizeof(ap->source_mac));
+    s_ip = htonl(s_ip);
+    memcpy(ap->sender_ip, &s_ip, sizeof(ap->sender_ip));
+
+    memcpy(ap->target_mac, target_mac, sizeof(ap->target_mac));
+    target_ip = htonl(target_ip);
+    memcpy(ap->target_ip, &target_ip, sizeof(ap->target_ip));
+
+    pkt->size = sizeof(*ap);
+
+    nic->send(pkt);
+}
+
+static void arp_request(eth_dev_base_t *nic, uint32_t s_ip, uint32_t ip)
+{
+    static uint8_t const broadcast[6] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+    };
+    static uint8_t const unknown[6] = {};
+
+    ARP_TRACE("who has %d.%d.%d.%d\n", ip >> 24, (ip >> 16) & 0xFF,
+              (ip >> 8) & 0xFF, ip & 0xFF);
+
+    arp_packet_send(nic, ARP_OPER_REQUEST, broadcast, s_ip, unknown, ip);
+}
+
+// Ask again for a neighbor that wasn't confirmed recently,
+// it is still used meanwhile
+static void arp_refresh(arp_set_t *set, arp_entry_t *ent,
+                        eth_dev_base_t *nic, uint32_t ip, uint64_t now)
+{
+    arp_set_t::scoped_lock hold(set->lock);
+
+    if (ent->state != arp_state_t::STALE ||
+            ent->ip != ip || ent->nic != nic ||
+            now - ent->updated < ARP_RETRY_MS)
+        return;
+
+    ent->updated = now;
+    ++ent->requests;
+    uint32_t s_ip = ent->s_ip;
+
+    hold.unlock();
+
+    arp_request(nic, s_ip, ip);
+}
+
+// Queue a packet for a neighbor that isn't resolved,
+// and request it if it is a new one
+static int arp_send_slow(arp_set_t *set, eth_dev_base_t *nic,
+                         uint32_t s_ip, uint32_t ip, ethq_pkt_t *pkt)
+{
+    uint64_t now = arp_now_ms();
+
+    arp_set_t::scoped_lock hold(set->lock);
+
+    arp_entry_t *ent = arp_find_locked(set, nic, ip);
+
+    if (ent && ent->state != arp_state_t::INCOMPLETE) {
+        // Resolved meanwhile
+        memcpy(pkt->pkt.hdr.d_mac, ent->mac, sizeof(ent->mac));
+        hold.unlock();
+        return nic->send(pkt);
+    }
+
+    bool request = false;
+
+    if (!ent) {
+        ent = arp_alloc_locked(set);
+
+        if (unlikely(!ent)) {
+            // Every entry in the set is waiting for a reply
+            hold.unlock();
+            arp_drop(pkt);
+            return 0;
+        }
+
+        arp_write_begin(ent);
+        ent->ip = ip;
+        ent->nic = nic;
+        memset(ent->mac, 0, sizeof(ent->mac));
+        ent->state = arp_state_t::INCOMPLETE;
+        arp_write_end(ent);
+
+        ent->requests = 1;
+        ent->s_ip = s_ip;
+        ent->updated = now;
+        ent->used = now;
+
+        request = true;
+    }
+
+    if (unlikely(ent->pending_count >= ARP_PENDING_MAX)) {
+        hold.unlock();
+        ARP_TRACE("too many packets waiting, dropped\n");
+        arp_drop(pkt);
+        return 0;
+    }
+
+    // Coalesced, one request for all of them
+    pkt->next = nullptr;
+    if (ent->pending_tail)
+        ent->pending_tail->next = pkt;
+    else
+        ent->pending_head = pkt;
+    ent->pending_tail = pkt;
+    ++ent->pending_count;
+
+    hold.unlock();
+
+    if (request) {
+        arp_aging_start();
+        arp_request(nic, s_ip, ip);
+    }
+
+    return 1;
+}
+
+int arp_send(eth_dev_base_t *nic, uint32_t s_ip,
+             uint32_t next_hop, ethq_pkt_t *pkt)
+{
+    uint8_t *d_mac = pkt->pkt.hdr.d_mac;
+
+    if (!next_hop) {
+        nic->get_mac(d_mac);
+        return nic->send(pkt);
+    }
+
+    if (next_hop == ~UINT32_C(0)) {
+        memset(d_mac, 0xFF, 6);
+        return nic->send(pkt);
+    }
+
+    if (ipv4_is_multicast(next_hop)) {
+        // 01:00:5E and the low 23 bits of the group
+        d_mac[0] = 0x01;
+        d_mac[1] = 0x00;
+        d_mac[2] = 0x5E;
+        d_mac[3] = (next_hop >> 16) & 0x7F;
+        d_mac[4] = (next_hop >> 8) & 0xFF;
+        d_mac[5] = next_hop & 0xFF;
+        return nic->send(pkt);
+    }
+
+    arp_set_t *set = arp_set_of(next_hop);
+    arp_state_t state;
+    arp_entry_t *ent = arp_find(set, nic, next_hop, d_mac, &state);
+
+    if (likely(ent && state != arp_state_t::INCOMPLETE)) {
+        uint64_t now = arp_now_ms();
+
+        // Only stored when it changed enough to matter, so most
+        // packets don't write the line other CPUs read
+        if (now - ent->used >= ARP_RETRY_MS)
+            ent->used = now;
+
+        if (unlikely(state == arp_state_t::STALE) &&
+                now - ent->updated >= ARP_RETRY_MS)
+            arp_refresh(set, ent, nic, next_hop, now);
+
+        return nic->send(pkt);
+    }
+
+    return arp_send_slow(set, nic, s_ip, next_hop, pkt);
+}
+
+bool arp_lookup(eth_dev_base_t *nic, uint32_t ip, void *mac)
+{
+    arp_state_t state;
+    uint8_t found_mac[6];
+
+    if (!arp_find(arp_set_of(ip), nic, ip, found_mac, &state) ||
+            state == arp_state_t::INCOMPLETE)
+        return false;
+
+    memcpy(mac, found_mac, sizeof(found_mac));
+
+    return true;
+}
+
+void arp_update(eth_dev_base_t *nic, uint32_t ip,
+                void const *mac, bool create)
+{
+    uint64_t now = arp_now_ms();
+
+    arp_set_t *set = arp_set_of(ip);
+
+    arp_set_t::scoped_lock hold(set->lock);
+
+    arp_entry_t *ent = arp_find_locked(set, nic, ip);
+
+    if (!ent) {
+        if (!create)
+            return;
+
+        ent = arp_alloc_locked(set);
+
+        if (unlikely(!ent))
+            return;
+
+        ent->used = now;
+    }
+
+    arp_write_begin(ent);
+    ent->ip = ip;
+    ent->nic = nic;
+    memcpy(ent->mac, mac, sizeof(ent->mac));
+    ent->state = arp_state_t::REACHABLE;
+    arp_write_end(ent);
+
+    ent->requests = 0;
+    ent->updated = now;
+
+    ethq_pkt_t *pending = ent->pending_head;
+    ent->pending_head = nullptr;
+    ent->pending_tail = nullptr;
+    ent->pending_count = 0;
+
+    hold.unlock();
+
+    if (create)
+        arp_aging_start();
+
+    while (pending) {
+        ethq_pkt_t *next = pending->next;
+        pending->next = nullptr;
+
+        memcpy(pending->pkt.hdr.d_mac, mac, 6);
+        nic->send(pending);
+
+        pending = next;
+    }
+}
+
+// Retries requests, gives up on neighbors that don't reply,
+// and forgets the ones that aren't used
+static int arp_aging_thread(void *)
+{
+    struct request_t {
+        eth_dev_base_t *nic;
+        uint32_t s_ip;
+        uint32_t ip;
+    };
+
+    for (;;) {
+        thread_sleep_for(ARP_RETRY_MS);
+
+        uint64_t now = arp_now_ms();
+
+        for (arp_set_t& set : arp_sets) {
+            request_t requests[ARP_WAYS];
+            size_t request_count = 0;
+            ethq_pkt_t *failed = nullptr;
+
+            arp_set_t::scoped_lock hold(set.lock);
+
+            for (arp_entry_t& ent : set.ways) {
+                switch (ent.state) {
+                case arp_state_t::FREE:
+                    break;
+
+                case arp_state_t::INCOMPLETE:
+                    if (now - ent.updated < ARP_RETRY_MS)
+                        break;
+
+                    if (ent.requests < ARP_REQUEST_MAX) {
+                        ++ent.requests;
+                        ent.updated = now;
+                        requests[request_count++] = {
+                            ent.nic, ent.s_ip, ent.ip
+                        };
+                        break;
+                    }
+
+                    ARP_TRACE("no reply, dropping %zu packets\n",
+                              ent.pending_count);
+
+                    if (ethq_pkt_t *tail = ent.pending_tail) {
+                        tail->next = failed;
+                        failed = ent.pending_head;
+                    }
+
+                    arp_free_locked(&ent);
+                    break;
+
+                case arp_state_t::REACHABLE:
+                    if (now - ent.updated >= ARP_REACHABLE_MS) {
+                        arp_write_begin(&ent);
+                        ent.state = arp_state_t::STALE;
+                        arp_write_end(&ent);
+                    }
+                    break;
+
+                case arp_state_t::STALE:
+                    if (now - ent.used >= ARP_UNUSED_MS ||
+                            (ent.requests >= ARP_REQUEST_MAX &&
+                             now - ent.updated >= ARP_RETRY_MS))
+                        arp_free_locked(&ent);
+                    break;
+
+                }
+            }
+
+            hold.unlock();
+
+            for (size_t i = 0; i < request_count; ++i)
+                arp_request(requests[i].nic, requests[i].s_ip,
+                            requests[i].ip);
+
+            arp_drop(failed);
+        }
+    }
+
+    return 0;
 }
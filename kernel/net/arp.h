@@ -32,3 +32,27 @@ struct arp_packet_t {
     // Target IPv4 address
     uint8_t target_ip[4];
 } _packed;
+
+#define ARP_OPER_REQUEST    1
+#define ARP_OPER_REPLY      2
+
+// Send an ARP packet from nic to the ethernet address d_mac,
+// addresses are in host byte order
+void arp_packet_send(eth_dev_base_t *nic, uint16_t oper,
+                     void const *d_mac, uint32_t s_ip,
+                     void const *target_mac, uint32_t target_ip);
+
+// Fill in the destination MAC of a frame to next_hop and send it on
+// nic, or hold it until next_hop is resolved. s_ip is the source of
+// the requests for it. next_hop 0 is the interface itself. Takes the
+// reference like eth_dev_base_t::send
+int arp_send(eth_dev_base_t *nic, uint32_t s_ip,
+             uint32_t next_hop, ethq_pkt_t *pkt);
+
+// MAC of a resolved neighbor, without locking
+bool arp_lookup(eth_dev_base_t *nic, uint32_t ip, void *mac);
+
+// Record the MAC of a neighbor, and send the packets waiting for it.
+// A neighbor not in the cache is only added if create is true
+void arp_update(eth_dev_base_t *nic, uint32_t ip,
+                void const *mac, bool create);
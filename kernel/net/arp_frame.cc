@@ -1,5 +1,6 @@
 #include "arp_frame.h"
 #include "arp.h"
+#include "ipv4.h"
 #include "bswap.h"
 #include "string.h"
 #include "printk.h"
@@ -15,109 +16,47 @@ void arp_frame_received(ethq_pkt_t *pkt)
 {
     arp_packet_t *ap = (arp_packet_t*)&pkt->pkt;
 
-    if (ap->hlen == 6 && ap->plen == 4) {
-        ARP_TRACE("Sender=%02x:%02x:%02x:%02x:%02x:%02x"
-                  " IP=%d.%d.%d.%d"
-                  " Target=%02x:%02x:%02x:%02x:%02x:%02x"
-                  " IP=%d.%d.%d.%d hlen=%d plen=%d htype=%d oper=%d\n",
-                  ap->source_mac[0],
-                ap->source_mac[1],
-                ap->source_mac[2],
-                ap->source_mac[3],
-                ap->source_mac[4],
-                ap->source_mac[5],
-                ap->sender_ip[0],
-                ap->sender_ip[1],
-                ap->sender_ip[2],
-                ap->sender_ip[3],
-                ap->target_mac[0],
-                ap->target_mac[1],
-                ap->target_mac[2],
-                ap->target_mac[3],
-                ap->target_mac[4],
-                ap->target_mac[5],
-                ap->target_ip[0],
-                ap->target_ip[1],
-                ap->target_ip[2],
-                ap->target_ip[3],
-                ap->hlen,
-                ap->plen,
-                ntohs(ap->htype),
-                ntohs(ap->oper));
-
-        if (ap->target_ip[0] == 192 &&
-                ap->target_ip[1] == 168 &&
-                ap->target_ip[2] == 122 &&
-                ap->target_ip[3] == 42) {
-            ethq_pkt_t *reply_pkt = ethq_pkt_acquire();
-            arp_packet_t *reply = (arp_packet_t*)&reply_pkt->pkt;
-            // Ethernet
-            reply->htype = htons(1);
-            // IPv4
-            reply->ptype = htons(ETHERTYPE_IPv4);
-            // 6 byte MAC
-            reply->hlen = 6;
-            // 4 byte IP
-            reply->plen = 4;
-            // Reply
-            reply->oper = htons(2);
-
-            // Reply to sender's IP
-            memcpy(reply->sender_ip, ap->target_ip, 4);
-            // From this IP
-            memcpy(reply->target_ip, ap->sender_ip, 4);
-
-            //
-            // Ethernet headers
-
-            reply->eth_hdr.len_ethertype = htons(ETHERTYPE_ARP);
-
-            // Get MAC from NIC (from me)
-            pkt->nic->get_mac(reply->eth_hdr.s_mac);
-            memcpy(reply->source_mac, reply->eth_hdr.s_mac, 6);
-
-            // Broadcast destination
-            memset(reply->eth_hdr.d_mac, 0xFF, 6);
-
-            // To them
-            memcpy(reply->target_mac, ap->source_mac, 6);
-
-            reply_pkt->size = sizeof(*reply);
-
-            ARP_TRACE("Reply: Sender=%02x:%02x:%02x:%02x:%02x:%02x"
-                      " IP=%d.%d.%d.%d"
-                      " Target=%02x:%02x:%02x:%02x:%02x:%02x"
-                      " IP=%d.%d.%d.%d\n",
-                    reply->source_mac[0],
-                    reply->source_mac[1],
-                    reply->source_mac[2],
-                    reply->source_mac[3],
-                    reply->source_mac[4],
-                    reply->source_mac[5],
-                    reply->sender_ip[0],
-                    reply->sender_ip[1],
-                    reply->sender_ip[2],
-                    reply->sender_ip[3],
-                    reply->target_mac[0],
-                    reply->target_mac[1],
-                    reply->target_mac[2],
-                    reply->target_mac[3],
-                    reply->target_mac[4],
-                    reply->target_mac[5],
-                    reply->target_ip[0],
-                    reply->target_ip[1],
-                    reply->target_ip[2],
-                    reply->target_ip[3]);
-
-            // Transmit
-            ARP_TRACE("Sending ARP reply\n");
-            pkt->nic->send(reply_pkt);
-        }
-    } else {
+    if (unlikely(pkt->size < sizeof(*ap) ||
+                 ntohs(ap->htype) != 1 ||
+                 ntohs(ap->ptype) != ETHERTYPE_IPv4 ||
+                 ap->hlen != 6 || ap->plen != 4)) {
         ARP_TRACE("Unrecognized packet, hlen=%d, plen=%d\n",
                   ap->hlen, ap->plen);
+        return;
     }
 
-    (void)ap;
+    uint32_t sender_ip;
+    uint32_t target_ip;
+    memcpy(&sender_ip, ap->sender_ip, sizeof(sender_ip));
+    memcpy(&target_ip, ap->target_ip, sizeof(target_ip));
+    sender_ip = ntohl(sender_ip);
+    target_ip = ntohl(target_ip);
+
+    uint16_t oper = ntohs(ap->oper);
+
+    ARP_TRACE("oper=%d Sender=%02x:%02x:%02x:%02x:%02x:%02x"
+              " IP=%d.%d.%d.%d Target IP=%d.%d.%d.%d\n",
+              oper,
+              ap->source_mac[0], ap->source_mac[1], ap->source_mac[2],
+              ap->source_mac[3], ap->source_mac[4], ap->source_mac[5],
+              ap->sender_ip[0], ap->sender_ip[1],
+              ap->sender_ip[2], ap->sender_ip[3],
+              ap->target_ip[0], ap->target_ip[1],
+              ap->target_ip[2], ap->target_ip[3]);
+
+    bool for_us = ipv4_addr_is_local(target_ip);
+
+    // RFC 826: update the sender if it is known, and add it if it
+    // is talking to us, it is likely to be sent to soon.
+    // A probe from an address being claimed has no sender
+    if (sender_ip)
+        arp_update(pkt->nic, sender_ip, ap->source_mac, for_us);
+
+    if (for_us && oper == ARP_OPER_REQUEST) {
+        ARP_TRACE("Sending ARP reply\n");
+
+        // Straight back to the sender
+        arp_packet_send(pkt->nic, ARP_OPER_REPLY, ap->source_mac,
+                        target_ip, ap->source_mac, sender_ip);
+    }
 }
-
@@ -4,6 +4,10 @@
 #include "cpu/atomic.h"
 #include "printk.h"
 #include "mutex.h"
+#include "string.h"
+#include "algorithm.h"
+#include "thread.h"
+#include "cpu/control_regs.h"
 
 #define ETHQ_DEBUG  1
 #if ETHQ_DEBUG
@@ -19,176 +23,259 @@ struct alignas(2048) ethq_pkt2K_t {
 
 C_ASSERT(sizeof(ethq_pkt2K_t) == (PAGESIZE >> 1));
 
-static ethq_pkt2K_t *ethq_pkts;
-static ethq_pkt_t ** ethq_pkt_list;
-static size_t ethq_pkt_count;
-static uint16_t volatile *ethq_free_chain;
-static uint32_t volatile ethq_first_free_aba;
-static ethq_pkt_t *ethq_first_free;
+// Buffers allocated each time a pool runs dry, 128KB
+static constexpr size_t ethq_chunk_pkts = 64;
 
-// Redundant calls are tolerated and ignored
-int ethq_init(void)
-{
-    if (ethq_pkts)
-        return 1;
+// Buffers each per-CPU cache holds, it refills or flushes
+// half of that from or to the shared free list at once
+static constexpr size_t ethq_cache_pkts = 64;
 
-    // Allocate 64KB of packets
-    //  + 64KB of packet pointers
-    //  + 8KB of free chain indices
-    ethq_pkt_count = 1 << 4;
-    size_t ethq_pool_size = ethq_pkt_count *
-            (sizeof(ethq_pkt2K_t) +
-             sizeof(ethq_pkt2K_t*) +
-             sizeof(uint16_t));
-
-    ethq_pkts = (ethq_pkt2K_t*)mmap(nullptr, ethq_pool_size,
-                          PROT_READ | PROT_WRITE,
-                          MAP_POPULATE | MAP_32BIT, -1, 0);
-    if (!ethq_pkts || ethq_pkts == MAP_FAILED)
-        return 0;
+enum ethq_pool_id_t : uint8_t {
+    ETHQ_POOL_ANY,
+    ETHQ_POOL_DMA32,
+    ETHQ_POOL_COUNT
+};
+
+struct ethq_pool_t {
+    using lock_type = std::mcslock;
+    using scoped_lock = std::unique_lock<lock_type>;
+
+    struct alignas(64) cache_t {
+        ethq_pkt_t *pkts[ethq_cache_pkts];
+        size_t count;
+    };
+
+    ethq_pkt_t *acquire();
+    void release(ethq_pkt_t *pkt);
+
+    bool grow();
 
-    ethq_pkt_list = (ethq_pkt_t**)(ethq_pkts + ethq_pkt_count);
-    ethq_free_chain = (uint16_t*)(ethq_pkt_list + ethq_pkt_count);
+    cache_t caches[MAX_CPUS];
+
+    lock_type lock;
+
+    // Shared free list, linked through next
+    ethq_pkt_t *free_list;
+    size_t free_count;
+
+    size_t total;
+    size_t max_total;
+    int map_flags;
+    ethq_pool_id_t id;
+};
+
+static ethq_pool_t ethq_pools[ETHQ_POOL_COUNT];
+
+// Allocate a chunk of buffers and add them to the shared free list
+bool ethq_pool_t::grow()
+{
+    if (atomic_ld_acq(&total) >= max_total)
+        return false;
+
+    ethq_pkt2K_t *pkts = (ethq_pkt2K_t*)mmap(
+                nullptr, sizeof(ethq_pkt2K_t) * ethq_chunk_pkts,
+                PROT_READ | PROT_WRITE, MAP_POPULATE | map_flags, -1, 0);
+    if (!pkts || pkts == MAP_FAILED)
+        return false;
 
     uintptr_t physaddr = 0;
-    for (size_t i = 0; i < ethq_pkt_count; ++i) {
+    for (size_t i = 0; i < ethq_chunk_pkts; ++i) {
+        // Two buffers per page
         if (!(i & 1))
-            physaddr = mphysaddr(&ethq_pkts[i].pkt);
+            physaddr = mphysaddr(&pkts[i].pkt.pkt);
         else
             physaddr += sizeof(ethq_pkt2K_t);
 
-        ethq_pkts[i].pkt.next = (i+1) < ethq_pkt_count
-                ? &ethq_pkts[i+1].pkt
+        pkts[i].pkt.physaddr = physaddr;
+        pkts[i].pkt.pool = id;
+        pkts[i].pkt.next = (i + 1) < ethq_chunk_pkts
+                ? &pkts[i + 1].pkt
                 : nullptr;
-
-        ethq_pkts[i].pkt.physaddr = physaddr;
-
-        ethq_pkt_list[i] = &ethq_pkts[i].pkt;
     }
-    ethq_first_free = &ethq_pkts[0].pkt;
 
-    // Initialize lock free MRU allocator
-    ethq_free_chain[ethq_pkt_count-1] = 0xFFFF;
-    for (size_t i = ethq_pkt_count-1; i > 0; --i) {
-        ethq_free_chain[i-1] = i;
-    }
-    ethq_first_free_aba = 0;
-
-#ifndef NDEBUG
-    // Self test
-    ethq_pkt_t *test1 = ethq_pkt_acquire();
-    ethq_pkt_t *test2 = ethq_pkt_acquire();
-    ethq_pkt_t *test3 = ethq_pkt_acquire();
-    ethq_pkt_t *test4 = ethq_pkt_acquire();
-    ethq_pkt_release(test1);
-    ethq_pkt_release(test2);
-    ethq_pkt_release(test3);
-    ethq_pkt_release(test4);
-    ethq_pkt_t *chk1 = ethq_pkt_acquire();
-    ethq_pkt_t *chk2 = ethq_pkt_acquire();
-    ethq_pkt_t *chk3 = ethq_pkt_acquire();
-    ethq_pkt_t *chk4 = ethq_pkt_acquire();
-    assert(chk4 == test1);
-    assert(chk3 == test2);
-    assert(chk2 == test3);
-    assert(chk1 == test4);
-    ethq_pkt_release(test4);
-    ethq_pkt_release(test3);
-    ethq_pkt_release(test2);
-    ethq_pkt_release(test1);
-#endif
+    scoped_lock hold(lock);
+    pkts[ethq_chunk_pkts - 1].pkt.next = free_list;
+    free_list = &pkts[0].pkt;
+    free_count += ethq_chunk_pkts;
+    total += ethq_chunk_pkts;
 
-    return 1;
+    ETHQ_TRACE("Pool %u grew to %zu buffers\n", id, total);
+
+    return true;
 }
 
-#if 1
-static std::mcslock ethq_lock;
-ethq_pkt_t *ethq_pkt_acquire(void)
+ethq_pkt_t *ethq_pool_t::acquire()
 {
-    std::unique_lock<std::mcslock> lock(ethq_lock);
+    for (;;) {
+        cpu_scoped_irq_disable intr_was_enabled;
 
-    ethq_pkt_t *pkt = ethq_first_free;
+        cache_t *cache = caches + thread_cpu_number();
 
-    if (pkt)
-        ethq_first_free = pkt->next;
+        if (likely(cache->count))
+            return cache->pkts[--cache->count];
 
-    return pkt;
+        // Refill half of the cache from the shared list
+        scoped_lock hold(lock);
+
+        for (size_t i = 0; free_list && i < ethq_cache_pkts / 2; ++i) {
+            ethq_pkt_t *pkt = free_list;
+            free_list = pkt->next;
+            --free_count;
+            cache->pkts[cache->count++] = pkt;
+        }
+
+        hold.unlock();
+
+        if (cache->count)
+            return cache->pkts[--cache->count];
+
+        // Never allocate memory in an interrupt handler
+        if (!intr_was_enabled)
+            return nullptr;
+
+        intr_was_enabled.restore();
+
+        if (!grow())
+            return nullptr;
+    }
 }
 
-void ethq_pkt_release(ethq_pkt_t *pkt)
+void ethq_pool_t::release(ethq_pkt_t *pkt)
 {
-    std::unique_lock<std::mcslock> lock(ethq_lock);
+    cpu_scoped_irq_disable intr_was_enabled;
 
-    pkt->next = ethq_first_free;
-    ethq_first_free = pkt;
-}
+    cache_t *cache = caches + thread_cpu_number();
 
-#else
+    if (unlikely(cache->count == ethq_cache_pkts)) {
+        // Flush the older half of the cache to the shared list
+        size_t flush = ethq_cache_pkts / 2;
 
-ethq_pkt_t *ethq_pkt_acquire(void)
-{
-    for (uint32_t first_free_aba = ethq_first_free_aba;
-         first_free_aba != 0xFFFF; pause()) {
-        // Determine the next ABA protection sequence number
-        uint32_t next_seq = (first_free_aba & -65536) + 0x10000;
+        for (size_t i = 0; i + 1 < flush; ++i)
+            cache->pkts[i]->next = cache->pkts[i + 1];
 
-        // Mask off ABA protection sequence number
-        uint32_t first_free = first_free_aba & 0xFFFF;
+        scoped_lock hold(lock);
+        cache->pkts[flush - 1]->next = free_list;
+        free_list = cache->pkts[0];
+        free_count += flush;
+        hold.unlock();
 
-        // See which packet is next
-        uint32_t next_free = ethq_free_chain[first_free];
+        memmove(cache->pkts, cache->pkts + flush,
+                sizeof(*cache->pkts) * (ethq_cache_pkts - flush));
+        cache->count -= flush;
+    }
 
-        // Try to atomically take a packet
-        uint32_t old_first_free = atomic_cmpxchg(
-                    &ethq_first_free_aba,
-                    first_free_aba,
-                    next_free | next_seq);
+    cache->pkts[cache->count++] = pkt;
+}
+
+// Redundant calls are tolerated and ignored
+int ethq_init(void)
+{
+    static bool initialized;
 
-        // If no race, return pointer to packet
-        if (old_first_free == first_free_aba) {
-            ethq_pkt_t *pkt = ethq_pkt_list[first_free];
+    if (initialized)
+        return 1;
 
-            ETHQ_TRACE("Acquired packet %p\n", (void*)pkt);
+    // Up to 32MB of buffers for anything,
+    // and 4MB for 32-bit DMA devices
+    ethq_pools[ETHQ_POOL_ANY].id = ETHQ_POOL_ANY;
+    ethq_pools[ETHQ_POOL_ANY].max_total = 16384;
+    ethq_pools[ETHQ_POOL_DMA32].id = ETHQ_POOL_DMA32;
+    ethq_pools[ETHQ_POOL_DMA32].max_total = 2048;
+    ethq_pools[ETHQ_POOL_DMA32].map_flags = MAP_32BIT;
 
-            return pkt;
-        }
+    // Fail early if there is no memory at all
+    if (!ethq_pools[ETHQ_POOL_ANY].grow())
+        return 0;
 
-        // Try again with fresh value of ethq_first_free_aba
-        first_free_aba = old_first_free;
+    initialized = true;
+
+    return 1;
+}
+
+static ethq_pkt_t *ethq_pkt_init(ethq_pkt_t *pkt)
+{
+    if (likely(pkt)) {
+        pkt->next = nullptr;
+        pkt->frag = nullptr;
+        pkt->callback = nullptr;
+        pkt->callback_arg = 0;
+        pkt->nic = nullptr;
+        pkt->size = 0;
+        pkt->offload = 0;
+        pkt->gso_size = 0;
+        pkt->csum_start = 0;
+        pkt->csum_offset = 0;
+        pkt->refcount = 1;
+        pkt->proto_flags = 0;
+        pkt->seq = 0;
+        pkt->stamp = 0;
+        pkt->data_ofs = 0;
+        pkt->data_len = 0;
+        pkt->data_csum = 0;
     }
 
-    return 0;
+    return pkt;
 }
 
-void ethq_pkt_release(ethq_pkt_t *pkt)
+ethq_pkt_t *ethq_pkt_acquire(void)
 {
-    uint16_t pkt_index = (ethq_pkt2K_t*)pkt - ethq_pkts;
+    return ethq_pkt_init(ethq_pools[ETHQ_POOL_ANY].acquire());
+}
 
-    for (uint32_t first_free_aba = ethq_first_free_aba; ; pause()) {
-        // Determine the next ABA protection sequence number
-        uint32_t next_seq = (first_free_aba & -65536) + 0x10000;
+ethq_pkt_t *ethq_pkt_acquire_dma32(void)
+{
+    return ethq_pkt_init(ethq_pools[ETHQ_POOL_DMA32].acquire());
+}
 
-        // Mask off ABA protection sequence number
-        uint16_t first_free = first_free_aba & 0xFFFF;
+ethq_pkt_t *ethq_pkt_acquire_size(size_t size)
+{
+    ethq_pkt_t *first = ethq_pkt_acquire();
+    ethq_pkt_t *last = first;
 
-        // Set next index for this slot
-        ethq_free_chain[pkt_index] = first_free;
+    for (size_t have = ethq_pkt_capacity; last && have < size;
+         have += ethq_pkt_capacity) {
+        last->frag = ethq_pkt_acquire();
+        last = last->frag;
+    }
 
-        uint32_t old_first_free = atomic_cmpxchg(
-                    &ethq_first_free_aba,
-                    first_free_aba,
-                    pkt_index | next_seq);
+    if (unlikely(!last && first)) {
+        ethq_pkt_release(first);
+        return nullptr;
+    }
 
-        if (old_first_free == first_free_aba) {
-            ETHQ_TRACE("Released packet %p\n", (void*)pkt);
-            return;
-        }
+    return first;
+}
+
+void ethq_pkt_release(ethq_pkt_t *pkt)
+{
+    if (pkt && atomic_dec(&pkt->refcount) != 0)
+        return;
 
-        // Try again with fresh value of ethq_first_free_aba
-        first_free_aba = old_first_free;
+    ethq_pkt_t *frag;
+    for (; pkt; pkt = frag) {
+        frag = pkt->frag;
+        ethq_pools[pkt->pool].release(pkt);
     }
 }
-#endif
+
+size_t ethq_pkt_total_size(ethq_pkt_t const *pkt)
+{
+    size_t size = 0;
+    for (; pkt; pkt = pkt->frag)
+        size += pkt->size;
+    return size;
+}
+
+size_t ethq_pkt_copy(void *dest, ethq_pkt_t const *pkt, size_t max)
+{
+    size_t size = 0;
+    for (; pkt && size < max; pkt = pkt->frag) {
+        size_t chunk = std::min(size_t(pkt->size), max - size);
+        memcpy((char*)dest + size, &pkt->pkt, chunk);
+        size += chunk;
+    }
+    return size;
+}
 
 void ethq_enqueue(ethq_queue_t *queue, ethq_pkt_t *pkt)
 {
@@ -230,9 +317,8 @@ ethq_pkt_t *ethq_dequeue(ethq_queue_t *queue)
 
 ethq_pkt_t *ethq_dequeue_all(ethq_queue_t *queue)
 {
-    ethq_pkt_t *all = queue->head;
-    if (queue->tail)
-        queue->tail->next = nullptr;
+    // Oldest first, linked through next up to head
+    ethq_pkt_t *all = queue->tail;
     queue->head = nullptr;
     queue->tail = nullptr;
     queue->count = 0;
@@ -1,6 +1,8 @@
 #pragma once
 #include "types.h"
 #include "ethernet.h"
+#include "assert.h"
+#include "cpu/atomic.h"
 
 // Circular dependency
 struct ethq_pkt_t;
@@ -8,16 +10,17 @@ struct eth_dev_base_t;
 
 #include "dev_eth.h"
 
-struct ethq_pkt_t {
-    // Ethernet packet
-    ethernet_pkt_t pkt;
-
-    // physical address of packet
-    uintptr_t physaddr;
+// Bytes in front of pkt that drivers and protocols may prepend
+// headers into without moving the frame
+#define ETHQ_HEADROOM   56
 
+struct ethq_pkt_t {
     // Next packet in queue
     ethq_pkt_t *next;
 
+    // Next buffer of a frame that doesn't fit in one buffer
+    ethq_pkt_t *frag;
+
     // Completion callback
     void (*callback)(ethq_pkt_t*, int error, uintptr_t);
     uintptr_t callback_arg;
@@ -25,14 +28,109 @@ struct ethq_pkt_t {
     // Source network interface
     eth_dev_base_t *nic;
 
-    // Size of packet
+    // physical address of packet
+    uintptr_t physaddr;
+
+    // Size of packet, the bytes used in this buffer
     uint16_t size;
+
+    // Pool the buffer is returned to
+    uint8_t pool;
+
+    // ETHQ_OFFLOAD_* bits, and their parameters, offsets are from pkt
+    uint8_t offload;
+    uint16_t gso_size;
+    uint8_t csum_start;
+    uint8_t csum_offset;
+
+    // References, the buffer is released when the last one is
+    // dropped. Only the first buffer of a frag chain is counted
+    uint16_t refcount;
+
+    // Protocol state, the meaning depends on the protocol
+    uint16_t proto_flags;
+    uint32_t seq;
+    uint32_t stamp;
+
+    // Payload not consumed by the protocol yet, offset from pkt
+    uint16_t data_ofs;
+    uint16_t data_len;
+
+    // Folded checksum of the payload, valid if the protocol says so
+    uint16_t data_csum;
+
+    // Ends where the IP header that follows
+    // the ethernet header is aligned
+    uint8_t headroom[ETHQ_HEADROOM];
+
+    // Ethernet packet, or continuation bytes in frag buffers
+    ethernet_pkt_t pkt;
 };
 
+C_ASSERT((offsetof(ethq_pkt_t, pkt) + sizeof(ethernet_hdr_t)) % 8 == 0);
+
+// Transmit: the NIC computes the checksum from csum_start to the end
+// and stores it at csum_start + csum_offset, see ETH_DEV_OFFLOAD_TX_CSUM
+#define ETHQ_OFFLOAD_CSUM       (1U<<0)
+
+// Receive: the NIC verified the checksums
+#define ETHQ_OFFLOAD_CSUM_OK    (1U<<1)
+
+// Transmit: the NIC splits the TCP payload into gso_size segments,
+// receive: the NIC coalesced gso_size segments
+#define ETHQ_OFFLOAD_TSO4       (1U<<2)
+
+// Bytes a single buffer holds
+static constexpr size_t ethq_pkt_capacity = sizeof(ethernet_pkt_t);
+
 int ethq_init(void);
+
+// Buffers come from a pool that grows on demand, through per-CPU
+// caches. Callable from interrupt handlers, but the pool only
+// grows when called with interrupts enabled
 ethq_pkt_t *ethq_pkt_acquire(void);
+
+// Buffers below 4GB, for devices with 32-bit DMA addresses
+ethq_pkt_t *ethq_pkt_acquire_dma32(void);
+
+// Acquire enough buffers, linked through frag, to hold size bytes
+ethq_pkt_t *ethq_pkt_acquire_size(size_t size);
+
+// Drop a reference to a packet, the last one
+// releases it and all of its frag buffers
 void ethq_pkt_release(ethq_pkt_t *pkt);
 
+// Add a reference, to keep a packet after handing it to a NIC or
+// after returning it from a receive path that releases it
+static _always_inline void ethq_pkt_ref(ethq_pkt_t *pkt)
+{
+    atomic_inc(&pkt->refcount);
+}
+
+static _always_inline bool ethq_pkt_shared(ethq_pkt_t const *pkt)
+{
+    return atomic_ld_acq(&pkt->refcount) > 1;
+}
+
+// Total size of a packet, including frag buffers
+size_t ethq_pkt_total_size(ethq_pkt_t const *pkt);
+
+// Copy at most max bytes of a packet, including frag buffers, into a
+// flat buffer, returns the number of bytes copied
+size_t ethq_pkt_copy(void *dest, ethq_pkt_t const *pkt, size_t max);
+
+// Start of a header of the given size prepended in front of pkt
+static _always_inline void *ethq_pkt_prepend(ethq_pkt_t *pkt, size_t size)
+{
+    return (char*)&pkt->pkt - size;
+}
+
+static _always_inline uintptr_t ethq_pkt_prepend_physaddr(
+        ethq_pkt_t const *pkt, size_t size)
+{
+    return pkt->physaddr - size;
+}
+
 struct ethq_queue_t {
     ethq_pkt_t * volatile head;
     ethq_pkt_t * volatile tail;
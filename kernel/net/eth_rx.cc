@@ -0,0 +1,227 @@
+#include "eth_rx.h"
+#include "eth_frame.h"
+#include "eth_tx.h"
+#include "rss.h"
+#include "tcp.h"
+#include "work_queue.h"
+#include "thread.h"
+#include "cpu/atomic.h"
+#include "printk.h"
+
+// Steer frames to the CPU that consumes their flow (RFS)
+#define ETH_RX_RFS          1
+
+// Spread the flows of NICs with one receive ring across CPUs (RPS)
+#define ETH_RX_RPS          1
+
+// Frames allowed to wait for one CPU, more are dropped
+#define ETH_RX_BACKLOG_MAX  1024
+
+#define ETH_RX_DEBUG   0
+#if ETH_RX_DEBUG
+#define ETH_RX_TRACE(...) printdbg("eth_rx: " __VA_ARGS__)
+#else
+#define ETH_RX_TRACE(...) ((void)0)
+#endif
+
+static void eth_rx_run(eth_rx_queue_t *queue);
+static void eth_rx_process(ethq_pkt_t *pkt, bool steer);
+
+// Frames steered to a CPU by the others, processed by its work queue
+struct alignas(64) eth_rx_backlog_t {
+    // Newest first
+    ethq_pkt_t * volatile head;
+    size_t volatile count;
+
+    // Frames pushed and frames processed, free running
+    uint32_t volatile pushed;
+    uint32_t volatile done;
+
+    bool volatile scheduled;
+
+    uint64_t volatile drops;
+};
+
+static eth_rx_backlog_t eth_rx_backlogs[MAX_CPUS];
+
+// The CPU each flow's frames were last steered to, + 1, and the backlog
+// position after its last frame there. Indexed by flow hash, flows
+// that collide share an entry
+struct eth_rx_flow_t {
+    uint16_t cpu;
+    uint32_t tail;
+};
+
+static constexpr size_t eth_rx_flow_count = 4096;
+
+static eth_rx_flow_t eth_rx_flows[eth_rx_flow_count];
+
+void eth_rx_schedule(eth_rx_queue_t *queue, int cpu)
+{
+    if (atomic_xchg(&queue->rx_poll_scheduled, true))
+        return;
+
+    if (cpu < 0)
+        cpu = thread_cpu_number();
+
+    workq::enqueue_on_cpu(cpu, [queue] {
+        eth_rx_run(queue);
+    });
+}
+
+static void eth_rx_run(eth_rx_queue_t *queue)
+{
+    int done = queue->rx_poll(eth_rx_budget);
+
+    ETH_RX_TRACE("poll processed %d frames\n", done);
+
+    if (done >= eth_rx_budget) {
+        // Probably more waiting, let other work on this CPU run first
+        workq::enqueue([queue] {
+            eth_rx_run(queue);
+        });
+        return;
+    }
+
+    // Idle before unmasking, so an interrupt that arrives
+    // right after unmasking reschedules the poll
+    atomic_st_rel(&queue->rx_poll_scheduled, false);
+
+    queue->rx_irq_unmask();
+}
+
+static void eth_rx_backlog_run(int cpu)
+{
+    eth_rx_backlog_t& backlog = eth_rx_backlogs[cpu];
+
+    // Idle before taking the frames, a frame pushed
+    // after that schedules another run
+    atomic_st_rel(&backlog.scheduled, false);
+
+    ethq_pkt_t *pkt = atomic_xchg(&backlog.head, nullptr);
+
+    // Reverse it into arrival order
+    ethq_pkt_t *first = nullptr;
+    uint32_t count = 0;
+    while (pkt) {
+        ethq_pkt_t *next = pkt->next;
+        pkt->next = first;
+        first = pkt;
+        pkt = next;
+        ++count;
+    }
+
+    atomic_sub(&backlog.count, count);
+
+    eth_rx_process(first, false);
+
+    atomic_add(&backlog.done, count);
+}
+
+// Returns false if the backlog is full and the frame was dropped
+static bool eth_rx_backlog_push(int cpu, ethq_pkt_t *pkt, uint32_t *tail)
+{
+    eth_rx_backlog_t& backlog = eth_rx_backlogs[cpu];
+
+    if (unlikely(atomic_xadd(&backlog.count, 1) >= ETH_RX_BACKLOG_MAX)) {
+        atomic_dec(&backlog.count);
+        atomic_inc(&backlog.drops);
+        ethq_pkt_release(pkt);
+        return false;
+    }
+
+    *tail = atomic_inc(&backlog.pushed);
+
+    ethq_pkt_t *old = atomic_ld_acq(&backlog.head);
+    for (;;) {
+        pkt->next = old;
+        ethq_pkt_t *seen = atomic_cmpxchg(&backlog.head, old, pkt);
+        if (seen == old)
+            break;
+        old = seen;
+    }
+
+    if (!atomic_xchg(&backlog.scheduled, true)) {
+        workq::enqueue_on_cpu(cpu, [cpu] {
+            eth_rx_backlog_run(cpu);
+        });
+    }
+
+    return true;
+}
+
+// Returns true if the frame was passed to another CPU
+static bool eth_rx_steer(ethq_pkt_t *pkt, int cpu)
+{
+    uint32_t hash = rss_hash_frame(pkt);
+
+    if (!hash)
+        return false;
+
+    int target = -1;
+
+#if ETH_RX_RFS
+    target = rss_flow_cpu(hash);
+#endif
+
+#if ETH_RX_RPS
+    // NICs with several rings spread flows themselves
+    if (target < 0 && pkt->nic && pkt->nic->rx_queue_count() == 1)
+        target = int((uint64_t(hash) * thread_get_cpu_count()) >> 32);
+#endif
+
+    if (target < 0)
+        target = cpu;
+
+    eth_rx_flow_t& flow = eth_rx_flows[hash & (eth_rx_flow_count - 1)];
+    int current = int(flow.cpu) - 1;
+
+    // Stay until the frames waiting for the old CPU are processed,
+    // they would be overtaken otherwise
+    if (current >= 0 && current != target && int32_t(
+                atomic_ld_acq(&eth_rx_backlogs[current].done) -
+                flow.tail) < 0)
+        target = current;
+
+    flow.cpu = uint16_t(target + 1);
+
+    if (target == cpu)
+        return false;
+
+    uint32_t tail;
+    if (eth_rx_backlog_push(target, pkt, &tail))
+        flow.tail = tail;
+
+    return true;
+}
+
+static void eth_rx_process(ethq_pkt_t *pkt, bool steer)
+{
+    int cpu = thread_cpu_number();
+
+    // ACKs for the whole batch go out after it,
+    // and replies share one doorbell per ring
+    eth_tx_batch_begin();
+    tcp_rx_batch_begin();
+
+    ethq_pkt_t *next;
+    for (; pkt; pkt = next) {
+        next = pkt->next;
+        pkt->next = nullptr;
+
+        // Frames steered to another CPU are processed there
+        if ((ETH_RX_RFS || ETH_RX_RPS) && steer && eth_rx_steer(pkt, cpu))
+            continue;
+
+        eth_frame_received(pkt);
+        ethq_pkt_release(pkt);
+    }
+
+    tcp_rx_batch_end();
+    eth_tx_batch_end();
+}
+
+void eth_rx_deliver(ethq_pkt_t *pkt)
+{
+    eth_rx_process(pkt, true);
+}
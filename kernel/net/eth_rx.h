@@ -0,0 +1,36 @@
+#pragma once
+#include "eth_q.h"
+
+// Receive processing
+//
+// A NIC interrupt handler only masks the receive interrupt and calls
+// eth_rx_schedule. That queues the NIC's rx_poll on the interrupted
+// CPU's work queue thread. Each pass takes at most eth_rx_budget
+// frames from the ring and passes them through the protocol stack.
+// When a pass finds the ring drained, the poll is marked idle and the
+// driver unmasks the interrupt. Otherwise the poll is queued again
+// behind any other work on that CPU.
+//
+// Under load, frames are processed in batches with the interrupt
+// masked. A receive storm therefore can't keep a CPU stuck in
+// interrupt handlers.
+//
+// Delivered frames are steered by flow, see rss.h. A flow whose socket
+// user last ran on another CPU is passed to that CPU's backlog, and
+// processed by its work queue (RFS). Flows of a NIC with one receive
+// ring are otherwise spread across CPUs by hash (RPS), a NIC with more
+// rings already spread them. A flow only moves once the frames it left
+// in the old CPU's backlog were processed, so it stays in order.
+
+// Frames one poll pass may process before yielding the CPU
+static constexpr int eth_rx_budget = 64;
+
+// Queue a poll of a receive ring, if one isn't already queued or
+// running, on the given CPU or by default the current one. Callable
+// from interrupt handlers
+void eth_rx_schedule(eth_rx_queue_t *queue, int cpu = -1);
+
+// Pass a chain of received frames, linked through next, to the
+// protocol stack, here or on the CPUs they are steered to, and
+// release them. Only called on work queue threads
+void eth_rx_deliver(ethq_pkt_t *pkt);
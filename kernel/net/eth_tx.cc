@@ -0,0 +1,347 @@
+#include "eth_tx.h"
+#include "dev_eth.h"
+#include "thread.h"
+#include "time.h"
+#include "bitsearch.h"
+#include "cpu/atomic.h"
+#include "cpu/control_regs.h"
+#include "printk.h"
+
+#define ETH_TX_DEBUG   0
+#if ETH_TX_DEBUG
+#define ETH_TX_TRACE(...) printdbg("eth_tx: " __VA_ARGS__)
+#else
+#define ETH_TX_TRACE(...) ((void)0)
+#endif
+
+// The limit shrinks at most once per interval
+static constexpr uint64_t eth_tx_slack_interval_ns = 1000000000;
+
+// Thread id 0 is valid, so no owner is -1
+static constexpr thread_t eth_tx_defer_no_owner = -1;
+
+// Rings with deferred doorbells, see eth_tx_batch_begin
+struct alignas(64) eth_tx_defer_t {
+    thread_t owner = eth_tx_defer_no_owner;
+    size_t count = 0;
+    eth_tx_queue_t *queues[8] = {};
+};
+
+static eth_tx_defer_t eth_tx_defers[MAX_CPUS];
+
+static void eth_tx_run(eth_tx_queue_t *queue);
+
+eth_tx_state_t::eth_tx_state_t()
+    : staged_mask(0)
+    , queued(0)
+    , dropped(0)
+    , running(false)
+    , reclaim_pending(false)
+    , backlog_head(nullptr)
+    , backlog_tail(nullptr)
+    , inflight(0)
+    , limit(eth_tx_limit_min)
+    , slack(SIZE_MAX)
+    , slack_start(0)
+    , limited(false)
+{
+    for (size_t i = 0; i < MAX_CPUS; ++i)
+        staged[i].head = nullptr;
+}
+
+static void eth_tx_drop(ethq_pkt_t *pkt)
+{
+    pkt->next = nullptr;
+    if (pkt->callback)
+        pkt->callback(pkt, 1, pkt->callback_arg);
+    ethq_pkt_release(pkt);
+}
+
+// Returns true if the doorbell was deferred, called with irqs disabled
+static bool eth_tx_defer(eth_tx_queue_t *queue, int cpu)
+{
+    eth_tx_defer_t& defer = eth_tx_defers[cpu];
+
+    if (defer.owner != thread_get_id())
+        return false;
+
+    for (size_t i = 0; i < defer.count; ++i) {
+        if (defer.queues[i] == queue)
+            return true;
+    }
+
+    if (unlikely(defer.count >= countof(defer.queues)))
+        return false;
+
+    defer.queues[defer.count++] = queue;
+
+    return true;
+}
+
+size_t eth_tx_send_batch(eth_tx_queue_t *queue,
+                         ethq_pkt_t **pkts, size_t count)
+{
+    if (unlikely(!count))
+        return 0;
+
+    eth_tx_state_t& state = queue->tx_state;
+
+    // Reserve backlog space, drop what doesn't fit
+    size_t queued = atomic_xadd(&state.queued, count);
+    size_t room = queued < eth_tx_backlog_max
+            ? eth_tx_backlog_max - queued
+            : 0;
+
+    if (unlikely(room < count)) {
+        ETH_TX_TRACE("backlog full, dropped %zu frames\n", count - room);
+
+        atomic_sub(&state.queued, count - room);
+        atomic_add(&state.dropped, count - room);
+
+        for (size_t i = room; i < count; ++i)
+            eth_tx_drop(pkts[i]);
+
+        count = room;
+
+        if (!count)
+            return 0;
+    }
+
+    // Stages are newest first, the owner reverses them
+    pkts[0]->next = nullptr;
+    for (size_t i = 1; i < count; ++i)
+        pkts[i]->next = pkts[i - 1];
+
+    ethq_pkt_t *first = pkts[count - 1];
+    ethq_pkt_t *last = pkts[0];
+
+    cpu_scoped_irq_disable irq_dis;
+
+    int cpu = thread_cpu_number();
+    eth_tx_stage_t& stage = state.staged[cpu];
+
+    // Only this CPU pushes, but the owner may take the stage
+    ethq_pkt_t *old = atomic_ld_acq(&stage.head);
+    for (;;) {
+        last->next = old;
+        ethq_pkt_t *seen = atomic_cmpxchg(&stage.head, old, first);
+        if (seen == old)
+            break;
+        old = seen;
+    }
+
+    atomic_or(&state.staged_mask, UINT64_C(1) << cpu);
+
+    if (!eth_tx_defer(queue, cpu))
+        eth_tx_run(queue);
+
+    return count;
+}
+
+int eth_tx_send(eth_tx_queue_t *queue, ethq_pkt_t *pkt)
+{
+    return int(eth_tx_send_batch(queue, &pkt, 1));
+}
+
+void eth_tx_complete(eth_tx_queue_t *queue)
+{
+    atomic_st_rel(&queue->tx_state.reclaim_pending, true);
+
+    cpu_scoped_irq_disable irq_dis;
+
+    eth_tx_run(queue);
+}
+
+// Move every stage to the end of the backlog, in the order sent
+static void eth_tx_gather(eth_tx_state_t& state)
+{
+    uint64_t mask = atomic_xchg(&state.staged_mask, 0);
+
+    while (mask) {
+        int cpu = bit_lsb_set(mask);
+        mask &= mask - 1;
+
+        ethq_pkt_t *pkt = atomic_xchg(&state.staged[cpu].head, nullptr);
+
+        // Reverse it
+        ethq_pkt_t *chain = nullptr;
+        ethq_pkt_t *chain_tail = pkt;
+        while (pkt) {
+            ethq_pkt_t *next = pkt->next;
+            pkt->next = chain;
+            chain = pkt;
+            pkt = next;
+        }
+
+        if (!chain)
+            continue;
+
+        if (state.backlog_tail)
+            state.backlog_tail->next = chain;
+        else
+            state.backlog_head = chain;
+        state.backlog_tail = chain_tail;
+    }
+}
+
+// Reclaim and adjust the limit, returns the bytes reclaimed
+static size_t eth_tx_reclaim(eth_tx_queue_t *queue)
+{
+    eth_tx_state_t& state = queue->tx_state;
+
+    size_t bytes = queue->tx_reclaim();
+
+    state.inflight -= bytes < state.inflight ? bytes : state.inflight;
+
+    uint64_t now = time_ns();
+
+    if (state.limited && !state.inflight && state.backlog_head) {
+        // The device ran dry while frames waited for the limit
+        state.limit = state.limit < eth_tx_limit_max / 2
+                ? state.limit * 2
+                : eth_tx_limit_max;
+        state.slack = SIZE_MAX;
+        state.slack_start = now;
+
+        ETH_TX_TRACE("limit raised to %zu\n", state.limit);
+    } else {
+        if (state.slack > state.inflight)
+            state.slack = state.inflight;
+
+        if (now - state.slack_start >= eth_tx_slack_interval_ns) {
+            // Bytes that stayed queued the whole interval weren't needed
+            if (state.slack != SIZE_MAX) {
+                size_t cut = state.slack >> 1;
+                state.limit = state.limit > eth_tx_limit_min + cut
+                        ? state.limit - cut
+                        : eth_tx_limit_min;
+            }
+
+            state.slack = SIZE_MAX;
+            state.slack_start = now;
+        }
+    }
+
+    // Stays set until a completion shows whether it starved the device
+    if (bytes)
+        state.limited = false;
+
+    return bytes;
+}
+
+// Post the backlog while the ring and the limit allow, called by the owner
+static void eth_tx_process(eth_tx_queue_t *queue)
+{
+    eth_tx_state_t& state = queue->tx_state;
+
+    if (atomic_xchg(&state.reclaim_pending, false))
+        eth_tx_reclaim(queue);
+
+    eth_tx_gather(state);
+
+    ethq_pkt_t *batch[eth_tx_batch];
+    size_t sizes[eth_tx_batch];
+    size_t posted = 0;
+
+    while (state.backlog_head) {
+        if (state.inflight >= state.limit) {
+            state.limited = true;
+
+            if (eth_tx_reclaim(queue) && state.inflight < state.limit)
+                continue;
+
+            break;
+        }
+
+        // Take frames up to the limit, at least one
+        size_t count = 0;
+        size_t bytes = 0;
+        while (count < eth_tx_batch && state.backlog_head &&
+               state.inflight + bytes < state.limit) {
+            ethq_pkt_t *pkt = state.backlog_head;
+            state.backlog_head = pkt->next;
+            pkt->next = nullptr;
+
+            sizes[count] = ethq_pkt_total_size(pkt);
+            bytes += sizes[count];
+            batch[count++] = pkt;
+        }
+
+        if (!state.backlog_head)
+            state.backlog_tail = nullptr;
+
+        size_t done = queue->tx_post(batch, count);
+
+        for (size_t i = 0; i < done; ++i)
+            state.inflight += sizes[i];
+
+        posted += done;
+        atomic_sub(&state.queued, done);
+
+        if (done == count)
+            continue;
+
+        // Ring is full, put back what didn't fit
+        for (size_t i = count; i > done; --i) {
+            ethq_pkt_t *pkt = batch[i - 1];
+            pkt->next = state.backlog_head;
+            if (!state.backlog_head)
+                state.backlog_tail = pkt;
+            state.backlog_head = pkt;
+        }
+
+        if (!eth_tx_reclaim(queue))
+            break;
+    }
+
+    if (posted)
+        queue->tx_kick();
+
+    ETH_TX_TRACE("posted %zu frames, %zu bytes in flight\n",
+                 posted, state.inflight);
+
+    // Frames left waiting need a completion to move
+    if (state.backlog_head && queue->tx_wait())
+        atomic_st_rel(&state.reclaim_pending, true);
+}
+
+// Called with irqs disabled
+static void eth_tx_run(eth_tx_queue_t *queue)
+{
+    eth_tx_state_t& state = queue->tx_state;
+
+    do {
+        // The owner sees anything staged before it lets go
+        if (atomic_xchg(&state.running, true))
+            return;
+
+        eth_tx_process(queue);
+
+        // A sender stages then checks running, the owner clears running
+        // then checks the stages, the fence keeps one from missing both
+        atomic_st_rel(&state.running, false);
+        atomic_fence();
+    } while (atomic_ld_acq(&state.staged_mask) ||
+             atomic_ld_acq(&state.reclaim_pending));
+}
+
+void eth_tx_batch_begin()
+{
+    cpu_scoped_irq_disable irq_dis;
+
+    eth_tx_defer_t& defer = eth_tx_defers[thread_cpu_number()];
+    defer.owner = thread_get_id();
+}
+
+void eth_tx_batch_end()
+{
+    cpu_scoped_irq_disable irq_dis;
+
+    eth_tx_defer_t& defer = eth_tx_defers[thread_cpu_number()];
+    defer.owner = eth_tx_defer_no_owner;
+
+    for (size_t i = 0; i < defer.count; ++i)
+        eth_tx_run(defer.queues[i]);
+
+    defer.count = 0;
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include "types.h"
+#include "cpu/control_regs_constants.h"
+
+// Transmit processing
+//
+// Drivers implement eth_tx_queue_t for each transmit ring. Senders
+// never touch the ring. A send pushes the frame onto its CPU's staging
+// stack for that ring and tries to take ownership of the ring. The
+// owner gathers the frames every CPU staged, posts them in batches,
+// and notifies the device once for all of them. Senders that find the
+// ring owned just leave their frames for the owner, so CPUs sending
+// at once don't wait for each other.
+//
+// Completed frames are reclaimed lazily, when the ring or the byte
+// limit stops posting, or when the driver reports completions with
+// eth_tx_complete. Drivers don't need a completion interrupt while
+// frames keep flowing, it is only requested when frames are left
+// waiting for completions, see eth_tx_queue_t::tx_wait.
+//
+// The byte limit keeps the ring only as full as it needs to be to keep
+// the device busy, like Linux byte queue limits. It grows when the
+// device ran dry while frames waited for the limit, and shrinks when
+// bytes were still queued at every reclaim for a while. Frames past
+// the limit wait in the backlog, and past eth_tx_backlog_max they are
+// dropped.
+
+// Included by dev_eth.h, which defines eth_tx_queue_t
+struct ethq_pkt_t;
+struct eth_tx_queue_t;
+
+// Frames one eth_tx_queue_t::tx_post call is given at most
+static constexpr size_t eth_tx_batch = 32;
+
+// Frames a ring may have staged and waiting before sends drop
+static constexpr size_t eth_tx_backlog_max = 1024;
+
+// Byte limit bounds, the minimum fits two maximum size frames
+static constexpr size_t eth_tx_limit_min = 3028;
+static constexpr size_t eth_tx_limit_max = size_t(1) << 20;
+
+// Frames pushed by one CPU, newest first
+struct alignas(64) eth_tx_stage_t {
+    ethq_pkt_t * volatile head;
+};
+
+struct eth_tx_state_t {
+    eth_tx_state_t();
+
+    eth_tx_stage_t staged[MAX_CPUS];
+
+    // Bit n set when CPU n may have staged frames
+    uint64_t volatile staged_mask;
+
+    // Frames staged or in the backlog
+    size_t volatile queued;
+
+    uint64_t volatile dropped;
+
+    // Set while a CPU owns the ring
+    bool volatile running;
+
+    // Completions were reported while the ring was owned
+    bool volatile reclaim_pending;
+
+    // The rest is only touched by the owner
+
+    // Frames gathered from the stages, oldest first
+    ethq_pkt_t *backlog_head;
+    ethq_pkt_t *backlog_tail;
+
+    // Bytes posted and not yet reclaimed
+    size_t inflight;
+
+    // Byte limit
+    size_t limit;
+
+    // Fewest bytes left in flight after a reclaim this interval
+    size_t slack;
+    uint64_t slack_start;
+
+    // Frames waited for the limit since the last reclaim
+    bool limited;
+};
+
+// Queue a frame for transmission, consuming the reference. Returns 1,
+// or 0 if it was dropped, then its callback was called with an error.
+// Callable from interrupt handlers
+int eth_tx_send(eth_tx_queue_t *queue, ethq_pkt_t *pkt);
+
+// Queue count frames at once, they are staged with one atomic
+// operation. Returns how many were queued, the rest were dropped
+size_t eth_tx_send_batch(eth_tx_queue_t *queue,
+                         ethq_pkt_t **pkts, size_t count);
+
+// Report that frames may have completed. Reclaims them and posts
+// frames waiting for room, unless another CPU owns the ring, then
+// the owner does it. Callable from interrupt handlers
+void eth_tx_complete(eth_tx_queue_t *queue);
+
+// Defer doorbells to eth_tx_batch_end on this CPU. Only for threads
+// that stay on one CPU, like the receive poll, see eth_rx_deliver
+void eth_tx_batch_begin();
+void eth_tx_batch_end();
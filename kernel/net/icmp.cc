@@ -1,15 +1,12 @@
 #include "icmp.h"
 #include "ipv4.h"
 #include "bswap.h"
+#include "inet_csum.h"
 
 uint16_t icmp_checksum(icmp_hdr_t const *hdr, void const *end)
 {
-    uint32_t checksum = 0;
-    for (uint16_t const *in = (uint16_t*)&hdr->type; (void*)in < end; ++in)
-        checksum += ntohs(*in);
-    checksum += (checksum >> 16);
-    checksum &= 0xFFFF;
-    return htons(~checksum);
+    return inet_csum(&hdr->type, (char const *)end -
+                     (char const *)&hdr->type, 0);
 }
 
 uint16_t icmp_finalize(icmp_hdr_t *hdr, void const *end)
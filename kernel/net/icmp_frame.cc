@@ -5,6 +5,7 @@
 #include "string.h"
 #include "bswap.h"
 #include "assert.h"
+#include "inet_csum.h"
 
 #define ICMP_DEBUG  1
 #if ICMP_DEBUG
@@ -33,6 +34,10 @@ static void icmp_echo(ethq_pkt_t *pkt)
     }
 
     ethq_pkt_t *reply_pkt = ethq_pkt_acquire();
+
+    if (unlikely(!reply_pkt))
+        return;
+
     icmp_echo_hdr_t *reply = (icmp_echo_hdr_t*)&reply_pkt->pkt;
 
     memset(reply, 0, sizeof(*reply));
@@ -52,10 +57,9 @@ static void icmp_echo(ethq_pkt_t *pkt)
     memcpy(reply->icmp_hdr.ipv4_hdr.d_ip, hdr->icmp_hdr.ipv4_hdr.s_ip,
            sizeof(reply->icmp_hdr.ipv4_hdr.d_ip));
 
-    reply->icmp_hdr.ipv4_hdr.s_ip[0] = 192;
-    reply->icmp_hdr.ipv4_hdr.s_ip[1] = 168;
-    reply->icmp_hdr.ipv4_hdr.s_ip[2] = 122;
-    reply->icmp_hdr.ipv4_hdr.s_ip[3] = 42;
+    // Reply from the address that was pinged
+    memcpy(reply->icmp_hdr.ipv4_hdr.s_ip, hdr->icmp_hdr.ipv4_hdr.d_ip,
+           sizeof(reply->icmp_hdr.ipv4_hdr.s_ip));
 
     reply->icmp_hdr.ipv4_hdr.protocol = IPV4_PROTO_ICMP;
 
@@ -76,7 +80,18 @@ static void icmp_echo(ethq_pkt_t *pkt)
     reply->seq = hdr->seq;
     reply->identifier = hdr->identifier;
 
-    reply_pkt->size = icmp_finalize(&reply->icmp_hdr, reply_end);
+    // Only the type and code differ from the request,
+    // update its checksum instead of summing the payload again
+    uint16_t old_word;
+    uint16_t new_word;
+    memcpy(&old_word, &hdr->icmp_hdr.type, sizeof(old_word));
+    memcpy(&new_word, &reply->icmp_hdr.type, sizeof(new_word));
+    reply->icmp_hdr.checksum = inet_csum_update16(
+                hdr->icmp_hdr.checksum, old_word, new_word);
+
+    ipv4_finalize(&reply->icmp_hdr.ipv4_hdr, reply_end);
+
+    reply_pkt->size = reply_end - (char*)&reply->icmp_hdr.ipv4_hdr.eth_hdr;
 
     ICMP_TRACE("Transmitting ICMP reply seq=%d pkt=%p\n",
                ntohs(reply->seq), (void*)reply_pkt);
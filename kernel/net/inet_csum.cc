@@ -0,0 +1,106 @@
+#include "inet_csum.h"
+#include "string.h"
+#include "cpu/cpuid.h"
+#include "cpu/control_regs.h"
+#include "cpu/except.h"
+
+// Sums 8 bytes per add, with two carry chains
+uint64_t inet_csum_partial_generic(void const *data, size_t size,
+                                   uint64_t sum)
+{
+    char const *p = (char const *)data;
+    uint64_t sum2 = 0;
+
+    for (; size >= 32; p += 32, size -= 32) {
+        uint64_t w[4];
+        memcpy(w, p, sizeof(w));
+        sum = inet_csum_add(sum, w[0]);
+        sum2 = inet_csum_add(sum2, w[1]);
+        sum = inet_csum_add(sum, w[2]);
+        sum2 = inet_csum_add(sum2, w[3]);
+    }
+
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        sum = inet_csum_add(sum, w);
+    }
+
+    // The tail starts at an even offset, it is padded with zeros
+    if (size) {
+        uint64_t w = 0;
+        memcpy(&w, p, size);
+        sum = inet_csum_add(sum, w);
+    }
+
+    return inet_csum_add(sum, sum2);
+}
+
+typedef uint64_t (*inet_csum_partial_fn)(
+        void const *data, size_t size, uint64_t sum);
+
+extern "C" inet_csum_partial_fn inet_csum_partial_resolver()
+{
+    if (cpuid_has_avx() && cpuid_has_avx2())
+        return inet_csum_partial_avx2;
+    return inet_csum_partial_sse2;
+}
+
+_ifunc_resolver(inet_csum_partial_resolver)
+uint64_t inet_csum_partial(void const *data, size_t size, uint64_t sum);
+
+// Copies never use vector registers, a fault in the middle
+// would leave them clobbered
+uint64_t inet_csum_copy(void *dest, void const *src,
+                        size_t size, uint64_t sum)
+{
+    char const *s = (char const *)src;
+    char *d = (char *)dest;
+    uint64_t sum2 = 0;
+
+    for (; size >= 16; s += 16, d += 16, size -= 16) {
+        uint64_t w[2];
+        memcpy(w, s, sizeof(w));
+        memcpy(d, w, sizeof(w));
+        sum = inet_csum_add(sum, w[0]);
+        sum2 = inet_csum_add(sum2, w[1]);
+    }
+
+    for (; size >= 8; s += 8, d += 8, size -= 8) {
+        uint64_t w;
+        memcpy(&w, s, sizeof(w));
+        memcpy(d, &w, sizeof(w));
+        sum = inet_csum_add(sum, w);
+    }
+
+    if (size) {
+        uint64_t w = 0;
+        memcpy(&w, s, size);
+        memcpy(d, &w, size);
+        sum = inet_csum_add(sum, w);
+    }
+
+    return inet_csum_add(sum, sum2);
+}
+
+bool inet_csum_copy_user(void *dest, void const *src,
+                         size_t size, uint64_t *sum)
+{
+    uint64_t result;
+
+    __try {
+        if (cpuid_has_smap())
+            cpu_stac();
+
+        result = inet_csum_copy(dest, src, size, *sum);
+
+        if (cpuid_has_smap())
+            cpu_clac();
+    } __catch {
+        return false;
+    }
+
+    *sum = result;
+
+    return true;
+}
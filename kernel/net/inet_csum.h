@@ -0,0 +1,97 @@
+#pragma once
+#include "types.h"
+
+// Internet checksum (RFC 1071)
+//
+// Partial sums are 64-bit ones' complement sums of the data in memory
+// order. Folding one to 16 bits gives the checksum in memory order, so
+// it is stored into a header as it is, and values read from headers
+// are added without byte swapping. A block whose sum is added to a
+// larger one must start at an even offset, or be added with
+// inet_csum_block.
+
+// Ones' complement add
+static _always_inline uint64_t inet_csum_add(uint64_t sum, uint64_t n)
+{
+    sum += n;
+    return sum + (sum < n);
+}
+
+static _always_inline uint16_t inet_csum_fold(uint64_t sum)
+{
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return uint16_t(sum);
+}
+
+// Add the sum of a block that starts offset bytes into the data,
+// a block at an odd offset sums swapped bytes
+static _always_inline uint64_t inet_csum_block(
+        uint64_t sum, uint64_t block_sum, size_t offset)
+{
+    uint16_t part = inet_csum_fold(block_sum);
+
+    if (offset & 1)
+        part = uint16_t((part << 8) | (part >> 8));
+
+    return inet_csum_add(sum, part);
+}
+
+// Sum of size bytes added to sum. Uses vector instructions when the
+// CPU has them and the calling thread has an FPU context
+uint64_t inet_csum_partial(void const *data, size_t size, uint64_t sum);
+
+// The checksum to store, or 0 when verifying data that includes one
+static _always_inline uint16_t inet_csum(
+        void const *data, size_t size, uint64_t sum)
+{
+    return uint16_t(~inet_csum_fold(inet_csum_partial(data, size, sum)));
+}
+
+// Copy and sum in one pass
+uint64_t inet_csum_copy(void *dest, void const *src,
+                        size_t size, uint64_t sum);
+
+// Copy and sum when either side may be user memory,
+// false if it faulted, and then *sum is unchanged
+bool inet_csum_copy_user(void *dest, void const *src,
+                         size_t size, uint64_t *sum);
+
+// Sum of the IPv4 pseudo header, addresses as they are stored
+static _always_inline uint64_t inet_csum_pseudo(
+        uint32_t s_ip, uint32_t d_ip, uint8_t protocol, uint16_t len)
+{
+    return uint64_t(s_ip) + d_ip +
+            uint16_t(protocol << 8) +
+            uint16_t((len << 8) | (len >> 8));
+}
+
+// Incremental update (RFC 1624 eqn. 3) of a checksum after a 16 or
+// 32-bit field it covers changed from old_val to new_val, all of them
+// in memory order
+static _always_inline uint16_t inet_csum_update16(
+        uint16_t csum, uint16_t old_val, uint16_t new_val)
+{
+    uint32_t sum = uint32_t(uint16_t(~csum)) +
+            uint16_t(~old_val) + new_val;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return uint16_t(~sum);
+}
+
+static _always_inline uint16_t inet_csum_update32(
+        uint16_t csum, uint32_t old_val, uint32_t new_val)
+{
+    uint64_t sum = uint64_t(uint16_t(~csum)) + ~old_val + new_val;
+    return uint16_t(~inet_csum_fold(sum));
+}
+
+// The individual implementations, for benchmarking
+uint64_t inet_csum_partial_generic(void const *data, size_t size,
+                                   uint64_t sum);
+extern "C" uint64_t inet_csum_partial_sse2(void const *data, size_t size,
+                                           uint64_t sum);
+extern "C" uint64_t inet_csum_partial_avx2(void const *data, size_t size,
+                                           uint64_t sum);
@@ -1,21 +1,330 @@
 #include "ipv4.h"
+#include "dev_eth.h"
 #include "bswap.h"
+#include "inet_csum.h"
 #include "memory.h"
 #include "string.h"
+#include "mutex.h"
 
-uint16_t ipv4_checksum(ipv4_hdr_t const *hdr)
+struct ipv4_ifaddr_t {
+    eth_dev_base_t *nic;
+    uint32_t ip;
+    uint32_t mask;
+};
+
+#define IPV4_MAX_ADDRS  16
+static ipv4_ifaddr_t ipv4_addrs[IPV4_MAX_ADDRS];
+static size_t ipv4_addr_count;
+static std::spinlock ipv4_addr_lock;
+
+// Route flags
+#define IPV4_RT_LOCAL   0x01    // To this machine, through loopback
+
+struct ipv4_rt_entry_t {
+    eth_dev_base_t *nic;
+    uint32_t prefix;
+    uint32_t mask;
+    uint32_t gateway;
+    uint32_t s_ip;
+    uint8_t prefix_len;
+    uint8_t flags;
+};
+
+#define IPV4_MAX_ROUTES 64
+
+// Sorted longest prefix first, so the first match is the best one.
+// Readers don't lock, they retry if the sequence number was odd or
+// changed while they looked
+static ipv4_rt_entry_t ipv4_routes[IPV4_MAX_ROUTES];
+static size_t ipv4_route_count;
+static uint32_t ipv4_route_seq;
+static std::spinlock ipv4_route_lock;
+
+static eth_dev_base_t *ipv4_loopback_nic;
+
+// Destination cache, direct mapped. A slot holds the destination in
+// the high 32 bits, then 24 bits of the route table sequence number
+// it was found in, then the route index plus one, so it is read and
+// written with single loads and stores
+#define IPV4_DST_CACHE_BITS 8
+static uint64_t ipv4_dst_cache[1 << IPV4_DST_CACHE_BITS];
+
+C_ASSERT(IPV4_MAX_ROUTES < 256);
+
+static _always_inline uint32_t ipv4_prefix_mask(int prefix_len)
+{
+    return prefix_len ? ~UINT32_C(0) << (32 - prefix_len) : 0;
+}
+
+static _always_inline void ipv4_route_write_begin()
+{
+    atomic_st_rel(&ipv4_route_seq, ipv4_route_seq + 1);
+    atomic_barrier();
+}
+
+static _always_inline void ipv4_route_write_end()
+{
+    atomic_barrier();
+    atomic_st_rel(&ipv4_route_seq, ipv4_route_seq + 1);
+}
+
+static ssize_t ipv4_route_find_locked(uint32_t prefix, int prefix_len)
+{
+    for (size_t i = 0; i < ipv4_route_count; ++i) {
+        if (ipv4_routes[i].prefix == prefix &&
+                ipv4_routes[i].prefix_len == prefix_len)
+            return ssize_t(i);
+    }
+
+    return -1;
+}
+
+static bool ipv4_route_insert_locked(ipv4_rt_entry_t const& rt)
+{
+    ssize_t found = ipv4_route_find_locked(rt.prefix, rt.prefix_len);
+
+    if (found >= 0) {
+        ipv4_route_write_begin();
+        ipv4_routes[found] = rt;
+        ipv4_route_write_end();
+        return true;
+    }
+
+    if (unlikely(ipv4_route_count >= IPV4_MAX_ROUTES))
+        return false;
+
+    // After the routes with the same or a longer prefix
+    size_t pos = 0;
+    while (pos < ipv4_route_count &&
+           ipv4_routes[pos].prefix_len >= rt.prefix_len)
+        ++pos;
+
+    ipv4_route_write_begin();
+    for (size_t i = ipv4_route_count; i > pos; --i)
+        ipv4_routes[i] = ipv4_routes[i - 1];
+    ipv4_routes[pos] = rt;
+    ++ipv4_route_count;
+    ipv4_route_write_end();
+
+    return true;
+}
+
+// The first address assigned to nic
+static uint32_t ipv4_nic_addr_locked(eth_dev_base_t *nic)
+{
+    for (size_t i = 0, e = atomic_ld_acq(&ipv4_addr_count); i < e; ++i) {
+        if (ipv4_addrs[i].nic == nic)
+            return ipv4_addrs[i].ip;
+    }
+
+    return 0;
+}
+
+bool ipv4_addr_add(eth_dev_base_t *nic, uint32_t ip, int prefix_len)
+{
+    std::unique_lock<std::spinlock> hold(ipv4_addr_lock);
+
+    if (ipv4_addr_count >= IPV4_MAX_ADDRS)
+        return false;
+
+    ipv4_ifaddr_t& addr = ipv4_addrs[ipv4_addr_count];
+    addr.nic = nic;
+    addr.ip = ip;
+    addr.mask = ipv4_prefix_mask(prefix_len);
+
+    // Entries are never removed, readers only look up to the count
+    atomic_st_rel(&ipv4_addr_count, ipv4_addr_count + 1);
+
+    hold.unlock();
+
+    std::unique_lock<std::spinlock> route_hold(ipv4_route_lock);
+
+    ipv4_rt_entry_t rt{};
+    rt.nic = nic;
+    rt.s_ip = ip;
+
+    if (ipv4_is_loopback(ip)) {
+        // The whole network is this machine
+        atomic_st_rel(&ipv4_loopback_nic, nic);
+
+        rt.prefix = ip & addr.mask;
+        rt.mask = addr.mask;
+        rt.prefix_len = prefix_len;
+        rt.flags = IPV4_RT_LOCAL;
+
+        return ipv4_route_insert_locked(rt);
+    }
+
+    // The address itself
+    rt.prefix = ip;
+    rt.mask = ~UINT32_C(0);
+    rt.prefix_len = 32;
+    rt.flags = IPV4_RT_LOCAL;
+
+    if (unlikely(!ipv4_route_insert_locked(rt)))
+        return false;
+
+    // Its network
+    rt.prefix = ip & addr.mask;
+    rt.mask = addr.mask;
+    rt.prefix_len = prefix_len;
+    rt.flags = 0;
+
+    if (prefix_len < 32 && unlikely(!ipv4_route_insert_locked(rt)))
+        return false;
+
+    // Everything else is on the link, until a gateway is configured
+    if (ipv4_route_find_locked(0, 0) < 0) {
+        rt.prefix = 0;
+        rt.mask = 0;
+        rt.prefix_len = 0;
+
+        if (unlikely(!ipv4_route_insert_locked(rt)))
+            return false;
+    }
+
+    return true;
+}
+
+bool ipv4_addr_is_local(uint32_t ip)
+{
+    for (size_t i = 0, e = atomic_ld_acq(&ipv4_addr_count); i < e; ++i) {
+        if (ipv4_addrs[i].ip == ip)
+            return true;
+    }
+
+    return false;
+}
+
+bool ipv4_route_add(uint32_t prefix, int prefix_len,
+                    uint32_t gateway, eth_dev_base_t *nic)
+{
+    if (unlikely(prefix_len < 0 || prefix_len > 32 || !nic))
+        return false;
+
+    std::unique_lock<std::spinlock> hold(ipv4_route_lock);
+
+    ipv4_rt_entry_t rt{};
+    rt.nic = nic;
+    rt.mask = ipv4_prefix_mask(prefix_len);
+    rt.prefix = prefix & rt.mask;
+    rt.gateway = gateway;
+    rt.s_ip = ipv4_nic_addr_locked(nic);
+    rt.prefix_len = prefix_len;
+
+    if (unlikely(!rt.s_ip))
+        return false;
+
+    return ipv4_route_insert_locked(rt);
+}
+
+bool ipv4_route_del(uint32_t prefix, int prefix_len)
+{
+    if (unlikely(prefix_len < 0 || prefix_len > 32))
+        return false;
+
+    std::unique_lock<std::spinlock> hold(ipv4_route_lock);
+
+    ssize_t found = ipv4_route_find_locked(
+                prefix & ipv4_prefix_mask(prefix_len), prefix_len);
+
+    if (found < 0)
+        return false;
+
+    ipv4_route_write_begin();
+    for (size_t i = found + 1; i < ipv4_route_count; ++i)
+        ipv4_routes[i - 1] = ipv4_routes[i];
+    --ipv4_route_count;
+    ipv4_route_write_end();
+
+    return true;
+}
+
+// Index of the longest matching prefix, or the count if none matches
+static _always_inline size_t ipv4_route_match(uint32_t d_ip, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; ++i) {
+        if ((d_ip & ipv4_routes[i].mask) == ipv4_routes[i].prefix)
+            break;
+    }
+    return i;
+}
+
+bool ipv4_route_get(ipv4_route_t *route, uint32_t d_ip)
 {
-    uint16_t *in = (uint16_t*)&hdr->ver_ihl;
+    uint64_t *slot = ipv4_dst_cache +
+            ((d_ip * UINT32_C(0x9E3779B1)) >> (32 - IPV4_DST_CACHE_BITS));
+
+    ipv4_rt_entry_t rt;
+    bool found;
+
+    for (;;) {
+        uint32_t seq = atomic_ld_acq(&ipv4_route_seq);
+
+        if (unlikely(seq & 1)) {
+            pause();
+            continue;
+        }
+
+        uint64_t tag = (uint64_t(d_ip) << 32) |
+                ((uint64_t(seq >> 1) & 0xFFFFFF) << 8);
+
+        uint64_t cached = atomic_ld_acq(slot);
+        size_t count = ipv4_route_count;
+        size_t index;
 
-    uint32_t total = 0;
-    for (size_t i = 0, e = (hdr->ver_ihl & 0xF) << 1;
-         i < e; ++i)
-        total += htons(in[i]);
+        if ((cached & ~UINT64_C(0xFF)) == tag && (cached & 0xFF)) {
+            index = (cached & 0xFF) - 1;
+        } else {
+            index = ipv4_route_match(d_ip, count);
 
-    total += total >> 16;
-    total &= 0xFFFF;
+            // Tagged with the sequence number it was found in, a stale
+            // one never matches, even if it was written mid-update
+            if (index < count)
+                atomic_st_rel(slot, tag | (index + 1));
+        }
 
-    return htons(~total);
+        found = index < count;
+        if (found)
+            rt = ipv4_routes[index];
+
+        atomic_lfence();
+
+        if (likely(atomic_ld_acq(&ipv4_route_seq) == seq))
+            break;
+    }
+
+    if (unlikely(!found))
+        return false;
+
+    route->nic = rt.nic;
+    route->s_ip = rt.s_ip;
+
+    if (rt.flags & IPV4_RT_LOCAL) {
+        // Traffic to the machine's own addresses stays in memory
+        eth_dev_base_t *loopback = atomic_ld_acq(&ipv4_loopback_nic);
+        if (loopback)
+            route->nic = loopback;
+
+        // Reply from the address that was used
+        route->s_ip = d_ip;
+        route->next_hop = 0;
+    } else if (rt.gateway) {
+        route->next_hop = rt.gateway;
+    } else if ((d_ip | rt.mask) == ~UINT32_C(0) && rt.mask != ~UINT32_C(0)) {
+        // Broadcast to the network
+        route->next_hop = ~UINT32_C(0);
+    } else {
+        route->next_hop = d_ip;
+    }
+
+    return true;
+}
+
+uint16_t ipv4_checksum(ipv4_hdr_t const *hdr)
+{
+    return inet_csum(&hdr->ver_ihl, (hdr->ver_ihl & 0xF) * 4, 0);
 }
 
 void ipv4_finalize(ipv4_hdr_t *hdr, void const *end)
@@ -30,7 +339,7 @@ void ipv4_ip_get(ipv4_addr_pair_t *addr, ipv4_hdr_t const *hdr)
     memcpy(&addr->s.ip, hdr->s_ip, sizeof(addr->s.ip));
     memcpy(&addr->d.ip, hdr->d_ip, sizeof(addr->d.ip));
     addr->s.ip = ntohl(addr->s.ip);
-    addr->s.ip = ntohl(addr->d.ip);
+    addr->d.ip = ntohl(addr->d.ip);
 }
 
 void const *ipv4_end_get(ipv4_hdr_t const *hdr)
@@ -53,6 +53,49 @@ struct std::hash<ipv4_addr_pair_t>
     }
 };
 
+struct eth_dev_base_t;
+
+// Where packets to a destination go
+struct ipv4_route_t {
+    eth_dev_base_t *nic;
+    uint32_t s_ip;
+
+    // The gateway, or the destination itself when it is on the link.
+    // 0 when the packet stays in this machine and needs no resolution
+    uint32_t next_hop;
+};
+
+// Assign an address to an interface. Adds a route to the address
+// itself, one to its network, and a default route through the
+// interface if there is none yet
+bool ipv4_addr_add(eth_dev_base_t *nic, uint32_t ip, int prefix_len);
+
+// True if the address is assigned to an interface
+bool ipv4_addr_is_local(uint32_t ip);
+
+// Add a route to a prefix through a gateway, or directly attached to
+// nic when gateway is 0. Replaces a route to the same prefix
+bool ipv4_route_add(uint32_t prefix, int prefix_len,
+                    uint32_t gateway, eth_dev_base_t *nic);
+
+bool ipv4_route_del(uint32_t prefix, int prefix_len);
+
+// Find the interface, source address and next hop for a destination,
+// from the route with the longest matching prefix. Local addresses go
+// through the loopback interface if there is one. Does not lock, and
+// recently used destinations are found without searching the table
+bool ipv4_route_get(ipv4_route_t *route, uint32_t d_ip);
+
+static _always_inline bool ipv4_is_loopback(uint32_t ip)
+{
+    return (ip >> 24) == 127;
+}
+
+static _always_inline bool ipv4_is_multicast(uint32_t ip)
+{
+    return (ip >> 28) == 0xE;
+}
+
 uint16_t ipv4_checksum(ipv4_hdr_t const *hdr);
 void ipv4_ip_get(ipv4_addr_pair_t *addr, ipv4_hdr_t const *hdr);
 
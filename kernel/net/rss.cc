@@ -0,0 +1,166 @@
+#include "rss.h"
+#include "eth_q.h"
+#include "ipv4.h"
+#include "thread.h"
+#include "bswap.h"
+#include "cpu/atomic.h"
+
+// The key from the Microsoft RSS specification, which NICs
+// and their drivers use by default
+constexpr uint8_t rss_key[rss_key_size] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+};
+
+// The 32 key bits starting at bit
+static constexpr uint32_t rss_key_window(uint8_t const *key, size_t bit)
+{
+    uint64_t w = (uint64_t(key[bit >> 3]) << 32) |
+            (uint64_t(key[(bit >> 3) + 1]) << 24) |
+            (uint64_t(key[(bit >> 3) + 2]) << 16) |
+            (uint64_t(key[(bit >> 3) + 3]) << 8) |
+            key[(bit >> 3) + 4];
+    return uint32_t(w >> (8 - (bit & 7)));
+}
+
+// What each value of each input byte contributes to the hash,
+// the hash is the xor of the contributions of the input bytes
+struct rss_lut_t {
+    uint32_t v[rss_input_max][256];
+};
+
+static constexpr rss_lut_t rss_lut_build()
+{
+    rss_lut_t lut{};
+
+    for (size_t i = 0; i < rss_input_max; ++i) {
+        for (size_t n = 0; n < 256; ++n) {
+            uint32_t h = 0;
+            for (size_t b = 0; b < 8; ++b) {
+                if (n & (0x80 >> b))
+                    h ^= rss_key_window(rss_key, i * 8 + b);
+            }
+            lut.v[i][n] = h;
+        }
+    }
+
+    return lut;
+}
+
+static constexpr rss_lut_t rss_lut = rss_lut_build();
+
+uint32_t rss_toeplitz(uint8_t const *key, size_t key_size,
+                      void const *data, size_t size)
+{
+    assert(key_size >= size + 4);
+
+    uint8_t const *input = (uint8_t const *)data;
+    uint32_t h = 0;
+
+    for (size_t i = 0; i < size * 8; ++i) {
+        if (input[i >> 3] & (0x80 >> (i & 7)))
+            h ^= rss_key_window(key, i);
+    }
+
+    return h;
+}
+
+// Hash a big endian 32 bit input word at byte offset pos
+static _always_inline uint32_t rss_hash_32(uint32_t h, size_t pos,
+                                           uint32_t n)
+{
+    return h ^ rss_lut.v[pos][n >> 24] ^
+            rss_lut.v[pos + 1][(n >> 16) & 0xFF] ^
+            rss_lut.v[pos + 2][(n >> 8) & 0xFF] ^
+            rss_lut.v[pos + 3][n & 0xFF];
+}
+
+uint32_t rss_hash_ipv4(uint32_t s_ip, uint32_t d_ip)
+{
+    return rss_hash_32(rss_hash_32(0, 0, s_ip), 4, d_ip);
+}
+
+uint32_t rss_hash_ipv4_ports(uint32_t s_ip, uint32_t d_ip,
+                             uint16_t s_port, uint16_t d_port)
+{
+    return rss_hash_32(rss_hash_ipv4(s_ip, d_ip), 8,
+                       (uint32_t(s_port) << 16) | d_port);
+}
+
+uint32_t rss_hash_frame(ethq_pkt_t const *pkt)
+{
+    ipv4_hdr_t const *hdr = (ipv4_hdr_t const *)&pkt->pkt;
+
+    if (unlikely(pkt->size < sizeof(*hdr) ||
+                 hdr->eth_hdr.len_ethertype != htons(ETHERTYPE_IPv4)))
+        return 0;
+
+    uint32_t s_ip = (uint32_t(hdr->s_ip[0]) << 24) |
+            (uint32_t(hdr->s_ip[1]) << 16) |
+            (uint32_t(hdr->s_ip[2]) << 8) | hdr->s_ip[3];
+    uint32_t d_ip = (uint32_t(hdr->d_ip[0]) << 24) |
+            (uint32_t(hdr->d_ip[1]) << 16) |
+            (uint32_t(hdr->d_ip[2]) << 8) | hdr->d_ip[3];
+
+    size_t ports_ofs = sizeof(ethernet_hdr_t) + ((hdr->ver_ihl & 0xF) << 2);
+
+    // Only the first fragment has the ports, hash them all without
+    bool has_ports = (hdr->protocol == IPV4_PROTO_TCP ||
+                      hdr->protocol == IPV4_PROTO_UDP) &&
+            !(hdr->flags_fragofs & htons(0x3FFF)) &&
+            pkt->size >= ports_ofs + 4;
+
+    if (!has_ports)
+        return rss_hash_ipv4(s_ip, d_ip);
+
+    uint8_t const *ports = (uint8_t const *)&pkt->pkt + ports_ofs;
+
+    return rss_hash_ipv4_ports(s_ip, d_ip,
+                               (ports[0] << 8) | ports[1],
+                               (ports[2] << 8) | ports[3]);
+}
+
+void rss_indir_fill(uint16_t *table, size_t size, size_t ring_count)
+{
+    for (size_t i = 0; i < size; ++i)
+        table[i] = uint16_t(i % ring_count);
+}
+
+//
+// Flow consumers
+
+static constexpr size_t rss_flow_count = 4096;
+
+// Each entry holds the high hash bits of the flow and its CPU + 1 in
+// the low bits, 0 when empty. Flows that collide share an entry
+static constexpr uint32_t rss_flow_cpu_mask = 0xFF;
+
+C_ASSERT(MAX_CPUS < rss_flow_cpu_mask);
+
+static uint32_t rss_flows[rss_flow_count];
+
+void rss_flow_record(uint32_t hash)
+{
+    uint32_t entry = (hash & ~rss_flow_cpu_mask) |
+            uint32_t(thread_cpu_number() + 1);
+
+    uint32_t *slot = &rss_flows[hash & (rss_flow_count - 1)];
+
+    // Don't dirty the cache line when nothing moved
+    if (atomic_ld_acq(slot) != entry)
+        atomic_st_rel(slot, entry);
+}
+
+int rss_flow_cpu(uint32_t hash)
+{
+    uint32_t entry = atomic_ld_acq(
+                &rss_flows[hash & (rss_flow_count - 1)]);
+
+    if ((entry ^ hash) & ~rss_flow_cpu_mask)
+        return -1;
+
+    return int(entry & rss_flow_cpu_mask) - 1;
+}
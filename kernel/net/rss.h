@@ -0,0 +1,49 @@
+#pragma once
+#include "types.h"
+
+struct ethq_pkt_t;
+
+// Receive side scaling
+//
+// A NIC with several receive rings hashes the addresses and ports of
+// each received frame, and looks the hash up in an indirection table
+// to pick the ring. Each ring interrupts its own CPU, so the table
+// spreads flows across CPUs and keeps each flow on one. The hash is
+// the Toeplitz hash with rss_key, which drivers program into the NIC.
+// Receive steering in software uses the same hash, see eth_rx.h.
+//
+// Flows are also remembered by the CPU that consumes them (receive
+// flow steering). A socket records its flow whenever its user sends
+// or receives, and receive processing moves the flow's frames there.
+
+// Toeplitz key length NICs take
+static constexpr size_t rss_key_size = 40;
+
+extern uint8_t const rss_key[rss_key_size];
+
+// Bytes hashed for IPv4 with ports
+static constexpr size_t rss_input_max = 12;
+
+// Toeplitz hash of size bytes with any key at least 4 bytes
+// longer than the input, one bit at a time
+uint32_t rss_toeplitz(uint8_t const *key, size_t key_size,
+                      void const *data, size_t size);
+
+// Hashes with rss_key of an IPv4 flow as it is received, the source
+// is the remote end. Addresses and ports in host byte order
+uint32_t rss_hash_ipv4(uint32_t s_ip, uint32_t d_ip);
+uint32_t rss_hash_ipv4_ports(uint32_t s_ip, uint32_t d_ip,
+                             uint16_t s_port, uint16_t d_port);
+
+// Hash of a received frame, with ports for TCP and UDP unless it is a
+// fragment, 0 if it isn't IPv4
+uint32_t rss_hash_frame(ethq_pkt_t const *pkt);
+
+// Spread an indirection table of size entries evenly across rings
+void rss_indir_fill(uint16_t *table, size_t size, size_t ring_count);
+
+// Record the current CPU as the consumer of the flow with the hash
+void rss_flow_record(uint32_t hash);
+
+// The CPU that last consumed the flow, -1 if none did
+int rss_flow_cpu(uint32_t hash);
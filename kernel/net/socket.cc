@@ -0,0 +1,898 @@
+#include "socket.h"
+#include "tcp.h"
+#include "udp.h"
+#include "fileio.h"
+#include "dev_storage.h"
+#include "dirent.h"
+#include "string.h"
+#include "../libc/include/sys/socket.h"
+#include "../libc/include/netinet/tcp.h"
+
+// An open socket, the protocol implements the operations
+struct sock_t : public fs_file_info_t {
+    sock_t(int type, bool nonblock)
+        : type(type)
+        , nonblock(nonblock)
+    {
+    }
+
+    ino_t get_inode() const override final
+    {
+        return 0;
+    }
+
+    virtual errno_t bind(ipv4_addr_t const& addr) = 0;
+
+    virtual errno_t listen(int backlog)
+    {
+        return errno_t::EOPNOTSUPP;
+    }
+
+    virtual errno_t accept(sock_t **result, ipv4_addr_t *peer,
+                           bool nonblock)
+    {
+        return errno_t::EOPNOTSUPP;
+    }
+
+    virtual errno_t connect(ipv4_addr_t const& addr) = 0;
+
+    // Returns the bytes transferred, or a negated errno
+    virtual ssize_t send(sock_msg_t *msg, bool nonblock) = 0;
+    virtual ssize_t recv(sock_msg_t *msg, bool nonblock) = 0;
+
+    virtual errno_t shutdown(int how) = 0;
+    virtual errno_t name(ipv4_addr_t *addr, bool peer) = 0;
+
+    virtual errno_t setopt(int level, int name, int value);
+    virtual errno_t getopt(int level, int name, int *value);
+
+    // SOCK_STREAM or SOCK_DGRAM
+    int const type;
+
+    // Opened with SOCK_NONBLOCK
+    bool nonblock;
+};
+
+errno_t sock_t::setopt(int level, int name, int value)
+{
+    // Addresses are always reusable
+    if (level == SOL_SOCKET && name == SO_REUSEADDR)
+        return errno_t::OK;
+
+    return errno_t::ENOPROTOOPT;
+}
+
+errno_t sock_t::getopt(int level, int name, int *value)
+{
+    if (level != SOL_SOCKET)
+        return errno_t::ENOPROTOOPT;
+
+    switch (name) {
+    case SO_TYPE:
+        *value = type;
+        return errno_t::OK;
+
+    case SO_ERROR:
+        // Errors are reported by the call that hits them
+        *value = 0;
+        return errno_t::OK;
+
+    case SO_REUSEADDR:
+        *value = 1;
+        return errno_t::OK;
+
+    default:
+        return errno_t::ENOPROTOOPT;
+    }
+}
+
+//
+// TCP
+
+struct sock_tcp_t final : public sock_t {
+    explicit sock_tcp_t(bool nonblock, tcp_sock_t *conn = nullptr)
+        : sock_t(SOCK_STREAM, nonblock)
+        , conn(conn)
+        , local{}
+        , bound(false)
+        , listening(false)
+        , nodelay(false)
+    {
+    }
+
+    ~sock_tcp_t()
+    {
+        if (conn)
+            tcp_close(conn);
+    }
+
+    errno_t bind(ipv4_addr_t const& addr) override final;
+    errno_t listen(int backlog) override final;
+    errno_t accept(sock_t **result, ipv4_addr_t *peer,
+                   bool nonblock) override final;
+    errno_t connect(ipv4_addr_t const& addr) override final;
+    ssize_t send(sock_msg_t *msg, bool nonblock) override final;
+    ssize_t recv(sock_msg_t *msg, bool nonblock) override final;
+    errno_t shutdown(int how) override final;
+    errno_t name(ipv4_addr_t *addr, bool peer) override final;
+    errno_t setopt(int level, int name, int value) override final;
+    errno_t getopt(int level, int name, int *value) override final;
+
+    // The connection, or the listener
+    tcp_sock_t *conn;
+
+    // Where bind said to listen
+    ipv4_addr_t local;
+
+    bool bound;
+    bool listening;
+    bool nodelay;
+};
+
+errno_t sock_tcp_t::bind(ipv4_addr_t const& addr)
+{
+    if (bound || conn)
+        return errno_t::EINVAL;
+
+    if (addr.ip && !ipv4_addr_is_local(addr.ip))
+        return errno_t::EADDRNOTAVAIL;
+
+    local = addr;
+    local.align = 0;
+    bound = true;
+
+    return errno_t::OK;
+}
+
+errno_t sock_tcp_t::listen(int backlog)
+{
+    if (listening)
+        return errno_t::OK;
+
+    if (conn)
+        return errno_t::EISCONN;
+
+    // Listening on an unused port is not supported
+    if (!bound || !local.port)
+        return errno_t::EINVAL;
+
+    errno_t err = tcp_listen(&conn, &local, backlog);
+
+    if (likely(err == errno_t::OK))
+        listening = true;
+
+    return err;
+}
+
+errno_t sock_tcp_t::accept(sock_t **result, ipv4_addr_t *peer,
+                           bool nonblock)
+{
+    if (!listening)
+        return errno_t::EINVAL;
+
+    tcp_sock_t *child;
+    errno_t err = tcp_accept(conn, &child, nonblock);
+
+    if (unlikely(err != errno_t::OK))
+        return err;
+
+    sock_tcp_t *sock = new sock_tcp_t(false, child);
+
+    if (unlikely(!sock)) {
+        tcp_close(child);
+        return errno_t::ENOMEM;
+    }
+
+    if (peer) {
+        ipv4_addr_pair_t pair;
+        tcp_addr_get(child, &pair);
+        *peer = pair.d;
+    }
+
+    *result = sock;
+
+    return errno_t::OK;
+}
+
+// The address given to bind is not used, connections get an unused
+// port on the address of the interface they are routed through
+errno_t sock_tcp_t::connect(ipv4_addr_t const& addr)
+{
+    if (listening)
+        return errno_t::EINVAL;
+
+    if (conn)
+        return errno_t::EISCONN;
+
+    tcp_sock_t *new_conn = nullptr;
+    errno_t err = tcp_connect(&new_conn, &addr, nonblock);
+
+    if (new_conn) {
+        conn = new_conn;
+
+        if (nodelay)
+            tcp_set_nodelay(conn, true);
+    }
+
+    return err;
+}
+
+ssize_t sock_tcp_t::send(sock_msg_t *msg, bool nonblock)
+{
+    if (!conn || listening)
+        return -int(errno_t::ENOTCONN);
+
+    size_t sent = 0;
+
+    for (size_t i = 0; i < msg->iovcnt; ++i) {
+        if (!msg->iov[i].iov_len)
+            continue;
+
+        ssize_t part = tcp_send(conn, msg->iov[i].iov_base,
+                                msg->iov[i].iov_len, nonblock);
+
+        if (part < 0)
+            return sent ? ssize_t(sent) : part;
+
+        sent += part;
+
+        if (size_t(part) < msg->iov[i].iov_len)
+            break;
+    }
+
+    return ssize_t(sent);
+}
+
+ssize_t sock_tcp_t::recv(sock_msg_t *msg, bool nonblock)
+{
+    if (!conn || listening)
+        return -int(errno_t::ENOTCONN);
+
+    size_t received = 0;
+
+    for (size_t i = 0; i < msg->iovcnt; ++i) {
+        if (!msg->iov[i].iov_len)
+            continue;
+
+        // Only wait for the first bytes
+        ssize_t part = tcp_recv(conn, msg->iov[i].iov_base,
+                                msg->iov[i].iov_len,
+                                nonblock || received);
+
+        if (part < 0)
+            return received ? ssize_t(received) : part;
+
+        received += part;
+
+        if (size_t(part) < msg->iov[i].iov_len)
+            break;
+    }
+
+    msg->has_addr = false;
+
+    return ssize_t(received);
+}
+
+errno_t sock_tcp_t::shutdown(int how)
+{
+    if (!conn || listening)
+        return errno_t::ENOTCONN;
+
+    switch (how) {
+    case SHUT_RD:
+        // Nothing to do, data keeps arriving until the peer closes
+        return errno_t::OK;
+
+    case SHUT_WR:
+    case SHUT_RDWR:
+        return tcp_shutdown(conn);
+
+    default:
+        return errno_t::EINVAL;
+    }
+}
+
+errno_t sock_tcp_t::name(ipv4_addr_t *addr, bool peer)
+{
+    if (!conn || listening) {
+        if (peer)
+            return errno_t::ENOTCONN;
+
+        *addr = local;
+        return errno_t::OK;
+    }
+
+    ipv4_addr_pair_t pair;
+    tcp_addr_get(conn, &pair);
+    *addr = peer ? pair.d : pair.s;
+
+    return errno_t::OK;
+}
+
+errno_t sock_tcp_t::setopt(int level, int name, int value)
+{
+    if (level != IPPROTO_TCP)
+        return sock_t::setopt(level, name, value);
+
+    if (name != TCP_NODELAY)
+        return errno_t::ENOPROTOOPT;
+
+    nodelay = value != 0;
+
+    if (conn && !listening)
+        tcp_set_nodelay(conn, nodelay);
+
+    return errno_t::OK;
+}
+
+errno_t sock_tcp_t::getopt(int level, int name, int *value)
+{
+    if (level != IPPROTO_TCP)
+        return sock_t::getopt(level, name, value);
+
+    if (name != TCP_NODELAY)
+        return errno_t::ENOPROTOOPT;
+
+    *value = nodelay;
+
+    return errno_t::OK;
+}
+
+//
+// UDP
+
+struct sock_udp_t final : public sock_t {
+    sock_udp_t(bool nonblock, udp_sock_t *udp)
+        : sock_t(SOCK_DGRAM, nonblock)
+        , udp(udp)
+    {
+    }
+
+    ~sock_udp_t()
+    {
+        udp_close(udp);
+    }
+
+    errno_t bind(ipv4_addr_t const& addr) override final;
+    errno_t connect(ipv4_addr_t const& addr) override final;
+    ssize_t send(sock_msg_t *msg, bool nonblock) override final;
+    ssize_t recv(sock_msg_t *msg, bool nonblock) override final;
+    errno_t shutdown(int how) override final;
+    errno_t name(ipv4_addr_t *addr, bool peer) override final;
+
+    udp_sock_t *udp;
+};
+
+errno_t sock_udp_t::bind(ipv4_addr_t const& addr)
+{
+    return udp_bind(udp, &addr);
+}
+
+errno_t sock_udp_t::connect(ipv4_addr_t const& addr)
+{
+    return udp_connect(udp, &addr);
+}
+
+// Sending never waits, a full transmit queue drops the datagram
+ssize_t sock_udp_t::send(sock_msg_t *msg, bool)
+{
+    return udp_send(udp, msg->iov, msg->iovcnt,
+                    msg->has_addr ? &msg->addr : nullptr);
+}
+
+ssize_t sock_udp_t::recv(sock_msg_t *msg, bool nonblock)
+{
+    bool truncated = false;
+
+    ssize_t size = udp_recv(udp, msg->iov, msg->iovcnt, &msg->addr,
+                            &truncated, nonblock);
+
+    if (size >= 0) {
+        msg->has_addr = true;
+        if (truncated)
+            msg->flags |= MSG_TRUNC;
+    }
+
+    return size;
+}
+
+errno_t sock_udp_t::shutdown(int how)
+{
+    ipv4_addr_pair_t pair;
+    udp_addr_get(udp, &pair);
+
+    if (!pair.d.port)
+        return errno_t::ENOTCONN;
+
+    return how >= SHUT_RD && how <= SHUT_RDWR
+            ? errno_t::OK
+            : errno_t::EINVAL;
+}
+
+errno_t sock_udp_t::name(ipv4_addr_t *addr, bool peer)
+{
+    ipv4_addr_pair_t pair;
+    udp_addr_get(udp, &pair);
+
+    if (peer && !pair.d.port)
+        return errno_t::ENOTCONN;
+
+    *addr = peer ? pair.d : pair.s;
+
+    return errno_t::OK;
+}
+
+//
+// The filesystem of sockets, which only has open files
+
+struct sock_fs_t final : public fs_base_t {
+    FS_BASE_RW_IMPL
+
+    ssize_t readv(fs_file_info_t *fi, fs_iovec_t const *iov,
+                  size_t iovcnt, off_t offset) override final;
+    ssize_t writev(fs_file_info_t *fi, fs_iovec_t const *iov,
+                   size_t iovcnt, off_t offset) override final;
+};
+
+static sock_fs_t sock_fs;
+
+void sock_fs_t::unmount()
+{
+}
+
+bool sock_fs_t::is_boot() const
+{
+    return false;
+}
+
+int sock_fs_t::opendir(fs_file_info_t **fi, fs_cpath_t path)
+{
+    return -int(errno_t::ENOTDIR);
+}
+
+ssize_t sock_fs_t::readdir(fs_file_info_t *fi, dirent_t* buf, off_t offset)
+{
+    return -int(errno_t::ENOTDIR);
+}
+
+int sock_fs_t::releasedir(fs_file_info_t *fi)
+{
+    return -int(errno_t::ENOTDIR);
+}
+
+int sock_fs_t::getattr(fs_cpath_t path, fs_stat_t* stbuf)
+{
+    return -int(errno_t::ENOENT);
+}
+
+int sock_fs_t::access(fs_cpath_t path, int mask)
+{
+    return -int(errno_t::ENOENT);
+}
+
+int sock_fs_t::readlink(fs_cpath_t path, char* buf, size_t size)
+{
+    return -int(errno_t::ENOENT);
+}
+
+int sock_fs_t::mknod(fs_cpath_t path, fs_mode_t mode, fs_dev_t rdev)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::mkdir(fs_cpath_t path, fs_mode_t mode)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::rmdir(fs_cpath_t path)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::symlink(fs_cpath_t to, fs_cpath_t from)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::rename(fs_cpath_t from, fs_cpath_t to)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::link(fs_cpath_t from, fs_cpath_t to)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::unlink(fs_cpath_t path)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::chmod(fs_cpath_t path, fs_mode_t mode)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::chown(fs_cpath_t path, fs_uid_t uid, fs_gid_t gid)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::truncate(fs_cpath_t path, off_t size)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::utimens(fs_cpath_t path, fs_timespec_t const *ts)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::open(fs_file_info_t **fi, fs_cpath_t path,
+                    int flags, mode_t mode)
+{
+    return -int(errno_t::ENOENT);
+}
+
+int sock_fs_t::release(fs_file_info_t *fi)
+{
+    delete (sock_t*)fi;
+    return 0;
+}
+
+ssize_t sock_fs_t::read(fs_file_info_t *fi, char *buf,
+                        size_t size, off_t offset)
+{
+    fs_iovec_t iov{ buf, size };
+    return readv(fi, &iov, 1, offset);
+}
+
+ssize_t sock_fs_t::write(fs_file_info_t *fi, char const *buf,
+                         size_t size, off_t offset)
+{
+    fs_iovec_t iov{ const_cast<char*>(buf), size };
+    return writev(fi, &iov, 1, offset);
+}
+
+// The whole vector is one message
+ssize_t sock_fs_t::readv(fs_file_info_t *fi, fs_iovec_t const *iov,
+                         size_t iovcnt, off_t)
+{
+    sock_t *sock = (sock_t*)fi;
+
+    sock_msg_t msg{};
+    msg.iov = iov;
+    msg.iovcnt = iovcnt;
+
+    return sock->recv(&msg, sock->nonblock);
+}
+
+ssize_t sock_fs_t::writev(fs_file_info_t *fi, fs_iovec_t const *iov,
+                          size_t iovcnt, off_t)
+{
+    sock_t *sock = (sock_t*)fi;
+
+    sock_msg_t msg{};
+    msg.iov = iov;
+    msg.iovcnt = iovcnt;
+
+    return sock->send(&msg, sock->nonblock);
+}
+
+int sock_fs_t::ftruncate(fs_file_info_t *fi, off_t offset)
+{
+    return -int(errno_t::EINVAL);
+}
+
+int sock_fs_t::fstat(fs_file_info_t *fi, fs_stat_t *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFSOCK | 0777;
+    st->st_nlink = 1;
+    return 0;
+}
+
+int sock_fs_t::fsync(fs_file_info_t *fi, int isdatasync)
+{
+    return -int(errno_t::EINVAL);
+}
+
+int sock_fs_t::fsyncdir(fs_file_info_t *fi, int isdatasync)
+{
+    return -int(errno_t::EINVAL);
+}
+
+int sock_fs_t::flush(fs_file_info_t *fi)
+{
+    return 0;
+}
+
+int sock_fs_t::lock(fs_file_info_t *fi, int cmd, fs_flock_t* locks)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::bmap(fs_cpath_t path, size_t blocksize, uint64_t* blockno)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::statfs(fs_statvfs_t* stbuf)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::setxattr(fs_cpath_t path, char const* name,
+                        char const* value, size_t size, int flags)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::getxattr(fs_cpath_t path, char const* name,
+                        char* value, size_t size)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::listxattr(fs_cpath_t path, char const* list, size_t size)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+int sock_fs_t::ioctl(fs_file_info_t *fi, int cmd, void* arg,
+                     unsigned int flags, void* data)
+{
+    return -int(errno_t::ENOTTY);
+}
+
+int sock_fs_t::poll(fs_file_info_t *fi, fs_pollhandle_t* ph,
+                    unsigned* reventsp)
+{
+    return -int(errno_t::ENOSYS);
+}
+
+//
+// Socket calls
+
+// Holds a reference to an open socket for the duration of one call
+class sock_ref_t {
+public:
+    explicit sock_ref_t(int id)
+        : id(id)
+        , sock((sock_t*)file_handle_ref(id, &sock_fs))
+    {
+    }
+
+    sock_ref_t(sock_ref_t const&) = delete;
+    sock_ref_t& operator=(sock_ref_t const&) = delete;
+
+    ~sock_ref_t()
+    {
+        if (sock)
+            file_unref_filetab(id);
+    }
+
+    sock_t *operator->() const
+    {
+        return sock;
+    }
+
+    explicit operator bool() const
+    {
+        return sock != nullptr;
+    }
+
+    // Why the lookup failed
+    int err() const
+    {
+        if (!file_ref_filetab(id))
+            return -int(errno_t::EBADF);
+
+        file_unref_filetab(id);
+        return -int(errno_t::ENOTSOCK);
+    }
+
+private:
+    int id;
+    sock_t *sock;
+};
+
+static int sock_publish(sock_t *sock)
+{
+    int id = file_open_handle(&sock_fs, sock);
+
+    if (unlikely(id < 0))
+        delete sock;
+
+    return id;
+}
+
+int sock_create(int domain, int type, int protocol)
+{
+    if (domain != AF_INET)
+        return -int(errno_t::EAFNOSUPPORT);
+
+    bool nonblock = type & SOCK_NONBLOCK;
+    type &= ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    sock_t *sock;
+
+    switch (type) {
+    case SOCK_STREAM:
+        if (protocol != IPPROTO_IP && protocol != IPPROTO_TCP)
+            return -int(errno_t::EPROTONOSUPPORT);
+
+        sock = new sock_tcp_t(nonblock);
+        break;
+
+    case SOCK_DGRAM: {
+        if (protocol != IPPROTO_IP && protocol != IPPROTO_UDP)
+            return -int(errno_t::EPROTONOSUPPORT);
+
+        udp_sock_t *udp;
+        errno_t err = udp_open(&udp);
+
+        if (unlikely(err != errno_t::OK))
+            return -int(err);
+
+        sock = new sock_udp_t(nonblock, udp);
+
+        if (unlikely(!sock))
+            udp_close(udp);
+
+        break;
+    }
+
+    default:
+        return -int(errno_t::ESOCKTNOSUPPORT);
+    }
+
+    if (unlikely(!sock))
+        return -int(errno_t::ENOMEM);
+
+    return sock_publish(sock);
+}
+
+int sock_bind(int id, ipv4_addr_t const *addr)
+{
+    sock_ref_t sock(id);
+    if (unlikely(!sock))
+        return sock.err();
+
+    return -int(sock->bind(*addr));
+}
+
+int sock_listen(int id, int backlog)
+{
+    sock_ref_t sock(id);
+    if (unlikely(!sock))
+        return sock.err();
+
+    return -int(sock->listen(backlog));
+}
+
+int sock_accept(int id, ipv4_addr_t *peer, int flags)
+{
+    sock_ref_t sock(id);
+    if (unlikely(!sock))
+        return sock.err();
+
+    sock_t *conn;
+    errno_t err = sock->accept(&conn, peer, sock->nonblock);
+
+    if (unlikely(err != errno_t::OK))
+        return -int(err);
+
+    conn->nonblock = flags & SOCK_NONBLOCK;
+
+    return sock_publish(conn);
+}
+
+int sock_connect(int id, ipv4_addr_t const *addr)
+{
+    sock_ref_t sock(id);
+    if (unlikely(!sock))
+        return sock.err();
+
+    return -int(sock->connect(*addr));
+}
+
+int sock_shutdown(int id, int how)
+{
+    sock_ref_t sock(id);
+    if (unlikely(!sock))
+        return sock.err();
+
+    return -int(sock->shutdown(how));
+}
+
+int sock_name(int id, ipv4_addr_t *addr, bool peer)
+{
+    sock_ref_t sock(id);
+    if (unlikely(!sock))
+        return sock.err();
+
+    return -int(sock->name(addr, peer));
+}
+
+int sock_setopt(int id, int level, int name, int value)
+{
+    sock_ref_t sock(id);
+    if (unlikely(!sock))
+        return sock.err();
+
+    return -int(sock->setopt(level, name, value));
+}
+
+int sock_getopt(int id, int level, int name, int *value)
+{
+    sock_ref_t sock(id);
+    if (unlikely(!sock))
+        return sock.err();
+
+    return -int(sock->getopt(level, name, value));
+}
+
+ssize_t sock_sendmmsg(int id, sock_msg_t *msgs, size_t count, int flags)
+{
+    sock_ref_t sock(id);
+    if (unlikely(!sock))
+        return sock.err();
+
+    bool nonblock = sock->nonblock || (flags & MSG_DONTWAIT);
+
+    for (size_t i = 0; i < count; ++i) {
+        sock_msg_t& msg = msgs[i];
+
+        msg.flags = 0;
+
+        ssize_t size = sock->send(&msg, nonblock);
+
+        if (size < 0)
+            return i ? ssize_t(i) : size;
+
+        msg.len = size;
+
+        if (sock->type == SOCK_STREAM) {
+            size_t total = 0;
+            for (size_t k = 0; k < msg.iovcnt; ++k)
+                total += msg.iov[k].iov_len;
+
+            if (size_t(size) < total)
+                return i + 1;
+        }
+    }
+
+    return count;
+}
+
+ssize_t sock_recvmmsg(int id, sock_msg_t *msgs, size_t count, int flags)
+{
+    sock_ref_t sock(id);
+    if (unlikely(!sock))
+        return sock.err();
+
+    bool nonblock = sock->nonblock || (flags & MSG_DONTWAIT);
+
+    for (size_t i = 0; i < count; ++i) {
+        sock_msg_t& msg = msgs[i];
+
+        msg.flags = 0;
+        msg.has_addr = false;
+
+        ssize_t size = sock->recv(&msg, nonblock || i);
+
+        if (size < 0)
+            return i ? ssize_t(i) : size;
+
+        msg.len = size;
+
+        // End of stream
+        if (sock->type == SOCK_STREAM && !size)
+            return i + 1;
+    }
+
+    return count;
+}
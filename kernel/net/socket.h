@@ -0,0 +1,54 @@
+#pragma once
+#include "types.h"
+#include "errno.h"
+#include "ipv4.h"
+
+struct fs_iovec_t;
+
+// Sockets are open files of a filesystem without paths, so they share
+// the file table with every other open file, and read, write, close
+// and dup work on them. The calls take an open file id and return a
+// negated errno on failure. Addresses are in host byte order.
+
+// One message of a send or receive batch
+struct sock_msg_t {
+    // Validated vector, may be in user memory
+    fs_iovec_t const *iov;
+    size_t iovcnt;
+
+    // The destination when sending, the connected address is used
+    // when has_addr is false. Receives the source of datagrams
+    ipv4_addr_t addr;
+    bool has_addr;
+
+    // Bytes transferred, and MSG_TRUNC if a datagram didn't fit
+    size_t len;
+    int flags;
+};
+
+// AF_INET only, type may include SOCK_NONBLOCK.
+// Returns the open file id
+int sock_create(int domain, int type, int protocol);
+
+int sock_bind(int id, ipv4_addr_t const *addr);
+int sock_listen(int id, int backlog);
+
+// Returns the open file id of the connection, flags may
+// include SOCK_NONBLOCK
+int sock_accept(int id, ipv4_addr_t *peer, int flags);
+
+int sock_connect(int id, ipv4_addr_t const *addr);
+int sock_shutdown(int id, int how);
+
+// The local address, or the remote address if peer is set
+int sock_name(int id, ipv4_addr_t *addr, bool peer);
+
+int sock_setopt(int id, int level, int name, int value);
+int sock_getopt(int id, int level, int name, int *value);
+
+// Transfer a batch of messages, holding the file once for all of them.
+// Returns the number of messages transferred, or a negated errno if
+// none were. A receive only waits for the first message, and a stream
+// send stops at the first message that is sent partially
+ssize_t sock_sendmmsg(int id, sock_msg_t *msgs, size_t count, int flags);
+ssize_t sock_recvmmsg(int id, sock_msg_t *msgs, size_t count, int flags);
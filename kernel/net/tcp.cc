@@ -1,6 +1,2664 @@
 #include "tcp.h"
+#include "arp.h"
+#include "dev_eth.h"
+#include "mutex.h"
+#include "thread.h"
+#include "time.h"
+#include "mm.h"
+#include "string.h"
+#include "bswap.h"
+#include "printk.h"
+#include "algorithm.h"
+#include "inet_csum.h"
+#include "rss.h"
+#include "cpu/atomic.h"
+#include "cpu/control_regs.h"
+
+#define TCP_DEBUG   0
+#if TCP_DEBUG
+#define TCP_TRACE(...) printdbg("tcp: " __VA_ARGS__)
+#else
+#define TCP_TRACE(...) ((void)0)
+#endif
+
+// Connection and listener table buckets, a power of two
+static constexpr size_t tcp_hash_buckets = 1024;
+
+// Ethernet, IPv4 and TCP headers without options
+static constexpr size_t tcp_hdrs_size = sizeof(tcp_hdr_t);
+
+// TCP header without options, and the most options allowed
+static constexpr size_t tcp_hdr_size = 20;
+static constexpr size_t tcp_opts_max = 40;
+
+// Largest segment payload that fits in one packet buffer
+static constexpr uint16_t tcp_mss_max = ethq_pkt_capacity -
+        sizeof(uint32_t) - tcp_hdrs_size;
+
+// Assumed when the peer doesn't say
+static constexpr uint16_t tcp_mss_default = 536;
+
+// Smallest peer MSS honored, a tiny one would turn every send into
+// a flood of mostly header segments. Same floor as Linux
+static constexpr uint16_t tcp_mss_min = 88;
+
+// Payload bytes buffered per connection
+static constexpr uint32_t tcp_rcvbuf = 256 << 10;
+static constexpr uint32_t tcp_sndbuf = 256 << 10;
+
+// Enough to advertise all of tcp_rcvbuf
+static constexpr uint8_t tcp_rcv_wscale = 3;
+
+C_ASSERT((UINT32_C(0xFFFF) << tcp_rcv_wscale) >= tcp_rcvbuf);
+
+// Send ring entries, a power of two
+static constexpr uint32_t tcp_snd_ring_size = 256;
+
+// Timeouts, in milliseconds
+static constexpr uint32_t tcp_rto_init_ms = 1000;
+static constexpr uint32_t tcp_rto_min_ms = 200;
+static constexpr uint32_t tcp_rto_max_ms = 60000;
+static constexpr uint32_t tcp_delack_ms = 40;
+static constexpr uint32_t tcp_timewait_ms = 60000;
+
+// Closed connections waiting for the peer's FIN give up after this
+static constexpr uint32_t tcp_fin_wait_ms = 60000;
+
+// Retransmissions before the connection is dropped
+static constexpr unsigned tcp_max_retries = 12;
+static constexpr unsigned tcp_max_syn_retries = 6;
+
+// Timer wheel granularity and size
+static constexpr uint64_t tcp_tick_ms = 10;
+static constexpr size_t tcp_wheel_slots = 256;
+
+// Ephemeral ports for outgoing connections
+static constexpr uint16_t tcp_ephemeral_min = 32768;
+static constexpr uint16_t tcp_ephemeral_max = 60999;
+
+// proto_flags of send ring buffers
+#define TCP_PKT_SYN     0x01    // SYN, no payload
+#define TCP_PKT_FIN     0x02    // FIN, no payload
+#define TCP_PKT_SACKED  0x04    // Selectively acknowledged
+#define TCP_PKT_RETRANS 0x08    // Retransmitted during this recovery
+#define TCP_PKT_BUSY    0x10    // tcp_send is filling it
+#define TCP_PKT_CSUM    0x20    // data_csum holds the payload sum
+
+enum struct tcp_state_t : uint8_t {
+    CLOSED,
+    LISTEN,
+    SYN_SENT,
+    SYN_RCVD,
+    ESTABLISHED,
+    FIN_WAIT_1,
+    FIN_WAIT_2,
+    CLOSE_WAIT,
+    CLOSING,
+    LAST_ACK,
+    TIME_WAIT
+};
+
+// Where segments of a connection go
+struct tcp_path_t {
+    eth_dev_base_t *nic;
+    unsigned offloads;
+    uint8_t s_mac[6];
+
+    // Gateway or peer, resolved by ARP for each segment
+    uint32_t next_hop;
+
+    // Local address in s, remote in d
+    ipv4_addr_pair_t pair;
+};
+
+// A received segment
+struct tcp_seg_t {
+    ethq_pkt_t *pkt;
+    uint32_t seq;
+    uint32_t ack;
+    uint32_t len;
+    uint16_t wnd;
+    uint16_t flags;
+
+    // Options
+    uint16_t mss;
+    uint8_t wscale;
+    bool has_wscale;
+    bool sack_ok;
+    uint8_t sack_count;
+    uint32_t sack[4][2];
+};
+
+struct tcp_sock_t {
+    using lock_type = std::mcslock;
+    using scoped_lock = std::unique_lock<lock_type>;
+
+    tcp_sock_t();
+
+    lock_type lock;
+
+    // Waiters for data, space, connections and state changes
+    std::condition_variable changed;
+
+    // Serialize senders and receivers, which copy outside the lock
+    std::mutex send_lock;
+    std::mutex recv_lock;
+
+    int refcount;
+
+    tcp_path_t path;
+
+    tcp_state_t state;
+
+    // The user closed its handle
+    bool orphan;
+
+    // Linked into the connection or listener table
+    bool hashed;
+
+    // In the receive batch's ACK list
+    bool ack_batched;
+
+    // Send short segments without waiting for outstanding data
+    bool nodelay;
+
+    // Fatal error for the user, reported by the next call
+    errno_t err;
+
+    // Connection table bucket chain
+    tcp_sock_t *hash_next;
+
+    //
+    // Listening
+
+    // Connections waiting to be accepted, linked through accept_next
+    tcp_sock_t *accept_head;
+    tcp_sock_t *accept_tail;
+    tcp_sock_t *accept_next;
+
+    // Handshakes in progress and connections not accepted yet
+    int pending;
+    int backlog;
+
+    // The listener of a connection in SYN_RCVD
+    tcp_sock_t *parent;
+
+    //
+    // Sending
+
+    uint32_t iss;
+    uint32_t snd_una;
+    uint32_t snd_nxt;
+    uint32_t snd_max;
+
+    // Sequence number after the last byte queued
+    uint32_t snd_end;
+
+    uint32_t snd_wnd;
+    uint32_t snd_wl1;
+    uint32_t snd_wl2;
+
+    uint16_t mss;
+    uint8_t snd_wscale;
+    uint8_t rcv_wscale;
+    bool sack_ok;
+
+    // Congestion control
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t recover;
+    uint32_t sack_high;
+    uint8_t dupacks;
+    bool in_recovery;
+
+    // Segments, from the oldest unacknowledged to the last queued,
+    // free running indices. Each is a complete frame
+    ethq_pkt_t *snd_ring[tcp_snd_ring_size];
+    uint32_t snd_head;
+    uint32_t snd_send;
+    uint32_t snd_tail;
+
+    // Payload bytes in the ring
+    uint32_t snd_bytes;
+
+    bool fin_queued;
+
+    //
+    // Receiving
+
+    uint32_t irs;
+    uint32_t rcv_nxt;
+
+    // Right edge of the advertised window
+    uint32_t rcv_adv;
+
+    // In order data, linked through next
+    ethq_pkt_t *rcv_head;
+    ethq_pkt_t *rcv_tail;
+    uint32_t rcv_bytes;
+
+    // Incremented when the queues are discarded
+    uint32_t rcv_gen;
+
+    // Out of order data, sorted by seq
+    ethq_pkt_t *ooo_head;
+    uint32_t ooo_bytes;
+
+    bool fin_rcvd;
+
+    // Full segments received since the last ACK
+    uint8_t ack_pending;
+    bool ack_now;
+
+    //
+    // Timers
+
+    // Smoothed round trip time, in 1/8 ms, and its variance in 1/4 ms
+    uint32_t srtt;
+    uint32_t rttvar;
+    uint32_t rto;
+    uint8_t retries;
+
+    // Deadlines in ms, 0 when not armed
+    uint64_t rto_due;
+    uint64_t delack_due;
+    uint64_t persist_due;
+    uint64_t close_due;
+
+    // Timer wheel entry
+    tcp_sock_t *timer_next;
+    tcp_sock_t **timer_pprev;
+    uint64_t timer_tick;
+
+    // Receive batch ACK list
+    tcp_sock_t *ack_next;
+};
+
+using scoped_lock = tcp_sock_t::scoped_lock;
+
+struct tcp_bucket_t {
+    std::spinlock lock;
+    tcp_sock_t *head;
+};
+
+using bucket_lock = std::unique_lock<std::spinlock>;
+
+// Connections by address pair, listeners by local port
+static tcp_bucket_t tcp_conns[tcp_hash_buckets];
+static tcp_bucket_t tcp_listeners[tcp_hash_buckets];
+
+static uint16_t tcp_next_ephemeral;
+
+struct tcp_wheel_t {
+    std::spinlock lock;
+    tcp_sock_t *slots[tcp_wheel_slots];
+    uint64_t last_tick;
+    bool started;
+};
+
+static tcp_wheel_t tcp_wheel;
+
+struct alignas(64) tcp_ack_batch_t {
+    thread_t owner;
+    tcp_sock_t *head;
+};
+
+static tcp_ack_batch_t tcp_ack_batches[MAX_CPUS];
+
+static void tcp_finish(tcp_sock_t *sock);
+
+//
+// Sequence numbers
+
+static _always_inline bool seq_lt(uint32_t a, uint32_t b)
+{
+    return int32_t(a - b) < 0;
+}
+
+static _always_inline bool seq_le(uint32_t a, uint32_t b)
+{
+    return int32_t(a - b) <= 0;
+}
+
+static _always_inline bool seq_gt(uint32_t a, uint32_t b)
+{
+    return int32_t(a - b) > 0;
+}
+
+static _always_inline bool seq_ge(uint32_t a, uint32_t b)
+{
+    return int32_t(a - b) >= 0;
+}
+
+static _always_inline uint64_t tcp_now_ms()
+{
+    return time_ns() / 1000000;
+}
+
+// Transmit timestamps, 0 means not timed
+static _always_inline uint32_t tcp_stamp()
+{
+    return uint32_t(tcp_now_ms()) | 1;
+}
+
+// Sequence space a send ring buffer takes
+static _always_inline uint32_t tcp_seg_len(ethq_pkt_t const *pkt)
+{
+    return pkt->data_len + ((pkt->proto_flags &
+                             (TCP_PKT_SYN | TCP_PKT_FIN)) != 0);
+}
+
+static _always_inline void *tcp_payload(ethq_pkt_t *pkt)
+{
+    return (char*)&pkt->pkt + tcp_hdrs_size;
+}
+
+static _always_inline ethq_pkt_t *&tcp_snd_at(tcp_sock_t *sock,
+                                              uint32_t index)
+{
+    return sock->snd_ring[index & (tcp_snd_ring_size - 1)];
+}
+
+static _always_inline bool tcp_can_send(tcp_state_t state)
+{
+    return state == tcp_state_t::ESTABLISHED ||
+            state == tcp_state_t::CLOSE_WAIT;
+}
+
+static _always_inline bool tcp_can_recv(tcp_state_t state)
+{
+    return state == tcp_state_t::ESTABLISHED ||
+            state == tcp_state_t::FIN_WAIT_1 ||
+            state == tcp_state_t::FIN_WAIT_2;
+}
+
+static size_t tcp_hash(ipv4_addr_pair_t const& pair)
+{
+    uint64_t h = (uint64_t(pair.s.ip) << 32) | pair.d.ip;
+    h ^= (uint64_t(pair.s.port) << 16) | pair.d.port;
+    h *= UINT64_C(0x9E3779B97F4A7C15);
+    return h >> 32;
+}
+
+static _always_inline size_t tcp_port_hash(uint16_t port)
+{
+    return (port * UINT32_C(0x9E3779B1)) >> 16;
+}
+
+//
+// Checksums
+
+static uint64_t tcp_pseudo_sum(ipv4_hdr_t const *hdr, size_t tcp_len)
+{
+    uint32_t s_ip;
+    uint32_t d_ip;
+    memcpy(&s_ip, hdr->s_ip, sizeof(s_ip));
+    memcpy(&d_ip, hdr->d_ip, sizeof(d_ip));
+
+    return inet_csum_pseudo(s_ip, d_ip, IPV4_PROTO_TCP, uint16_t(tcp_len));
+}
+
+// Verify a received segment, which may continue into frag buffers
+static bool tcp_checksum_ok(ethq_pkt_t const *pkt, size_t tcp_len)
+{
+    tcp_hdr_t const *hdr = (tcp_hdr_t const *)&pkt->pkt;
+
+    uint64_t sum = tcp_pseudo_sum(&hdr->ipv4_hdr, tcp_len);
+
+    size_t ofs = offsetof(tcp_hdr_t, s_port);
+    size_t done = 0;
+
+    for (; pkt && done < tcp_len; pkt = pkt->frag, ofs = 0) {
+        if (pkt->size <= ofs)
+            continue;
+
+        size_t chunk = std::min(size_t(pkt->size) - ofs, tcp_len - done);
+        sum = inet_csum_block(sum, inet_csum_partial(
+                                  (char const *)&pkt->pkt + ofs, chunk, 0),
+                              done);
+        done += chunk;
+    }
+
+    return done == tcp_len && inet_csum_fold(sum) == 0xFFFF;
+}
+
+//
+// Building segments
+
+static void tcp_build(tcp_path_t const *path, ethq_pkt_t *pkt,
+                      uint32_t seq, uint32_t ack, unsigned flags,
+                      uint16_t window, void const *opts, size_t opt_len,
+                      size_t payload_len)
+{
+    tcp_hdr_t *hdr = (tcp_hdr_t*)&pkt->pkt;
+    size_t tcp_len = tcp_hdr_size + opt_len + payload_len;
+
+    memcpy(hdr->ipv4_hdr.eth_hdr.s_mac, path->s_mac,
+           sizeof(hdr->ipv4_hdr.eth_hdr.s_mac));
+    hdr->ipv4_hdr.eth_hdr.len_ethertype = htons(ETHERTYPE_IPv4);
+
+    uint32_t s_ip = htonl(path->pair.s.ip);
+    uint32_t d_ip = htonl(path->pair.d.ip);
+
+    hdr->ipv4_hdr.ver_ihl = 0x45;
+    hdr->ipv4_hdr.dscp_ecn = 0;
+    hdr->ipv4_hdr.len = htons(uint16_t(sizeof(ipv4_hdr_t) -
+                                       sizeof(ethernet_hdr_t) + tcp_len));
+    hdr->ipv4_hdr.id = 0;
+    // Don't fragment
+    hdr->ipv4_hdr.flags_fragofs = htons(0x4000);
+    hdr->ipv4_hdr.ttl = 64;
+    hdr->ipv4_hdr.protocol = IPV4_PROTO_TCP;
+    hdr->ipv4_hdr.hdr_checksum = 0;
+    memcpy(hdr->ipv4_hdr.s_ip, &s_ip, sizeof(s_ip));
+    memcpy(hdr->ipv4_hdr.d_ip, &d_ip, sizeof(d_ip));
+    hdr->ipv4_hdr.hdr_checksum = ipv4_checksum(&hdr->ipv4_hdr);
+
+    hdr->s_port = htons(path->pair.s.port);
+    hdr->d_port = htons(path->pair.d.port);
+    hdr->seq = htonl(seq);
+    hdr->ack = htonl((flags & TCP_FLAGS_ACK) ? ack : 0);
+    hdr->flags = htons(uint16_t(flags | (((tcp_hdr_size + opt_len) >> 2)
+                                         << TCP_FLAGS_DATAOFS_BIT)));
+    hdr->window = htons(window);
+    hdr->checksum = 0;
+    hdr->urgent = 0;
+
+    if (opt_len)
+        memcpy(hdr + 1, opts, opt_len);
+
+    pkt->size = tcp_hdrs_size + opt_len + payload_len;
+
+    uint64_t sum = tcp_pseudo_sum(&hdr->ipv4_hdr, tcp_len);
+
+    if (path->offloads & ETH_DEV_OFFLOAD_TX_CSUM) {
+        // The NIC adds the segment to the pseudo header sum
+        pkt->offload = ETHQ_OFFLOAD_CSUM;
+        pkt->csum_start = offsetof(tcp_hdr_t, s_port);
+        pkt->csum_offset = offsetof(tcp_hdr_t, checksum) -
+                offsetof(tcp_hdr_t, s_port);
+        hdr->checksum = inet_csum_fold(sum);
+    } else if ((pkt->proto_flags & TCP_PKT_CSUM) && !opt_len) {
+        // tcp_send summed the payload while copying it in
+        pkt->offload = 0;
+        sum = inet_csum_partial(&hdr->s_port, tcp_hdr_size, sum);
+        sum = inet_csum_add(sum, pkt->data_csum);
+        hdr->checksum = ~inet_csum_fold(sum);
+    } else {
+        pkt->offload = 0;
+        hdr->checksum = inet_csum(&hdr->s_port, tcp_len, sum);
+    }
+}
+
+static uint32_t tcp_rcv_space(tcp_sock_t const *sock)
+{
+    uint32_t used = sock->rcv_bytes + sock->ooo_bytes;
+    return used < tcp_rcvbuf ? tcp_rcvbuf - used : 0;
+}
+
+// The window to advertise, which never moves the right edge back
+static uint16_t tcp_window(tcp_sock_t *sock, bool syn)
+{
+    uint32_t space = tcp_rcv_space(sock);
+
+    if (seq_lt(sock->rcv_nxt + space, sock->rcv_adv))
+        space = sock->rcv_adv - sock->rcv_nxt;
+
+    uint8_t shift = syn ? 0 : sock->rcv_wscale;
+    uint32_t window = std::min(space >> shift, UINT32_C(0xFFFF));
+
+    sock->rcv_adv = sock->rcv_nxt + (window << shift);
+
+    return uint16_t(window);
+}
+
+static size_t tcp_syn_options(tcp_sock_t const *sock, uint8_t *opts)
+{
+    size_t len = 0;
+
+    opts[len++] = TCP_OPT_MSS;
+    opts[len++] = 4;
+    opts[len++] = uint8_t(tcp_mss_max >> 8);
+    opts[len++] = uint8_t(tcp_mss_max);
+
+    // Offered in SYN, echoed in SYN-ACK when the peer offered them
+    bool syn_ack = sock->state != tcp_state_t::SYN_SENT;
+
+    if (!syn_ack || sock->rcv_wscale) {
+        opts[len++] = TCP_OPT_NOP;
+        opts[len++] = TCP_OPT_WSCALE;
+        opts[len++] = 3;
+        opts[len++] = tcp_rcv_wscale;
+    }
+
+    if (!syn_ack || sock->sack_ok) {
+        opts[len++] = TCP_OPT_NOP;
+        opts[len++] = TCP_OPT_NOP;
+        opts[len++] = TCP_OPT_SACK_PERM;
+        opts[len++] = 2;
+    }
+
+    return len;
+}
+
+// SACK blocks for the out of order data, lowest first
+static size_t tcp_sack_options(tcp_sock_t const *sock, uint8_t *opts)
+{
+    if (!sock->sack_ok || !sock->ooo_head)
+        return 0;
+
+    size_t len = 2;
+    size_t blocks = 0;
+
+    opts[0] = TCP_OPT_NOP;
+    opts[1] = TCP_OPT_NOP;
+    opts[len++] = TCP_OPT_SACK;
+    size_t len_ofs = len++;
+
+    ethq_pkt_t const *pkt = sock->ooo_head;
+
+    while (pkt && blocks < 4) {
+        uint32_t left = pkt->seq;
+        uint32_t right = pkt->seq + pkt->stamp;
+
+        // Merge adjacent and overlapping entries
+        for (pkt = pkt->next; pkt && seq_le(pkt->seq, right);
+             pkt = pkt->next) {
+            if (seq_gt(pkt->seq + pkt->stamp, right))
+                right = pkt->seq + pkt->stamp;
+        }
+
+        left = htonl(left);
+        right = htonl(right);
+        memcpy(opts + len, &left, sizeof(left));
+        memcpy(opts + len + 4, &right, sizeof(right));
+        len += 8;
+        ++blocks;
+    }
+
+    opts[len_ofs] = uint8_t(2 + blocks * 8);
+
+    return len;
+}
+
+// The destination MAC is filled in when the next hop is resolved
+static _always_inline int tcp_path_send(tcp_path_t const *path,
+                                        ethq_pkt_t *pkt)
+{
+    return arp_send(path->nic, path->pair.s.ip, path->next_hop, pkt);
+}
+
+// Route a path to the remote address, or send back through
+// the interface a segment came from if there is no route
+static void tcp_path_route(tcp_path_t *path, eth_dev_base_t *in_nic)
+{
+    ipv4_route_t route;
+
+    if (likely(ipv4_route_get(&route, path->pair.d.ip))) {
+        path->nic = route.nic;
+        path->next_hop = route.next_hop;
+    } else {
+        path->nic = in_nic;
+        path->next_hop = path->pair.d.ip;
+    }
+
+    path->offloads = path->nic->get_offloads();
+    path->nic->get_mac(path->s_mac);
+}
+
+static void tcp_send_ctl(tcp_sock_t *sock, uint32_t seq, unsigned flags)
+{
+    ethq_pkt_t *pkt = ethq_pkt_acquire();
+
+    if (unlikely(!pkt))
+        return;
+
+    uint8_t opts[tcp_opts_max];
+    size_t opt_len = (flags & TCP_FLAGS_RST)
+            ? 0
+            : tcp_sack_options(sock, opts);
+
+    tcp_build(&sock->path, pkt, seq, sock->rcv_nxt, flags,
+              tcp_window(sock, false), opts, opt_len, 0);
+
+    tcp_path_send(&sock->path, pkt);
+}
+
+static void tcp_send_ack(tcp_sock_t *sock)
+{
+    tcp_send_ctl(sock, sock->snd_nxt, TCP_FLAGS_ACK);
+
+    sock->ack_pending = 0;
+    sock->ack_now = false;
+    sock->delack_due = 0;
+}
+
+// Reply to a segment that has no connection
+static void tcp_reply_reset(tcp_seg_t const& seg)
+{
+    if (seg.flags & TCP_FLAGS_RST)
+        return;
+
+    tcp_hdr_t const *in = (tcp_hdr_t const *)&seg.pkt->pkt;
+
+    tcp_path_t path;
+    ipv4_ip_get(&path.pair, &in->ipv4_hdr);
+    std::swap(path.pair.s.ip, path.pair.d.ip);
+    path.pair.s.port = ntohs(in->d_port);
+    path.pair.d.port = ntohs(in->s_port);
+    tcp_path_route(&path, seg.pkt->nic);
+
+    ethq_pkt_t *pkt = ethq_pkt_acquire();
+
+    if (unlikely(!pkt))
+        return;
+
+    if (seg.flags & TCP_FLAGS_ACK) {
+        tcp_build(&path, pkt, seg.ack, 0, TCP_FLAGS_RST,
+                  0, nullptr, 0, 0);
+    } else {
+        uint32_t ack = seg.seq + seg.len +
+                ((seg.flags & TCP_FLAGS_SYN) != 0) +
+                ((seg.flags & TCP_FLAGS_FIN) != 0);
+        tcp_build(&path, pkt, 0, ack, TCP_FLAGS_RST | TCP_FLAGS_ACK,
+                  0, nullptr, 0, 0);
+    }
+
+    tcp_path_send(&path, pkt);
+}
+
+//
+// Socket lifetime
+
+tcp_sock_t::tcp_sock_t()
+    : refcount(1)
+    , path{}
+    , state(tcp_state_t::CLOSED)
+    , orphan(false)
+    , hashed(false)
+    , ack_batched(false)
+    , nodelay(false)
+    , err(errno_t::OK)
+    , hash_next(nullptr)
+    , accept_head(nullptr)
+    , accept_tail(nullptr)
+    , accept_next(nullptr)
+    , pending(0)
+    , backlog(0)
+    , parent(nullptr)
+    , iss(0)
+    , snd_una(0)
+    , snd_nxt(0)
+    , snd_max(0)
+    , snd_end(0)
+    , snd_wnd(0)
+    , snd_wl1(0)
+    , snd_wl2(0)
+    , mss(tcp_mss_default)
+    , snd_wscale(0)
+    , rcv_wscale(0)
+    , sack_ok(false)
+    , cwnd(0)
+    , ssthresh(UINT32_MAX)
+    , recover(0)
+    , sack_high(0)
+    , dupacks(0)
+    , in_recovery(false)
+    , snd_ring{}
+    , snd_head(0)
+    , snd_send(0)
+    , snd_tail(0)
+    , snd_bytes(0)
+    , fin_queued(false)
+    , irs(0)
+    , rcv_nxt(0)
+    , rcv_adv(0)
+    , rcv_head(nullptr)
+    , rcv_tail(nullptr)
+    , rcv_bytes(0)
+    , rcv_gen(0)
+    , ooo_head(nullptr)
+    , ooo_bytes(0)
+    , fin_rcvd(false)
+    , ack_pending(0)
+    , ack_now(false)
+    , srtt(0)
+    , rttvar(0)
+    , rto(tcp_rto_init_ms)
+    , retries(0)
+    , rto_due(0)
+    , delack_due(0)
+    , persist_due(0)
+    , close_due(0)
+    , timer_next(nullptr)
+    , timer_pprev(nullptr)
+    , timer_tick(0)
+    , ack_next(nullptr)
+{
+}
+
+static _always_inline void tcp_sock_ref(tcp_sock_t *sock)
+{
+    atomic_inc(&sock->refcount);
+}
+
+static void tcp_purge(tcp_sock_t *sock)
+{
+    while (sock->snd_head != sock->snd_tail) {
+        ethq_pkt_t *&slot = tcp_snd_at(sock, sock->snd_head++);
+        ethq_pkt_release(slot);
+        slot = nullptr;
+    }
+
+    sock->snd_send = sock->snd_head;
+    sock->snd_bytes = 0;
+
+    for (ethq_pkt_t *pkt = sock->rcv_head, *next; pkt; pkt = next) {
+        next = pkt->next;
+        ethq_pkt_release(pkt);
+    }
+
+    for (ethq_pkt_t *pkt = sock->ooo_head, *next; pkt; pkt = next) {
+        next = pkt->next;
+        ethq_pkt_release(pkt);
+    }
+
+    sock->rcv_head = nullptr;
+    sock->rcv_tail = nullptr;
+    sock->rcv_bytes = 0;
+    sock->ooo_head = nullptr;
+    sock->ooo_bytes = 0;
+    ++sock->rcv_gen;
+}
+
+static void tcp_sock_release(tcp_sock_t *sock)
+{
+    if (atomic_dec(&sock->refcount) != 0)
+        return;
+
+    assert(!sock->hashed);
+
+    tcp_purge(sock);
+    delete sock;
+}
+
+//
+// Connection and listener tables
+
+static bool tcp_conn_insert(tcp_sock_t *sock)
+{
+    tcp_bucket_t& bucket = tcp_conns[tcp_hash(sock->path.pair) &
+            (tcp_hash_buckets - 1)];
+
+    bucket_lock hold(bucket.lock);
+
+    for (tcp_sock_t *it = bucket.head; it; it = it->hash_next) {
+        if (!memcmp(&it->path.pair, &sock->path.pair,
+                    sizeof(sock->path.pair)))
+            return false;
+    }
+
+    tcp_sock_ref(sock);
+    sock->hash_next = bucket.head;
+    bucket.head = sock;
+    sock->hashed = true;
+
+    return true;
+}
+
+static tcp_sock_t *tcp_conn_lookup(ipv4_addr_pair_t const& pair)
+{
+    tcp_bucket_t& bucket = tcp_conns[tcp_hash(pair) &
+            (tcp_hash_buckets - 1)];
+
+    bucket_lock hold(bucket.lock);
+
+    for (tcp_sock_t *it = bucket.head; it; it = it->hash_next) {
+        if (!memcmp(&it->path.pair, &pair, sizeof(pair))) {
+            tcp_sock_ref(it);
+            return it;
+        }
+    }
+
+    return nullptr;
+}
+
+static bool tcp_listener_insert(tcp_sock_t *sock)
+{
+    tcp_bucket_t& bucket = tcp_listeners[tcp_port_hash(
+                sock->path.pair.s.port) & (tcp_hash_buckets - 1)];
+
+    bucket_lock hold(bucket.lock);
+
+    for (tcp_sock_t *it = bucket.head; it; it = it->hash_next) {
+        if (it->path.pair.s.port == sock->path.pair.s.port &&
+                (!it->path.pair.s.ip || !sock->path.pair.s.ip ||
+                 it->path.pair.s.ip == sock->path.pair.s.ip))
+            return false;
+    }
+
+    tcp_sock_ref(sock);
+    sock->hash_next = bucket.head;
+    bucket.head = sock;
+    sock->hashed = true;
+
+    return true;
+}
+
+// Prefers a listener on the exact address over one on every address
+static tcp_sock_t *tcp_listener_lookup(uint32_t ip, uint16_t port)
+{
+    tcp_bucket_t& bucket = tcp_listeners[tcp_port_hash(port) &
+            (tcp_hash_buckets - 1)];
+
+    bucket_lock hold(bucket.lock);
+
+    tcp_sock_t *match = nullptr;
+
+    for (tcp_sock_t *it = bucket.head; it; it = it->hash_next) {
+        if (it->path.pair.s.port != port)
+            continue;
+
+        if (it->path.pair.s.ip == ip) {
+            match = it;
+            break;
+        }
+
+        if (!it->path.pair.s.ip)
+            match = it;
+    }
+
+    if (match)
+        tcp_sock_ref(match);
+
+    return match;
+}
+
+// Called with the socket locked, which still holds a reference
+static void tcp_unhash(tcp_sock_t *sock)
+{
+    if (!sock->hashed)
+        return;
+
+    bool listener = sock->state == tcp_state_t::LISTEN;
+
+    tcp_bucket_t& bucket = listener
+            ? tcp_listeners[tcp_port_hash(sock->path.pair.s.port) &
+            (tcp_hash_buckets - 1)]
+            : tcp_conns[tcp_hash(sock->path.pair) &
+            (tcp_hash_buckets - 1)];
+
+    bucket_lock hold(bucket.lock);
+
+    tcp_sock_t **link = &bucket.head;
+    while (*link && *link != sock)
+        link = &(*link)->hash_next;
+
+    assert(*link == sock);
+    *link = sock->hash_next;
+    sock->hash_next = nullptr;
+    sock->hashed = false;
+
+    hold.unlock();
+
+    atomic_dec(&sock->refcount);
+}
+
+//
+// Timers
+//
+// Each connection has one wheel entry, armed for its earliest deadline.
+// Deadlines moving later leave the entry where it is, when it fires
+// early it is armed again. A thread advances the wheel every tick.
+
+static int tcp_timer_thread(void *);
+
+static void tcp_timer_arm(tcp_sock_t *sock, uint64_t due_ms)
+{
+    uint64_t tick = (due_ms + tcp_tick_ms - 1) / tcp_tick_ms;
+
+    bucket_lock hold(tcp_wheel.lock);
+
+    if (sock->timer_pprev) {
+        if (sock->timer_tick <= tick)
+            return;
+
+        // Earlier, move it
+        *sock->timer_pprev = sock->timer_next;
+        if (sock->timer_next)
+            sock->timer_next->timer_pprev = sock->timer_pprev;
+    } else {
+        // The wheel holds a reference
+        tcp_sock_ref(sock);
+    }
+
+    // Never in a slot the wheel already passed
+    tick = std::max(tick, tcp_wheel.last_tick + 1);
+
+    tcp_sock_t **slot = tcp_wheel.slots + (tick & (tcp_wheel_slots - 1));
+
+    sock->timer_tick = tick;
+    sock->timer_next = *slot;
+    sock->timer_pprev = slot;
+    if (*slot)
+        (*slot)->timer_pprev = &sock->timer_next;
+    *slot = sock;
+
+    if (unlikely(!tcp_wheel.started)) {
+        tcp_wheel.started = true;
+        hold.unlock();
+        thread_create(tcp_timer_thread, nullptr, 0, false);
+    }
+}
+
+// Arm the wheel entry for the earliest deadline
+static void tcp_timer_update(tcp_sock_t *sock)
+{
+    uint64_t due = UINT64_MAX;
+
+    if (sock->rto_due)
+        due = std::min(due, sock->rto_due);
+    if (sock->delack_due)
+        due = std::min(due, sock->delack_due);
+    if (sock->persist_due)
+        due = std::min(due, sock->persist_due);
+    if (sock->close_due)
+        due = std::min(due, sock->close_due);
+
+    if (due != UINT64_MAX)
+        tcp_timer_arm(sock, due);
+}
+
+static void tcp_rto_expired(tcp_sock_t *sock);
+
+static void tcp_timer_expired(tcp_sock_t *sock)
+{
+    scoped_lock hold(sock->lock);
+
+    uint64_t now = tcp_now_ms();
+
+    if (sock->close_due && now >= sock->close_due) {
+        // TIME_WAIT over, or the peer never closed an orphan
+        sock->close_due = 0;
+        tcp_finish(sock);
+        return;
+    }
+
+    if (sock->delack_due && now >= sock->delack_due)
+        tcp_send_ack(sock);
+
+    if (sock->rto_due && now >= sock->rto_due) {
+        sock->rto_due = 0;
+        tcp_rto_expired(sock);
+    }
+
+    if (sock->persist_due && now >= sock->persist_due) {
+        // Window probe, acknowledged with the current window
+        tcp_send_ctl(sock, sock->snd_una - 1, TCP_FLAGS_ACK);
+        sock->rto = std::min(sock->rto * 2, tcp_rto_max_ms);
+        sock->persist_due = now + sock->rto;
+    }
+
+    if (sock->state != tcp_state_t::CLOSED)
+        tcp_timer_update(sock);
+}
+
+static int tcp_timer_thread(void *)
+{
+    for (;;) {
+        uint64_t now_tick = tcp_now_ms() / tcp_tick_ms;
+
+        bucket_lock hold(tcp_wheel.lock);
+
+        tcp_sock_t *expired = nullptr;
+
+        // Catch up, but one lap of the wheel covers every slot
+        uint64_t first = std::max(tcp_wheel.last_tick + 1,
+                                  now_tick > tcp_wheel_slots
+                                  ? now_tick - tcp_wheel_slots + 1
+                                  : 0);
+
+        for (uint64_t tick = first; tick <= now_tick; ++tick) {
+            tcp_sock_t **link = tcp_wheel.slots +
+                    (tick & (tcp_wheel_slots - 1));
+
+            while (*link) {
+                tcp_sock_t *sock = *link;
+
+                if (sock->timer_tick > now_tick) {
+                    // A later lap
+                    link = &sock->timer_next;
+                    continue;
+                }
+
+                *link = sock->timer_next;
+                if (sock->timer_next)
+                    sock->timer_next->timer_pprev = link;
+
+                sock->timer_pprev = nullptr;
+                sock->timer_next = expired;
+                expired = sock;
+            }
+        }
+
+        tcp_wheel.last_tick = std::max(tcp_wheel.last_tick, now_tick);
+
+        hold.unlock();
+
+        // Keeps the reference the wheel held
+        while (expired) {
+            tcp_sock_t *sock = expired;
+            expired = sock->timer_next;
+            sock->timer_next = nullptr;
+
+            tcp_timer_expired(sock);
+            tcp_sock_release(sock);
+        }
+
+        thread_sleep_until((now_tick + 1) * tcp_tick_ms * 1000000);
+    }
+
+    return 0;
+}
+
+//
+// Sending
+
+static void tcp_xmit(tcp_sock_t *sock, ethq_pkt_t *pkt)
+{
+    // Still queued in the NIC from the last time
+    if (ethq_pkt_shared(pkt))
+        return;
+
+    uint8_t opts[tcp_opts_max];
+    size_t opt_len = 0;
+    unsigned flags = TCP_FLAGS_ACK;
+    bool syn = pkt->proto_flags & TCP_PKT_SYN;
+
+    if (syn) {
+        opt_len = tcp_syn_options(sock, opts);
+        flags = TCP_FLAGS_SYN;
+        if (sock->state != tcp_state_t::SYN_SENT)
+            flags |= TCP_FLAGS_ACK;
+    }
+
+    if (pkt->proto_flags & TCP_PKT_FIN)
+        flags |= TCP_FLAGS_FIN;
+
+    if (pkt->data_len)
+        flags |= TCP_FLAGS_PSH;
+
+    tcp_build(&sock->path, pkt, pkt->seq, sock->rcv_nxt, flags,
+              tcp_window(sock, syn), opts, opt_len, pkt->data_len);
+
+    // The ring keeps its reference
+    ethq_pkt_ref(pkt);
+    tcp_path_send(&sock->path, pkt);
+
+    // It carried the ACK
+    if (flags & TCP_FLAGS_ACK) {
+        sock->ack_pending = 0;
+        sock->ack_now = false;
+        sock->delack_due = 0;
+    }
+}
+
+// Send what the windows allow
+static void tcp_output(tcp_sock_t *sock)
+{
+    if (sock->state == tcp_state_t::CLOSED ||
+            sock->state == tcp_state_t::LISTEN ||
+            sock->state == tcp_state_t::TIME_WAIT)
+        return;
+
+    uint32_t window = std::min(sock->snd_wnd, sock->cwnd);
+
+    while (sock->snd_send != sock->snd_tail) {
+        ethq_pkt_t *pkt = tcp_snd_at(sock, sock->snd_send);
+
+        if (pkt->proto_flags & TCP_PKT_BUSY)
+            break;
+
+        uint32_t len = tcp_seg_len(pkt);
+        bool rexmit = seq_lt(pkt->seq, sock->snd_max);
+
+        if (!(pkt->proto_flags & TCP_PKT_SYN) &&
+                seq_gt(pkt->seq + len, sock->snd_una + window)) {
+            // Probe a zero window until it opens
+            if (!sock->snd_wnd && sock->snd_una == sock->snd_max &&
+                    !sock->persist_due)
+                sock->persist_due = tcp_now_ms() + sock->rto;
+            break;
+        }
+
+        // Nagle, hold back a short last segment
+        // while there is unacknowledged data
+        if (!rexmit && !sock->nodelay && pkt->data_len < sock->mss &&
+                !(pkt->proto_flags & TCP_PKT_FIN) &&
+                sock->snd_send + 1 == sock->snd_tail &&
+                sock->snd_max != sock->snd_una)
+            break;
+
+        pkt->stamp = rexmit ? 0 : tcp_stamp();
+        tcp_xmit(sock, pkt);
+
+        ++sock->snd_send;
+        sock->snd_nxt = pkt->seq + len;
+        if (seq_gt(sock->snd_nxt, sock->snd_max))
+            sock->snd_max = sock->snd_nxt;
+
+        if (!sock->rto_due)
+            sock->rto_due = tcp_now_ms() + sock->rto;
+    }
+}
+
+static bool tcp_snd_push(tcp_sock_t *sock, ethq_pkt_t *pkt)
+{
+    if (sock->snd_tail - sock->snd_head >= tcp_snd_ring_size)
+        return false;
+
+    pkt->seq = sock->snd_end;
+    sock->snd_end += tcp_seg_len(pkt);
+    sock->snd_bytes += pkt->data_len;
+    tcp_snd_at(sock, sock->snd_tail++) = pkt;
+
+    return true;
+}
+
+static bool tcp_queue_ctl(tcp_sock_t *sock, uint16_t proto_flags)
+{
+    ethq_pkt_t *pkt = ethq_pkt_acquire();
+
+    if (unlikely(!pkt))
+        return false;
+
+    pkt->proto_flags = proto_flags;
+    pkt->data_len = 0;
+
+    if (unlikely(!tcp_snd_push(sock, pkt))) {
+        ethq_pkt_release(pkt);
+        return false;
+    }
+
+    return true;
+}
+
+// The first unacknowledged segment known to be lost
+static void tcp_retransmit_hole(tcp_sock_t *sock)
+{
+    for (uint32_t i = sock->snd_head; i != sock->snd_send; ++i) {
+        ethq_pkt_t *pkt = tcp_snd_at(sock, i);
+
+        if (pkt->proto_flags & (TCP_PKT_SACKED | TCP_PKT_RETRANS))
+            continue;
+
+        // Above everything selectively acknowledged isn't known lost
+        if (i != sock->snd_head && !seq_lt(pkt->seq, sock->sack_high))
+            break;
+
+        pkt->proto_flags |= TCP_PKT_RETRANS;
+        pkt->stamp = 0;
+        tcp_xmit(sock, pkt);
+        break;
+    }
+}
+
+static void tcp_rto_expired(tcp_sock_t *sock)
+{
+    bool handshake = sock->state == tcp_state_t::SYN_SENT ||
+            sock->state == tcp_state_t::SYN_RCVD;
+
+    if (sock->snd_head == sock->snd_send)
+        return;
+
+    if (++sock->retries > (handshake
+                           ? tcp_max_syn_retries
+                           : tcp_max_retries)) {
+        TCP_TRACE("connection timed out\n");
+        sock->err = errno_t::ETIMEDOUT;
+        if (!handshake)
+            tcp_send_ctl(sock, sock->snd_nxt, TCP_FLAGS_RST);
+        tcp_finish(sock);
+        return;
+    }
+
+    uint32_t flight = sock->snd_max - sock->snd_una;
+    sock->ssthresh = std::max(flight / 2, uint32_t(sock->mss) * 2);
+    sock->cwnd = sock->mss;
+    sock->in_recovery = false;
+    sock->dupacks = 0;
+    sock->rto = std::min(sock->rto * 2, tcp_rto_max_ms);
+
+    // Go back to the first unacknowledged segment,
+    // what the peer selectively acknowledged may be lost
+    for (uint32_t i = sock->snd_head; i != sock->snd_tail; ++i)
+        tcp_snd_at(sock, i)->proto_flags &=
+                ~(TCP_PKT_SACKED | TCP_PKT_RETRANS);
+
+    sock->snd_send = sock->snd_head;
+    sock->snd_nxt = sock->snd_una;
+    sock->sack_high = sock->snd_una;
+
+    tcp_output(sock);
+}
+
+//
+// Receiving
+
+static uint32_t tcp_pkt_len(ethq_pkt_t const *pkt)
+{
+    uint32_t len = 0;
+    for (; pkt; pkt = pkt->frag)
+        len += pkt->data_len;
+    return len;
+}
+
+static void tcp_pkt_trim_front(ethq_pkt_t *pkt, uint32_t len)
+{
+    for (; pkt && len; pkt = pkt->frag) {
+        uint32_t chunk = std::min(len, uint32_t(pkt->data_len));
+        pkt->data_ofs += chunk;
+        pkt->data_len -= chunk;
+        len -= chunk;
+    }
+}
+
+static void tcp_pkt_trim_to(ethq_pkt_t *pkt, uint32_t len)
+{
+    for (; pkt; pkt = pkt->frag) {
+        pkt->data_len = std::min(len, uint32_t(pkt->data_len));
+        len -= pkt->data_len;
+    }
+}
+
+static void tcp_rcv_append(tcp_sock_t *sock, ethq_pkt_t *pkt, uint32_t len)
+{
+    pkt->next = nullptr;
+
+    if (sock->rcv_tail)
+        sock->rcv_tail->next = pkt;
+    else
+        sock->rcv_head = pkt;
+
+    sock->rcv_tail = pkt;
+    sock->rcv_bytes += len;
+    sock->rcv_nxt += len;
+}
+
+// Out of order entries keep their length in stamp
+static void tcp_ooo_insert(tcp_sock_t *sock, ethq_pkt_t *pkt, uint32_t len)
+{
+    ethq_pkt_t **link = &sock->ooo_head;
+    uint32_t seq = pkt->seq;
+
+    // Skip entries that end before it starts, trim overlap with the last
+    while (*link && seq_le((*link)->seq + (*link)->stamp, seq))
+        link = &(*link)->next;
+
+    if (*link && seq_lt((*link)->seq, seq)) {
+        uint32_t end = (*link)->seq + (*link)->stamp;
+        if (seq_ge(end, seq + len)) {
+            // Already have all of it
+            ethq_pkt_release(pkt);
+            return;
+        }
+    }
+
+    // Drop entries it covers completely
+    while (*link && seq_ge((*link)->seq, seq) &&
+           seq_le((*link)->seq + (*link)->stamp, seq + len)) {
+        ethq_pkt_t *covered = *link;
+        *link = covered->next;
+        sock->ooo_bytes -= covered->stamp;
+        ethq_pkt_release(covered);
+    }
+
+    pkt->stamp = len;
+    pkt->next = *link;
+    *link = pkt;
+    sock->ooo_bytes += len;
+}
+
+// Move out of order data that became in order
+static void tcp_ooo_drain(tcp_sock_t *sock)
+{
+    while (sock->ooo_head && seq_le(sock->ooo_head->seq, sock->rcv_nxt)) {
+        ethq_pkt_t *pkt = sock->ooo_head;
+        sock->ooo_head = pkt->next;
+
+        uint32_t len = pkt->stamp;
+        sock->ooo_bytes -= len;
+
+        uint32_t dup = sock->rcv_nxt - pkt->seq;
+
+        if (dup >= len) {
+            ethq_pkt_release(pkt);
+            continue;
+        }
+
+        tcp_pkt_trim_front(pkt, dup);
+        pkt->seq = sock->rcv_nxt;
+        tcp_rcv_append(sock, pkt, len - dup);
+    }
+}
+
+static void tcp_data_rcvd(tcp_sock_t *sock, tcp_seg_t& seg)
+{
+    ethq_pkt_t *pkt = seg.pkt;
+    uint32_t seq = seg.seq;
+    uint32_t len = seg.len;
+
+    if (seq_lt(seq, sock->rcv_nxt)) {
+        uint32_t dup = sock->rcv_nxt - seq;
+
+        if (dup >= len) {
+            // Retransmitted, the ACK was probably lost
+            sock->ack_now = true;
+            return;
+        }
+
+        tcp_pkt_trim_front(pkt, dup);
+        seq += dup;
+        len -= dup;
+    }
+
+    // Accept what fits in the advertised window
+    uint32_t limit = std::max(tcp_rcv_space(sock),
+                              sock->rcv_adv - sock->rcv_nxt);
+    uint32_t ofs = seq - sock->rcv_nxt;
+
+    if (ofs >= limit) {
+        sock->ack_now = true;
+        return;
+    }
+
+    if (ofs + len > limit) {
+        len = limit - ofs;
+        tcp_pkt_trim_to(pkt, len);
+    }
+
+    // Queued as it is, the receive path drops its reference
+    ethq_pkt_ref(pkt);
+    pkt->seq = seq;
+
+    if (ofs == 0) {
+        bool filled_hole = sock->ooo_head != nullptr;
+
+        tcp_rcv_append(sock, pkt, len);
+        tcp_ooo_drain(sock);
+
+        if (filled_hole)
+            sock->ack_now = true;
+        else
+            ++sock->ack_pending;
+
+        sock->changed.notify_all();
+    } else {
+        tcp_ooo_insert(sock, pkt, len);
+
+        // Duplicate ACK, with the SACK blocks
+        sock->ack_now = true;
+    }
+}
+
+static void tcp_rtt_sample(tcp_sock_t *sock, uint32_t rtt)
+{
+    // RFC 6298
+    if (!sock->srtt) {
+        sock->srtt = rtt << 3;
+        sock->rttvar = rtt << 1;
+    } else {
+        int32_t delta = int32_t(rtt) - int32_t(sock->srtt >> 3);
+        sock->srtt += delta;
+        if (delta < 0)
+            delta = -delta;
+        sock->rttvar += delta - int32_t(sock->rttvar >> 2);
+    }
+
+    sock->rto = std::max(tcp_rto_min_ms,
+                         std::min(tcp_rto_max_ms,
+                                  (sock->srtt >> 3) + sock->rttvar));
+}
+
+static void tcp_sack_rcvd(tcp_sock_t *sock, tcp_seg_t const& seg)
+{
+    for (size_t b = 0; b < seg.sack_count; ++b) {
+        uint32_t left = seg.sack[b][0];
+        uint32_t right = seg.sack[b][1];
+
+        if (!seq_lt(left, right) || seq_le(right, sock->snd_una) ||
+                seq_gt(right, sock->snd_max))
+            continue;
+
+        for (uint32_t i = sock->snd_head; i != sock->snd_send; ++i) {
+            ethq_pkt_t *pkt = tcp_snd_at(sock, i);
+
+            if (seq_ge(pkt->seq, right))
+                break;
+
+            if (seq_ge(pkt->seq, left) &&
+                    seq_le(pkt->seq + tcp_seg_len(pkt), right))
+                pkt->proto_flags |= TCP_PKT_SACKED;
+        }
+
+        if (seq_gt(right, sock->sack_high))
+            sock->sack_high = right;
+    }
+}
+
+static void tcp_dupack(tcp_sock_t *sock)
+{
+    if (++sock->dupacks == 3 && !sock->in_recovery) {
+        // Fast retransmit, RFC 5681
+        uint32_t flight = sock->snd_max - sock->snd_una;
+        sock->ssthresh = std::max(flight / 2, uint32_t(sock->mss) * 2);
+        sock->cwnd = sock->ssthresh + sock->mss * 3;
+        sock->recover = sock->snd_max;
+        sock->in_recovery = true;
+
+        for (uint32_t i = sock->snd_head; i != sock->snd_send; ++i)
+            tcp_snd_at(sock, i)->proto_flags &= ~TCP_PKT_RETRANS;
+
+        tcp_retransmit_hole(sock);
+    } else if (sock->in_recovery) {
+        sock->cwnd += sock->mss;
+
+        if (sock->sack_ok)
+            tcp_retransmit_hole(sock);
+    }
+}
+
+// Returns false if the ACK acknowledges something never sent
+static bool tcp_ack_rcvd(tcp_sock_t *sock, tcp_seg_t const& seg)
+{
+    uint32_t ack = seg.ack;
+
+    if (seq_gt(ack, sock->snd_max)) {
+        sock->ack_now = true;
+        return false;
+    }
+
+    bool window_changed = false;
+
+    if (seq_lt(sock->snd_wl1, seg.seq) || (sock->snd_wl1 == seg.seq &&
+                                           seq_le(sock->snd_wl2, ack))) {
+        uint32_t window = uint32_t(seg.wnd) << sock->snd_wscale;
+
+        window_changed = window != sock->snd_wnd;
+
+        sock->snd_wnd = window;
+        sock->snd_wl1 = seg.seq;
+        sock->snd_wl2 = ack;
+
+        if (window && sock->persist_due) {
+            sock->persist_due = 0;
+            sock->rto = std::max(tcp_rto_min_ms, (sock->srtt >> 3) +
+                                 sock->rttvar);
+        }
+    }
+
+    if (sock->sack_ok && seg.sack_count)
+        tcp_sack_rcvd(sock, seg);
+
+    if (seq_le(ack, sock->snd_una)) {
+        if (ack == sock->snd_una && !seg.len && !window_changed &&
+                !(seg.flags & (TCP_FLAGS_SYN | TCP_FLAGS_FIN)) &&
+                sock->snd_una != sock->snd_max)
+            tcp_dupack(sock);
+        return true;
+    }
+
+    uint32_t acked = ack - sock->snd_una;
+    uint32_t rtt = 0;
+
+    // Release what is acknowledged, the latest timed one gives the RTT
+    while (sock->snd_head != sock->snd_tail) {
+        ethq_pkt_t *&slot = tcp_snd_at(sock, sock->snd_head);
+        ethq_pkt_t *pkt = slot;
+
+        if (pkt->proto_flags & TCP_PKT_BUSY ||
+                seq_gt(pkt->seq + tcp_seg_len(pkt), ack))
+            break;
+
+        if (pkt->stamp)
+            rtt = tcp_stamp() - pkt->stamp;
+
+        sock->snd_bytes -= pkt->data_len;
+        slot = nullptr;
+        ++sock->snd_head;
+        ethq_pkt_release(pkt);
+    }
+
+    if (int32_t(sock->snd_send - sock->snd_head) < 0)
+        sock->snd_send = sock->snd_head;
+
+    sock->snd_una = ack;
+    if (seq_lt(sock->snd_nxt, ack))
+        sock->snd_nxt = ack;
+
+    if (rtt)
+        tcp_rtt_sample(sock, rtt);
+
+    sock->retries = 0;
+    sock->dupacks = 0;
+
+    if (sock->in_recovery) {
+        if (seq_ge(ack, sock->recover)) {
+            sock->in_recovery = false;
+            sock->cwnd = sock->ssthresh;
+        } else {
+            // Partial ACK, the next hole is lost too
+            sock->cwnd = sock->cwnd > acked
+                    ? sock->cwnd - acked + sock->mss
+                    : sock->mss;
+            tcp_retransmit_hole(sock);
+        }
+    } else if (sock->cwnd < sock->ssthresh) {
+        sock->cwnd += std::min(acked, uint32_t(sock->mss));
+    } else {
+        sock->cwnd += std::max(UINT32_C(1),
+                               uint32_t(sock->mss) * sock->mss /
+                               sock->cwnd);
+    }
+
+    sock->cwnd = std::min(sock->cwnd, tcp_sndbuf * 2);
+
+    sock->rto_due = sock->snd_una != sock->snd_max
+            ? tcp_now_ms() + sock->rto
+            : 0;
+
+    // Space for senders
+    sock->changed.notify_all();
+
+    return true;
+}
+
+//
+// State changes
+
+static void tcp_set_state(tcp_sock_t *sock, tcp_state_t state)
+{
+    TCP_TRACE("%u -> %u\n", unsigned(sock->state), unsigned(state));
+    sock->state = state;
+    sock->changed.notify_all();
+}
+
+static void tcp_enter_time_wait(tcp_sock_t *sock)
+{
+    tcp_set_state(sock, tcp_state_t::TIME_WAIT);
+    sock->rto_due = 0;
+    sock->persist_due = 0;
+    sock->close_due = tcp_now_ms() + tcp_timewait_ms;
+}
+
+// Drop a handshake's claim on its listener. Lock order is
+// connection before listener
+static void tcp_detach_parent(tcp_sock_t *sock)
+{
+    tcp_sock_t *parent = sock->parent;
+
+    if (!parent)
+        return;
+
+    sock->parent = nullptr;
+
+    scoped_lock parent_hold(parent->lock);
+    --parent->pending;
+    parent_hold.unlock();
+
+    tcp_sock_release(parent);
+}
+
+// Called with the socket locked and referenced
+static void tcp_finish(tcp_sock_t *sock)
+{
+    tcp_detach_parent(sock);
+    tcp_unhash(sock);
+    tcp_set_state(sock, tcp_state_t::CLOSED);
+    tcp_purge(sock);
+
+    sock->rto_due = 0;
+    sock->delack_due = 0;
+    sock->persist_due = 0;
+    sock->close_due = 0;
+}
+
+static void tcp_abort(tcp_sock_t *sock, errno_t err)
+{
+    sock->err = err;
+    tcp_finish(sock);
+}
+
+// A handshake completed, queue it on its listener
+static void tcp_established_passive(tcp_sock_t *sock)
+{
+    tcp_sock_t *parent = sock->parent;
+
+    if (!parent)
+        return;
+
+    sock->parent = nullptr;
+
+    scoped_lock parent_hold(parent->lock);
+
+    bool listening = parent->state == tcp_state_t::LISTEN;
+
+    if (listening) {
+        // The accept queue holds a reference
+        tcp_sock_ref(sock);
+        sock->accept_next = nullptr;
+        if (parent->accept_tail)
+            parent->accept_tail->accept_next = sock;
+        else
+            parent->accept_head = sock;
+        parent->accept_tail = sock;
+        parent->changed.notify_all();
+    } else {
+        --parent->pending;
+    }
+
+    parent_hold.unlock();
+
+    tcp_sock_release(parent);
+
+    if (!listening) {
+        tcp_send_ctl(sock, sock->snd_nxt, TCP_FLAGS_RST);
+        tcp_abort(sock, errno_t::ECONNRESET);
+    }
+}
+
+static void tcp_apply_syn_options(tcp_sock_t *sock, tcp_seg_t const& seg)
+{
+    sock->mss = std::min(std::max(seg.mss ? seg.mss : tcp_mss_default,
+                                  tcp_mss_min), tcp_mss_max);
+
+    if (seg.has_wscale) {
+        sock->snd_wscale = std::min(seg.wscale, uint8_t(14));
+        sock->rcv_wscale = tcp_rcv_wscale;
+    } else {
+        sock->snd_wscale = 0;
+        sock->rcv_wscale = 0;
+    }
+
+    sock->sack_ok = seg.sack_ok;
+
+    // RFC 6928 initial window
+    sock->cwnd = std::min(uint32_t(sock->mss) * 10, std::max(
+                              uint32_t(sock->mss) * 2, UINT32_C(14600)));
+}
+
+//
+// Receive batches
+
+void tcp_rx_batch_begin()
+{
+    tcp_ack_batch_t& batch = tcp_ack_batches[thread_cpu_number()];
+    batch.owner = thread_get_id();
+}
+
+void tcp_rx_batch_end()
+{
+    tcp_ack_batch_t& batch = tcp_ack_batches[thread_cpu_number()];
+
+    while (batch.head) {
+        tcp_sock_t *sock = batch.head;
+        batch.head = sock->ack_next;
+        sock->ack_next = nullptr;
+
+        scoped_lock hold(sock->lock);
+        sock->ack_batched = false;
+        if (sock->ack_pending && sock->state != tcp_state_t::CLOSED)
+            tcp_send_ack(sock);
+        hold.unlock();
+
+        tcp_sock_release(sock);
+    }
+
+    batch.owner = 0;
+}
+
+// Defer the ACK to the end of the receive batch
+static bool tcp_ack_batch_add(tcp_sock_t *sock)
+{
+    tcp_ack_batch_t& batch = tcp_ack_batches[thread_cpu_number()];
+
+    if (batch.owner != thread_get_id())
+        return false;
+
+    if (!sock->ack_batched) {
+        tcp_sock_ref(sock);
+        sock->ack_batched = true;
+        sock->ack_next = batch.head;
+        batch.head = sock;
+    }
+
+    return true;
+}
+
+static void tcp_ack_schedule(tcp_sock_t *sock)
+{
+    if (sock->ack_now) {
+        tcp_send_ack(sock);
+    } else if (sock->ack_pending >= 2) {
+        // Every second full segment, once per batch
+        if (!tcp_ack_batch_add(sock))
+            tcp_send_ack(sock);
+    } else if (sock->ack_pending && !sock->delack_due) {
+        sock->delack_due = tcp_now_ms() + tcp_delack_ms;
+    }
+}
+
+//
+// Segment arrival, RFC 793 3.9
+
+static void tcp_input(tcp_sock_t *sock, tcp_seg_t& seg)
+{
+    scoped_lock hold(sock->lock);
+
+    if (sock->state == tcp_state_t::CLOSED) {
+        hold.unlock();
+        tcp_reply_reset(seg);
+        return;
+    }
+
+    if (sock->state == tcp_state_t::SYN_SENT) {
+        bool ack_ok = (seg.flags & TCP_FLAGS_ACK) &&
+                seq_gt(seg.ack, sock->iss) &&
+                seq_le(seg.ack, sock->snd_max);
+
+        if ((seg.flags & TCP_FLAGS_ACK) && !ack_ok) {
+            hold.unlock();
+            tcp_reply_reset(seg);
+            return;
+        }
+
+        if (seg.flags & TCP_FLAGS_RST) {
+            if (ack_ok)
+                tcp_abort(sock, errno_t::ECONNREFUSED);
+            return;
+        }
+
+        // Simultaneous open isn't supported, the peer retries
+        if (!(seg.flags & TCP_FLAGS_SYN) || !ack_ok)
+            return;
+
+        sock->irs = seg.seq;
+        sock->rcv_nxt = seg.seq + 1;
+        sock->rcv_adv = sock->rcv_nxt;
+        tcp_apply_syn_options(sock, seg);
+
+        // The window in a SYN is never scaled
+        sock->snd_wl1 = seg.seq;
+        tcp_ack_rcvd(sock, seg);
+        sock->snd_wnd = seg.wnd;
+
+        tcp_set_state(sock, tcp_state_t::ESTABLISHED);
+        sock->ack_now = true;
+
+        tcp_output(sock);
+        tcp_ack_schedule(sock);
+        tcp_timer_update(sock);
+        return;
+    }
+
+    // Acceptability test
+    uint32_t window = std::max(tcp_rcv_space(sock),
+                               sock->rcv_adv - sock->rcv_nxt);
+    uint32_t seg_end = seg.seq + seg.len;
+    bool acceptable = seg.len
+            ? window && seq_lt(seg.seq, sock->rcv_nxt + window) &&
+              seq_gt(seg_end, sock->rcv_nxt)
+            : seq_ge(seg.seq, sock->rcv_nxt) &&
+              seq_le(seg.seq, sock->rcv_nxt + window);
+
+    if (!acceptable) {
+        if (!(seg.flags & TCP_FLAGS_RST)) {
+            if (sock->state == tcp_state_t::TIME_WAIT)
+                sock->close_due = tcp_now_ms() + tcp_timewait_ms;
+            tcp_send_ack(sock);
+        }
+        return;
+    }
+
+    if (seg.flags & TCP_FLAGS_RST) {
+        // RFC 5961, only an exact match resets
+        if (seg.seq != sock->rcv_nxt) {
+            tcp_send_ack(sock);
+            return;
+        }
+
+        tcp_abort(sock, sock->state == tcp_state_t::CLOSE_WAIT
+                  ? errno_t::EPIPE
+                  : errno_t::ECONNRESET);
+        return;
+    }
+
+    if (seg.flags & TCP_FLAGS_SYN) {
+        // RFC 5961, challenge ACK
+        tcp_send_ack(sock);
+        return;
+    }
+
+    if (!(seg.flags & TCP_FLAGS_ACK))
+        return;
+
+    if (sock->state == tcp_state_t::SYN_RCVD) {
+        if (!seq_gt(seg.ack, sock->snd_una) ||
+                seq_gt(seg.ack, sock->snd_max)) {
+            hold.unlock();
+            tcp_reply_reset(seg);
+            return;
+        }
+
+        tcp_set_state(sock, tcp_state_t::ESTABLISHED);
+        sock->snd_wl1 = seg.seq - 1;
+        tcp_established_passive(sock);
+
+        if (sock->state == tcp_state_t::CLOSED)
+            return;
+    }
+
+    if (!tcp_ack_rcvd(sock, seg)) {
+        tcp_ack_schedule(sock);
+        return;
+    }
+
+    // Our FIN is acknowledged when the ring is empty
+    bool fin_acked = sock->fin_queued && sock->snd_head == sock->snd_tail;
+
+    switch (sock->state) {
+    case tcp_state_t::FIN_WAIT_1:
+        if (fin_acked) {
+            tcp_set_state(sock, tcp_state_t::FIN_WAIT_2);
+            if (sock->orphan)
+                sock->close_due = tcp_now_ms() + tcp_fin_wait_ms;
+        }
+        break;
+
+    case tcp_state_t::CLOSING:
+        if (fin_acked)
+            tcp_enter_time_wait(sock);
+        break;
+
+    case tcp_state_t::LAST_ACK:
+        if (fin_acked) {
+            tcp_finish(sock);
+            return;
+        }
+        break;
+
+    case tcp_state_t::TIME_WAIT:
+        // A retransmitted FIN
+        if (seg.flags & TCP_FLAGS_FIN) {
+            sock->close_due = tcp_now_ms() + tcp_timewait_ms;
+            tcp_send_ack(sock);
+        }
+        return;
+
+    default:
+        break;
+    }
+
+    if (seg.len && tcp_can_recv(sock->state))
+        tcp_data_rcvd(sock, seg);
+
+    // Only an in order FIN is taken, the peer retransmits the others
+    if ((seg.flags & TCP_FLAGS_FIN) && seg_end == sock->rcv_nxt &&
+            !sock->fin_rcvd) {
+        sock->fin_rcvd = true;
+        ++sock->rcv_nxt;
+        sock->ack_now = true;
+
+        switch (sock->state) {
+        case tcp_state_t::ESTABLISHED:
+            tcp_set_state(sock, tcp_state_t::CLOSE_WAIT);
+            break;
+
+        case tcp_state_t::FIN_WAIT_1:
+            if (fin_acked)
+                tcp_enter_time_wait(sock);
+            else
+                tcp_set_state(sock, tcp_state_t::CLOSING);
+            break;
+
+        case tcp_state_t::FIN_WAIT_2:
+            tcp_enter_time_wait(sock);
+            break;
+
+        default:
+            break;
+        }
+
+        sock->changed.notify_all();
+    }
+
+    tcp_output(sock);
+    tcp_ack_schedule(sock);
+    tcp_timer_update(sock);
+}
+
+// A SYN to a listener starts a handshake
+static void tcp_syn_rcvd(tcp_sock_t *listener, tcp_seg_t& seg,
+                         ipv4_addr_pair_t const& pair)
+{
+    scoped_lock hold(listener->lock);
+
+    if (listener->state != tcp_state_t::LISTEN)
+        return;
+
+    // Full, the peer retries the SYN
+    if (listener->pending >= listener->backlog)
+        return;
+
+    tcp_sock_t *sock = new tcp_sock_t();
+
+    if (unlikely(!sock))
+        return;
+
+    sock->path.pair = pair;
+    tcp_path_route(&sock->path, seg.pkt->nic);
+
+    tcp_apply_syn_options(sock, seg);
+
+    sock->irs = seg.seq;
+    sock->rcv_nxt = seg.seq + 1;
+    sock->rcv_adv = sock->rcv_nxt;
+
+    sock->iss = uint32_t(time_ns() >> 12) + uint32_t(tcp_hash(pair));
+    sock->snd_una = sock->iss;
+    sock->snd_nxt = sock->iss;
+    sock->snd_max = sock->iss;
+    sock->snd_end = sock->iss;
+    sock->snd_wnd = seg.wnd;
+    sock->snd_wl1 = seg.seq;
+    sock->snd_wl2 = sock->iss;
+
+    sock->state = tcp_state_t::SYN_RCVD;
+
+    scoped_lock sock_hold(sock->lock);
+
+    if (!tcp_queue_ctl(sock, TCP_PKT_SYN) || !tcp_conn_insert(sock)) {
+        // A duplicate SYN raced with this one
+        sock_hold.unlock();
+        tcp_sock_release(sock);
+        return;
+    }
+
+    tcp_sock_ref(listener);
+    sock->parent = listener;
+    ++listener->pending;
+
+    hold.unlock();
+
+    tcp_output(sock);
+    tcp_timer_update(sock);
+
+    sock_hold.unlock();
+
+    // The table holds it now
+    tcp_sock_release(sock);
+}
+
+static bool tcp_parse_options(tcp_seg_t& seg, uint8_t const *opts,
+                              size_t len)
+{
+    for (size_t i = 0; i < len; ) {
+        uint8_t kind = opts[i];
+
+        if (kind == TCP_OPT_END)
+            break;
+
+        if (kind == TCP_OPT_NOP) {
+            ++i;
+            continue;
+        }
+
+        if (i + 1 >= len || opts[i + 1] < 2 || i + opts[i + 1] > len)
+            return false;
+
+        uint8_t opt_len = opts[i + 1];
+        uint8_t const *data = opts + i + 2;
+
+        switch (kind) {
+        case TCP_OPT_MSS:
+            if (opt_len == 4)
+                seg.mss = (data[0] << 8) | data[1];
+            break;
+
+        case TCP_OPT_WSCALE:
+            if (opt_len == 3) {
+                seg.wscale = data[0];
+                seg.has_wscale = true;
+            }
+            break;
+
+        case TCP_OPT_SACK_PERM:
+            seg.sack_ok = true;
+            break;
+
+        case TCP_OPT_SACK:
+            for (size_t b = 0; b < size_t(opt_len - 2) / 8 &&
+                 seg.sack_count < countof(seg.sack); ++b) {
+                uint32_t edges[2];
+                memcpy(edges, data + b * 8, sizeof(edges));
+                seg.sack[seg.sack_count][0] = ntohl(edges[0]);
+                seg.sack[seg.sack_count][1] = ntohl(edges[1]);
+                ++seg.sack_count;
+            }
+            break;
+        }
+
+        i += opt_len;
+    }
+
+    return true;
+}
 
 void tcp_received_frame(ethq_pkt_t *pkt)
 {
-    (void)pkt;
+    tcp_hdr_t const *hdr = (tcp_hdr_t const *)&pkt->pkt;
+
+    if (unlikely(pkt->size < sizeof(*hdr)))
+        return;
+
+    // No IP options
+    if (unlikely(hdr->ipv4_hdr.ver_ihl != 0x45))
+        return;
+
+    size_t ip_len = ntohs(hdr->ipv4_hdr.len);
+    size_t tcp_len = ip_len - (sizeof(ipv4_hdr_t) -
+                               sizeof(ethernet_hdr_t));
+
+    if (unlikely(ip_len < sizeof(ipv4_hdr_t) - sizeof(ethernet_hdr_t) +
+                 tcp_hdr_size || ip_len + sizeof(ethernet_hdr_t) >
+                 ethq_pkt_total_size(pkt)))
+        return;
+
+    uint16_t flags = ntohs(hdr->flags);
+    size_t doff = (flags >> TCP_FLAGS_DATAOFS_BIT) << 2;
+
+    if (unlikely(doff < tcp_hdr_size || doff > tcp_len ||
+                 sizeof(ethernet_hdr_t) + sizeof(ipv4_hdr_t) -
+                 sizeof(ethernet_hdr_t) + doff > pkt->size))
+        return;
+
+    if (!(pkt->offload & ETHQ_OFFLOAD_CSUM_OK) &&
+            unlikely(!tcp_checksum_ok(pkt, tcp_len))) {
+        TCP_TRACE("bad checksum, dropped\n");
+        return;
+    }
+
+    tcp_seg_t seg;
+    memset(&seg, 0, sizeof(seg));
+    seg.pkt = pkt;
+    seg.seq = ntohl(hdr->seq);
+    seg.ack = ntohl(hdr->ack);
+    seg.wnd = ntohs(hdr->window);
+    seg.flags = flags & 0x1FF;
+    seg.len = tcp_len - doff;
+
+    if (unlikely(!tcp_parse_options(seg, (uint8_t const *)(hdr + 1),
+                                    doff - tcp_hdr_size)))
+        return;
+
+    // Payload in each buffer, without ethernet padding
+    uint32_t remain = seg.len;
+    pkt->data_ofs = offsetof(tcp_hdr_t, s_port) + doff;
+    pkt->data_len = std::min(uint32_t(pkt->size - pkt->data_ofs), remain);
+    remain -= pkt->data_len;
+
+    for (ethq_pkt_t *frag = pkt->frag; frag; frag = frag->frag) {
+        frag->data_ofs = 0;
+        frag->data_len = std::min(uint32_t(frag->size), remain);
+        remain -= frag->data_len;
+    }
+
+    ipv4_addr_pair_t pair;
+    ipv4_ip_get(&pair, &hdr->ipv4_hdr);
+
+    // Local in s, remote in d
+    std::swap(pair.s.ip, pair.d.ip);
+    pair.s.port = ntohs(hdr->d_port);
+    pair.d.port = ntohs(hdr->s_port);
+    pair.s.align = 0;
+    pair.d.align = 0;
+
+    tcp_sock_t *sock = tcp_conn_lookup(pair);
+
+    if (sock) {
+        tcp_input(sock, seg);
+        tcp_sock_release(sock);
+        return;
+    }
+
+    if ((seg.flags & (TCP_FLAGS_SYN | TCP_FLAGS_ACK | TCP_FLAGS_RST)) ==
+            TCP_FLAGS_SYN) {
+        tcp_sock_t *listener = tcp_listener_lookup(pair.s.ip, pair.s.port);
+
+        if (listener) {
+            tcp_syn_rcvd(listener, seg, pair);
+            tcp_sock_release(listener);
+            return;
+        }
+    }
+
+    tcp_reply_reset(seg);
+}
+
+//
+// Connection interface
+
+errno_t tcp_listen(tcp_sock_t **result, ipv4_addr_t const *local,
+                   int backlog)
+{
+    tcp_sock_t *sock = new tcp_sock_t();
+
+    if (unlikely(!sock))
+        return errno_t::ENOMEM;
+
+    sock->path.pair.s = *local;
+    sock->path.pair.s.align = 0;
+    sock->backlog = std::max(1, backlog);
+    sock->state = tcp_state_t::LISTEN;
+
+    if (!tcp_listener_insert(sock)) {
+        tcp_sock_release(sock);
+        return errno_t::EADDRINUSE;
+    }
+
+    *result = sock;
+
+    return errno_t::OK;
+}
+
+errno_t tcp_accept(tcp_sock_t *listener, tcp_sock_t **result,
+                   bool nonblock)
+{
+    scoped_lock hold(listener->lock);
+
+    while (!listener->accept_head) {
+        if (listener->state != tcp_state_t::LISTEN)
+            return errno_t::EINVAL;
+
+        if (nonblock)
+            return errno_t::EAGAIN;
+
+        listener->changed.wait(hold);
+    }
+
+    tcp_sock_t *sock = listener->accept_head;
+    listener->accept_head = sock->accept_next;
+    if (!listener->accept_head)
+        listener->accept_tail = nullptr;
+    sock->accept_next = nullptr;
+    --listener->pending;
+
+    // The accept queue's reference goes to the caller
+    *result = sock;
+
+    return errno_t::OK;
+}
+
+// Pick an unused ephemeral port and insert into the connection table
+static bool tcp_conn_insert_ephemeral(tcp_sock_t *sock)
+{
+    constexpr unsigned range = tcp_ephemeral_max - tcp_ephemeral_min + 1;
+
+    for (unsigned attempt = 0; attempt < range; ++attempt) {
+        unsigned port = atomic_xadd(&tcp_next_ephemeral, 1);
+        sock->path.pair.s.port = tcp_ephemeral_min + port % range;
+
+        if (tcp_conn_insert(sock))
+            return true;
+    }
+
+    return false;
+}
+
+errno_t tcp_connect(tcp_sock_t **result, ipv4_addr_t const *remote,
+                    bool nonblock)
+{
+    ipv4_route_t route;
+
+    if (!ipv4_route_get(&route, remote->ip))
+        return errno_t::ENETUNREACH;
+
+    tcp_sock_t *sock = new tcp_sock_t();
+
+    if (unlikely(!sock))
+        return errno_t::ENOMEM;
+
+    sock->path.nic = route.nic;
+    sock->path.offloads = route.nic->get_offloads();
+    route.nic->get_mac(sock->path.s_mac);
+    sock->path.next_hop = route.next_hop;
+    sock->path.pair.s.ip = route.s_ip;
+    sock->path.pair.d = *remote;
+    sock->path.pair.d.align = 0;
+
+    scoped_lock hold(sock->lock);
+
+    if (!tcp_conn_insert_ephemeral(sock)) {
+        hold.unlock();
+        tcp_sock_release(sock);
+        return errno_t::EADDRINUSE;
+    }
+
+    sock->iss = uint32_t(time_ns() >> 12) +
+            uint32_t(tcp_hash(sock->path.pair));
+    sock->snd_una = sock->iss;
+    sock->snd_nxt = sock->iss;
+    sock->snd_max = sock->iss;
+    sock->snd_end = sock->iss;
+    sock->cwnd = tcp_mss_default;
+    sock->rcv_wscale = tcp_rcv_wscale;
+
+    sock->state = tcp_state_t::SYN_SENT;
+
+    if (!tcp_queue_ctl(sock, TCP_PKT_SYN)) {
+        tcp_finish(sock);
+        hold.unlock();
+        tcp_sock_release(sock);
+        return errno_t::ENOBUFS;
+    }
+
+    tcp_output(sock);
+    tcp_timer_update(sock);
+
+    *result = sock;
+
+    if (nonblock)
+        return errno_t::EINPROGRESS;
+
+    while (sock->state == tcp_state_t::SYN_SENT)
+        sock->changed.wait(hold);
+
+    if (sock->state != tcp_state_t::CLOSED)
+        return errno_t::OK;
+
+    errno_t err = sock->err;
+    hold.unlock();
+
+    tcp_sock_release(sock);
+    *result = nullptr;
+
+    return err;
+}
+
+// Wait for room in the send ring, returns false with err set if
+// sending is no longer possible, or would wait with nonblock
+static bool tcp_wait_send_space(tcp_sock_t *sock, scoped_lock& hold,
+                                bool nonblock, errno_t& err)
+{
+    for (;;) {
+        if (sock->err != errno_t::OK) {
+            err = sock->err;
+            return false;
+        }
+
+        if (sock->fin_queued || (!tcp_can_send(sock->state) &&
+                                 sock->state != tcp_state_t::SYN_SENT &&
+                                 sock->state != tcp_state_t::SYN_RCVD)) {
+            err = errno_t::EPIPE;
+            return false;
+        }
+
+        if (tcp_can_send(sock->state) && sock->snd_bytes < tcp_sndbuf &&
+                sock->snd_tail - sock->snd_head < tcp_snd_ring_size)
+            return true;
+
+        if (nonblock) {
+            err = errno_t::EAGAIN;
+            return false;
+        }
+
+        sock->changed.wait(hold);
+    }
+}
+
+static bool tcp_copy(void *dest, void const *src, size_t size)
+{
+    if (mm_is_user_range(const_cast<void*>(src), size) ||
+            mm_is_user_range(dest, size))
+        return mm_copy_user(dest, src, size);
+
+    memcpy(dest, src, size);
+    return true;
+}
+
+// Copy and sum the copied bytes
+static bool tcp_copy_csum(void *dest, void const *src, size_t size,
+                          uint64_t *sum)
+{
+    if (mm_is_user_range(const_cast<void*>(src), size) ||
+            mm_is_user_range(dest, size))
+        return inet_csum_copy_user(dest, src, size, sum);
+
+    *sum = inet_csum_copy(dest, src, size, *sum);
+    return true;
+}
+
+// Have the connection's segments processed on the user's CPU
+static _always_inline void tcp_flow_record(tcp_sock_t const *sock)
+{
+    // As received, from the remote end
+    rss_flow_record(rss_hash_ipv4_ports(
+                        sock->path.pair.d.ip, sock->path.pair.s.ip,
+                        sock->path.pair.d.port, sock->path.pair.s.port));
+}
+
+ssize_t tcp_send(tcp_sock_t *sock, void const *data, size_t size,
+                 bool nonblock)
+{
+    tcp_flow_record(sock);
+
+    std::unique_lock<std::mutex> send_hold(sock->send_lock);
+
+    char const *src = (char const *)data;
+    size_t sent = 0;
+
+    scoped_lock hold(sock->lock);
+
+    while (sent < size) {
+        errno_t err;
+
+        if (!tcp_wait_send_space(sock, hold, nonblock, err))
+            return sent ? ssize_t(sent) : -int(err);
+
+        // Append to a short segment not sent yet, or start another
+        ethq_pkt_t *pkt = nullptr;
+        bool append = false;
+
+        if (sock->snd_tail != sock->snd_send) {
+            pkt = tcp_snd_at(sock, sock->snd_tail - 1);
+            append = pkt->data_len < sock->mss &&
+                    !(pkt->proto_flags & (TCP_PKT_SYN | TCP_PKT_FIN));
+        }
+
+        uint32_t gen = sock->rcv_gen;
+        uint16_t mss = sock->mss;
+
+        // Without checksum offload, the copy sums the payload
+        bool csum = !(sock->path.offloads & ETH_DEV_OFFLOAD_TX_CSUM);
+
+        if (append) {
+            // Kept out of the output path while it is filled
+            pkt->proto_flags |= TCP_PKT_BUSY;
+            ethq_pkt_ref(pkt);
+        }
+
+        hold.unlock();
+
+        if (!append) {
+            pkt = ethq_pkt_acquire();
+
+            if (unlikely(!pkt))
+                return sent ? ssize_t(sent) : -int(errno_t::ENOBUFS);
+        }
+
+        size_t ofs = pkt->data_len;
+        size_t chunk = std::min(size_t(mss) - ofs, size - sent);
+        uint64_t chunk_sum = 0;
+        bool ok = csum
+                ? tcp_copy_csum((char*)tcp_payload(pkt) + ofs,
+                                src + sent, chunk, &chunk_sum)
+                : tcp_copy((char*)tcp_payload(pkt) + ofs,
+                           src + sent, chunk);
+
+        hold.lock();
+
+        if (append)
+            pkt->proto_flags &= ~TCP_PKT_BUSY;
+
+        // Reset while unlocked, the ring was discarded
+        if (unlikely(gen != sock->rcv_gen)) {
+            ethq_pkt_release(pkt);
+            err = sock->err != errno_t::OK ? sock->err : errno_t::EPIPE;
+            return sent ? ssize_t(sent) : -int(err);
+        }
+
+        if (unlikely(!ok)) {
+            ethq_pkt_release(pkt);
+            tcp_output(sock);
+            return sent ? ssize_t(sent) : -int(errno_t::EFAULT);
+        }
+
+        if (append) {
+            // An appended chunk may start at an odd offset
+            if (csum && (pkt->proto_flags & TCP_PKT_CSUM))
+                pkt->data_csum = inet_csum_fold(inet_csum_block(
+                                     pkt->data_csum, chunk_sum, ofs));
+            else
+                pkt->proto_flags &= ~TCP_PKT_CSUM;
+
+            pkt->data_len += chunk;
+            sock->snd_end += chunk;
+            sock->snd_bytes += chunk;
+            ethq_pkt_release(pkt);
+        } else {
+            if (csum) {
+                pkt->data_csum = inet_csum_fold(chunk_sum);
+                pkt->proto_flags |= TCP_PKT_CSUM;
+            }
+
+            pkt->data_len = chunk;
+            tcp_snd_push(sock, pkt);
+        }
+
+        sent += chunk;
+
+        tcp_output(sock);
+        tcp_timer_update(sock);
+    }
+
+    return ssize_t(sent);
+}
+
+ssize_t tcp_recv(tcp_sock_t *sock, void *data, size_t size, bool nonblock)
+{
+    tcp_flow_record(sock);
+
+    std::unique_lock<std::mutex> recv_hold(sock->recv_lock);
+
+    scoped_lock hold(sock->lock);
+
+    while (!sock->rcv_head) {
+        if (sock->err != errno_t::OK)
+            return -int(sock->err);
+
+        if (sock->fin_rcvd || (!tcp_can_recv(sock->state) &&
+                               sock->state != tcp_state_t::SYN_SENT &&
+                               sock->state != tcp_state_t::SYN_RCVD))
+            return 0;
+
+        if (nonblock)
+            return -int(errno_t::EAGAIN);
+
+        sock->changed.wait(hold);
+
+        // It may have woken up on another CPU
+        tcp_flow_record(sock);
+    }
+
+    // Take the whole queue and copy outside the lock, meanwhile
+    // arriving data starts another queue
+    ethq_pkt_t *pkt = sock->rcv_head;
+    sock->rcv_head = nullptr;
+    sock->rcv_tail = nullptr;
+    uint32_t gen = sock->rcv_gen;
+
+    hold.unlock();
+
+    char *dest = (char*)data;
+    size_t copied = 0;
+    bool ok = true;
+
+    while (pkt && copied < size && ok) {
+        for (ethq_pkt_t *buf = pkt; buf && copied < size; buf = buf->frag) {
+            size_t chunk = std::min(size_t(buf->data_len), size - copied);
+
+            if (!chunk)
+                continue;
+
+            ok = tcp_copy(dest + copied,
+                          (char const *)&buf->pkt + buf->data_ofs, chunk);
+
+            if (unlikely(!ok))
+                break;
+
+            buf->data_ofs += chunk;
+            buf->data_len -= chunk;
+            copied += chunk;
+        }
+
+        if (tcp_pkt_len(pkt))
+            break;
+
+        ethq_pkt_t *next = pkt->next;
+        ethq_pkt_release(pkt);
+        pkt = next;
+    }
+
+    hold.lock();
+
+    if (unlikely(gen != sock->rcv_gen)) {
+        // Reset while unlocked
+        for (ethq_pkt_t *next; pkt; pkt = next) {
+            next = pkt->next;
+            ethq_pkt_release(pkt);
+        }
+    } else if (pkt) {
+        // Put back what is left in front of what arrived meanwhile
+        ethq_pkt_t *last = pkt;
+        while (last->next)
+            last = last->next;
+
+        last->next = sock->rcv_head;
+        if (!sock->rcv_head)
+            sock->rcv_tail = last;
+        sock->rcv_head = pkt;
+    }
+
+    if (gen == sock->rcv_gen) {
+        sock->rcv_bytes -= copied;
+
+        // Tell the peer when the window opened up significantly
+        uint32_t advertised = sock->rcv_adv - sock->rcv_nxt;
+        uint32_t space = tcp_rcv_space(sock);
+        if (tcp_can_recv(sock->state) && space > advertised &&
+                space - advertised >= std::min(tcp_rcvbuf / 2,
+                                               uint32_t(sock->mss) * 2))
+            tcp_send_ack(sock);
+    }
+
+    if (!ok && !copied)
+        return -int(errno_t::EFAULT);
+
+    return ssize_t(copied);
+}
+
+// Called with the socket locked
+static void tcp_queue_fin(tcp_sock_t *sock)
+{
+    if (sock->fin_queued || !tcp_queue_ctl(sock, TCP_PKT_FIN))
+        return;
+
+    sock->fin_queued = true;
+
+    tcp_set_state(sock, sock->state == tcp_state_t::CLOSE_WAIT
+                  ? tcp_state_t::LAST_ACK
+                  : tcp_state_t::FIN_WAIT_1);
+
+    tcp_output(sock);
+    tcp_timer_update(sock);
+}
+
+errno_t tcp_shutdown(tcp_sock_t *sock)
+{
+    std::unique_lock<std::mutex> send_hold(sock->send_lock);
+    scoped_lock hold(sock->lock);
+
+    if (!tcp_can_send(sock->state))
+        return sock->fin_queued ? errno_t::OK : errno_t::ENOTCONN;
+
+    tcp_queue_fin(sock);
+
+    return errno_t::OK;
+}
+
+void tcp_close(tcp_sock_t *sock)
+{
+    scoped_lock hold(sock->lock);
+
+    sock->orphan = true;
+
+    tcp_sock_t *accept_head = nullptr;
+
+    switch (sock->state) {
+    case tcp_state_t::LISTEN:
+        // Connections not accepted yet are reset
+        tcp_unhash(sock);
+        accept_head = sock->accept_head;
+        sock->accept_head = nullptr;
+        sock->accept_tail = nullptr;
+        tcp_set_state(sock, tcp_state_t::CLOSED);
+        break;
+
+    case tcp_state_t::SYN_SENT:
+        tcp_finish(sock);
+        break;
+
+    case tcp_state_t::SYN_RCVD:
+    case tcp_state_t::ESTABLISHED:
+    case tcp_state_t::CLOSE_WAIT:
+        if (sock->rcv_head || sock->ooo_head) {
+            // Unread data, RFC 2525
+            tcp_send_ctl(sock, sock->snd_nxt,
+                         TCP_FLAGS_RST | TCP_FLAGS_ACK);
+            tcp_finish(sock);
+        } else {
+            tcp_queue_fin(sock);
+        }
+        break;
+
+    case tcp_state_t::FIN_WAIT_2:
+        sock->close_due = tcp_now_ms() + tcp_fin_wait_ms;
+        tcp_timer_update(sock);
+        break;
+
+    default:
+        break;
+    }
+
+    hold.unlock();
+
+    while (accept_head) {
+        tcp_sock_t *child = accept_head;
+        accept_head = child->accept_next;
+        child->accept_next = nullptr;
+
+        scoped_lock child_hold(child->lock);
+        tcp_send_ctl(child, child->snd_nxt, TCP_FLAGS_RST | TCP_FLAGS_ACK);
+        tcp_abort(child, errno_t::ECONNRESET);
+        child_hold.unlock();
+
+        tcp_sock_release(child);
+    }
+
+    tcp_sock_release(sock);
+}
+
+void tcp_addr_get(tcp_sock_t const *sock, ipv4_addr_pair_t *pair)
+{
+    *pair = sock->path.pair;
+}
+
+void tcp_set_nodelay(tcp_sock_t *sock, bool nodelay)
+{
+    scoped_lock hold(sock->lock);
+
+    sock->nodelay = nodelay;
+
+    if (nodelay)
+        tcp_output(sock);
 }
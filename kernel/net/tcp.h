@@ -1,6 +1,7 @@
 #pragma once
 #include "eth_q.h"
 #include "ipv4.h"
+#include "errno.h"
 
 struct tcp_hdr_t {
     ipv4_hdr_t ipv4_hdr;
@@ -26,4 +27,69 @@ struct tcp_hdr_t {
 #define TCP_FLAGS_DATAOFS_BIT   12
 #define TCP_FLAGS_DATAOFS_BITS  4
 
+#define TCP_FLAGS_FIN           (1U<<TCP_FLAGS_FIN_BIT)
+#define TCP_FLAGS_SYN           (1U<<TCP_FLAGS_SYN_BIT)
+#define TCP_FLAGS_RST           (1U<<TCP_FLAGS_RST_BIT)
+#define TCP_FLAGS_PSH           (1U<<TCP_FLAGS_PSH_BIT)
+#define TCP_FLAGS_ACK           (1U<<TCP_FLAGS_ACK_BIT)
+
+// Options
+#define TCP_OPT_END             0
+#define TCP_OPT_NOP             1
+#define TCP_OPT_MSS             2
+#define TCP_OPT_WSCALE          3
+#define TCP_OPT_SACK_PERM       4
+#define TCP_OPT_SACK            5
+
 void tcp_received_frame(ethq_pkt_t *pkt);
+
+// Connections
+//
+// Connections are looked up in a table hashed on the address and port
+// pair. Each connection keeps its send and receive data in packet
+// buffers. Sent data is copied once, into the buffers that are
+// transmitted and retransmitted, and received data stays in the
+// buffers it arrived in until tcp_recv copies it out.
+//
+// Addresses are in host byte order. Unless nonblock is set, the calls
+// wait. Sizes are returned as ssize_t, errors as negated errno_t.
+
+struct tcp_sock_t;
+
+// Accept connections to a local address, an ip of 0 accepts them on
+// every address. At most backlog connections wait to be accepted
+errno_t tcp_listen(tcp_sock_t **result, ipv4_addr_t const *local,
+                   int backlog);
+
+errno_t tcp_accept(tcp_sock_t *listener, tcp_sock_t **result,
+                   bool nonblock);
+
+// With nonblock, returns EINPROGRESS and the connection
+// when the handshake was started
+errno_t tcp_connect(tcp_sock_t **result, ipv4_addr_t const *remote,
+                    bool nonblock);
+
+// Data may come from user or kernel memory
+ssize_t tcp_send(tcp_sock_t *sock, void const *data, size_t size,
+                 bool nonblock);
+
+// Returns 0 after the peer closed its side
+ssize_t tcp_recv(tcp_sock_t *sock, void *data, size_t size, bool nonblock);
+
+// Close the sending side
+errno_t tcp_shutdown(tcp_sock_t *sock);
+
+// Release the caller's reference, the connection closes gracefully
+// if it still can, or is reset if received data was left unread
+void tcp_close(tcp_sock_t *sock);
+
+// Local address in s, remote in d
+void tcp_addr_get(tcp_sock_t const *sock, ipv4_addr_pair_t *pair);
+
+// Disable the Nagle algorithm, short segments are sent immediately
+void tcp_set_nodelay(tcp_sock_t *sock, bool nodelay);
+
+// Send ACKs owed by frames processed since the batch began as one
+// ACK per connection, see eth_rx_deliver
+void tcp_rx_batch_begin();
+void tcp_rx_batch_end();
@@ -1,6 +1,7 @@
 #include "tcp_frame.h"
+#include "tcp.h"
 
 void tcp_frame_received(ethq_pkt_t *pkt)
 {
-    (void)pkt;
+    tcp_received_frame(pkt);
 }
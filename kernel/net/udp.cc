@@ -1,41 +1,107 @@
 #include "udp.h"
+#include "arp.h"
+#include "dev_eth.h"
+#include "dev_storage.h"
 #include "bswap.h"
 #include "string.h"
+#include "mutex.h"
+#include "mm.h"
+#include "algorithm.h"
+#include "printk.h"
+#include "inet_csum.h"
+#include "cpu/atomic.h"
 
-uint16_t udp_checksum(udp_hdr_t const *hdr)
-{
-    // Some IPv4 header fields are included in the UDP checksum
-    uint16_t ipv4_fields[6];
+#define UDP_DEBUG   0
+#if UDP_DEBUG
+#define UDP_TRACE(...) printdbg("udp: " __VA_ARGS__)
+#else
+#define UDP_TRACE(...) ((void)0)
+#endif
 
-    // Source and destination IP
-    memcpy(ipv4_fields, hdr->ipv4_hdr.s_ip, 4);
-    memcpy(ipv4_fields+2, hdr->ipv4_hdr.d_ip, 4);
-    ipv4_fields[4] = ntohs(hdr->ipv4_hdr.protocol);
-    memcpy(ipv4_fields + 5, &hdr->len, 2);
+// proto_flags of received datagrams
+#define UDP_PKT_VERIFY  0x01    // udp_recv verifies the checksum
 
-    uint32_t total = 0;
-    for (size_t i = 0; i < 6; ++i) {
-        uint32_t native = ntohs(ipv4_fields[i]);
-        total += native;
-    }
+// Bind table buckets, a power of two
+static constexpr size_t udp_hash_buckets = 256;
 
-    char const *in = (char const *)&hdr->s_port;
-    uint16_t native_udplen = ntohs(hdr->len);
-    for (size_t i = 0, e = native_udplen >> 1; i < e; ++i) {
-        uint16_t tmp;
-        memcpy(&tmp, in + (i*2), sizeof(tmp));
-        uint32_t native = ntohs(tmp);
-        total += native;
-    }
+// Payload bytes queued per socket
+static constexpr uint32_t udp_rcvbuf = 256 << 10;
+
+// Largest datagram that fits in one packet buffer
+static constexpr size_t udp_payload_max = ethq_pkt_capacity -
+        sizeof(uint32_t) - sizeof(udp_hdr_t);
+
+// Ephemeral ports for sockets that send without binding
+static constexpr uint16_t udp_ephemeral_min = 32768;
+static constexpr uint16_t udp_ephemeral_max = 60999;
+
+struct udp_sock_t {
+    using lock_type = std::mcslock;
+    using scoped_lock = std::unique_lock<lock_type>;
+
+    lock_type lock;
+
+    // Waiters for datagrams
+    std::condition_variable changed;
+
+    int refcount;
+
+    ipv4_addr_t local;
+
+    // Connected address, port 0 when not connected
+    ipv4_addr_t remote;
+
+    // Linked into the bind table
+    bool hashed;
+
+    udp_sock_t *hash_next;
 
-    total += total >> 16;
-    total = ~total;
-    total &= 0xFFFF;
+    // Received datagrams, linked through next
+    ethq_pkt_t *rcv_head;
+    ethq_pkt_t *rcv_tail;
+    uint32_t rcv_bytes;
 
-    return total ? htons(total) : 0xFFFF;
+    // Datagrams dropped because the receive buffer was full
+    uint64_t rcv_drops;
+};
+
+struct udp_bucket_t {
+    std::spinlock lock;
+    udp_sock_t *head;
+};
+
+using bucket_lock = std::unique_lock<std::spinlock>;
+
+static udp_bucket_t udp_binds[udp_hash_buckets];
+
+static uint16_t udp_next_ephemeral;
+
+// Sum of the IPv4 header fields included in the UDP checksum
+static uint64_t udp_pseudo_sum(udp_hdr_t const *hdr)
+{
+    uint32_t s_ip;
+    uint32_t d_ip;
+    memcpy(&s_ip, hdr->ipv4_hdr.s_ip, sizeof(s_ip));
+    memcpy(&d_ip, hdr->ipv4_hdr.d_ip, sizeof(d_ip));
+
+    return inet_csum_pseudo(s_ip, d_ip, IPV4_PROTO_UDP, ntohs(hdr->len));
 }
 
-uint16_t udp_finalize(udp_hdr_t *hdr, void const *end)
+// Zero means no checksum, a checksum of zero is sent as all ones
+static _always_inline uint16_t udp_checksum_final(uint64_t sum)
+{
+    uint16_t checksum = uint16_t(~inet_csum_fold(sum));
+    return checksum ? checksum : 0xFFFF;
+}
+
+uint16_t udp_checksum(udp_hdr_t const *hdr)
+{
+    return udp_checksum_final(inet_csum_partial(
+                &hdr->s_port, ntohs(hdr->len), udp_pseudo_sum(hdr)));
+}
+
+// Fill in the lengths, returns the frame size
+static uint16_t udp_set_len(udp_hdr_t *hdr, void const *end)
 {
     ipv4_finalize(&hdr->ipv4_hdr, end);
 
@@ -43,11 +109,19 @@ uint16_t udp_finalize(udp_hdr_t *hdr, void const *end)
     uint16_t udp_size = (char*)end -
             ((char*)&hdr->ipv4_hdr + (hdr->ipv4_hdr.ver_ihl & 0xF) * 4) - 14;
     hdr->len = htons(udp_size);
-    hdr->checksum = udp_checksum(hdr);
 
     return (char*)end - (char*)&hdr->ipv4_hdr.eth_hdr;
 }
 
+uint16_t udp_finalize(udp_hdr_t *hdr, void const *end)
+{
+    uint16_t size = udp_set_len(hdr, end);
+
+    hdr->checksum = udp_checksum(hdr);
+
+    return size;
+}
+
 void udp_port_get(ipv4_addr_pair_t *addr, const udp_hdr_t *hdr)
 {
     memcpy(&addr->s.port, &hdr->s_port, sizeof(addr->s.port));
@@ -63,3 +137,540 @@ void udp_port_set(udp_hdr_t *hdr, ipv4_addr_pair_t const *addr)
     hdr->d_port = htons(hdr->d_port);
     hdr->s_port = htons(hdr->s_port);
 }
+
+static _always_inline size_t udp_port_hash(uint16_t port)
+{
+    return (port * UINT32_C(0x9E3779B1)) >> 16;
+}
+
+static _always_inline udp_bucket_t& udp_bucket(uint16_t port)
+{
+    return udp_binds[udp_port_hash(port) & (udp_hash_buckets - 1)];
+}
+
+static _always_inline void udp_sock_ref(udp_sock_t *sock)
+{
+    atomic_inc(&sock->refcount);
+}
+
+static void udp_purge(udp_sock_t *sock)
+{
+    for (ethq_pkt_t *pkt = sock->rcv_head, *next; pkt; pkt = next) {
+        next = pkt->next;
+        ethq_pkt_release(pkt);
+    }
+
+    sock->rcv_head = nullptr;
+    sock->rcv_tail = nullptr;
+    sock->rcv_bytes = 0;
+}
+
+static void udp_sock_release(udp_sock_t *sock)
+{
+    if (atomic_dec(&sock->refcount) != 0)
+        return;
+
+    assert(!sock->hashed);
+
+    udp_purge(sock);
+    delete sock;
+}
+
+// Called with the socket locked
+static bool udp_bind_insert(udp_sock_t *sock, ipv4_addr_t const& local)
+{
+    udp_bucket_t& bucket = udp_bucket(local.port);
+
+    bucket_lock hold(bucket.lock);
+
+    for (udp_sock_t *it = bucket.head; it; it = it->hash_next) {
+        if (it->local.port == local.port &&
+                (!it->local.ip || !local.ip || it->local.ip == local.ip))
+            return false;
+    }
+
+    sock->local = local;
+    sock->local.align = 0;
+
+    udp_sock_ref(sock);
+    sock->hash_next = bucket.head;
+    bucket.head = sock;
+    sock->hashed = true;
+
+    return true;
+}
+
+// Called with the socket locked
+static errno_t udp_bind_locked(udp_sock_t *sock, ipv4_addr_t const& local)
+{
+    if (sock->hashed)
+        return errno_t::EINVAL;
+
+    if (local.port)
+        return udp_bind_insert(sock, local)
+                ? errno_t::OK
+                : errno_t::EADDRINUSE;
+
+    constexpr unsigned range = udp_ephemeral_max - udp_ephemeral_min + 1;
+
+    ipv4_addr_t candidate = local;
+
+    for (unsigned attempt = 0; attempt < range; ++attempt) {
+        unsigned port = atomic_xadd(&udp_next_ephemeral, 1);
+        candidate.port = udp_ephemeral_min + port % range;
+
+        if (udp_bind_insert(sock, candidate))
+            return errno_t::OK;
+    }
+
+    return errno_t::EADDRINUSE;
+}
+
+static void udp_unhash(udp_sock_t *sock)
+{
+    if (!sock->hashed)
+        return;
+
+    udp_bucket_t& bucket = udp_bucket(sock->local.port);
+
+    bucket_lock hold(bucket.lock);
+
+    udp_sock_t **link = &bucket.head;
+    while (*link && *link != sock)
+        link = &(*link)->hash_next;
+
+    assert(*link == sock);
+    *link = sock->hash_next;
+    sock->hash_next = nullptr;
+    sock->hashed = false;
+
+    hold.unlock();
+
+    atomic_dec(&sock->refcount);
+}
+
+// Prefers a socket bound to the exact address over one bound to every
+// address, skips connected sockets connected somewhere else
+static udp_sock_t *udp_lookup(ipv4_addr_pair_t const& pair)
+{
+    udp_bucket_t& bucket = udp_bucket(pair.s.port);
+
+    bucket_lock hold(bucket.lock);
+
+    udp_sock_t *match = nullptr;
+
+    for (udp_sock_t *it = bucket.head; it; it = it->hash_next) {
+        if (it->local.port != pair.s.port)
+            continue;
+
+        if (it->remote.port && (it->remote.port != pair.d.port ||
+                                it->remote.ip != pair.d.ip))
+            continue;
+
+        if (it->local.ip == pair.s.ip) {
+            match = it;
+            break;
+        }
+
+        if (!it->local.ip)
+            match = it;
+    }
+
+    if (match)
+        udp_sock_ref(match);
+
+    return match;
+}
+
+void udp_received_frame(ethq_pkt_t *pkt)
+{
+    udp_hdr_t *hdr = (udp_hdr_t*)&pkt->pkt;
+
+    if (unlikely(pkt->size < sizeof(*hdr)))
+        return;
+
+    // No IP options
+    if (unlikely(hdr->ipv4_hdr.ver_ihl != 0x45))
+        return;
+
+    size_t ip_len = ntohs(hdr->ipv4_hdr.len);
+    size_t udp_len = ntohs(hdr->len);
+    size_t ip_hdr_len = sizeof(ipv4_hdr_t) - sizeof(ethernet_hdr_t);
+
+    if (unlikely(udp_len < sizeof(*hdr) - sizeof(ipv4_hdr_t) ||
+                 ip_len < ip_hdr_len + udp_len ||
+                 ip_len + sizeof(ethernet_hdr_t) >
+                 ethq_pkt_total_size(pkt)))
+        return;
+
+    pkt->proto_flags = 0;
+
+    if (hdr->checksum && !(pkt->offload & ETHQ_OFFLOAD_CSUM_OK)) {
+        // Frag chains only come from NICs that verify checksums
+        if (unlikely(pkt->frag))
+            return;
+
+        // Verified while udp_recv copies it out
+        pkt->proto_flags = UDP_PKT_VERIFY;
+    }
+
+    // Payload in each buffer, without ethernet padding
+    uint32_t remain = udp_len - (sizeof(*hdr) - sizeof(ipv4_hdr_t));
+    uint32_t payload_len = remain;
+    pkt->data_ofs = sizeof(*hdr);
+    pkt->data_len = std::min(uint32_t(pkt->size - pkt->data_ofs), remain);
+    remain -= pkt->data_len;
+
+    for (ethq_pkt_t *frag = pkt->frag; frag; frag = frag->frag) {
+        frag->data_ofs = 0;
+        frag->data_len = std::min(uint32_t(frag->size), remain);
+        remain -= frag->data_len;
+    }
+
+    ipv4_addr_pair_t pair;
+    ipv4_ip_get(&pair, &hdr->ipv4_hdr);
+    udp_port_get(&pair, hdr);
+
+    // Local in s, remote in d
+    std::swap(pair.s, pair.d);
+    pair.s.align = 0;
+    pair.d.align = 0;
+
+    udp_sock_t *sock = udp_lookup(pair);
+
+    if (!sock)
+        return;
+
+    udp_sock_t::scoped_lock hold(sock->lock);
+
+    if (likely(sock->hashed &&
+               sock->rcv_bytes + payload_len <= udp_rcvbuf)) {
+        // Queued as it is, the receive path drops its reference
+        ethq_pkt_ref(pkt);
+        pkt->next = nullptr;
+        pkt->stamp = payload_len;
+
+        if (sock->rcv_tail)
+            sock->rcv_tail->next = pkt;
+        else
+            sock->rcv_head = pkt;
+        sock->rcv_tail = pkt;
+        sock->rcv_bytes += payload_len;
+
+        sock->changed.notify_one();
+    } else {
+        ++sock->rcv_drops;
+    }
+
+    hold.unlock();
+
+    udp_sock_release(sock);
+}
+
+errno_t udp_open(udp_sock_t **result)
+{
+    udp_sock_t *sock = new udp_sock_t();
+
+    if (unlikely(!sock))
+        return errno_t::ENOMEM;
+
+    sock->refcount = 1;
+    sock->local = {};
+    sock->remote = {};
+    sock->hashed = false;
+    sock->hash_next = nullptr;
+    sock->rcv_head = nullptr;
+    sock->rcv_tail = nullptr;
+    sock->rcv_bytes = 0;
+    sock->rcv_drops = 0;
+
+    *result = sock;
+
+    return errno_t::OK;
+}
+
+errno_t udp_bind(udp_sock_t *sock, ipv4_addr_t const *local)
+{
+    udp_sock_t::scoped_lock hold(sock->lock);
+
+    if (local->ip && local->ip != IPV4_ADDR32(255U, 255U, 255U, 255U) &&
+            !ipv4_addr_is_local(local->ip))
+        return errno_t::EADDRNOTAVAIL;
+
+    return udp_bind_locked(sock, *local);
+}
+
+errno_t udp_connect(udp_sock_t *sock, ipv4_addr_t const *remote)
+{
+    udp_sock_t::scoped_lock hold(sock->lock);
+
+    if (!sock->hashed) {
+        errno_t err = udp_bind_locked(sock, ipv4_addr_t{});
+
+        if (unlikely(err != errno_t::OK))
+            return err;
+    }
+
+    sock->remote = *remote;
+    sock->remote.align = 0;
+
+    return errno_t::OK;
+}
+
+ssize_t udp_send(udp_sock_t *sock, fs_iovec_t const *iov, size_t iovcnt,
+                 ipv4_addr_t const *to)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < iovcnt; ++i)
+        size += iov[i].iov_len;
+
+    if (unlikely(size > udp_payload_max))
+        return -int(errno_t::EMSGSIZE);
+
+    udp_sock_t::scoped_lock hold(sock->lock);
+
+    if (!to) {
+        if (unlikely(!sock->remote.port))
+            return -int(errno_t::EDESTADDRREQ);
+
+        to = &sock->remote;
+    }
+
+    if (unlikely(!sock->hashed)) {
+        errno_t err = udp_bind_locked(sock, ipv4_addr_t{});
+
+        if (unlikely(err != errno_t::OK))
+            return -int(err);
+    }
+
+    ipv4_addr_pair_t pair;
+    pair.s = sock->local;
+    pair.d = *to;
+
+    hold.unlock();
+
+    ipv4_route_t route;
+
+    if (unlikely(!ipv4_route_get(&route, pair.d.ip)))
+        return -int(errno_t::ENETUNREACH);
+
+    if (!pair.s.ip || pair.s.ip == IPV4_ADDR32(255U, 255U, 255U, 255U))
+        pair.s.ip = route.s_ip;
+
+    ethq_pkt_t *pkt = ethq_pkt_acquire();
+
+    if (unlikely(!pkt))
+        return -int(errno_t::ENOBUFS);
+
+    udp_hdr_t *hdr = (udp_hdr_t*)&pkt->pkt;
+    char *payload = (char*)(hdr + 1);
+
+    // Without checksum offload, sum the payload while copying it
+    bool tx_csum = route.nic->get_offloads() & ETH_DEV_OFFLOAD_TX_CSUM;
+    uint64_t payload_sum = 0;
+
+    for (size_t i = 0, ofs = 0; i < iovcnt; ofs += iov[i++].iov_len) {
+        bool ok;
+
+        if (tx_csum) {
+            ok = mm_copy_user(payload + ofs, iov[i].iov_base,
+                              iov[i].iov_len);
+        } else {
+            uint64_t part = 0;
+            ok = inet_csum_copy_user(payload + ofs, iov[i].iov_base,
+                                     iov[i].iov_len, &part);
+            payload_sum = inet_csum_block(payload_sum, part, ofs);
+        }
+
+        if (unlikely(!ok)) {
+            ethq_pkt_release(pkt);
+            return -int(errno_t::EFAULT);
+        }
+    }
+
+    route.nic->get_mac(hdr->ipv4_hdr.eth_hdr.s_mac);
+    hdr->ipv4_hdr.eth_hdr.len_ethertype = htons(ETHERTYPE_IPv4);
+
+    uint32_t s_ip = htonl(pair.s.ip);
+    uint32_t d_ip = htonl(pair.d.ip);
+
+    hdr->ipv4_hdr.ver_ihl = 0x45;
+    hdr->ipv4_hdr.dscp_ecn = 0;
+    hdr->ipv4_hdr.id = 0;
+    // Don't fragment
+    hdr->ipv4_hdr.flags_fragofs = htons(0x4000);
+    hdr->ipv4_hdr.ttl = 64;
+    hdr->ipv4_hdr.protocol = IPV4_PROTO_UDP;
+    hdr->ipv4_hdr.hdr_checksum = 0;
+    memcpy(hdr->ipv4_hdr.s_ip, &s_ip, sizeof(s_ip));
+    memcpy(hdr->ipv4_hdr.d_ip, &d_ip, sizeof(d_ip));
+
+    udp_port_set(hdr, &pair);
+    hdr->checksum = 0;
+
+    pkt->size = udp_set_len(hdr, payload + size);
+
+    if (tx_csum) {
+        // The NIC adds the datagram to the pseudo header sum
+        pkt->offload = ETHQ_OFFLOAD_CSUM;
+        pkt->csum_start = offsetof(udp_hdr_t, s_port);
+        pkt->csum_offset = offsetof(udp_hdr_t, checksum) -
+                offsetof(udp_hdr_t, s_port);
+        hdr->checksum = inet_csum_fold(udp_pseudo_sum(hdr));
+    } else {
+        // The payload was summed by the copy, add the UDP header
+        uint64_t sum = inet_csum_partial(&hdr->s_port,
+                                         sizeof(*hdr) - sizeof(ipv4_hdr_t),
+                                         udp_pseudo_sum(hdr));
+        hdr->checksum = udp_checksum_final(inet_csum_add(sum, payload_sum));
+    }
+
+    // The MAC is filled in when the next hop is resolved. A full
+    // transmit backlog drops it, tell the sender to back off
+    if (unlikely(!arp_send(route.nic, pair.s.ip, route.next_hop, pkt)))
+        return -int(errno_t::ENOBUFS);
+
+    return ssize_t(size);
+}
+
+// Copies a dequeued datagram out, verifying its checksum in the same
+// pass if the receive path left that to the copy
+static ssize_t udp_recv_pkt(ethq_pkt_t const *pkt,
+                            fs_iovec_t const *iov, size_t iovcnt,
+                            ipv4_addr_t *from, bool *truncated)
+{
+    bool verify = pkt->proto_flags & UDP_PKT_VERIFY;
+    uint64_t sum = 0;
+
+    if (from) {
+        udp_hdr_t const *hdr = (udp_hdr_t const *)&pkt->pkt;
+        ipv4_addr_pair_t pair;
+        ipv4_ip_get(&pair, &hdr->ipv4_hdr);
+        udp_port_get(&pair, hdr);
+        *from = pair.s;
+        from->align = 0;
+    }
+
+    // Gather the frag chain into the vector
+    ethq_pkt_t const *buf = pkt;
+    size_t buf_ofs = 0;
+    size_t copied = 0;
+    bool ok = true;
+
+    for (size_t i = 0; i < iovcnt && buf && ok; ++i) {
+        size_t seg_ofs = 0;
+
+        while (seg_ofs < iov[i].iov_len && buf) {
+            size_t chunk = std::min(iov[i].iov_len - seg_ofs,
+                                    size_t(buf->data_len) - buf_ofs);
+
+            char *dest = (char*)iov[i].iov_base + seg_ofs;
+            char const *src = (char const *)&buf->pkt +
+                    buf->data_ofs + buf_ofs;
+
+            if (verify) {
+                uint64_t part = 0;
+                ok = inet_csum_copy_user(dest, src, chunk, &part);
+                sum = inet_csum_block(sum, part, copied);
+            } else {
+                ok = mm_copy_user(dest, src, chunk);
+            }
+
+            if (unlikely(!ok))
+                break;
+
+            seg_ofs += chunk;
+            buf_ofs += chunk;
+            copied += chunk;
+
+            if (buf_ofs == buf->data_len) {
+                buf = buf->frag;
+                buf_ofs = 0;
+            }
+        }
+    }
+
+    if (unlikely(!ok))
+        return -int(errno_t::EFAULT);
+
+    if (verify) {
+        // Verified datagrams are never frag chains
+        udp_hdr_t const *hdr = (udp_hdr_t const *)&pkt->pkt;
+        char const *payload = (char const *)&pkt->pkt + pkt->data_ofs;
+
+        // Sum what did not fit
+        if (copied < pkt->stamp)
+            sum = inet_csum_block(sum, inet_csum_partial(
+                                      payload + copied,
+                                      pkt->stamp - copied, 0), copied);
+
+        sum = inet_csum_add(sum, inet_csum_partial(
+                                &hdr->s_port,
+                                sizeof(*hdr) - sizeof(ipv4_hdr_t),
+                                udp_pseudo_sum(hdr)));
+
+        if (unlikely(inet_csum_fold(sum) != 0xFFFF))
+            return -int(errno_t::EBADMSG);
+    }
+
+    if (truncated)
+        *truncated = copied < pkt->stamp;
+
+    return ssize_t(copied);
+}
+
+ssize_t udp_recv(udp_sock_t *sock, fs_iovec_t const *iov, size_t iovcnt,
+                 ipv4_addr_t *from, bool *truncated, bool nonblock)
+{
+    udp_sock_t::scoped_lock hold(sock->lock);
+
+    for (;;) {
+        while (!sock->rcv_head) {
+            if (nonblock)
+                return -int(errno_t::EAGAIN);
+
+            sock->changed.wait(hold);
+        }
+
+        ethq_pkt_t *pkt = sock->rcv_head;
+        sock->rcv_head = pkt->next;
+        if (!sock->rcv_head)
+            sock->rcv_tail = nullptr;
+        sock->rcv_bytes -= pkt->stamp;
+        pkt->next = nullptr;
+
+        hold.unlock();
+
+        ssize_t result = udp_recv_pkt(pkt, iov, iovcnt, from, truncated);
+
+        ethq_pkt_release(pkt);
+
+        if (likely(result != -int(errno_t::EBADMSG)))
+            return result;
+
+        // Bad checksum, try the next datagram
+        UDP_TRACE("bad checksum, dropped\n");
+
+        hold.lock();
+
+        ++sock->rcv_drops;
+    }
+}
+
+void udp_close(udp_sock_t *sock)
+{
+    udp_sock_t::scoped_lock hold(sock->lock);
+
+    udp_unhash(sock);
+    udp_purge(sock);
+
+    hold.unlock();
+
+    udp_sock_release(sock);
+}
+
+void udp_addr_get(udp_sock_t const *sock, ipv4_addr_pair_t *pair)
+{
+    pair->s = sock->local;
+    pair->d = sock->remote;
+}
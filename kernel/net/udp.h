@@ -1,5 +1,7 @@
 #pragma once
 #include "ipv4.h"
+#include "eth_q.h"
+#include "errno.h"
 
 struct udp_hdr_t {
     ipv4_hdr_t ipv4_hdr;
@@ -15,3 +17,40 @@ uint16_t udp_finalize(udp_hdr_t *hdr, void const *end);
 
 void udp_port_get(ipv4_addr_pair_t *addr, udp_hdr_t const *hdr);
 void udp_port_set(udp_hdr_t *hdr, ipv4_addr_pair_t const *addr);
+
+void udp_received_frame(ethq_pkt_t *pkt);
+
+// Sockets
+//
+// Sockets are found by local port. Received datagrams stay in the
+// buffers they arrived in until udp_recv copies them out, datagrams
+// arriving while the receive buffer is full are dropped.
+//
+// Addresses are in host byte order. Data may be in user or kernel
+// memory. Sizes are returned as ssize_t, errors as negated errno_t.
+
+struct fs_iovec_t;
+struct udp_sock_t;
+
+errno_t udp_open(udp_sock_t **result);
+
+// A port of 0 picks an unused one
+errno_t udp_bind(udp_sock_t *sock, ipv4_addr_t const *local);
+
+// Set the default destination, and only accept datagrams from it
+errno_t udp_connect(udp_sock_t *sock, ipv4_addr_t const *remote);
+
+// Send one datagram, to the connected address if to is null.
+// Binds to an unused port if the socket is not bound yet
+ssize_t udp_send(udp_sock_t *sock, fs_iovec_t const *iov, size_t iovcnt,
+                 ipv4_addr_t const *to);
+
+// Receive one datagram, the part that doesn't fit in iov is discarded
+// and sets truncated. Waits for one unless nonblock is set
+ssize_t udp_recv(udp_sock_t *sock, fs_iovec_t const *iov, size_t iovcnt,
+                 ipv4_addr_t *from, bool *truncated, bool nonblock);
+
+void udp_close(udp_sock_t *sock);
+
+// Local address in s, connected address in d
+void udp_addr_get(udp_sock_t const *sock, ipv4_addr_pair_t *pair);
@@ -6,6 +6,8 @@
 #include "../libc/include/sys/ioctl.h"
 #include "mm.h"
 #include "unique_ptr.h"
+#include "dev_storage.h"
+#include "stdlib.h"
 
 // Validate the errno and return its negated integer value
 static int err(errno_t errno)
@@ -72,7 +74,7 @@ int sys_close(int fd)
 {
     process_t *p = fast_cur_process();
 
-    int id = p->fd_to_id(fd);
+    int id = p->ids.remove(fd);
 
     if (unlikely(id < 0))
         return badf_err();
@@ -117,6 +119,140 @@ ssize_t sys_pwrite64(int fd, void const *bufaddr,
     return err(sz);
 }
 
+ssize_t sys_readv(int fd, void const *iov, int iovcnt)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    fs_iovec_t fast_iov[iov_fast_max];
+    ext::unique_ptr_free<fs_iovec_t> slow_iov;
+    fs_iovec_t const *kiov;
+
+    ssize_t len = import_iov(fast_iov, slow_iov, kiov, iov, iovcnt);
+    if (unlikely(len < 0))
+        return len;
+
+    ssize_t sz = file_readv(id, kiov, iovcnt);
+    if (likely(sz >= 0))
+        return sz;
+
+    return err(sz);
+}
+
+ssize_t sys_writev(int fd, void const *iov, int iovcnt)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    fs_iovec_t fast_iov[iov_fast_max];
+    ext::unique_ptr_free<fs_iovec_t> slow_iov;
+    fs_iovec_t const *kiov;
+
+    ssize_t len = import_iov(fast_iov, slow_iov, kiov, iov, iovcnt);
+    if (unlikely(len < 0))
+        return len;
+
+    ssize_t sz = file_writev(id, kiov, iovcnt);
+    if (likely(sz >= 0))
+        return sz;
+
+    return err(sz);
+}
+
+ssize_t sys_preadv(int fd, void const *iov, int iovcnt, off_t ofs)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    if (unlikely(ofs < 0))
+        return err(errno_t::EINVAL);
+
+    fs_iovec_t fast_iov[iov_fast_max];
+    ext::unique_ptr_free<fs_iovec_t> slow_iov;
+    fs_iovec_t const *kiov;
+
+    ssize_t len = import_iov(fast_iov, slow_iov, kiov, iov, iovcnt);
+    if (unlikely(len < 0))
+        return len;
+
+    ssize_t sz = file_preadv(id, kiov, iovcnt, ofs);
+    if (likely(sz >= 0))
+        return sz;
+
+    return err(sz);
+}
+
+ssize_t sys_pwritev(int fd, void const *iov, int iovcnt, off_t ofs)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    if (unlikely(ofs < 0))
+        return err(errno_t::EINVAL);
+
+    fs_iovec_t fast_iov[iov_fast_max];
+    ext::unique_ptr_free<fs_iovec_t> slow_iov;
+    fs_iovec_t const *kiov;
+
+    ssize_t len = import_iov(fast_iov, slow_iov, kiov, iov, iovcnt);
+    if (unlikely(len < 0))
+        return len;
+
+    ssize_t sz = file_pwritev(id, kiov, iovcnt, ofs);
+    if (likely(sz >= 0))
+        return sz;
+
+    return err(sz);
+}
+
+ssize_t sys_sendfile(int out_fd, int in_fd, off_t *ofs, size_t count)
+{
+    process_t *p = fast_cur_process();
+
+    int in_id = p->fd_to_id(in_fd);
+    int out_id = p->fd_to_id(out_fd);
+
+    if (unlikely(in_id < 0 || out_id < 0))
+        return badf_err();
+
+    off_t kofs = 0;
+
+    if (ofs) {
+        if (unlikely(!mm_copy_user(&kofs, ofs, sizeof(kofs))))
+            return err(errno_t::EFAULT);
+
+        if (unlikely(kofs < 0))
+            return err(errno_t::EINVAL);
+    }
+
+    ssize_t sz = file_copy_range(in_id, ofs ? &kofs : nullptr,
+                                 out_id, nullptr, count);
+
+    if (unlikely(sz < 0))
+        return err(sz);
+
+    if (ofs && unlikely(!mm_copy_user(ofs, &kofs, sizeof(kofs))))
+        return err(errno_t::EFAULT);
+
+    return sz;
+}
+
 off_t sys_lseek(int fd, off_t ofs, int whence)
 {
     process_t *p = fast_cur_process();
@@ -250,11 +386,15 @@ int sys_dup3(int oldfd, int newfd, int flags)
 
     int id = p->fd_to_id(oldfd);
 
-    int newid = p->fd_to_id(newfd);
+    if (unlikely(newfd < 0 || newfd >= fd_table_t::max_file))
+        return badf_err();
+
+    int newid = p->ids.remove(newfd);
 
     if (newid >= 0)
         file_close(newid);
-    else if (!p->ids.desc_alloc.take(newfd))
+
+    if (!p->ids.desc_alloc.take(newfd))
         return err(errno_t::EMFILE);
 
 
@@ -12,6 +12,11 @@ ssize_t sys_pread64(int fd, void *bufaddr,
                     size_t count, off_t ofs);
 ssize_t sys_pwrite64(int fd, void const *bufaddr,
                      size_t count, off_t ofs);
+ssize_t sys_readv(int fd, void const *iov, int iovcnt);
+ssize_t sys_writev(int fd, void const *iov, int iovcnt);
+ssize_t sys_preadv(int fd, void const *iov, int iovcnt, off_t ofs);
+ssize_t sys_pwritev(int fd, void const *iov, int iovcnt, off_t ofs);
+ssize_t sys_sendfile(int out_fd, int in_fd, off_t *ofs, size_t count);
 int sys_fsync(int fd);
 int sys_fdatasync(int fd);
 int sys_dup(int oldfd);
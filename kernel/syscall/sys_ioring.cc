@@ -0,0 +1,22 @@
+#include "sys_ioring.h"
+#include "ioring.h"
+
+int sys_io_ring_setup(unsigned entries, void *ring)
+{
+    return ioring_setup(entries, ring);
+}
+
+int sys_io_ring_destroy(int ring_id)
+{
+    return ioring_destroy(ring_id);
+}
+
+int sys_io_ring_wait(int ring_id, unsigned min_complete)
+{
+    return ioring_enter(ring_id, 0, min_complete);
+}
+
+int sys_io_ring_enter(int ring_id, unsigned to_submit, unsigned min_complete)
+{
+    return ioring_enter(ring_id, to_submit, min_complete);
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "types.h"
+
+__BEGIN_DECLS
+
+int sys_io_ring_setup(unsigned entries, void *ring);
+int sys_io_ring_destroy(int ring_id);
+int sys_io_ring_wait(int ring_id, unsigned min_complete);
+int sys_io_ring_enter(int ring_id, unsigned to_submit, unsigned min_complete);
+
+__END_DECLS
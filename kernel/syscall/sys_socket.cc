@@ -0,0 +1,666 @@
+#include "sys_socket.h"
+#include "process.h"
+#include "fileio.h"
+#include "syscall_helper.h"
+#include "socket.h"
+#include "dev_storage.h"
+#include "mm.h"
+#include "bswap.h"
+#include "string.h"
+#include "unique_ptr.h"
+#include "../libc/include/sys/socket.h"
+#include "../libc/include/netinet/in.h"
+
+// Messages of a sendmmsg or recvmmsg batch handled at a time, and the
+// vector entries they share. Sized for the syscall stack
+static constexpr size_t sock_batch_max = 8;
+static constexpr size_t sock_batch_iov = 32;
+
+// Validate the errno and return its negated integer value
+static int err(errno_t errno)
+{
+    assert(int(errno) > int(errno_t::OK) &&
+           int(errno) < int(errno_t::MAX_ERRNO));
+    return -int(errno);
+}
+
+static int err(int negerr)
+{
+    assert(negerr < 0 && -negerr < int(errno_t::MAX_ERRNO));
+    return negerr;
+}
+
+static int badf_err()
+{
+    return err(errno_t::EBADF);
+}
+
+static int sock_import_addr(ipv4_addr_t *addr, void const *user_addr,
+                            socklen_t len)
+{
+    sockaddr_in sin;
+
+    if (unlikely(len < sizeof(sin)))
+        return err(errno_t::EINVAL);
+
+    if (unlikely(!mm_is_user_range((void*)user_addr, sizeof(sin)) ||
+                 !mm_copy_user(&sin, user_addr, sizeof(sin))))
+        return err(errno_t::EFAULT);
+
+    if (unlikely(sin.sin_family != AF_INET))
+        return err(errno_t::EAFNOSUPPORT);
+
+    addr->ip = ntohl(sin.sin_addr.s_addr);
+    addr->port = ntohs(sin.sin_port);
+    addr->align = 0;
+
+    return 0;
+}
+
+// Store as much of the address as fits,
+// and the size of the whole address
+static int sock_export_addr(void *user_addr, socklen_t *user_len,
+                            ipv4_addr_t const& addr)
+{
+    socklen_t len;
+
+    if (unlikely(!mm_is_user_range(user_len, sizeof(*user_len)) ||
+                 !mm_copy_user(&len, user_len, sizeof(len))))
+        return err(errno_t::EFAULT);
+
+    sockaddr_in sin{};
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(addr.port);
+    sin.sin_addr.s_addr = htonl(addr.ip);
+
+    len = std::min(len, socklen_t(sizeof(sin)));
+
+    if (unlikely(!mm_is_user_range(user_addr, len) ||
+                 !mm_copy_user(user_addr, &sin, len)))
+        return err(errno_t::EFAULT);
+
+    len = sizeof(sin);
+
+    if (unlikely(!mm_copy_user(user_len, &len, sizeof(len))))
+        return err(errno_t::EFAULT);
+
+    return 0;
+}
+
+// Give an open file a descriptor, it is closed if there are none left
+static int sock_install(int id, int flags)
+{
+    process_t *p = fast_cur_process();
+
+    int fd = p->ids.desc_alloc.alloc();
+
+    if (unlikely(fd < 0)) {
+        file_close(id);
+        return err(errno_t::EMFILE);
+    }
+
+    p->ids.ids[fd].set(id, (flags & SOCK_CLOEXEC) != 0);
+
+    return fd;
+}
+
+int sys_socket(int domain, int type, int protocol)
+{
+    int id = sock_create(domain, type, protocol);
+
+    if (unlikely(id < 0))
+        return err(id);
+
+    return sock_install(id, type);
+}
+
+int sys_bind(int fd, void const *addr, socklen_t addrlen)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    ipv4_addr_t kaddr;
+    int status = sock_import_addr(&kaddr, addr, addrlen);
+
+    if (likely(status == 0))
+        status = sock_bind(id, &kaddr);
+
+    return status;
+}
+
+int sys_listen(int fd, int backlog)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    return sock_listen(id, backlog);
+}
+
+int sys_accept4(int fd, void *addr, socklen_t *addrlen, int flags)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    if (unlikely(flags & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)))
+        return err(errno_t::EINVAL);
+
+    ipv4_addr_t peer;
+    int conn_id = sock_accept(id, &peer, flags);
+
+    if (unlikely(conn_id < 0))
+        return err(conn_id);
+
+    if (addr) {
+        int status = sock_export_addr(addr, addrlen, peer);
+
+        if (unlikely(status < 0)) {
+            file_close(conn_id);
+            return status;
+        }
+    }
+
+    return sock_install(conn_id, flags);
+}
+
+int sys_accept(int fd, void *addr, socklen_t *addrlen)
+{
+    return sys_accept4(fd, addr, addrlen, 0);
+}
+
+int sys_connect(int fd, void const *addr, socklen_t addrlen)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    ipv4_addr_t kaddr;
+    int status = sock_import_addr(&kaddr, addr, addrlen);
+
+    if (likely(status == 0))
+        status = sock_connect(id, &kaddr);
+
+    return status;
+}
+
+int sys_shutdown(int fd, int how)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    return sock_shutdown(id, how);
+}
+
+static int sys_sockname(int fd, void *addr, socklen_t *addrlen, bool peer)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    ipv4_addr_t kaddr;
+    int status = sock_name(id, &kaddr, peer);
+
+    if (likely(status == 0))
+        status = sock_export_addr(addr, addrlen, kaddr);
+
+    return status;
+}
+
+int sys_getsockname(int fd, void *addr, socklen_t *addrlen)
+{
+    return sys_sockname(fd, addr, addrlen, false);
+}
+
+int sys_getpeername(int fd, void *addr, socklen_t *addrlen)
+{
+    return sys_sockname(fd, addr, addrlen, true);
+}
+
+// Every supported option is an int
+int sys_setsockopt(int fd, int level, int name,
+                   void const *value, socklen_t len)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    int kvalue;
+
+    if (unlikely(len < sizeof(kvalue)))
+        return err(errno_t::EINVAL);
+
+    if (unlikely(!mm_is_user_range((void*)value, sizeof(kvalue)) ||
+                 !mm_copy_user(&kvalue, value, sizeof(kvalue))))
+        return err(errno_t::EFAULT);
+
+    return sock_setopt(id, level, name, kvalue);
+}
+
+int sys_getsockopt(int fd, int level, int name,
+                   void *value, socklen_t *len)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    socklen_t klen;
+
+    if (unlikely(!mm_is_user_range(len, sizeof(klen)) ||
+                 !mm_copy_user(&klen, len, sizeof(klen))))
+        return err(errno_t::EFAULT);
+
+    int kvalue;
+
+    if (unlikely(klen < sizeof(kvalue)))
+        return err(errno_t::EINVAL);
+
+    int status = sock_getopt(id, level, name, &kvalue);
+
+    if (unlikely(status < 0))
+        return status;
+
+    klen = sizeof(kvalue);
+
+    if (unlikely(!mm_is_user_range(value, sizeof(kvalue)) ||
+                 !mm_copy_user(value, &kvalue, sizeof(kvalue)) ||
+                 !mm_copy_user(len, &klen, sizeof(klen))))
+        return err(errno_t::EFAULT);
+
+    return 0;
+}
+
+ssize_t sys_sendto(int fd, void const *buf, size_t len, int flags,
+                   void const *addr, socklen_t addrlen)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    if (unlikely(!mm_is_user_range((void*)buf, len)))
+        return err(errno_t::EFAULT);
+
+    fs_iovec_t iov{ const_cast<void*>(buf), len };
+
+    sock_msg_t msg{};
+    msg.iov = &iov;
+    msg.iovcnt = 1;
+
+    if (addr) {
+        int status = sock_import_addr(&msg.addr, addr, addrlen);
+
+        if (unlikely(status < 0))
+            return status;
+
+        msg.has_addr = true;
+    }
+
+    ssize_t count = sock_sendmmsg(id, &msg, 1, flags);
+
+    if (unlikely(count < 0))
+        return err(count);
+
+    return msg.len;
+}
+
+ssize_t sys_recvfrom(int fd, void *buf, size_t len, int flags,
+                     void *addr, socklen_t *addrlen)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    if (unlikely(!mm_is_user_range(buf, len)))
+        return err(errno_t::EFAULT);
+
+    fs_iovec_t iov{ buf, len };
+
+    sock_msg_t msg{};
+    msg.iov = &iov;
+    msg.iovcnt = 1;
+
+    ssize_t count = sock_recvmmsg(id, &msg, 1, flags);
+
+    if (unlikely(count < 0))
+        return err(count);
+
+    if (addr && msg.has_addr) {
+        int status = sock_export_addr(addr, addrlen, msg.addr);
+
+        if (unlikely(status < 0))
+            return status;
+    }
+
+    return msg.len;
+}
+
+// Fill in a message from a user message header,
+// the vector goes into kiov
+static int sock_import_msg(sock_msg_t *msg, msghdr const& hdr,
+                           fs_iovec_t *kiov)
+{
+    ssize_t total = copy_iov(kiov, hdr.msg_iov, int(hdr.msg_iovlen));
+
+    if (unlikely(total < 0))
+        return total;
+
+    msg->iov = kiov;
+    msg->iovcnt = hdr.msg_iovlen;
+    msg->has_addr = false;
+    msg->len = 0;
+    msg->flags = 0;
+
+    return 0;
+}
+
+// Store the source address and flags of a received message
+static int sock_export_msg(msghdr *hdr, void *user_hdr,
+                           sock_msg_t const& msg)
+{
+    if (hdr->msg_name) {
+        if (msg.has_addr) {
+            int status = sock_export_addr(
+                        hdr->msg_name,
+                        (socklen_t*)((char*)user_hdr +
+                                     offsetof(msghdr, msg_namelen)),
+                        msg.addr);
+
+            if (unlikely(status < 0))
+                return status;
+        }
+
+        // Keep the updated length when the header is copied out
+        if (unlikely(!mm_copy_user(&hdr->msg_namelen,
+                                   (char*)user_hdr +
+                                   offsetof(msghdr, msg_namelen),
+                                   sizeof(hdr->msg_namelen))))
+            return err(errno_t::EFAULT);
+
+        if (!msg.has_addr)
+            hdr->msg_namelen = 0;
+    }
+
+    // No control messages
+    hdr->msg_controllen = 0;
+    hdr->msg_flags = msg.flags;
+
+    return 0;
+}
+
+ssize_t sys_sendmsg(int fd, void const *user_msg, int flags)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    msghdr hdr;
+
+    if (unlikely(!mm_is_user_range((void*)user_msg, sizeof(hdr)) ||
+                 !mm_copy_user(&hdr, user_msg, sizeof(hdr))))
+        return err(errno_t::EFAULT);
+
+    fs_iovec_t fast_iov[iov_fast_max];
+    ext::unique_ptr_free<fs_iovec_t> slow_iov;
+    fs_iovec_t const *kiov;
+
+    ssize_t len = import_iov(fast_iov, slow_iov, kiov,
+                             hdr.msg_iov, int(hdr.msg_iovlen));
+    if (unlikely(len < 0))
+        return len;
+
+    sock_msg_t msg{};
+    msg.iov = kiov;
+    msg.iovcnt = hdr.msg_iovlen;
+
+    if (hdr.msg_name) {
+        int status = sock_import_addr(&msg.addr, hdr.msg_name,
+                                      hdr.msg_namelen);
+
+        if (unlikely(status < 0))
+            return status;
+
+        msg.has_addr = true;
+    }
+
+    ssize_t count = sock_sendmmsg(id, &msg, 1, flags);
+
+    if (unlikely(count < 0))
+        return err(count);
+
+    return msg.len;
+}
+
+ssize_t sys_recvmsg(int fd, void *user_msg, int flags)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    msghdr hdr;
+
+    if (unlikely(!mm_is_user_range(user_msg, sizeof(hdr)) ||
+                 !mm_copy_user(&hdr, user_msg, sizeof(hdr))))
+        return err(errno_t::EFAULT);
+
+    fs_iovec_t fast_iov[iov_fast_max];
+    ext::unique_ptr_free<fs_iovec_t> slow_iov;
+    fs_iovec_t const *kiov;
+
+    ssize_t len = import_iov(fast_iov, slow_iov, kiov,
+                             hdr.msg_iov, int(hdr.msg_iovlen));
+    if (unlikely(len < 0))
+        return len;
+
+    sock_msg_t msg{};
+    msg.iov = kiov;
+    msg.iovcnt = hdr.msg_iovlen;
+
+    ssize_t count = sock_recvmmsg(id, &msg, 1, flags);
+
+    if (unlikely(count < 0))
+        return err(count);
+
+    int status = sock_export_msg(&hdr, user_msg, msg);
+
+    if (unlikely(status < 0))
+        return status;
+
+    if (unlikely(!mm_copy_user(user_msg, &hdr, sizeof(hdr))))
+        return err(errno_t::EFAULT);
+
+    return msg.len;
+}
+
+// Handles one chunk of a sendmmsg or recvmmsg batch, returns the number
+// of messages transferred, or a negated errno if none were. A chunk
+// may end early because the vector entries ran out, then the batch
+// goes on, otherwise stopped is set
+static ssize_t sys_mmsg_chunk(int id, mmsghdr *user_vec, size_t count,
+                              int flags, bool recv, bool *stopped)
+{
+    mmsghdr hdrs[sock_batch_max];
+    sock_msg_t msgs[sock_batch_max];
+    fs_iovec_t iov_buf[sock_batch_iov];
+
+    if (unlikely(!mm_is_user_range(user_vec, sizeof(*hdrs) * count) ||
+                 !mm_copy_user(hdrs, user_vec, sizeof(*hdrs) * count)))
+        return err(errno_t::EFAULT);
+
+    // Take as many messages as there are vector entries for,
+    // but at least one, which may need its own vector
+    size_t iov_used = 0;
+    size_t n = 0;
+    ext::unique_ptr_free<fs_iovec_t> slow_iov;
+
+    // A bad message ends the batch, after the ones before it
+    int import_status = 0;
+
+    for (; n < count; ++n) {
+        msghdr const& hdr = hdrs[n].msg_hdr;
+
+        if (unlikely(hdr.msg_iovlen > iov_max)) {
+            import_status = err(errno_t::EINVAL);
+            break;
+        }
+
+        fs_iovec_t *kiov = iov_buf + iov_used;
+
+        if (iov_used + hdr.msg_iovlen > sock_batch_iov) {
+            if (n)
+                break;
+
+            size_t iov_size = sizeof(*kiov) * hdr.msg_iovlen;
+            if (unlikely(!slow_iov.reset((fs_iovec_t*)malloc(iov_size))))
+                return err(errno_t::ENOMEM);
+            kiov = slow_iov;
+        }
+
+        int status = sock_import_msg(msgs + n, hdr, kiov);
+
+        if (unlikely(status < 0)) {
+            import_status = status;
+            break;
+        }
+
+        if (!recv && hdr.msg_name) {
+            status = sock_import_addr(&msgs[n].addr, hdr.msg_name,
+                                      hdr.msg_namelen);
+
+            if (unlikely(status < 0)) {
+                import_status = status;
+                break;
+            }
+
+            msgs[n].has_addr = true;
+        }
+
+        if (kiov != slow_iov)
+            iov_used += hdr.msg_iovlen;
+    }
+
+    if (unlikely(!n))
+        return import_status;
+
+    ssize_t done = recv
+            ? sock_recvmmsg(id, msgs, n, flags)
+            : sock_sendmmsg(id, msgs, n, flags);
+
+    if (unlikely(done < 0))
+        return done;
+
+    *stopped = import_status < 0 || size_t(done) < n;
+
+    // Headers of messages before one that can't be stored still go out
+    int export_status = 0;
+
+    for (ssize_t i = 0; i < done; ++i) {
+        if (recv) {
+            export_status = sock_export_msg(&hdrs[i].msg_hdr,
+                                            user_vec + i, msgs[i]);
+
+            if (unlikely(export_status < 0)) {
+                done = i;
+                *stopped = true;
+                break;
+            }
+        }
+
+        hdrs[i].msg_len = msgs[i].len;
+    }
+
+    if (unlikely(!mm_copy_user(user_vec, hdrs, sizeof(*hdrs) * done)))
+        return err(errno_t::EFAULT);
+
+    return done ? done : export_status;
+}
+
+static int sys_mmsg(int fd, void *vec, unsigned vlen, int flags, bool recv)
+{
+    process_t *p = fast_cur_process();
+
+    int id = p->fd_to_id(fd);
+
+    if (unlikely(id < 0))
+        return badf_err();
+
+    vlen = std::min(vlen, unsigned(iov_max));
+
+    mmsghdr *user_vec = (mmsghdr*)vec;
+    unsigned done = 0;
+
+    while (done < vlen) {
+        size_t count = std::min(size_t(vlen - done), sock_batch_max);
+
+        bool stopped = false;
+        ssize_t chunk = sys_mmsg_chunk(id, user_vec + done, count,
+                                       flags, recv, &stopped);
+
+        if (chunk < 0)
+            return done ? int(done) : err(chunk);
+
+        done += chunk;
+
+        if (stopped)
+            break;
+
+        // Only the first message of a receive waits
+        if (recv)
+            flags |= MSG_DONTWAIT;
+    }
+
+    return done;
+}
+
+int sys_sendmmsg(int fd, void *vec, unsigned vlen, int flags)
+{
+    return sys_mmsg(fd, vec, vlen, flags, false);
+}
+
+// Behaves as if MSG_WAITFORONE were always set, timeouts are not
+// supported
+int sys_recvmmsg(int fd, void *vec, unsigned vlen, int flags,
+                 void *timeout)
+{
+    if (unlikely(timeout))
+        return err(errno_t::EINVAL);
+
+    return sys_mmsg(fd, vec, vlen, flags, true);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "types.h"
+
+extern "C" {
+
+int sys_socket(int domain, int type, int protocol);
+int sys_bind(int fd, void const *addr, uint32_t addrlen);
+int sys_listen(int fd, int backlog);
+int sys_accept(int fd, void *addr, uint32_t *addrlen);
+int sys_accept4(int fd, void *addr, uint32_t *addrlen, int flags);
+int sys_connect(int fd, void const *addr, uint32_t addrlen);
+int sys_shutdown(int fd, int how);
+int sys_getsockname(int fd, void *addr, uint32_t *addrlen);
+int sys_getpeername(int fd, void *addr, uint32_t *addrlen);
+int sys_setsockopt(int fd, int level, int name,
+                   void const *value, uint32_t len);
+int sys_getsockopt(int fd, int level, int name,
+                   void *value, uint32_t *len);
+
+ssize_t sys_sendto(int fd, void const *buf, size_t len, int flags,
+                   void const *addr, uint32_t addrlen);
+ssize_t sys_recvfrom(int fd, void *buf, size_t len, int flags,
+                     void *addr, uint32_t *addrlen);
+ssize_t sys_sendmsg(int fd, void const *msg, int flags);
+ssize_t sys_recvmsg(int fd, void *msg, int flags);
+int sys_sendmmsg(int fd, void *vec, unsigned vlen, int flags);
+int sys_recvmmsg(int fd, void *vec, unsigned vlen, int flags,
+                 void *timeout);
+
+}
@@ -1,7 +1,59 @@
 #include "syscall_helper.h"
+#include "dev_storage.h"
+#include "stdlib.h"
 #include "mm.h"
 
 bool verify_accessible(void const *addr, size_t len, bool writable)
 {
     return mpresent(uintptr_t(addr), len);
 }
+
+ssize_t copy_iov(fs_iovec_t *kiov, void const *user_iov, int iovcnt)
+{
+    size_t iov_size = sizeof(*kiov) * iovcnt;
+
+    if (unlikely(!mm_is_user_range((void*)user_iov, iov_size)))
+        return -int(errno_t::EFAULT);
+
+    if (unlikely(!mm_copy_user(kiov, user_iov, iov_size)))
+        return -int(errno_t::EFAULT);
+
+    size_t total = 0;
+
+    for (int i = 0; i < iovcnt; ++i) {
+        if (unlikely(!mm_is_user_range(kiov[i].iov_base, kiov[i].iov_len)))
+            return -int(errno_t::EFAULT);
+
+        total += kiov[i].iov_len;
+
+        if (unlikely(ssize_t(total) < 0 || total < kiov[i].iov_len))
+            return -int(errno_t::EINVAL);
+    }
+
+    return total;
+}
+
+ssize_t import_iov(fs_iovec_t *fast_iov,
+                   ext::unique_ptr_free<fs_iovec_t>& slow_iov,
+                   fs_iovec_t const *&iov,
+                   void const *user_iov, int iovcnt)
+{
+    if (unlikely(iovcnt < 0 || size_t(iovcnt) > iov_max))
+        return -int(errno_t::EINVAL);
+
+    fs_iovec_t *kiov = fast_iov;
+
+    if (size_t(iovcnt) > iov_fast_max) {
+        size_t iov_size = sizeof(*kiov) * iovcnt;
+        if (unlikely(!slow_iov.reset((fs_iovec_t*)malloc(iov_size))))
+            return -int(errno_t::ENOMEM);
+        kiov = slow_iov;
+    }
+
+    ssize_t total = copy_iov(kiov, user_iov, iovcnt);
+
+    if (likely(total >= 0))
+        iov = kiov;
+
+    return total;
+}
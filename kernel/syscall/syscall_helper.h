@@ -1,5 +1,23 @@
 #pragma once
 
 #include "types.h"
+#include "unique_ptr.h"
+
+struct fs_iovec_t;
 
 bool verify_accessible(void const *addr, size_t len, bool writable);
+
+// Vectors up to this size are copied in on the stack
+static constexpr size_t iov_fast_max = 16;
+static constexpr size_t iov_max = 1024;
+
+// Copy an iovec array in from user space into kiov and validate every
+// segment. Returns the total length, or a negated errno
+ssize_t copy_iov(fs_iovec_t *kiov, void const *user_iov, int iovcnt);
+
+// Copy an iovec array in from user space and validate every segment.
+// Returns the total length, or a negated errno
+ssize_t import_iov(fs_iovec_t *fast_iov,
+                   ext::unique_ptr_free<fs_iovec_t>& slow_iov,
+                   fs_iovec_t const *&iov,
+                   void const *user_iov, int iovcnt);
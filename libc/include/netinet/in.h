@@ -0,0 +1,27 @@
+#pragma once
+
+#ifndef __DGOS_KERNEL__
+#include <sys/cdefs.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#endif
+
+typedef uint16_t in_port_t;
+typedef uint32_t in_addr_t;
+
+// In network byte order
+struct in_addr {
+    in_addr_t s_addr;
+};
+
+// Port and address in network byte order
+struct sockaddr_in {
+    sa_family_t sin_family;
+    in_port_t sin_port;
+    struct in_addr sin_addr;
+    unsigned char sin_zero[8];
+};
+
+#define INADDR_ANY          ((in_addr_t)0x00000000)
+#define INADDR_BROADCAST    ((in_addr_t)0xFFFFFFFF)
+#define INADDR_LOOPBACK     ((in_addr_t)0x7F000001)
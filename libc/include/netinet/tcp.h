@@ -0,0 +1,4 @@
+#pragma once
+
+// Options at level IPPROTO_TCP
+#define TCP_NODELAY     1
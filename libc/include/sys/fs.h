@@ -0,0 +1,20 @@
+#pragma once
+
+#ifndef __DGOS_KERNEL__
+#include <stdint.h>
+#endif
+
+#include "ioctl.h"
+
+// Range of a filesystem to discard, for FITRIM
+//
+// Free space from start up to start + len bytes, in free extents of at
+// least minlen bytes, is discarded on the underlying device. On return,
+// len holds the number of bytes discarded
+struct fstrim_range {
+    uint64_t start;
+    uint64_t len;
+    uint64_t minlen;
+};
+
+#define FITRIM  _IOWR('X', 121, struct fstrim_range)
@@ -0,0 +1,95 @@
+#pragma once
+
+#ifndef __DGOS_KERNEL__
+#include <stdint.h>
+#include <sys/types.h>
+#endif
+
+// Submission/completion ring for asynchronous file I/O
+//
+// The ring is a single block of user memory, laid out as the header,
+// followed by sq_entries submission entries, followed by cq_entries
+// completion entries. Both entry counts are powers of two.
+//
+// The process fills submission entries at sq_tail and advances it,
+// the kernel consumes them at sq_head. The kernel produces completion
+// entries at cq_tail, the process consumes them at cq_head.
+// The indices increase freely, they are masked to index the entries.
+
+#define IO_RING_OP_NOP      0
+#define IO_RING_OP_READ     1
+#define IO_RING_OP_WRITE    2
+#define IO_RING_OP_FSYNC    3
+
+#define IO_RING_MAX_ENTRIES 4096
+
+struct io_ring_hdr {
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    uint32_t cq_mask;
+    uint32_t cq_entries;
+
+    // Submissions rejected because they were malformed
+    uint32_t sq_dropped;
+
+    // Times completions were held back because the completion queue
+    // was full, they are delivered once the process makes room
+    uint32_t cq_overflow;
+
+    uint32_t reserved[6];
+};
+
+struct io_ring_sqe {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t reserved;
+    int32_t fd;
+    int64_t off;
+    uint64_t addr;
+    uint32_t len;
+    uint32_t reserved2;
+    uint64_t user_data;
+};
+
+// res is the byte count of a transfer, or a negated errno
+struct io_ring_cqe {
+    uint64_t user_data;
+    int64_t res;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+// Size in bytes of a ring with the given entry counts
+#define IO_RING_SIZE(sq_entries, cq_entries) \
+    (sizeof(struct io_ring_hdr) + \
+    (sq_entries) * sizeof(struct io_ring_sqe) + \
+    (cq_entries) * sizeof(struct io_ring_cqe))
+
+#ifndef __DGOS_KERNEL__
+
+__BEGIN_DECLS
+
+// The completion queue has twice as many entries as the
+// submission queue. Returns the ring id, or -1 and sets errno
+int io_ring_setup(unsigned entries, struct io_ring_hdr *ring);
+
+// Submit up to to_submit entries, then wait until at least
+// min_complete completions are available in the ring.
+// Returns the number of entries submitted
+int io_ring_enter(int ring_id, unsigned to_submit, unsigned min_complete);
+
+// Wait until at least min_complete completions are available in the
+// ring, without submitting. Returns 0, or -1 and sets errno
+int io_ring_wait(int ring_id, unsigned min_complete);
+
+// Waits for all outstanding requests before returning
+int io_ring_destroy(int ring_id);
+
+__END_DECLS
+
+#endif
@@ -48,5 +48,7 @@
     _IOC(_IOC_READ, (type), (nr), _IOC_TYPECHECK(size))
 #define _IOW(type, nr, size) \
     _IOC(_IOC_WRITE, (type), (nr), _IOC_TYPECHECK(size))
+#define _IOWR(type, nr, size) \
+    _IOC(_IOC_RDWR, (type), (nr), _IOC_TYPECHECK(size))
 
 int ioctl(int __fd, unsigned long int __request, ...);
@@ -0,0 +1,25 @@
+#pragma once
+
+#ifndef __DGOS_KERNEL__
+#include <stdint.h>
+#endif
+
+#include "ioctl.h"
+
+// Interrupt coalescing of an NVMe controller, for NVME_IOC_COALESCE,
+// issued on /dev/nvmestat
+//
+// The threshold is a zero based completion count and the time is in
+// 100us units, both apply to the whole controller. Coalescing is then
+// enabled or disabled on the interrupt vector of one I/O queue, or of
+// every I/O queue when queue is zero
+struct nvme_coalesce {
+    uint32_t controller;
+    uint32_t queue;
+    uint8_t threshold;
+    uint8_t time;
+    uint8_t enable;
+    uint8_t reserved;
+};
+
+#define NVME_IOC_COALESCE   _IOW('N', 1, struct nvme_coalesce)
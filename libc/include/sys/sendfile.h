@@ -0,0 +1,9 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+
+__BEGIN_DECLS
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+__END_DECLS
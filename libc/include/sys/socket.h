@@ -1,20 +1,120 @@
 #pragma once
 
+#ifndef __DGOS_KERNEL__
 #include <sys/cdefs.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#endif
 
-__BEGIN_DECLS
+#define AF_UNSPEC   0
+#define AF_INET     2
 
-#define AF_INET 2
+#define PF_UNSPEC   AF_UNSPEC
+#define PF_INET     AF_INET
 
 #define SOCK_STREAM 1
-#define SOCK_DGRAM 2
+#define SOCK_DGRAM  2
+
+// Or'ed into the type passed to socket and the flags passed to accept4
+#define SOCK_NONBLOCK   0x800
+#define SOCK_CLOEXEC    0x80000
 
 #define IPPROTO_IP  0
 #define IPPROTO_TCP 6
 #define IPPROTO_UDP 17
 
+// Flags passed to send and receive calls
+#define MSG_PEEK        0x2
+#define MSG_TRUNC       0x20
+#define MSG_DONTWAIT    0x40
+#define MSG_NOSIGNAL    0x4000
+#define MSG_WAITFORONE  0x10000
+
+// How to shutdown
+#define SHUT_RD     0
+#define SHUT_WR     1
+#define SHUT_RDWR   2
+
+// Socket options
+#define SOL_SOCKET      1
+
+#define SO_REUSEADDR    2
+#define SO_TYPE         3
+#define SO_ERROR        4
+#define SO_SNDBUF       7
+#define SO_RCVBUF       8
+
+typedef uint32_t socklen_t;
+typedef uint16_t sa_family_t;
+
+struct sockaddr {
+    sa_family_t sa_family;
+    char sa_data[14];
+};
+
+struct sockaddr_storage {
+    sa_family_t ss_family;
+    char __ss_data[126];
+};
+
+struct iovec;
+
+struct msghdr {
+    void *msg_name;
+    socklen_t msg_namelen;
+    struct iovec *msg_iov;
+    size_t msg_iovlen;
+    void *msg_control;
+    size_t msg_controllen;
+    int msg_flags;
+};
+
+// One message of a sendmmsg or recvmmsg batch,
+// msg_len receives the number of bytes transferred
+struct mmsghdr {
+    struct msghdr msg_hdr;
+    unsigned msg_len;
+};
+
+#ifndef __DGOS_KERNEL__
+
+__BEGIN_DECLS
+
 int socket(int __domain, int __type, int __protocol);
-int send(int __fd, void const *__buf, int __len, int __flags);
-int recv(int __fd, void *__buf, int __len, int __flags);
+int bind(int __fd, struct sockaddr const *__addr, socklen_t __len);
+int listen(int __fd, int __backlog);
+int accept(int __fd, struct sockaddr *__addr, socklen_t *__len);
+int accept4(int __fd, struct sockaddr *__addr, socklen_t *__len,
+            int __flags);
+int connect(int __fd, struct sockaddr const *__addr, socklen_t __len);
+int shutdown(int __fd, int __how);
+
+int getsockname(int __fd, struct sockaddr *__addr, socklen_t *__len);
+int getpeername(int __fd, struct sockaddr *__addr, socklen_t *__len);
+
+int setsockopt(int __fd, int __level, int __name,
+               void const *__value, socklen_t __len);
+int getsockopt(int __fd, int __level, int __name,
+               void *__value, socklen_t *__len);
+
+ssize_t send(int __fd, void const *__buf, size_t __len, int __flags);
+ssize_t recv(int __fd, void *__buf, size_t __len, int __flags);
+
+ssize_t sendto(int __fd, void const *__buf, size_t __len, int __flags,
+               struct sockaddr const *__addr, socklen_t __addr_len);
+ssize_t recvfrom(int __fd, void *__buf, size_t __len, int __flags,
+                 struct sockaddr *__addr, socklen_t *__addr_len);
+
+ssize_t sendmsg(int __fd, struct msghdr const *__msg, int __flags);
+ssize_t recvmsg(int __fd, struct msghdr *__msg, int __flags);
+
+// Transfer up to vlen messages with one call, returns the number
+// of messages transferred. recvmmsg only waits for the first one
+int sendmmsg(int __fd, struct mmsghdr *__vec, unsigned __vlen,
+             int __flags);
+int recvmmsg(int __fd, struct mmsghdr *__vec, unsigned __vlen,
+             int __flags, struct timespec *__timeout);
 
 __END_DECLS
+
+#endif
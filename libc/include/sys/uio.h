@@ -0,0 +1,19 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+
+__BEGIN_DECLS
+
+#define IOV_MAX 1024
+
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+
+ssize_t readv(int fd, struct iovec const *iov, int iovcnt);
+ssize_t writev(int fd, struct iovec const *iov, int iovcnt);
+ssize_t preadv(int fd, struct iovec const *iov, int iovcnt, off_t ofs);
+ssize_t pwritev(int fd, struct iovec const *iov, int iovcnt, off_t ofs);
+
+__END_DECLS
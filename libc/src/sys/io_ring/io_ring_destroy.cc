@@ -0,0 +1,16 @@
+#include <sys/io_ring.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+int io_ring_destroy(int ring_id)
+{
+    long status = syscall1(long(ring_id), SYS_io_destroy);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
@@ -0,0 +1,17 @@
+#include <sys/io_ring.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+int io_ring_enter(int ring_id, unsigned to_submit, unsigned min_complete)
+{
+    long status = syscall3(long(ring_id), long(to_submit),
+                           long(min_complete), SYS_io_submit);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
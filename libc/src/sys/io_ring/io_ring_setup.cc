@@ -0,0 +1,16 @@
+#include <sys/io_ring.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+int io_ring_setup(unsigned entries, struct io_ring_hdr *ring)
+{
+    long status = syscall2(long(entries), long(ring), SYS_io_setup);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
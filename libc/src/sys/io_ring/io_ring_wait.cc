@@ -0,0 +1,17 @@
+#include <sys/io_ring.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+int io_ring_wait(int ring_id, unsigned min_complete)
+{
+    long status = syscall2(long(ring_id), long(min_complete),
+                           SYS_io_getevents);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
@@ -0,0 +1,18 @@
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <sys/types.h>
+#include <errno.h>
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    long status = syscall4(long(out_fd), long(in_fd), long(offset),
+                           long(count), SYS_sendfile);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
@@ -0,0 +1,17 @@
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+int accept4(int fd, struct sockaddr *addr, socklen_t *len, int flags)
+{
+    long status = syscall4(long(fd), long(addr), long(len), long(flags),
+                           SYS_accept4);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
@@ -0,0 +1,16 @@
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+int bind(int fd, struct sockaddr const *addr, socklen_t len)
+{
+    long status = syscall3(long(fd), long(addr), long(len), SYS_bind);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
@@ -0,0 +1,16 @@
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+int getpeername(int fd, struct sockaddr *addr, socklen_t *len)
+{
+    long status = syscall3(long(fd), long(addr), long(len), SYS_getpeername);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
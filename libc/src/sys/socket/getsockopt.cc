@@ -0,0 +1,17 @@
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+int getsockopt(int fd, int level, int name, void *value, socklen_t *len)
+{
+    long status = syscall5(long(fd), long(level), long(name), long(value),
+                           long(len), SYS_getsockopt);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
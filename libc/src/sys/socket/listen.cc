@@ -0,0 +1,16 @@
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+int listen(int fd, int backlog)
+{
+    long status = syscall2(long(fd), long(backlog), SYS_listen);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
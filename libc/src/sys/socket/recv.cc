@@ -0,0 +1,17 @@
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+ssize_t recv(int fd, void *buf, size_t len, int flags)
+{
+    long status = syscall6(long(fd), long(buf), long(len), long(flags),
+                           long(0), long(0), SYS_recvfrom);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
@@ -0,0 +1,18 @@
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+int recvmmsg(int fd, struct mmsghdr *vec, unsigned vlen, int flags,
+             struct timespec *timeout)
+{
+    long status = syscall5(long(fd), long(vec), long(vlen), long(flags),
+                           long(timeout), SYS_recvmmsg);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
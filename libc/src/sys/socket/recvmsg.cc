@@ -0,0 +1,16 @@
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+ssize_t recvmsg(int fd, struct msghdr *msg, int flags)
+{
+    long status = syscall3(long(fd), long(msg), long(flags), SYS_recvmsg);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
@@ -0,0 +1,17 @@
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+int sendmmsg(int fd, struct mmsghdr *vec, unsigned vlen, int flags)
+{
+    long status = syscall4(long(fd), long(vec), long(vlen), long(flags),
+                           SYS_sendmmsg);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
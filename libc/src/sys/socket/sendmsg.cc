@@ -0,0 +1,16 @@
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+ssize_t sendmsg(int fd, struct msghdr const *msg, int flags)
+{
+    long status = syscall3(long(fd), long(msg), long(flags), SYS_sendmsg);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
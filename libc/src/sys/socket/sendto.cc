@@ -0,0 +1,18 @@
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+ssize_t sendto(int fd, void const *buf, size_t len, int flags,
+               struct sockaddr const *addr, socklen_t addr_len)
+{
+    long status = syscall6(long(fd), long(buf), long(len), long(flags),
+                           long(addr), long(addr_len), SYS_sendto);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
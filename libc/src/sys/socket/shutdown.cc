@@ -0,0 +1,16 @@
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <errno.h>
+
+int shutdown(int fd, int how)
+{
+    long status = syscall2(long(fd), long(how), SYS_shutdown);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
@@ -0,0 +1,18 @@
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <sys/types.h>
+#include <errno.h>
+
+ssize_t pwritev(int fd, struct iovec const *iov, int iovcnt, off_t ofs)
+{
+    long status = syscall4(long(fd), long(iov), long(iovcnt),
+                           long(ofs), SYS_pwritev);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}
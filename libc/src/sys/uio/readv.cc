@@ -0,0 +1,17 @@
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/syscall_num.h>
+#include <sys/types.h>
+#include <errno.h>
+
+ssize_t readv(int fd, struct iovec const *iov, int iovcnt)
+{
+    long status = syscall3(long(fd), long(iov), long(iovcnt), SYS_readv);
+
+    if (status >= 0)
+        return status;
+
+    errno = -status;
+
+    return -1;
+}